@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# adduser.sh - Provision users one adduser at a time and in one batch.
+#
+# Usage: bench/adduser.sh [path/to/tsh]
+#
+# In the same scratch layout as run.sh, adds BENCH_USERS_LOOP users
+# with one adduser line each, then BENCH_USERS users with a single
+# adduser --batch into a fresh tree, and checks that passwd.txt and
+# home/ hold every user afterwards. Prints one JSON object with the
+# total time and the cost per user.
+#
+# Knobs (environment): BENCH_USERS       users in the batch       (100000)
+#                      BENCH_USERS_LOOP  users added one by one   (2000)
+
+TSH=${1:-./tsh}
+N=${BENCH_USERS:-100000}
+LOOP=${BENCH_USERS_LOOP:-2000}
+
+. "$(dirname "$0")/lib.sh"
+
+# fresh - (Re)create the scratch tree with only root in it
+fresh() {
+    rm -rf "$WORK/etc" "$WORK/home" "$WORK/proc"
+    mkdir -p "$WORK/etc" "$WORK/home/root" "$WORK/proc"
+    printf 'root:pass:/home/root' > "$WORK/etc/passwd.txt"
+    : > "$WORK/home/root/.tsh_history"
+}
+
+# session FILE - elapsed ns for a root session running FILE
+session() {
+    start=$(now_ns)
+    (cd "$WORK" && "$TSH" -p < "$1" > "$WORK/out" 2>&1)
+    echo $(( $(now_ns) - start ))
+}
+
+# check USERS - passwd.txt and home/ hold root plus USERS users?
+check() {
+    n=$(( $(wc -l < "$WORK/etc/passwd.txt") + 1 ))
+    h=$(ls "$WORK/home" | wc -l)
+    [ "$n" -eq $(( $1 + 1 )) ] && [ "$h" -eq $(( $1 + 1 )) ] && echo true || echo false
+}
+
+# json NAME USERS NS OK - one result member
+json() {
+    awk -v n="$2" -v t="$3" -v ok="$4" -v name="$1" 'BEGIN {
+        printf "  \"%s\": { \"users\": %d, \"total_ms\": %.1f, \"per_user_us\": %.2f, \"ok\": %s }",
+            name, n, t / 1e6, t / n / 1000, ok }'
+}
+
+fresh
+awk -v n="$LOOP" 'BEGIN {
+    print "root"; print "pass"
+    for (i = 0; i < n; i++) printf "adduser user%06d pw%d\n", i, i
+    print "quit" }' > "$WORK/loop.in"
+loop_ns=$(session "$WORK/loop.in")
+loop_ok=$(check "$LOOP")
+
+fresh
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) printf "user%06d:pw%d\n", i, i }' \
+    > "$WORK/users.txt"
+printf 'root\npass\nadduser --batch %s\nquit\n' "$WORK/users.txt" > "$WORK/batch.in"
+batch_ns=$(session "$WORK/batch.in")
+batch_ok=$(check "$N")
+
+echo "{"
+json one_by_one "$LOOP" "$loop_ns" "$loop_ok"
+echo ","
+json batch "$N" "$batch_ns" "$batch_ok"
+echo
+echo "}"
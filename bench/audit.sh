@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# audit.sh - Cost of the audit log per command and of indexed queries.
+#
+# Usage: bench/audit.sh [path/to/tsh]
+#
+# In the same scratch layout as run.sh, runs BENCH_AUDIT_CMDS true
+# builtins as root with TSH_AUDIT=0 and then with logging on; the
+# difference per command is the logging overhead. A second user then
+# runs BENCH_AUDIT_RECENT commands, and root queries the log twice:
+# "audit -u bob -s T" for just those, which the index narrows to the
+# last blocks, and a plain "audit" that decodes every block. Prints
+# one JSON object with the timings and the size of the log.
+#
+# Knobs (environment): BENCH_AUDIT_CMDS    commands logged as root  (200000)
+#                      BENCH_AUDIT_RECENT  commands run by bob      (1000)
+
+TSH=${1:-./tsh}
+N=${BENCH_AUDIT_CMDS:-200000}
+R=${BENCH_AUDIT_RECENT:-1000}
+
+. "$(dirname "$0")/lib.sh"
+
+mkdir -p "$WORK/home/bob"
+printf '\nbob:pw:/home/bob' >> "$WORK/etc/passwd.txt"
+: > "$WORK/home/bob/.tsh_history"
+
+# session FILE [AUDIT] - elapsed ns for a session reading FILE
+session() {
+    start=$(now_ns)
+    (cd "$WORK" && TSH_AUDIT=${2:-1} "$TSH" -p < "$1" > "$WORK/out" 2>&1)
+    echo $(( $(now_ns) - start ))
+}
+
+# cmds USER PASS COUNT - session input running COUNT true builtins
+cmds() {
+    awk -v u="$1" -v p="$2" -v n="$3" 'BEGIN {
+        print u; print p
+        for (i = 1; i <= n; i++) printf "true %d\n", i
+        print "quit" }'
+}
+
+cmds root pass "$N" > "$WORK/root.in"
+cmds bob pw "$R" > "$WORK/bob.in"
+printf 'root\npass\nquit\n' > "$WORK/empty.in"
+
+off_ns=$(session "$WORK/root.in" 0)
+on_ns=$(session "$WORK/root.in" 1)
+sleep 1
+since=$(date +%Y-%m-%dT%H:%M:%S)
+sleep 1
+session "$WORK/bob.in" > /dev/null
+
+printf 'root\npass\naudit -u bob -s %s\nquit\n' "$since" > "$WORK/narrow.in"
+printf 'root\npass\naudit\nquit\n' > "$WORK/full.in"
+base_ns=$(session "$WORK/empty.in" 0)
+narrow_ns=$(( $(session "$WORK/narrow.in" 0) - base_ns ))
+narrow=$(grep -c ' bob ' "$WORK/out")
+full_ns=$(( $(session "$WORK/full.in" 0) - base_ns ))
+full=$(grep -c 'true [0-9]' "$WORK/out")
+
+awk -v n="$N" -v r="$R" -v off="$off_ns" -v on="$on_ns" \
+    -v narrow_ns="$narrow_ns" -v narrow="$narrow" -v full_ns="$full_ns" -v full="$full" \
+    -v logb="$(wc -c < "$WORK/etc/audit.log")" -v idx="$(wc -c < "$WORK/etc/audit.idx")" 'BEGIN {
+    printf "{\n"
+    printf "  \"commands\": %d,\n", n
+    printf "  \"us_per_cmd_audit_off\": %.2f,\n", off / n / 1000
+    printf "  \"us_per_cmd_audit_on\": %.2f,\n", on / n / 1000
+    printf "  \"audit_overhead_us_per_cmd\": %.2f,\n", (on - off) / n / 1000
+    printf "  \"log_bytes\": %d,\n", logb
+    printf "  \"log_bytes_per_record\": %.1f,\n", logb / (n + r + 1)
+    printf "  \"index_bytes\": %d,\n", idx
+    printf "  \"narrow_query_ms\": %.2f,\n", narrow_ns / 1e6
+    printf "  \"narrow_query_records\": %d,\n", narrow
+    printf "  \"full_query_ms\": %.2f,\n", full_ns / 1e6
+    printf "  \"full_query_records\": %d\n", full
+    printf "}\n" }'
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# builtins.sh - Compare the fork-free builtins with the external tools.
+#
+# Usage: bench/builtins.sh [path/to/tsh]
+#
+# Each command is run BENCH_N times inside one session, once as a
+# builtin and once through its external binary, in the same scratch
+# layout as run.sh. Results are printed as one JSON object with the
+# mean cost per command in microseconds.
+#
+# Knobs (environment): BENCH_N  commands per sample (200)
+
+TSH=${1:-./tsh}
+N=${BENCH_N:-200}
+
+. "$(dirname "$0")/lib.sh"
+
+# per_cmd_us LINE - mean us per copy of LINE over an empty session
+per_cmd_us() {
+    {
+        printf 'root\npass\n'
+        i=0
+        while [ "$i" -lt "$N" ]; do
+            printf '%s\n' "$1"
+            i=$((i + 1))
+        done
+        printf 'quit\n'
+    } > "$WORK/cmd.in"
+    start=$(now_ns)
+    (cd "$WORK" && "$TSH" -p < "$WORK/cmd.in" > /dev/null 2>&1)
+    end=$(now_ns)
+    awk -v n="$N" -v t="$((end - start))" -v b="$base_ns" \
+        'BEGIN { printf "%.1f", (t - b) / n / 1000 }'
+}
+
+printf 'root\npass\nquit\n' > "$WORK/empty.in"
+start=$(now_ns)
+(cd "$WORK" && "$TSH" -p < "$WORK/empty.in" > /dev/null 2>&1)
+base_ns=$(( $(now_ns) - start ))
+
+# which_of PATH... - first of the given paths that exists
+which_of() {
+    for p in "$@"; do
+        [ -x "$p" ] && { echo "$p"; return; }
+    done
+    echo "$1"
+}
+ECHO=$(which_of /bin/echo /usr/bin/echo)
+TRUE=$(which_of /bin/true /usr/bin/true)
+TEST=$(which_of /usr/bin/test /bin/test)
+PRINTF=$(which_of /usr/bin/printf /bin/printf)
+SLEEP=$(which_of /bin/sleep /usr/bin/sleep)
+
+echo_b=$(per_cmd_us "echo hello world")
+echo_x=$(per_cmd_us "$ECHO hello world")
+true_b=$(per_cmd_us "true")
+true_x=$(per_cmd_us "$TRUE")
+test_b=$(per_cmd_us "test -d /tmp -a 3 -gt 2")
+test_x=$(per_cmd_us "$TEST -d /tmp -a 3 -gt 2")
+printf_b=$(per_cmd_us "printf %05d:%s\n 42 x")
+printf_x=$(per_cmd_us "$PRINTF %05d:%s\n 42 x")
+sleep_b=$(per_cmd_us "sleep 0")
+sleep_x=$(per_cmd_us "$SLEEP 0")
+
+cat <<JSON
+{
+  "commands": $N,
+  "echo_us": { "builtin": $echo_b, "external": $echo_x },
+  "true_us": { "builtin": $true_b, "external": $true_x },
+  "test_us": { "builtin": $test_b, "external": $test_x },
+  "printf_us": { "builtin": $printf_b, "external": $printf_x },
+  "sleep0_us": { "builtin": $sleep_b, "external": $sleep_x }
+}
+JSON
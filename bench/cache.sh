@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# cache.sh - Miss and hit cost of the result cache.
+#
+# Usage: bench/cache.sh [path/to/tsh]
+#
+# Runs tsh -p in the same scratch layout as run.sh. A session runs
+# sha256sum over a BENCH_CACHE_MB megabyte file BENCH_CACHE_N times,
+# once plainly and once through cache, and reports the mean time per
+# run of each. It checks that a hit prints what the miss printed and
+# that touching the file makes the next run a miss. A last session
+# reads 3 hot files six times for each of 5 cold ones, with the store
+# capped at 6 entries, and reports the hit rate and evictions from
+# cache --stats. Prints one JSON
+# object.
+#
+# Knobs (environment): BENCH_CACHE_MB  input size in MB  (64)
+#                      BENCH_CACHE_N   runs of each      (20)
+
+TSH=${1:-./tsh}
+MB=${BENCH_CACHE_MB:-64}
+N=${BENCH_CACHE_N:-20}
+SUM=$(command -v sha256sum)
+
+. "$(dirname "$0")/lib.sh"
+
+head -c $((MB * 1048576)) /dev/urandom > "$WORK/big"
+for i in 1 2 3 4 5 6 7 8; do echo "file $i" > "$WORK/f$i"; done
+
+# session FILE - elapsed ns for a session reading FILE, output in $WORK/out
+session() {
+    start=$(now_ns)
+    (cd "$WORK" && TSH_AUDIT=0 TSH_CACHE_MAX=${CAP:-64m} "$TSH" -p < "$1" > "$WORK/out" 2>&1)
+    echo $(( $(now_ns) - start ))
+}
+
+# cmds PREFIX - session input running sha256sum over big N times
+cmds() {
+    awk -v n="$N" -v p="$1" -v sum="$SUM" 'BEGIN { print "root"; print "pass"
+        for (i = 0; i < n; i++) print p sum " big"
+        print "quit" }'
+}
+
+printf 'root\npass\nquit\n' > "$WORK/empty.in"
+cmds '' > "$WORK/plain.in"
+cmds 'cache ' > "$WORK/cached.in"
+
+base=$(session "$WORK/empty.in")
+plain=$(( $(session "$WORK/plain.in") - base ))
+cached=$(( $(session "$WORK/cached.in") - base ))
+same=$(grep -c '[0-9a-f]\{64\}  big$' "$WORK/out")
+sums=$(grep -o '[0-9a-f]\{64\}  big$' "$WORK/out" | sort -u | wc -l)
+
+touch "$WORK/big"
+printf 'root\npass\ncache %s big\ncache --stats\nquit\n' "$SUM" > "$WORK/touch.in"
+session "$WORK/touch.in" > /dev/null
+misses=$(sed -n 's/.* \([0-9]*\) misses.*/\1/p' "$WORK/out")
+
+rm -rf "$WORK/home/root/.tsh_cache"
+size=$(( $(cd "$WORK" && "$SUM" f1 | wc -c) + 40 ))
+awk -v n="$N" -v sum="$SUM" 'BEGIN { print "root"; print "pass"
+    for (r = 0; r < n; r++) {
+        for (i = 1; i <= 6; i++) print "cache " sum " f" (1 + i % 3)
+        print "cache " sum " f" (4 + r % 5) }
+    print "cache --stats"; print "quit" }' > "$WORK/lru.in"
+CAP=$((size * 6)) session "$WORK/lru.in" > /dev/null
+rate=$(sed -n 's/.*hit rate \([0-9.]*\)%.*/\1/p' "$WORK/out")
+evicted=$(sed -n 's/.* \([0-9]*\) evicted.*/\1/p' "$WORK/out")
+
+awk -v n="$N" -v mb="$MB" -v plain="$plain" -v cached="$cached" -v same="$same" \
+    -v sums="$sums" -v misses="$misses" -v rate="$rate" -v evicted="$evicted" 'BEGIN {
+    printf "{\n"
+    printf "  \"input_mb\": %d,\n", mb
+    printf "  \"runs\": %d,\n", n
+    printf "  \"plain_ms_per_run\": %.2f,\n", plain / n / 1e6
+    printf "  \"cached_ms_per_run\": %.2f,\n", cached / n / 1e6
+    printf "  \"speedup\": %.1f,\n", plain / cached
+    printf "  \"hits_match_miss\": %s,\n", (same == n && sums == 1) ? "true" : "false"
+    printf "  \"touch_invalidates\": %s,\n", misses == 2 ? "true" : "false"
+    printf "  \"lru_hit_rate_pct\": %s,\n", rate
+    printf "  \"lru_evictions\": %d\n", evicted
+    printf "}\n" }'
@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# capture.sh - Throughput and memory of background output capture.
+#
+# Usage: bench/capture.sh [path/to/tsh]
+#
+# BENCH_CAPTURE_JOBS background jobs each write BENCH_CAPTURE_BYTES
+# to stdout while tsh runs with -C BENCH_CAPTURE_RING and
+# --capture-max BENCH_CAPTURE_MAX, in a scratch layout like run.sh.
+# Reports drain throughput and the shell's peak RSS, which should stay
+# near the cap however much the jobs write. Prints one JSON object.
+#
+# Knobs (environment): BENCH_CAPTURE_JOBS   jobs, in waves of 12  (48)
+#                      BENCH_CAPTURE_BYTES  bytes per job         (8000000)
+#                      BENCH_CAPTURE_RING   -C size               (1m)
+#                      BENCH_CAPTURE_MAX    --capture-max size    (8m)
+
+TSH=${1:-./tsh}
+JOBS=${BENCH_CAPTURE_JOBS:-48}
+BYTES=${BENCH_CAPTURE_BYTES:-8000000}
+RING=${BENCH_CAPTURE_RING:-1m}
+MAX=${BENCH_CAPTURE_MAX:-8m}
+
+. "$(dirname "$0")/lib.sh"
+
+# Waves of 12 writers; a foreground poller waits until only its own
+# and the shell's proc entries are left
+{
+    printf 'root\npass\n'
+    i=0
+    while [ "$i" -lt "$JOBS" ]; do
+        printf "/bin/sh -c 'head -c %s /dev/zero | tr \"\\\\\\\\0\" x' &\n" "$BYTES"
+        i=$((i + 1))
+        if [ $((i % 12)) -eq 0 ]; then
+            printf "/bin/sh -c 'while [ \$(ls proc | wc -l) -gt 2 ]; do sleep 0.01; done'\n"
+        fi
+    done
+    printf "/bin/sh -c 'grep VmHWM /proc/\$PPID/status'\nquit\n"
+} > "$WORK/cmd.in"
+
+start=$(now_ns)
+(cd "$WORK" && "$TSH" -p -C "$RING" --capture-max="$MAX" < "$WORK/cmd.in" > "$WORK/cmd.out" 2>&1)
+elapsed=$(( $(now_ns) - start ))
+
+peak_kb=$(awk '{ for (i = 1; i < NF; i++) if ($i == "VmHWM:") print $(i + 1) }' "$WORK/cmd.out")
+
+cat <<JSON
+{
+  "jobs": $JOBS,
+  "bytes_per_job": $BYTES,
+  "ring": "$RING",
+  "capture_max": "$MAX",
+  "drain_mb_per_sec": $(awk -v b="$((JOBS * BYTES))" -v t="$elapsed" 'BEGIN { printf "%.1f", b / 1e6 / (t / 1e9) }'),
+  "shell_peak_rss_kb": ${peak_kb:-0}
+}
+JSON
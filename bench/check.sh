@@ -0,0 +1,177 @@
+#!/bin/sh
+#
+# check.sh - Behaviour checks for printf, here-documents, the result
+# cache, remote jobs and server mode.
+#
+# Usage: bench/check.sh [path/to/tsh] [path/to/session_io]
+#
+# Runs short root sessions in the scratch layout of lib.sh, each
+# ending in audit, and compares what they print and the exit statuses
+# the audit log recorded with what is expected. Remote commands go to
+# a local worker on a Unix socket; server sessions are driven with
+# session_io. Prints one line per check and exits 1 if any failed.
+
+TSH=${1:-./tsh}
+IO=${2:-./bench/session_io}
+
+. "$(dirname "$0")/lib.sh"
+
+case $IO in
+    /*) ;;
+    *) IO=$(pwd)/$IO ;;
+esac
+
+checks=0
+failed=0
+
+# session NAME [VAR=value...] - run root's commands from stdin in one
+#    tsh -p session, then audit; output in $WORK/NAME.out
+session() {
+    name=$1
+    shift
+    { printf 'root\npass\n'; cat; printf 'audit\nquit\n'; } > "$WORK/$name.in"
+    (cd "$WORK" && env "$@" "$TSH" -p < "$WORK/$name.in" > "$WORK/$name.out" 2>&1)
+}
+
+# report NAME WHAT STATUS - count one check, failed unless STATUS is 0
+report() {
+    checks=$((checks + 1))
+    if [ "$3" -eq 0 ]; then
+        printf 'ok   %s: %s\n' "$1" "$2"
+    else
+        printf 'FAIL %s: %s\n' "$1" "$2"
+        failed=$((failed + 1))
+    fi
+}
+
+# prints NAME LINE - did session NAME print LINE?
+prints() {
+    sed 's/^username: password: //' "$WORK/$1.out" | grep -Fxq -- "$2"
+    report "$1" "prints '$2'" $?
+}
+
+# exits NAME CMD STATUS... - did each run of CMD, in order, exit with these?
+exits() {
+    name=$1
+    cmd=$2
+    shift 2
+    got=$(CMD=$cmd awk '$2 == "root" && $6 != "" {
+            t = $0
+            for (i = 0; i < 5; i++) sub(/^[^ ]+ +/, "", t)
+            if (t == ENVIRON["CMD"]) s = s (s == "" ? "" : " ") $4 }
+        END { print s }' "$WORK/$name.out")
+    [ "$got" = "$*" ]
+    report "$name" "'$cmd' exits $* (got ${got:-nothing})" $?
+}
+
+# printf: conversions, reuse of the format, bad numbers and specs
+session printf <<'EOF'
+printf '%s-%d\n' a 5
+printf '[%5.2f]\n' 3.14159
+printf '%x %o %X\n' 255 8 255
+printf '%s,' a b c
+printf '\n'
+printf '%-4s|%04d|%+d\n' ab 7 3
+printf '%*d|%.*f\n' 5 42 2 2.5
+printf '%c%c\n' hello world
+printf '%b\n' 'a\tb'
+printf '%d %d\n' 0x1f 010
+printf '%.3s\n' abcdef
+printf '%d\n' abc
+printf '%q\n' x
+printf '%---------------------------------------------------------------d\n' 1
+EOF
+prints printf 'a-5'
+prints printf '[ 3.14]'
+prints printf 'ff 10 FF'
+prints printf 'a,b,c,'
+prints printf 'ab  |0007|+3'
+prints printf '   42|2.50'
+prints printf 'hw'
+prints printf "$(printf 'a\tb')"
+prints printf '31 8'
+prints printf 'abc'
+prints printf "printf: 'abc': expected a numeric value"
+prints printf 'printf: %q: invalid conversion specification'
+prints printf 'printf: format specification too long'
+exits printf "printf '%s-%d\n' a 5" 0
+exits printf "printf '%d\n' abc" 1
+exits printf "printf '%q\n' x" 1
+exits printf "printf '%---------------------------------------------------------------d\n' 1" 1
+
+# Here-documents and here-strings
+session heredoc <<'EOF'
+/bin/cat << END
+line one
+  line two
+END
+/usr/bin/wc -l << END
+a
+b
+END
+/bin/cat <<< word
+/bin/grep -q x <<< y
+EOF
+prints heredoc 'line one'
+prints heredoc '  line two'
+prints heredoc '2'
+prints heredoc 'word'
+exits heredoc '/bin/grep -q x <<< y' 1
+
+# Result cache: a hit replays the output and the status
+session cache <<'EOF'
+cache /bin/echo cached
+cache /bin/echo cached
+cache /bin/false
+cache /bin/false
+cache --stats
+EOF
+[ "$(sed 's/^username: password: //' "$WORK/cache.out" | grep -c '^cached$')" -eq 2 ]
+report cache "hit prints what the miss printed" $?
+prints cache 'cache: 2 hits, 2 misses, hit rate 50.0%'
+exits cache 'cache /bin/echo cached' 0 0
+exits cache 'cache /bin/false' 1 1
+
+# Remote jobs report the worker's exit status
+head -c 32 /dev/urandom | od -An -tx1 | tr -d ' \n' > "$WORK/token"
+chmod 600 "$WORK/token"
+TSH_WORKER_TOKEN=$WORK/token "$TSH" -W "$WORK/w.sock" &
+worker=$!
+trap 'kill $worker $daemon 2>/dev/null; wait 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+while [ ! -S "$WORK/w.sock" ]; do
+    sleep 0.05
+done
+session remote TSH_WORKER_TOKEN="$WORK/token" TSH_WORKERS="$WORK/w.sock" <<'EOF'
+remote /bin/echo from worker
+remote /bin/true
+remote /bin/false
+remote /nonexistent
+EOF
+prints remote 'from worker'
+exits remote 'remote /bin/true' 0
+exits remote 'remote /bin/false' 1
+exits remote 'remote /nonexistent' 127
+
+# Server mode: login, shared history, builtins, statuses
+"$TSH" -r "$WORK" -S "$WORK/tsh.sock" > /dev/null 2>&1 &
+daemon=$!
+while [ ! -S "$WORK/tsh.sock" ]; do
+    sleep 0.05
+done
+printf 'root\nwrong\nroot\npass\n/bin/echo first\nprintf %%s-%%d\\n x 3\n/bin/false\nquit\n' \
+    | "$IO" -s "$WORK/tsh.sock" > "$WORK/server.out"
+printf 'root\npass\nhistory\n' | "$IO" -s "$WORK/tsh.sock" > "$WORK/history.out"
+kill $daemon
+wait $daemon 2> /dev/null
+prints server 'User Authentication failed. Please try again.'
+grep -q 'first$' "$WORK/server.out"
+report server "prints 'first'" $?
+grep -q 'x-3$' "$WORK/server.out"
+report server "printf runs in the session" $?
+grep -q ' /bin/echo first$' "$WORK/history.out"
+report server "a second session sees the first one's history" $?
+session audit < /dev/null
+exits audit '/bin/false' 1
+
+echo "$checks checks, $failed failed"
+[ "$failed" -eq 0 ]
@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# dag.sh - Compare the dag builtin with make -j on the same graphs.
+#
+# Usage: bench/dag.sh [path/to/tsh]
+#
+# Two layered graphs are generated, each layer's nodes depending on
+# two nodes of the layer before: one of /bin/sleep nodes (scheduling
+# latency) and one of /bin/true nodes (per node overhead). Each is run
+# as a dag file by tsh and as a Makefile by make, in a scratch layout
+# like run.sh. Results are printed as one JSON object, in ms.
+#
+# Knobs (environment): BENCH_DAG_LAYERS  layers per graph   (6)
+#                      BENCH_DAG_WIDTH   nodes per layer    (8)
+#                      BENCH_DAG_JOBS    -j for both        (8)
+
+TSH=${1:-./tsh}
+LAYERS=${BENCH_DAG_LAYERS:-6}
+WIDTH=${BENCH_DAG_WIDTH:-8}
+JOBS=${BENCH_DAG_JOBS:-8}
+MAKE=${MAKE:-make}
+
+. "$(dirname "$0")/lib.sh"
+
+# graph NAME COMMAND - write NAME.dag and NAME.mk for the layered graph
+graph() {
+    awk -v L="$LAYERS" -v W="$WIDTH" -v cmd="$2" -v mk="$WORK/$1.mk" 'BEGIN {
+        printf "all:" > mk
+        printf "all:"
+        for (w = 0; w < W; w++) {
+            printf " n%d_%d", L - 1, w > mk
+            printf " n%d_%d", L - 1, w
+        }
+        print "" > mk
+        print ""
+        print ".PHONY: all" > mk
+        for (l = 0; l < L; l++) {
+            for (w = 0; w < W; w++) {
+                deps = ""
+                if (l > 0)
+                    deps = sprintf(" n%d_%d n%d_%d", l - 1, w, l - 1, (w + 1) % W)
+                printf "n%d_%d:%s\n\t%s\n", l, w, deps, cmd
+                printf "n%d_%d:%s\n\t@%s\n.PHONY: n%d_%d\n", l, w, deps, cmd, l, w > mk
+            }
+        }
+    }' > "$WORK/$1.dag"
+}
+
+# ms NS - nanoseconds to milliseconds
+ms() {
+    awk -v t="$1" 'BEGIN { if (t < 0) t = 0; printf "%.1f", t / 1e6 }'
+}
+
+# run_tsh NAME - elapsed ns for dag -f NAME.dag, less an empty session
+run_tsh() {
+    printf 'root\npass\ndag -j %s -f %s.dag\nquit\n' "$JOBS" "$1" > "$WORK/cmd.in"
+    start=$(now_ns)
+    (cd "$WORK" && "$TSH" -p < "$WORK/cmd.in" > "$WORK/$1.tsh.out" 2>&1)
+    echo $(( $(now_ns) - start - base_ns ))
+}
+
+# run_make NAME - elapsed ns for make -j on NAME.mk
+run_make() {
+    start=$(now_ns)
+    (cd "$WORK" && "$MAKE" -s -j "$JOBS" -f "$1.mk" > /dev/null 2>&1)
+    echo $(( $(now_ns) - start ))
+}
+
+printf 'root\npass\nquit\n' > "$WORK/empty.in"
+start=$(now_ns)
+(cd "$WORK" && "$TSH" -p < "$WORK/empty.in" > /dev/null 2>&1)
+base_ns=$(( $(now_ns) - start ))
+
+graph sleep "/bin/sleep 0.05"
+graph true "/bin/true"
+
+sleep_tsh=$(run_tsh sleep)
+sleep_make=$(run_make sleep)
+true_tsh=$(run_tsh true)
+true_make=$(run_make true)
+critical=$(awk '/critical path/ { sub(/s:$/, "", $4); print $4 * 1000 }' "$WORK/sleep.tsh.out")
+
+cat <<JSON
+{
+  "nodes": $((LAYERS * WIDTH + 1)),
+  "jobs": $JOBS,
+  "sleep_graph_ms": { "tsh_dag": $(ms "$sleep_tsh"), "make": $(ms "$sleep_make"),
+                      "critical_path_ms": ${critical:-0}, "ideal_ms": $((LAYERS * 50)) },
+  "true_graph_ms": { "tsh_dag": $(ms "$true_tsh"), "make": $(ms "$true_make") }
+}
+JSON
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# env.sh - Spawn cost with a large environment and the cached envp.
+#
+# Usage: bench/env.sh [path/to/tsh]
+#
+# Starts tsh with BENCH_ENV_VARS extra environment variables, in the
+# same scratch layout as run.sh. It then times BENCH_ENV_SPAWNS
+# spawns of /bin/true in three ways:
+#   - as they are, sharing the cached envp
+#   - with two NAME=value prefixes layered on
+#   - each after an export, so every spawn rebuilds the envp
+# It also checks that prefixes reach the child and leave the shell
+# alone. Prints one JSON object with the cost per spawn, less an
+# empty session.
+#
+# Knobs (environment): BENCH_ENV_VARS    extra variables      (1000)
+#                      BENCH_ENV_SPAWNS  spawns in each case  (2000)
+
+TSH=${1:-./tsh}
+V=${BENCH_ENV_VARS:-1000}
+N=${BENCH_ENV_SPAWNS:-2000}
+
+. "$(dirname "$0")/lib.sh"
+
+# session FILE - elapsed ns for a session reading FILE, output in $WORK/out
+session() {
+    start=$(now_ns)
+    (cd "$WORK" && env $(awk -v v="$V" 'BEGIN { for (i = 0; i < v; i++) printf "BENCH_VAR_%d=value_%d ", i, i }') \
+        TSH_AUDIT=0 "$TSH" -p < "$1" > "$WORK/out" 2>&1)
+    echo $(( $(now_ns) - start ))
+}
+
+# cmds FORMAT - session input with N lines printed from FORMAT (%d is i)
+cmds() {
+    awk -v n="$N" -v f="$1" 'BEGIN {
+        print "root"; print "pass"
+        for (i = 1; i <= n; i++) printf f "\n", i, i
+        print "quit" }'
+}
+
+printf 'root\npass\nquit\n' > "$WORK/empty.in"
+cmds '/bin/true %d' > "$WORK/plain.in"
+cmds 'A=%d B=%d /bin/true' > "$WORK/prefix.in"
+cmds 'export X=%d\n/bin/true %d' > "$WORK/export.in"
+printf 'root\npass\necho start\nA=1 BENCH_VAR_0=new /usr/bin/env\n/usr/bin/env\nquit\n' > "$WORK/check.in"
+
+base=$(session "$WORK/empty.in")
+plain=$(( $(session "$WORK/plain.in") - base ))
+prefix=$(( $(session "$WORK/prefix.in") - base ))
+export_ns=$(( $(session "$WORK/export.in") - base ))
+session "$WORK/check.in" > /dev/null
+ok=$(awk -v v="$V" '
+    /^A=1$/ { a++ } /^BENCH_VAR_0=new$/ { n++ } /^BENCH_VAR_0=value_0$/ { o++ }
+    /^BENCH_VAR_/ { vars++ }
+    END { print (a == 1 && n == 1 && o == 1 && vars == 2 * v) ? "true" : "false" }' "$WORK/out")
+
+awk -v n="$N" -v v="$V" -v plain="$plain" -v prefix="$prefix" -v rebuild="$export_ns" \
+    -v ok="$ok" 'BEGIN {
+    printf "{\n"
+    printf "  \"env_vars\": %d,\n", v
+    printf "  \"spawns\": %d,\n", n
+    printf "  \"cached_us_per_spawn\": %.1f,\n", plain / n / 1000
+    printf "  \"prefix_us_per_spawn\": %.1f,\n", prefix / n / 1000
+    printf "  \"export_and_spawn_us\": %.1f,\n", rebuild / n / 1000
+    printf "  \"prefix_scoped\": %s\n", ok
+    printf "}\n" }'
@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# glob.sh - Compare tsh's glob expansion with glibc glob(3).
+#
+# Usage: bench/glob.sh [path/to/tsh] [path/to/glob_ref]
+#
+# Builds a tree of BENCH_GLOB_TOP x BENCH_GLOB_SUB directories holding
+# BENCH_GLOB_FILES files each (1M files by default) in a scratch layout
+# like run.sh, then times each pattern set as arguments to the true
+# builtin (less an empty session) and through glob(3). glob(3) has no
+# **, so the recursive pattern is reported for tsh alone. Also checks
+# the expansion of edge cases (an unterminated [ after a wildcard,
+# sets, patterns that match nothing) against the expected words.
+# Prints one JSON object with times in ms.
+#
+# Knobs (environment): BENCH_GLOB_TOP    top level directories  (100)
+#                      BENCH_GLOB_SUB    directories in each    (100)
+#                      BENCH_GLOB_FILES  files in each of those (100)
+
+TSH=${1:-./tsh}
+REF=${2:-./bench/glob_ref}
+TOP=${BENCH_GLOB_TOP:-100}
+SUB=${BENCH_GLOB_SUB:-100}
+FILES=${BENCH_GLOB_FILES:-100}
+
+. "$(dirname "$0")/lib.sh"
+
+case $REF in
+    /*) ;;
+    *) REF=$(pwd)/$REF ;;
+esac
+
+"$REF" tree "$WORK/t" "$TOP" "$SUB" "$FILES" || exit 1
+
+# session LINE - elapsed ns for a session running LINE
+session() {
+    printf 'root\npass\n%s\nquit\n' "$1" > "$WORK/cmd.in"
+    start=$(now_ns)
+    (cd "$WORK" && "$TSH" -p < "$WORK/cmd.in" > /dev/null 2>&1)
+    echo $(( $(now_ns) - start ))
+}
+
+# ms NS - nanoseconds to milliseconds
+ms() {
+    awk -v t="$1" 'BEGIN { if (t < 0) t = 0; printf "%.1f", t / 1e6 }'
+}
+
+# compare NAME PATTERN... - JSON member timing tsh and glob(3)
+compare() {
+    name=$1
+    shift
+    tsh_ns=$(( $(session "true $*") - base_ns ))
+    set -- $(cd "$WORK" && "$REF" glob "$@")
+    printf '  "%s": { "matches": %s, "tsh_ms": %s, "glob3_ms": %s },\n' \
+        "$name" "$1" "$(ms "$tsh_ns")" "$(ms "$2")"
+}
+
+# Edge cases: PATTERN EXPECTED pairs, echoed one per line
+mkdir -p "$WORK/g"
+: > "$WORK/g/a[x"
+: > "$WORK/g/ab"
+set -- 'g/*[x' 'g/a[x' \
+       'g/zz*[x' 'g/zz*[x' \
+       'g/[x' 'g/[x' \
+       'g/a[b]' 'g/ab' \
+       'g/[!b]b' 'g/ab' \
+       'g/a[' 'g/a['
+{
+    printf 'root\npass\n'
+    while [ $# -gt 0 ]; do
+        printf 'echo %s\n' "$1"
+        printf '%s\n' "$2" >> "$WORK/edge.want"
+        shift 2
+    done
+    printf 'quit\n'
+} > "$WORK/edge.in"
+(cd "$WORK" && "$TSH" -p < "$WORK/edge.in" 2>&1) | sed 's/^username: password: //' \
+    > "$WORK/edge.got"
+edge_ok=false
+cmp -s "$WORK/edge.got" "$WORK/edge.want" && edge_ok=true
+
+session "true t/*/*/*.c" > /dev/null       # warm the dentry cache
+base_ns=$(session "true")
+
+echo "{"
+echo "  \"files\": $((TOP * SUB * FILES)),"
+echo "  \"edge_cases_ok\": $edge_ok,"
+compare narrow 't/d0*/s*/f00*.c'
+compare all_c 't/*/*/*.c'
+compare shared_prefix 't/*/s1*/*.c' 't/*/s1*/*.h'
+deep_ns=$(( $(session "true t/**/f05?.h") - base_ns ))
+echo "  \"recursive_tsh_ms\": $(ms "$deep_ns")"
+echo "}"
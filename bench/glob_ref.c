@@ -0,0 +1,69 @@
+/*
+ * glob_ref - Tree builder and glob(3) reference for bench/glob.sh
+ *
+ * glob_ref tree DIR TOP SUB FILES
+ *     create DIR/dNN/sNN/fNNN.{c,h}: TOP x SUB directories of FILES
+ *     files each (alternating .c and .h)
+ * glob_ref glob PATTERN...
+ *     expand each pattern with glob(3), appending like one command
+ *     line, and print "matches ns"
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+static int tree(const char *root, int top, int sub, int files)
+{
+    char path[4096];
+    int i, j, k, fd;
+
+    mkdir(root, 0755);
+    for (i = 0; i < top; i++) {
+        snprintf(path, sizeof(path), "%s/d%02d", root, i);
+        mkdir(path, 0755);
+        for (j = 0; j < sub; j++) {
+            snprintf(path, sizeof(path), "%s/d%02d/s%02d", root, i, j);
+            mkdir(path, 0755);
+            for (k = 0; k < files; k++) {
+                snprintf(path, sizeof(path), "%s/d%02d/s%02d/f%03d.%c",
+                         root, i, j, k, k % 2 ? 'h' : 'c');
+                if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) < 0) {
+                    perror(path);
+                    return 1;
+                }
+                close(fd);
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct timespec a, b;
+    glob_t g;
+    int i, flags = 0;
+
+    if (argc == 6 && strcmp(argv[1], "tree") == 0)
+        return tree(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+    if (argc < 3 || strcmp(argv[1], "glob") != 0) {
+        fprintf(stderr, "usage: glob_ref tree DIR TOP SUB FILES | glob PATTERN...\n");
+        return 2;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (i = 2; i < argc; i++) {
+        glob(argv[i], flags | GLOB_NOCHECK, NULL, &g);
+        flags = GLOB_APPEND;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    printf("%zu %lld\n", g.gl_pathc,
+           (long long)(b.tv_sec - a.tv_sec) * 1000000000LL + (b.tv_nsec - a.tv_nsec));
+    globfree(&g);
+    return 0;
+}
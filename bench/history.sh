@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# history.sh - Shared history under concurrent sessions of one user.
+#
+# Usage: bench/history.sh [path/to/tsh]
+#
+# Runs BENCH_HIST_SESSIONS sessions of the same user at once, each
+# running BENCH_HIST_CMDS numbered true commands, in the same scratch
+# layout as run.sh. While they run, the history file is sampled; every
+# sample and the final file must hold only whole lines, with each
+# session's numbers in order and without gaps. Prints one JSON object
+# with the cost per command (less an empty session) for one session
+# alone and for all of them together.
+#
+# Knobs (environment): BENCH_HIST_SESSIONS  concurrent sessions  (4)
+#                      BENCH_HIST_CMDS      commands in each     (3000)
+
+TSH=${1:-./tsh}
+K=${BENCH_HIST_SESSIONS:-4}
+N=${BENCH_HIST_CMDS:-3000}
+
+. "$(dirname "$0")/lib.sh"
+HIST=$WORK/home/root/.tsh_history
+
+# script K - session input for session number K
+script() {
+    awk -v k="$1" -v n="$N" 'BEGIN {
+        print "root"; print "pass"
+        for (i = 1; i <= n; i++) printf "true s%d_%d\n", k, i
+        print "quit" }'
+}
+
+# check FILE - "ok" if FILE has only whole, ordered, gapless lines
+check() {
+    awk -F'[s_]' '
+        /^true s[0-9]+_[0-9]+$/ {
+            if (($2 in last) && $3 != last[$2] + 1) bad++
+            last[$2] = $3; next }
+        /^quit$/ { next }
+        { bad++ }
+        END { print bad ? "bad" : "ok" }' "$1"
+}
+
+printf 'root\npass\nquit\n' > "$WORK/empty.in"
+: > "$HIST"
+start=$(now_ns)
+(cd "$WORK" && "$TSH" -p < "$WORK/empty.in" > /dev/null 2>&1)
+base_ns=$(( $(now_ns) - start ))
+
+script 1 > "$WORK/one.in"
+: > "$HIST"
+start=$(now_ns)
+(cd "$WORK" && "$TSH" -p < "$WORK/one.in" > /dev/null 2>&1)
+one_ns=$(( $(now_ns) - start - base_ns ))
+
+k=1
+while [ "$k" -le "$K" ]; do
+    script "$k" > "$WORK/s$k.in"
+    k=$((k + 1))
+done
+: > "$HIST"
+start=$(now_ns)
+pids=
+k=1
+while [ "$k" -le "$K" ]; do
+    (cd "$WORK" && "$TSH" -p < "$WORK/s$k.in" > /dev/null 2>&1) &
+    pids="$pids $!"
+    k=$((k + 1))
+done
+samples=0
+bad=0
+while kill -0 $pids 2>/dev/null && [ "$samples" -lt 200 ]; do
+    cp "$HIST" "$WORK/snap" 2>/dev/null
+    [ "$(check "$WORK/snap")" = ok ] || bad=$((bad + 1))
+    samples=$((samples + 1))
+done
+wait
+all_ns=$(( $(now_ns) - start - base_ns ))
+[ "$(check "$HIST")" = ok ] || bad=$((bad + 1))
+
+awk -v n="$N" -v k="$K" -v one="$one_ns" -v all="$all_ns" \
+    -v samples="$samples" -v bad="$bad" -v size="$(wc -c < "$HIST")" 'BEGIN {
+    printf "{\n"
+    printf "  \"one_session_us_per_cmd\": %.1f,\n", one / n / 1000
+    printf "  \"sessions\": %d,\n", k
+    printf "  \"concurrent_us_per_cmd\": %.1f,\n", all / (n * k) / 1000
+    printf "  \"snapshots_checked\": %d,\n", samples + 1
+    printf "  \"inconsistent\": %d,\n", bad
+    printf "  \"final_history_bytes\": %d\n", size
+    printf "}\n" }'
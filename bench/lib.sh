@@ -0,0 +1,48 @@
+#
+# lib.sh - Setup shared by the bench/*.sh scripts, which source it.
+#
+# Usage: TSH=path/to/tsh; . "$(dirname "$0")/lib.sh"
+#
+# Makes TSH absolute and creates the scratch directory WORK, laid out
+# like the repo (etc/passwd.txt holding root:pass, home/root/.tsh_history,
+# proc/) so the checked in state is never touched. WORK is removed on
+# exit; a script that starts daemons sets its own trap afterwards.
+
+case $TSH in
+    /*) ;;
+    *) TSH=$(pwd)/$TSH ;;
+esac
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/tsh-bench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+mkdir -p "$WORK/etc" "$WORK/home/root" "$WORK/proc"
+printf 'root:pass:/home/root' > "$WORK/etc/passwd.txt"
+: > "$WORK/home/root/.tsh_history"
+
+now_ns() {
+    date +%s%N
+}
+
+# fixture NAME LINE COUNT - login, COUNT copies of LINE, then quit
+fixture() {
+    {
+        printf 'root\npass\n'
+        i=0
+        while [ "$i" -lt "$3" ]; do
+            printf '%s\n' "$2"
+            i=$((i + 1))
+        done
+        printf 'quit\n'
+    } > "$WORK/$1.in"
+}
+
+# run NAME [tsh flags] - feed a fixture to tsh, print elapsed ns
+run() {
+    name=$1
+    shift
+    start=$(now_ns)
+    (cd "$WORK" && "$TSH" -p "$@" < "$WORK/$name.in" > "$WORK/$name.out" 2>&1)
+    end=$(now_ns)
+    echo $((end - start))
+}
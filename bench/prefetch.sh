@@ -0,0 +1,102 @@
+#!/bin/sh
+#
+# prefetch.sh - Cold-cache exec latency with and without prefetch.
+#
+# Usage: bench/prefetch.sh [path/to/tsh] [path/to/prefetch_ref]
+#
+# Builds a payload binary carrying BENCH_PREFETCH_MB of data that it
+# reads on every run, in the same scratch layout as run.sh. A session
+# then alternates "prefetch_ref evict payload" (dropping the payload
+# from the page cache) and the payload itself, with BENCH_THINK_MS of
+# typing time before each line. A training session teaches tsh that
+# the payload follows the evict; the measured sessions run with the
+# prefetch on and with TSH_PREFETCH=0. Latency is from the moment the
+# payload's line is written to tsh until the payload has read its
+# data. Prints one JSON object with the mean and max in ms.
+#
+# Knobs (environment): BENCH_PREFETCH_MB  payload size in MB     (64)
+#                      BENCH_ROUNDS       runs per session       (10)
+#                      BENCH_THINK_MS     pause before each line (500)
+
+TSH=${1:-./tsh}
+REF=${2:-./bench/prefetch_ref}
+MB=${BENCH_PREFETCH_MB:-64}
+ROUNDS=${BENCH_ROUNDS:-10}
+THINK=${BENCH_THINK_MS:-500}
+CC=${CC:-cc}
+
+. "$(dirname "$0")/lib.sh"
+
+case $REF in
+    /*) ;;
+    *) REF=$(pwd)/$REF ;;
+esac
+
+# The payload: its data is part of the binary, so exec maps it cold
+head -c $((MB * 1024 * 1024)) /dev/urandom > "$WORK/blob"
+cat > "$WORK/payload.c" <<EOC
+#include <stdio.h>
+#include <time.h>
+__asm__(".section .rodata\n.global blob\nblob:\n.incbin \"$WORK/blob\"\n"
+        ".global blob_end\nblob_end:\n.previous\n");
+extern const unsigned char blob[], blob_end[];
+int main(void)
+{
+    struct timespec ts;
+    const volatile unsigned char *p;
+    unsigned sum = 0;
+
+    for (p = blob; p < blob_end; p += 4096)
+        sum += *p;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    printf("done %lld %u\n", (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec, sum);
+    return 0;
+}
+EOC
+$CC -O2 -o "$WORK/payload" "$WORK/payload.c" || exit 1
+rm -f "$WORK/blob"
+
+think() {
+    sleep "$(awk -v ms="$THINK" 'BEGIN { printf "%.3f", ms / 1000 }')"
+}
+
+# session [ENV...] - feed one session, one line at a time
+session() {
+    : > "$WORK/fed"
+    {
+        printf 'root\npass\n'
+        i=0
+        while [ "$i" -lt "$ROUNDS" ]; do
+            echo "$REF evict $WORK/payload"
+            think
+            now_ns >> "$WORK/fed"
+            echo "$WORK/payload"
+            think
+            i=$((i + 1))
+        done
+        echo quit
+    } | (cd "$WORK" && env "$@" "$TSH" -p > "$WORK/out" 2>&1)
+}
+
+# result NAME - JSON member for the last session
+result() {
+    grep -o 'done [0-9]*' "$WORK/out" | cut -d' ' -f2 | paste "$WORK/fed" - |
+    awk -v name="$1" '{ t = ($2 - $1) / 1e6; s += t; if (t > m) m = t; n++ }
+        END { printf "  \"%s\": { \"runs\": %d, \"mean_ms\": %.1f, \"max_ms\": %.1f }",
+              name, n, n ? s / n : 0, m }'
+}
+
+ROUNDS_SAVED=$ROUNDS
+ROUNDS=3
+session TSH_PREFETCH=0                  # training
+ROUNDS=$ROUNDS_SAVED
+
+echo "{"
+echo "  \"payload_mb\": $MB,"
+session TSH_PREFETCH=0
+result cold
+echo ","
+session TSH_PREFETCH=1
+result prefetch
+echo
+echo "}"
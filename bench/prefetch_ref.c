@@ -0,0 +1,58 @@
+/*
+ * prefetch_ref - Page cache helper for bench/prefetch.sh
+ *
+ * prefetch_ref evict FILE...
+ *     drop FILE's pages from the page cache (POSIX_FADV_DONTNEED), so
+ *     the next exec of it starts cold
+ * prefetch_ref resident FILE
+ *     print how many of FILE's pages are in the page cache, and of how many
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int main(int argc, char **argv)
+{
+    int i, fd;
+
+    if (argc >= 3 && strcmp(argv[1], "evict") == 0) {
+        for (i = 2; i < argc; i++) {
+            if ((fd = open(argv[i], O_RDONLY)) < 0) {
+                perror(argv[i]);
+                return 1;
+            }
+            fdatasync(fd);          /* dirty pages cannot be dropped */
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+        return 0;
+    }
+    if (argc == 3 && strcmp(argv[1], "resident") == 0) {
+        struct stat sb;
+        long page = sysconf(_SC_PAGESIZE), n, in = 0;
+        unsigned char *vec;
+        void *map;
+
+        if ((fd = open(argv[2], O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+            perror(argv[2]);
+            return 1;
+        }
+        n = (sb.st_size + page - 1) / page;
+        map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED || (vec = malloc(n)) == NULL
+            || mincore(map, sb.st_size, vec) < 0) {
+            perror("mincore");
+            return 1;
+        }
+        for (i = 0; i < n; i++)
+            in += vec[i] & 1;
+        printf("%ld %ld\n", in, n);
+        return 0;
+    }
+    fprintf(stderr, "usage: prefetch_ref evict FILE... | resident FILE\n");
+    return 2;
+}
@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# queue.sh - Admission, priority order and overflow of the job queue.
+#
+# Usage: bench/queue.sh [path/to/tsh]
+#
+# Runs three sessions of tsh in the same scratch layout as run.sh.
+# Every job is a small script that logs its name and start time:
+#   - admission: submit -j BENCH_QUEUE_MAX, then BENCH_QUEUE_JOBS jobs
+#     of 0.2s each; reports the most that ran at once and the makespan
+#   - order: one job holds the only slot while low, normal, idle and
+#     high jobs wait; reports the order they started in
+#   - overflow: BENCH_QUEUE_JOBS plain cmd & jobs with the job list
+#     holding 16; reports how many ran rather than being refused
+# Prints one JSON object.
+#
+# Knobs (environment): BENCH_QUEUE_MAX   submit -j          (2)
+#                      BENCH_QUEUE_JOBS  jobs in each case  (30)
+
+TSH=${1:-./tsh}
+M=${BENCH_QUEUE_MAX:-2}
+N=${BENCH_QUEUE_JOBS:-30}
+
+. "$(dirname "$0")/lib.sh"
+
+# job.sh NAME SECS - log "NAME start end" in ns to $WORK/log
+cat > "$WORK/job.sh" <<EOF
+s=\$(date +%s%N)
+sleep \$2
+echo "\$1 \$s \$(date +%s%N)" >> "$WORK/log"
+EOF
+
+# session FILE - run a session reading FILE, with a fresh log
+session() {
+    : > "$WORK/log"
+    (cd "$WORK" && TSH_AUDIT=0 "$TSH" -p < "$1" > "$WORK/out" 2>&1)
+}
+
+awk -v n="$N" -v m="$M" -v job="$WORK/job.sh" 'BEGIN {
+    print "root"; print "pass"; print "submit -j " m
+    for (i = 1; i <= n; i++) print "submit /bin/sh " job " a" i " 0.2"
+    printf "/bin/sleep %.1f\n", 0.2 * n / m + 1
+    print "quit" }' > "$WORK/admit.in"
+session "$WORK/admit.in"
+admit=$(sort -k2n "$WORK/log" | awk -v n="$N" '
+    { s[NR] = $2; e[NR] = $3; if (NR == 1 || $2 < lo) lo = $2; if ($3 > hi) hi = $3 }
+    END {
+        for (i = 1; i <= NR; i++) {
+            c = 0
+            for (j = 1; j <= NR; j++)
+                if (s[j] <= s[i] && e[j] > s[i])
+                    c++
+            if (c > most)
+                most = c
+        }
+        printf "%d %d %.2f", NR, most, (hi - lo) / 1e9 }')
+
+printf 'root\npass\nsubmit -j 1\nsubmit /bin/sh %s hold 0.3\n' "$WORK/job.sh" > "$WORK/order.in"
+for p in low normal idle high; do
+    printf 'submit -p %s /bin/sh %s %s 0\n' "$p" "$WORK/job.sh" "$p" >> "$WORK/order.in"
+done
+printf '/bin/sleep 1\nquit\n' >> "$WORK/order.in"
+session "$WORK/order.in"
+order=$(sort -k2n "$WORK/log" | awk '$1 != "hold" { printf "%s%s", sep, $1; sep = "," }')
+
+awk -v n="$N" -v job="$WORK/job.sh" 'BEGIN {
+    print "root"; print "pass"
+    for (i = 1; i <= n; i++) print "/bin/sh " job " o" i " 0.1 &"
+    print "/bin/sleep 2"
+    print "quit" }' > "$WORK/overflow.in"
+session "$WORK/overflow.in"
+ran=$(wc -l < "$WORK/log")
+
+echo "$admit" | awk -v n="$N" -v m="$M" -v order="$order" -v ran="$ran" '{
+    printf "{\n"
+    printf "  \"jobs\": %d,\n", n
+    printf "  \"max_running\": %d,\n", m
+    printf "  \"admitted\": %d,\n", $1
+    printf "  \"most_at_once\": %d,\n", $2
+    printf "  \"makespan_s\": %.2f,\n", $3
+    printf "  \"ideal_makespan_s\": %.2f,\n", 0.2 * int((n + m - 1) / m)
+    printf "  \"start_order\": \"%s\",\n", order
+    printf "  \"overflow_ran\": %d\n", ran
+    printf "}\n" }'
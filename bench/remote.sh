@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# remote.sh - Drive a pool of local workers through "remote" jobs.
+#
+# Usage: bench/remote.sh [path/to/tsh]
+#
+# Starts BENCH_WORKERS (3) workers on Unix sockets, then measures the
+# foreground round trip of BENCH_N (50) remote commands against the
+# same commands run locally, and how BENCH_FANOUT (12) background
+# remote jobs were placed across the pool. Prints one JSON object.
+
+TSH=${1:-./tsh}
+WORKERS=${BENCH_WORKERS:-3}
+N=${BENCH_N:-50}
+FANOUT=${BENCH_FANOUT:-12}
+
+. "$(dirname "$0")/lib.sh"
+head -c 32 /dev/urandom | od -An -tx1 | tr -d ' \n' > "$WORK/token"
+chmod 600 "$WORK/token"
+TSH_WORKER_TOKEN=$WORK/token
+export TSH_WORKER_TOKEN
+
+pids=""
+addrs=""
+i=0
+while [ "$i" -lt "$WORKERS" ]; do
+    "$TSH" -W "$WORK/w$i.sock" &
+    pids="$pids $!"
+    addrs="$addrs${addrs:+,}$WORK/w$i.sock"
+    i=$((i + 1))
+done
+trap 'kill $pids 2>/dev/null; wait 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+
+i=0
+while [ "$i" -lt "$WORKERS" ]; do
+    while [ ! -S "$WORK/w$i.sock" ]; do
+        sleep 0.05
+    done
+    i=$((i + 1))
+done
+
+# session PREFIX COUNT - time COUNT foreground /bin/true runs
+session() {
+    {
+        printf 'root\npass\n'
+        i=0
+        while [ "$i" -lt "$2" ]; do
+            printf '%s/bin/true\n' "$1"
+            i=$((i + 1))
+        done
+        printf 'quit\n'
+    } > "$WORK/session.in"
+    start=$(now_ns)
+    TSH_WORKERS=$addrs "$TSH" -p -r "$WORK" < "$WORK/session.in" > /dev/null 2>&1
+    end=$(now_ns)
+    echo $(( (end - start) / $2 / 1000 ))
+}
+
+local_us=$(session "" "$N")
+remote_us=$(session "remote " "$N")
+
+# Background placement: count the job handlers each worker has forked
+{
+    printf 'root\npass\n'
+    i=0
+    while [ "$i" -lt "$FANOUT" ]; do
+        printf 'remote /bin/sleep 1 &\n'
+        i=$((i + 1))
+    done
+    printf 'quit\n'
+} > "$WORK/fanout.in"
+TSH_WORKERS=$addrs "$TSH" -p -r "$WORK" < "$WORK/fanout.in" > /dev/null 2>&1
+sleep 0.3
+placement=""
+for p in $pids; do
+    placement="$placement${placement:+, }$(pgrep -c -P "$p")"
+done
+sleep 1
+
+cat <<JSON
+{
+  "workers": $WORKERS,
+  "commands": $N,
+  "local_roundtrip_mean_us": $local_us,
+  "remote_roundtrip_mean_us": $remote_us,
+  "bg_fanout_jobs": $FANOUT,
+  "bg_jobs_per_worker": [$placement]
+}
+JSON
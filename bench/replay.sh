@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# replay.sh - Record a session, then replay a trace at several speeds.
+#
+# Usage: bench/replay.sh [path/to/tsh]
+#
+# In the same scratch layout as run.sh, records a short session with
+# --record and replays it at full speed, which must not diverge. Then
+# builds a trace of BENCH_REPLAY_CMDS commands (external commands,
+# builtins and background jobs) with BENCH_REPLAY_THINK_US of think
+# time before each, and replays it with --speed 1x, 10x and max.
+# Prints one JSON object with the wall time of each replay, the p50
+# and p99 latency of /bin/true it reported, and the divergences.
+#
+# Knobs (environment): BENCH_REPLAY_CMDS      commands in the trace   (1000)
+#                      BENCH_REPLAY_THINK_US  think time before each  (2000)
+
+TSH=${1:-./tsh}
+N=${BENCH_REPLAY_CMDS:-1000}
+THINK=${BENCH_REPLAY_THINK_US:-2000}
+
+. "$(dirname "$0")/lib.sh"
+printf 'root\npass\n' > "$WORK/login.in"
+
+# replay TRACE SPEED - run TRACE, leave the report in $WORK/report
+replay() {
+    (cd "$WORK" && TSH_REPLAY_OUT="$WORK/report" TSH_AUDIT=0 \
+        "$TSH" -p --replay "$1" --speed "$2" < "$WORK/login.in" > /dev/null 2>&1)
+}
+
+# field NAME COLUMN - a column of the report row for command NAME
+field() {
+    awk -v n="$1" -v c="$2" '$1 == n { print $c; found = 1 } END { if (!found) print 0 }' \
+        "$WORK/report"
+}
+
+diverged() {
+    awk '/^replay: [0-9]+ diverged/ { print $2 }' "$WORK/report"
+}
+
+# Round trip: what was recorded replays without divergence
+printf 'root\npass\n/bin/echo one\n/bin/false\n/bin/sleep 0.1 &\n/bin/cat << EOF\nbody\nEOF\ntrue\n/bin/sleep 0.2\nquit\n' \
+    > "$WORK/session.in"
+(cd "$WORK" && TSH_AUDIT=0 "$TSH" -p --record "$WORK/session.tr" < "$WORK/session.in" > /dev/null 2>&1)
+replay "$WORK/session.tr" max
+roundtrip=$(diverged)
+
+# A synthetic trace: seq numbers follow the command lines
+awk -v n="$N" -v t="$THINK" 'BEGIN {
+    print "# tsh trace 1"
+    for (i = 1; i <= n; i++) {
+        k = i % 10
+        if (k < 5)       { cmd = "/bin/true"; st = 0 }
+        else if (k < 8)  { cmd = "echo x"; st = 0 }
+        else if (k == 8) { cmd = "/bin/false"; st = 1 }
+        else             { cmd = "/bin/true &"; st = 0 }
+        printf "L\t%d\t%s\n=\t%d\t%d\t1000\n", t, cmd, i, st
+        if (k == 9) printf "J\t%d\t0\n", i
+    }
+    printf "L\t%d\tquit\n", t }' > "$WORK/synthetic.tr"
+
+for s in 1 10 max; do
+    start=$(now_ns)
+    replay "$WORK/synthetic.tr" "$s"
+    eval "wall_$s=\$(( \$(now_ns) - start ))"
+    eval "p50_$s=\$(field /bin/true 4)"
+    eval "p99_$s=\$(field /bin/true 5)"
+    eval "div_$s=\$(diverged)"
+done
+
+awk -v n="$N" -v think="$THINK" -v rt="$roundtrip" \
+    -v w1="$wall_1" -v w10="$wall_10" -v wmax="$wall_max" \
+    -v a1="$p50_1" -v a10="$p50_10" -v amax="$p50_max" \
+    -v b1="$p99_1" -v b10="$p99_10" -v bmax="$p99_max" \
+    -v d1="$div_1" -v d10="$div_10" -v dmax="$div_max" 'BEGIN {
+    printf "{\n"
+    printf "  \"roundtrip_diverged\": %d,\n", rt
+    printf "  \"commands\": %d,\n", n
+    printf "  \"recorded_think_s\": %.3f,\n", n * think / 1e6
+    printf "  \"wall_s_1x\": %.3f,\n", w1 / 1e9
+    printf "  \"wall_s_10x\": %.3f,\n", w10 / 1e9
+    printf "  \"wall_s_max\": %.3f,\n", wmax / 1e9
+    printf "  \"true_p50_us\": [%d, %d, %d],\n", a1, a10, amax
+    printf "  \"true_p99_us\": [%d, %d, %d],\n", b1, b10, bmax
+    printf "  \"diverged\": [%d, %d, %d]\n", d1, d10, dmax
+    printf "}\n" }'
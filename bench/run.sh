@@ -0,0 +1,111 @@
+#!/bin/sh
+#
+# run.sh - Measure the shell's own overhead.
+#
+# Usage: bench/run.sh [path/to/tsh]
+#
+# Every run happens in a scratch directory laid out like the repo
+# (etc/passwd.txt, home/<user>/.tsh_history, proc/) so the checked in
+# state is never touched. Results are printed as one JSON object.
+#
+# Knobs (environment): BENCH_N       commands per sample      (200)
+#                      BENCH_FANOUT  background jobs launched (12)
+#                      BENCH_LOGINS  login/quit cycles        (50)
+
+TSH=${1:-./tsh}
+N=${BENCH_N:-200}
+FANOUT=${BENCH_FANOUT:-12}
+LOGINS=${BENCH_LOGINS:-50}
+
+. "$(dirname "$0")/lib.sh"
+
+# phase FILE PHASE FIELD - pull p50_ns (3) or p99_ns (4) from a -P dump
+phase() {
+    awk -v p="$2" -v f="$3" '$1 == p { print $f; found = 1 }
+        END { if (!found) print 0 }' "$1"
+}
+
+# Fixed cost of an empty session, subtracted from the per command numbers
+fixture empty "" 0
+base_ns=$(run empty)
+
+# Spawn rate and foreground round trip
+fixture spawn /bin/true "$N"
+spawn_ns=$(run spawn)
+spawn_per_s=$(awk -v n="$N" -v t="$spawn_ns" -v b="$base_ns" \
+    'BEGIN { d = t - b; if (d <= 0) d = 1; printf "%.1f", n * 1e9 / d }')
+rt_mean_us=$(awk -v n="$N" -v t="$spawn_ns" -v b="$base_ns" \
+    'BEGIN { printf "%.1f", (t - b) / n / 1000 }')
+
+# Percentiles of whole commands (-P's eval phase), not sums of phases
+TSH_PROFILE_OUT="$WORK/spawn.prof" run spawn -P > /dev/null
+rt_p50_ns=$(phase "$WORK/spawn.prof" eval 3)
+rt_p99_ns=$(phase "$WORK/spawn.prof" eval 4)
+
+# Background fan-out: launch FANOUT jobs, then one foreground command
+{
+    printf 'root\npass\n'
+    i=0
+    while [ "$i" -lt "$FANOUT" ]; do
+        printf '/bin/sleep 0.05 &\n'
+        i=$((i + 1))
+    done
+    printf '/bin/true\nquit\n'
+} > "$WORK/fanout.in"
+fanout_ns=$(run fanout)
+fanout_us=$(( (fanout_ns - base_ns) / 1000 ))
+
+# History write cost, from builtins that touch no processes
+fixture history jobs "$N"
+TSH_PROFILE_OUT="$WORK/history.prof" run history -P > /dev/null
+hist_p50_ns=$(phase "$WORK/history.prof" history 3)
+hist_p99_ns=$(phase "$WORK/history.prof" history 4)
+
+# Login cost: full start, authenticate, quit
+fixture login "" 0
+i=0
+login_total=0
+while [ "$i" -lt "$LOGINS" ]; do
+    login_total=$((login_total + $(run login)))
+    i=$((i + 1))
+done
+login_mean_us=$((login_total / LOGINS / 1000))
+
+# Memory growth across N commands, read from the shell's own status
+rss_cmd="/bin/sh -c 'grep VmRSS /proc/\$PPID/status'"
+{
+    printf 'root\npass\n%s\n' "$rss_cmd"
+    i=0
+    while [ "$i" -lt "$N" ]; do
+        printf 'jobs\n'
+        i=$((i + 1))
+    done
+    printf '%s\nquit\n' "$rss_cmd"
+} > "$WORK/memory.in"
+run memory > /dev/null
+rss_kb() {
+    awk '{ for (i = 1; i < NF; i++) if ($i == "VmRSS:") print $(i + 1) }' \
+        "$WORK/memory.out"
+}
+rss_start_kb=$(rss_kb | head -n 1)
+rss_end_kb=$(rss_kb | tail -n 1)
+rss_start_kb=${rss_start_kb:-0}
+rss_end_kb=${rss_end_kb:-0}
+
+cat <<JSON
+{
+  "commands": $N,
+  "spawn_per_sec": $spawn_per_s,
+  "fg_roundtrip_mean_us": $rt_mean_us,
+  "fg_roundtrip_p50_ns": $rt_p50_ns,
+  "fg_roundtrip_p99_ns": $rt_p99_ns,
+  "bg_fanout_jobs": $FANOUT,
+  "bg_fanout_us": $fanout_us,
+  "history_write_p50_ns": $hist_p50_ns,
+  "history_write_p99_ns": $hist_p99_ns,
+  "login_mean_us": $login_mean_us,
+  "rss_start_kb": $rss_start_kb,
+  "rss_end_kb": $rss_end_kb,
+  "rss_growth_kb": $((rss_end_kb - rss_start_kb))
+}
+JSON
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# script.sh - Measure script compilation and the bytecode cache.
+#
+# Usage: bench/script.sh [path/to/tsh]
+#
+# A BENCH_LINES line script of builtins (with an if and a while
+# block every 100 lines) is sourced three times in a scratch layout
+# like run.sh: cold (compiled and cached), warm (loaded from the
+# cache) and after a touch (mtime changed, so compiled again).
+# Results are printed as one JSON object.
+#
+# Knobs (environment): BENCH_LINES  script length (10000)
+
+TSH=${1:-./tsh}
+LINES=${BENCH_LINES:-10000}
+
+. "$(dirname "$0")/lib.sh"
+
+awk -v n="$LINES" 'BEGIN {
+    for (i = 0; i < n; i += 100) {
+        print "# block " i
+        print "if test " i " -ge 0"
+        for (j = 0; j < 46; j++) print "    true"
+        print "else"
+        print "    false"
+        print "fi"
+        print "while false"
+        for (j = 0; j < 47; j++) print "    true"
+        print "done"
+    }
+}' > "$WORK/big.tsh"
+
+# session FILE - elapsed ns for one session running FILE
+session() {
+    printf 'root\npass\n%s\nquit\n' "$1" > "$WORK/cmd.in"
+    start=$(now_ns)
+    (cd "$WORK" && "$TSH" -p < "$WORK/cmd.in" > "$WORK/cmd.out" 2>&1)
+    echo $(( $(now_ns) - start ))
+}
+
+base_ns=$(session "true")
+cold_ns=$(session "source big.tsh")
+warm_ns=$(session "source big.tsh")
+touch "$WORK/big.tsh"
+stale_ns=$(session "source big.tsh")
+cache_bytes=$(cat "$WORK"/home/root/.tsh_cache/* | wc -c)
+
+us() {
+    awk -v t="$1" -v b="$base_ns" 'BEGIN { d = t - b; if (d < 0) d = 0; printf "%.1f", d / 1000 }'
+}
+
+cat <<JSON
+{
+  "script_lines": $(wc -l < "$WORK/big.tsh"),
+  "cold_us": $(us "$cold_ns"),
+  "warm_us": $(us "$warm_ns"),
+  "touched_us": $(us "$stale_ns"),
+  "cache_bytes": $cache_bytes
+}
+JSON
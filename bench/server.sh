@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# server.sh - Load test tsh --server with many concurrent sessions.
+#
+# Usage: bench/server.sh [path/to/tsh] [path/to/session_load]
+#
+# Starts a daemon on a scratch copy of the etc/, home/ and proc/
+# layout, connects BENCH_SESSIONS (1000) sessions that each log in and
+# run one builtin, and prints session_load's JSON report.
+
+TSH=${1:-./tsh}
+LOAD=${2:-./bench/session_load}
+SESSIONS=${BENCH_SESSIONS:-1000}
+
+. "$(dirname "$0")/lib.sh"
+
+"$TSH" -r "$WORK" -S "$WORK/tsh.sock" &
+daemon=$!
+trap 'kill $daemon 2>/dev/null; wait $daemon 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+
+i=0
+while [ ! -S "$WORK/tsh.sock" ] && [ "$i" -lt 100 ]; do
+    sleep 0.05
+    i=$((i + 1))
+done
+
+"$LOAD" -s "$WORK/tsh.sock" -n "$SESSIONS" -p "$daemon"
@@ -0,0 +1,72 @@
+/*
+ * session_io - Run one tsh --server session from stdin
+ *
+ * Sends all of stdin to the daemon, closes the sending side and
+ * copies what the session printed to stdout until the daemon hangs
+ * up. Gives up after -t seconds (10) so a stuck daemon cannot hang
+ * a check.
+ *
+ * Usage: session_io -s sock [-t seconds]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* copy - Write all of buf[0..n) to fd; 0 on success */
+static int copy(int fd, const char *buf, ssize_t n)
+{
+    while (n > 0) {
+        ssize_t k = write(fd, buf, n);
+        if (k <= 0)
+            return -1;
+        buf += k;
+        n -= k;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *sock = NULL, buf[4096];
+    int secs = 10, fd, c;
+    struct sockaddr_un addr;
+    ssize_t n;
+
+    while ((c = getopt(argc, argv, "s:t:")) != -1) {
+        switch (c) {
+        case 's': sock = optarg; break;
+        case 't': secs = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s -s sock [-t seconds]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (sock == NULL) {
+        fprintf(stderr, "%s: -s sock is required\n", argv[0]);
+        return 2;
+    }
+    alarm(secs);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return 1;
+    }
+    while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
+        if (copy(fd, buf, n) < 0) {
+            perror("write");
+            return 1;
+        }
+    shutdown(fd, SHUT_WR);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        if (copy(STDOUT_FILENO, buf, n) < 0)
+            return 1;
+    return n < 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * session_load - Open many concurrent sessions against tsh --server
+ *
+ * Every session logs in, runs one command and then stays connected,
+ * so the daemon's memory can be sampled with all of them live.
+ * Results are printed as one JSON object.
+ *
+ * Usage: session_load -s sock [-n sessions] [-u user] [-w password]
+ *                     [-c command] [-p daemon_pid]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define PROMPT "tsh> "
+
+struct conn {
+    int fd;
+    int prompts;            /* shell prompts seen so far */
+    size_t match;           /* bytes of PROMPT matched across reads */
+    long long t_start;
+    long long t_login;
+    long long t_cmd;
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static long long pct(long long *v, int n, int p)
+{
+    int i;
+
+    if (n == 0)
+        return 0;
+    i = (n * p + 99) / 100 - 1;
+    return v[i < 0 ? 0 : i];
+}
+
+static long rss_kb(int pid)
+{
+    char path[64], line[256];
+    long kb = 0;
+    FILE *fp;
+
+    if (pid <= 0)
+        return 0;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb;
+}
+
+int main(int argc, char **argv)
+{
+    char *sock = NULL, *user = "root", *pass = "pass", *cmd = "jobs";
+    int n = 1000, pid = 0, c, i, epfd, done = 0, failed = 0;
+    struct sockaddr_un addr;
+    struct epoll_event ev, events[256];
+    struct rlimit rl;
+    struct conn *conns;
+    long long *login, *rtt, t0, t_all;
+    long rss_idle, rss_loaded;
+    char hello[512];
+
+    while ((c = getopt(argc, argv, "s:n:u:w:c:p:")) != -1) {
+        switch (c) {
+        case 's': sock = optarg; break;
+        case 'n': n = atoi(optarg); break;
+        case 'u': user = optarg; break;
+        case 'w': pass = optarg; break;
+        case 'c': cmd = optarg; break;
+        case 'p': pid = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s -s sock [-n sessions] [-u user] "
+                    "[-w password] [-c command] [-p daemon_pid]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (sock == NULL || n <= 0) {
+        fprintf(stderr, "%s: -s sock is required\n", argv[0]);
+        return 2;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    conns = calloc(n, sizeof(*conns));
+    login = calloc(n, sizeof(*login));
+    rtt = calloc(n, sizeof(*rtt));
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    snprintf(hello, sizeof(hello), "%s\n%s\n", user, pass);
+    epfd = epoll_create1(0);
+
+    rss_idle = rss_kb(pid);
+    t0 = now_ns();
+    for (i = 0; i < n; i++) {
+        struct conn *cn = &conns[i];
+
+        cn->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        cn->t_start = now_ns();
+        if (cn->fd < 0 || connect(cn->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            return 1;
+        }
+        if (write(cn->fd, hello, strlen(hello)) < 0) {
+            perror("write");
+            return 1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = cn;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, cn->fd, &ev);
+    }
+
+    while (done + failed < n) {
+        int k = epoll_wait(epfd, events, 256, 10000);
+
+        if (k <= 0) {
+            fprintf(stderr, "session_load: timed out with %d of %d done\n", done, n);
+            break;
+        }
+        for (i = 0; i < k; i++) {
+            struct conn *cn = events[i].data.ptr;
+            char buf[4096];
+            ssize_t r = read(cn->fd, buf, sizeof(buf));
+            ssize_t j;
+
+            if (r <= 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, cn->fd, NULL);
+                failed++;
+                continue;
+            }
+            for (j = 0; j < r; j++) {
+                cn->match = (buf[j] == PROMPT[cn->match]) ? cn->match + 1
+                    : (buf[j] == PROMPT[0]);
+                if (cn->match < strlen(PROMPT))
+                    continue;
+                cn->match = 0;
+                if (++cn->prompts == 1) {           /* logged in */
+                    cn->t_login = now_ns();
+                    dprintf(cn->fd, "%s\n", cmd);
+                }
+                else if (cn->prompts == 2) {        /* command done */
+                    cn->t_cmd = now_ns();
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, cn->fd, NULL);
+                    done++;
+                }
+            }
+        }
+    }
+    t_all = now_ns() - t0;
+    rss_loaded = rss_kb(pid);
+
+    for (i = 0, c = 0; i < n; i++) {
+        if (conns[i].t_cmd == 0)
+            continue;
+        login[c] = conns[i].t_login - conns[i].t_start;
+        rtt[c] = conns[i].t_cmd - conns[i].t_login;
+        c++;
+    }
+    qsort(login, c, sizeof(*login), cmp_ll);
+    qsort(rtt, c, sizeof(*rtt), cmp_ll);
+
+    printf("{\n");
+    printf("  \"sessions\": %d,\n", n);
+    printf("  \"completed\": %d,\n", done);
+    printf("  \"failed\": %d,\n", failed);
+    printf("  \"total_ms\": %.1f,\n", t_all / 1e6);
+    printf("  \"login_p50_us\": %.1f,\n", pct(login, c, 50) / 1e3);
+    printf("  \"login_p99_us\": %.1f,\n", pct(login, c, 99) / 1e3);
+    printf("  \"command_p50_us\": %.1f,\n", pct(rtt, c, 50) / 1e3);
+    printf("  \"command_p99_us\": %.1f,\n", pct(rtt, c, 99) / 1e3);
+    printf("  \"daemon_rss_idle_kb\": %ld,\n", rss_idle);
+    printf("  \"daemon_rss_loaded_kb\": %ld,\n", rss_loaded);
+    printf("  \"daemon_kb_per_session\": %.2f\n",
+           done ? (double)(rss_loaded - rss_idle) / done : 0.0);
+    printf("}\n");
+
+    for (i = 0; i < n; i++)
+        close(conns[i].fd);
+    return done == n ? 0 : 1;
+}
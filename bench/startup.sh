@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# startup.sh - Exec-to-first-command latency of short-lived tsh runs.
+#
+# Usage: bench/startup.sh [path/to/tsh] [path/to/startup_load] [path/to/tsh-static]
+#
+# Times BENCH_STARTUP_RUNS sequential runs that log in, run one
+# builtin and quit, in the same scratch layout as run.sh with a full
+# history file. Runs tsh as it is and with -L, and the static-PIE
+# build both ways if it exists (make static). Reports p50 and p99 of
+# the time to the first command's output and to exit, whether the
+# lean p50 is within BENCH_STARTUP_BUDGET_US, and how many proc
+# entries the lean runs left. Prints one JSON object.
+#
+# Knobs (environment): BENCH_STARTUP_RUNS       runs per variant  (300)
+#                      BENCH_STARTUP_BUDGET_US  lean p50 budget   (1000)
+
+TSH=${1:-./tsh}
+LOAD=${2:-./bench/startup_load}
+STATIC=${3:-./tsh-static}
+N=${BENCH_STARTUP_RUNS:-300}
+BUDGET=${BENCH_STARTUP_BUDGET_US:-1000}
+
+. "$(dirname "$0")/lib.sh"
+
+for v in LOAD STATIC; do
+    eval "p=\$$v"
+    case $p in
+        /*) ;;
+        *) eval "$v=\$(pwd)/\$p" ;;
+    esac
+done
+
+awk 'BEGIN { for (i = 0; i < 1000; i++) printf "/bin/command --with some arguments %d\n", i }' \
+    > "$WORK/home/root/.tsh_history"
+
+# load TSH [flags] - startup_load's JSON for one variant
+load() {
+    (cd "$WORK" && TSH_AUDIT=0 "$LOAD" -n "$N" -- "$@" -p)
+}
+
+default=$(load "$TSH")
+lean=$(load "$TSH" -L)
+left=$(ls "$WORK/proc" | wc -l)
+static=null
+static_lean=null
+if [ -x "$STATIC" ]; then
+    static=$(load "$STATIC")
+    static_lean=$(load "$STATIC" -L)
+fi
+
+echo "$lean" | awk -v n="$N" -v budget="$BUDGET" -v left="$left" \
+    -v d="$default" -v l="$lean" -v s="$static" -v sl="$static_lean" '{
+    match($0, /"first_cmd_p50_us": [0-9.]+/)
+    p50 = substr($0, RSTART + 20, RLENGTH - 20) + 0
+    printf "{\n"
+    printf "  \"runs\": %d,\n", n
+    printf "  \"default\": %s,\n", d
+    printf "  \"lean\": %s,\n", l
+    printf "  \"static\": %s,\n", s
+    printf "  \"static_lean\": %s,\n", sl
+    printf "  \"budget_us\": %d,\n", budget
+    printf "  \"lean_within_budget\": %s,\n", p50 <= budget ? "true" : "false"
+    printf "  \"lean_proc_entries\": %d\n", left
+    printf "}\n" }'
@@ -0,0 +1,142 @@
+/*
+ * startup_load - Time short-lived tsh runs from exec to first command
+ *
+ * Each run spawns tsh -p with its whole input already in a pipe: a
+ * login, "echo <marker>" and quit. The time from just before the
+ * spawn until the marker arrives on tsh's stdout is the startup
+ * latency; the time until tsh has exited is the run time. Runs are
+ * sequential. Results are printed as one JSON object.
+ *
+ * Usage: startup_load [-n runs] [-u user] [-w password] -- tsh [args]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#define MARKER "tsh-startup-marker"
+
+extern char **environ;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double pct_us(long long *v, int n, double p)
+{
+    int i = (int)(p * (n - 1) + 0.5);
+
+    return v[i] / 1000.0;
+}
+
+/* run_once - One run of argv; the marker and exit times in ns, or -1 */
+static int run_once(char **argv, const char *input, long long *first, long long *total)
+{
+    posix_spawn_file_actions_t fa;
+    char buf[4096];
+    size_t have = 0, mlen = strlen(MARKER);
+    long long t0;
+    ssize_t n;
+    pid_t pid;
+    int in[2], out[2], status, err;
+
+    if (pipe(in) < 0 || pipe(out) < 0)
+        return -1;
+    if (write(in[1], input, strlen(input)) != (ssize_t)strlen(input))
+        return -1;                      /* small enough for the pipe */
+    close(in[1]);
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], 0);
+    posix_spawn_file_actions_adddup2(&fa, out[1], 1);
+    posix_spawn_file_actions_addclose(&fa, in[0]);
+    posix_spawn_file_actions_addclose(&fa, out[0]);
+    posix_spawn_file_actions_addclose(&fa, out[1]);
+
+    t0 = now_ns();
+    err = posix_spawn(&pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(in[0]);
+    close(out[1]);
+    if (err != 0) {
+        close(out[0]);
+        errno = err;
+        return -1;
+    }
+
+    *first = -1;
+    while ((n = read(out[0], buf + have, sizeof(buf) - 1 - have)) > 0) {
+        have += n;
+        buf[have] = '\0';
+        if (*first < 0 && strstr(buf, MARKER "\n") != NULL)
+            *first = now_ns() - t0;
+        if (have > mlen + 1) {          /* keep a tail the marker may span */
+            memmove(buf, buf + have - mlen - 1, mlen + 1);
+            have = mlen + 1;
+        }
+    }
+    close(out[0]);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    *total = now_ns() - t0;
+    return *first < 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *user = "root", *pass = "pass";
+    char input[1024];
+    long long *first, *total;
+    int runs = 200, c, i, ok = 0;
+
+    while ((c = getopt(argc, argv, "n:u:w:")) != -1) {
+        switch (c) {
+        case 'n': runs = atoi(optarg); break;
+        case 'u': user = optarg; break;
+        case 'w': pass = optarg; break;
+        default:
+            fprintf(stderr, "usage: startup_load [-n runs] [-u user] [-w password] -- tsh [args]\n");
+            return 2;
+        }
+    }
+    if (optind >= argc || runs <= 0) {
+        fprintf(stderr, "usage: startup_load [-n runs] [-u user] [-w password] -- tsh [args]\n");
+        return 2;
+    }
+    snprintf(input, sizeof(input), "%s\n%s\necho %s\nquit\n", user, pass, MARKER);
+    first = calloc(runs, sizeof(*first));
+    total = calloc(runs, sizeof(*total));
+    if (first == NULL || total == NULL)
+        return 1;
+
+    for (i = 0; i < runs; i++)
+        if (run_once(argv + optind, input, &first[ok], &total[ok]) == 0)
+            ok++;
+    if (ok == 0) {
+        fprintf(stderr, "startup_load: no run reached its first command\n");
+        return 1;
+    }
+    qsort(first, ok, sizeof(*first), cmp_ll);
+    qsort(total, ok, sizeof(*total), cmp_ll);
+
+    printf("{\"runs\": %d, \"first_cmd_p50_us\": %.1f, \"first_cmd_p99_us\": %.1f, "
+           "\"exit_p50_us\": %.1f, \"exit_p99_us\": %.1f}\n",
+           ok, pct_us(first, ok, 0.5), pct_us(first, ok, 0.99),
+           pct_us(total, ok, 0.5), pct_us(total, ok, 0.99));
+    return 0;
+}
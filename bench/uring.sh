@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# uring.sh - Spawn and reap throughput with each proc entry backend.
+#
+# Usage: bench/uring.sh [path/to/tsh]
+#
+# Runs tsh -p in the same scratch layout as run.sh, once with the proc
+# entries written through io_uring and once with TSH_URING=0. Each run
+# starts BENCH_URING_N foreground /bin/true jobs, then BENCH_URING_N
+# background ones in rounds of 8 and a foreground one. It checks that
+# proc/ is empty after each session and prints one JSON object with the cost per spawn and reap, less an
+# empty session. The io_uring figures equal the plain ones when the
+# kernel has no io_uring.
+#
+# Knobs (environment): BENCH_URING_N  jobs in each case  (2000)
+
+TSH=${1:-./tsh}
+N=${BENCH_URING_N:-2000}
+
+. "$(dirname "$0")/lib.sh"
+
+# session URING FILE - elapsed ns for a session reading FILE
+session() {
+    start=$(now_ns)
+    (cd "$WORK" && TSH_URING=$1 TSH_AUDIT=0 "$TSH" -p < "$2" > /dev/null 2>&1)
+    echo $(( $(now_ns) - start ))
+}
+
+# clean - "true" if no proc entry was left behind; empties proc/
+clean() {
+    if [ -z "$(ls "$WORK/proc")" ]; then echo true; else echo false; fi
+    rm -rf "$WORK/proc" && mkdir "$WORK/proc"
+}
+
+printf 'root\npass\nquit\n' > "$WORK/empty.in"
+awk -v n="$N" 'BEGIN { print "root"; print "pass"
+    for (i = 0; i < n; i++) print "/bin/true"
+    print "quit" }' > "$WORK/fg.in"
+awk -v n="$N" 'BEGIN { print "root"; print "pass"
+    for (i = 1; i <= n; i++) { print "/bin/true &"; if (i % 8 == 0) print "/bin/true" }
+    print "/bin/sleep 0.5"; print "quit" }' > "$WORK/bg.in"
+
+for u in 1 0; do
+    base=$(session $u "$WORK/empty.in")
+    clean > /dev/null
+    eval "fg_$u=\$(( \$(session $u \"\$WORK/fg.in\") - base ))"
+    eval "fg_clean_$u=\$(clean)"
+    eval "bg_$u=\$(( \$(session $u \"\$WORK/bg.in\") - base - 500000000 ))"
+    eval "bg_clean_$u=\$(clean)"
+done
+
+awk -v n="$N" -v fu="$fg_1" -v fs="$fg_0" -v bu="$bg_1" -v bs="$bg_0" \
+    -v cu="$fg_clean_1" -v cs="$fg_clean_0" -v du="$bg_clean_1" -v ds="$bg_clean_0" 'BEGIN {
+    printf "{\n"
+    printf "  \"jobs\": %d,\n", n
+    printf "  \"fg_sync_us_per_job\": %.1f,\n", fs / n / 1000
+    printf "  \"fg_uring_us_per_job\": %.1f,\n", fu / n / 1000
+    printf "  \"bg_sync_us_per_job\": %.1f,\n", bs / n / 1000
+    printf "  \"bg_uring_us_per_job\": %.1f,\n", bu / n / 1000
+    printf "  \"fg_speedup\": %.2f,\n", fs / fu
+    printf "  \"proc_clean_sync\": %s,\n", (cs == "true" && ds == "true") ? "true" : "false"
+    printf "  \"proc_clean_uring\": %s\n", (cu == "true" && du == "true") ? "true" : "false"
+    printf "}\n" }'
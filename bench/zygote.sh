@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# zygote.sh - Launch latency with and without the -Z helper pool.
+#
+# Usage: bench/zygote.sh [path/to/tsh]
+#
+# Runs BENCH_ZYGOTE_N foreground /bin/echo commands under tsh -p -P in
+# the same scratch layout as run.sh, once with direct fork and once
+# with -Z BENCH_ZYGOTE_POOL. Launch latency is the fork phase (the
+# fork, or the handoff to a helper) plus the exec phase (until the
+# execve), summed per percentile as in run.sh; the fork phase alone is
+# what the shell itself spends starting a command. Also reports the wall
+# time per command, which includes refilling the pool, and checks
+# that every command ran and no proc entry was left behind. Prints
+# one JSON object.
+#
+# Knobs (environment): BENCH_ZYGOTE_N     commands     (2000)
+#                      BENCH_ZYGOTE_POOL  helpers      (4)
+
+TSH=${1:-./tsh}
+N=${BENCH_ZYGOTE_N:-2000}
+POOL=${BENCH_ZYGOTE_POOL:-4}
+
+. "$(dirname "$0")/lib.sh"
+
+# session NAME [tsh flags] - run NAME.in with a profile, print elapsed ns
+session() {
+    name=$1
+    shift
+    start=$(now_ns)
+    (cd "$WORK" && TSH_AUDIT=0 TSH_PROFILE_OUT="$WORK/$name.prof" \
+        "$TSH" -p -P "$@" < "$WORK/$name.in" > "$WORK/$name.out" 2>&1)
+    echo $(( $(now_ns) - start ))
+}
+
+# launch PROF FIELD - fork plus exec at p50 (3) or p99 (4), in ns
+launch() {
+    awk -v f="$2" '$1 == "fork" || $1 == "exec" { s += $f } END { print s + 0 }' "$1"
+}
+
+# start PROF FIELD - the fork phase alone, in ns
+start() {
+    awk -v f="$2" '$1 == "fork" { print $f }' "$1"
+}
+
+awk -v n="$N" 'BEGIN { print "root"; print "pass"
+    for (i = 0; i < n; i++) print "/bin/echo ran"
+    print "/bin/ls proc"; print "quit" }' > "$WORK/fork.in"
+cp "$WORK/fork.in" "$WORK/zygote.in"
+
+fork_ns=$(session fork)
+zygote_ns=$(session zygote -Z "$POOL")
+ok=true
+for m in fork zygote; do
+    [ "$(grep -c 'ran$' "$WORK/$m.out")" -eq "$N" ] || ok=false
+done
+[ -z "$(ls "$WORK/proc")" ] || ok=false
+
+awk -v n="$N" -v pool="$POOL" -v fw="$fork_ns" -v zw="$zygote_ns" \
+    -v f50="$(launch "$WORK/fork.prof" 3)" -v f99="$(launch "$WORK/fork.prof" 4)" \
+    -v z50="$(launch "$WORK/zygote.prof" 3)" -v z99="$(launch "$WORK/zygote.prof" 4)" \
+    -v fs50="$(start "$WORK/fork.prof" 3)" -v fs99="$(start "$WORK/fork.prof" 4)" \
+    -v zs50="$(start "$WORK/zygote.prof" 3)" -v zs99="$(start "$WORK/zygote.prof" 4)" \
+    -v ok="$ok" 'BEGIN {
+    printf "{\n"
+    printf "  \"commands\": %d,\n", n
+    printf "  \"pool\": %d,\n", pool
+    printf "  \"fork_launch_p50_us\": %.1f,\n", f50 / 1000
+    printf "  \"fork_launch_p99_us\": %.1f,\n", f99 / 1000
+    printf "  \"zygote_launch_p50_us\": %.1f,\n", z50 / 1000
+    printf "  \"zygote_launch_p99_us\": %.1f,\n", z99 / 1000
+    printf "  \"fork_start_p50_us\": %.1f,\n", fs50 / 1000
+    printf "  \"fork_start_p99_us\": %.1f,\n", fs99 / 1000
+    printf "  \"zygote_start_p50_us\": %.1f,\n", zs50 / 1000
+    printf "  \"zygote_start_p99_us\": %.1f,\n", zs99 / 1000
+    printf "  \"fork_wall_us_per_cmd\": %.1f,\n", fw / n / 1000
+    printf "  \"zygote_wall_us_per_cmd\": %.1f,\n", zw / n / 1000
+    printf "  \"all_ran\": %s\n", ok
+    printf "}\n" }'
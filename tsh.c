@@ -3,6 +3,10 @@
  * 
  * <Put your name and login ID here>
  */
+#define _GNU_SOURCE             /* accept4, pipe2 and friends on Linux */
+#ifndef __linux__
+#error "tsh needs Linux: jobs are tracked with pidfds and epoll"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,12 +17,52 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <elf.h>
+#include <linux/io_uring.h>
+#include <sys/sendfile.h>
+#include <sys/prctl.h>
+#include <spawn.h>
+#include <sched.h>
+
+#ifndef P_PIDFD
+#define P_PIDFD 3         /* waitid idtype, Linux 5.4 */
+#endif
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
 #define MAXJOBS      16   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
+#define MAXLOGS   (4 * MAXJOBS)  /* captured output logs, live or finished */
+#define MAXSUBST     8    /* <(...) and >(...) per command */
+
+#define JOBLOG_TAG   (1ULL << 32)   /* epoll data for log slot i: TAG | i */
+#define JOBLOG_CHUNK 65536          /* max bytes per capture read */
+#define TIMER_TAG    (1ULL << 33)   /* epoll data for the deadline timerfd */
+#define SUBST_TAG    (1ULL << 34)   /* epoll data for a substituted pid: TAG | pid */
+#define WHEEL_SLOTS  512            /* timer wheel slots */
+#define WHEEL_TICK_MS 10            /* timer wheel resolution */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -26,6 +70,20 @@
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
 
+/* Profiled phases of the read/eval pipeline (-P) */
+#define PROF_READ      0   /* fgets in main (includes time blocked on input) */
+#define PROF_PARSE     1   /* parseline */
+#define PROF_BUILTIN   2   /* builtin_cmd dispatch */
+#define PROF_HISTORY   3   /* update_tsh_history */
+#define PROF_FORK      4   /* fork (or the -Z handoff), as seen by the parent */
+#define PROF_PROCFILE  5   /* proc entry creation in the child, or queued by the shell */
+#define PROF_ADDJOB    6   /* addjob */
+#define PROF_EXEC      7   /* fork return until execve succeeds in the child */
+#define PROF_WAITFG    8   /* waitfg */
+#define PROF_EVAL      9   /* a whole eval: line read to command done */
+#define PROF_NPHASES   10
+#define PROF_NBUCKETS 512  /* log-linear buckets, 8 per power of two */
+
 /* 
  * Jobs states: FG (foreground), BG (background), ST (stopped)
  * Job state transitions and enabling actions:
@@ -42,40 +100,161 @@ char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
 int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
+char parse_quoted[MAXARGS]; /* set by parseline: word i was quoted */
+unsigned long launched_jobs;   /* launch_job calls, to tell builtins from jobs */
 char * username;            /* The name of the user currently logged into the shell */
+struct deadline {           /* an entry in the timer wheel */
+    struct deadline *next, *prev;
+    unsigned long rounds;   /* full turns of the wheel still to wait */
+    int slot;               /* -1 if not armed */
+};
+struct quser;
+struct cache_run;
+struct redir_t;
+struct launch_opts {        /* what one command hands down to launch_job */
+    struct redir_t *redir;  /* <(...), >(...), <<, or NULL */
+    char **env;             /* NAME=value words before the command */
+    int nenv;
+    struct cache_run *cache;    /* a cache miss; the job takes it */
+    int prio;               /* submit class for the child, -1 if none */
+};
+#define LAUNCH_OPTS_NONE { NULL, NULL, 0, NULL, -1 }
 struct job_t {              /* The job struct */
     pid_t pid;              /* job PID */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
+    int pidfd;              /* pidfd for pid, -1 if none */
+    struct deadline dl;     /* runtime limit, see timeout */
+    long long limit_ms;     /* 0 if none */
+    long long grace_ms;     /* SIGTERM to SIGKILL */
+    int timed_out;          /* the deadline has passed */
+    pid_t subs[MAXSUBST];   /* live <(...) and >(...) processes */
+    int subfd[MAXSUBST];    /* their pidfds */
+    char subdir[MAXSUBST];  /* '<' or '>' */
+    int nsubs;
+    int main_done;          /* pid exited; waiting for the subs */
+    int main_status;        /* pid's exit status once main_done */
+    long long start_ns;     /* audit_now() at launch */
+    long trace_seq;         /* command that started it with &, 0 if none */
+    struct quser *quser;    /* submitter, if it came from the job queue */
+    struct cache_run *cache;    /* cache miss to store at exit, or NULL */
     char cmdline[MAXLINE];  /* command line */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
 
-char * file_start = "./home/";
 char * file_end = "/.tsh_history";
-char * proc_start = "./proc/";
 char * proc_end ="/status";
+
+/* State directory paths, built once by init_paths (--root / TSH_ROOT) */
+char root_dir[MAXLINE] = ".";  /* holds etc/, home/ and proc/ */
+char passwd_path[MAXLINE];     /* <root>/etc/passwd.txt */
+char home_path[MAXLINE];       /* <root>/home/ */
+char proc_path[MAXLINE];       /* <root>/proc/ */
+size_t proc_path_len;
+char history_path[MAXLINE];    /* <root>/home/<user>/.tsh_history */
+
+struct histfile {              /* an open, shared .tsh_history */
+    int fd;                    /* O_APPEND, -1 if not open */
+    ino_t ino;                 /* inode fd refers to */
+    off_t off;                 /* bytes already read into the ring */
+};
+typedef void (*hist_push_t)(void *ctx, const char *line);
+
+struct cred_t {                /* passwd.txt entry in the credential index */
+    char *name;
+    char *password;
+    struct cred_t *next;
+};
+struct cred_t **cred_table;    /* hash buckets, a power of two */
+size_t cred_nbuckets;
+size_t cred_count;
+time_t cred_mtime;             /* passwd.txt mtime/size at last load */
+off_t cred_size;
 char history[10][MAXLINE];
 int history_index = 0;
-pid_t fg_pid = 0;
+struct histfile hist = { -1, 0, 0 };
 pid_t session_leader_pid = 0;
+
+int jobs_epfd = -1;         /* epoll set of job pidfds and chld_fd */
+int input_epfd = -1;        /* epoll set of stdin and jobs_epfd */
+int chld_fd = -1;           /* signalfd for SIGCHLD (stops only) */
+int stdin_pollable = 0;     /* stdin is a tty/pipe/socket, not a file */
+char inbuf[2 * MAXLINE];    /* unread bytes from stdin */
+size_t inlen = 0;
+int in_eof = 0;
+size_t capture_size = 0;    /* per-job output ring size, 0 = off (-C) */
+size_t capture_max = 64 << 20;  /* all rings together (--capture-max) */
+int zygote_size = 0;        /* pre-forked launch helpers (-Z), 0 = off */
+int lean = 0;               /* -L: skip the setup short runs never use */
+int proc_on = 1;            /* write proc entries (off under -L without -m) */
+int history_lazy = 0;       /* -L: the ring is read at its first use */
+long long default_timeout_ms = 0;  /* deadline for every job (timeout -d) */
+long long default_grace_ms = 5000;
+int last_status = 0;        /* exit status of the last foreground command */
+void (*job_exit_hook)(pid_t pid, int status) = NULL;  /* told of every job exit */
+volatile sig_atomic_t sigint_seen = 0;  /* ctrl-c arrived (ends builtin sleep) */
+
+int profile = 0;            /* if true, record per-phase latencies (-P) */
+pid_t profile_owner = 0;    /* only the shell itself reports at exit */
+struct prof_hist {          /* latency histogram for one phase */
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long buckets[PROF_NBUCKETS];
+};
+struct prof_hist prof[PROF_NPHASES];
+char * prof_names[PROF_NPHASES] = {
+    "read", "parseline", "builtin", "history", "fork",
+    "procfile", "addjob", "exec", "waitfg", "eval"
+};
+
+#define TRACE_RECORD 1
+#define TRACE_REPLAY 2
+int trace_mode = 0;         /* TRACE_RECORD (--record) or TRACE_REPLAY (--replay) */
+long trace_seq = 0;         /* number of the command being run, when tracing */
 /* End global variables */
 
+/* Profiling hooks: a single branch on a global when -P is off */
+#define PROF_START(t) do { if (profile) prof_now(&(t)); } while (0)
+#define PROF_STOP(phase, t) do { if (profile) prof_record((phase), &(t)); } while (0)
+
 
 /* Function prototypes */
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
-int builtin_cmd(char **argv);
+void run_command(char **argv, int bg, char *cmdline);
+void dispatch_command(char **argv, int bg, char *cmdline, struct launch_opts *lo);
+pid_t launch_job(char **argv, int bg, char *cmdline, struct launch_opts *lo);
+void run_job(char **argv, int bg, char *cmdline, long long timeout_ms, long long grace_ms,
+             struct launch_opts *lo);
+int source_file(char *path);
+int builtin_dag(char **argv);
+int builtin_cmd(char **argv, struct launch_opts *lo);
+int is_builtin(char *name);
+int fast_builtin_name(char *name);
+int fast_builtin(char **argv);
 void do_bgfg(char **argv);
 void waitfg(pid_t pid);
 
-void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+void sighup_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, char **argv); 
+struct gstate;
+int glob_magic(const char *s);
+char **glob_expand(char **argv, const char *quoted, struct gstate **gp);
+void glob_free(char **v, struct gstate *g);
+int heredoc_read(char **argv, int (*next)(char *line));
+int redir_parse(char **argv, const char *quoted, struct redir_t **rp);
+int redir_open(struct redir_t *r);
+void redir_child(struct redir_t *r);
+void redir_spawn(struct redir_t *r, pid_t pgid, int bg, char **env, int nenv);
+void redir_free(struct redir_t *r);
+void redir_attach(struct redir_t *r, struct job_t *job);
+char **redir_glob(struct redir_t *r, struct gstate **gp);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
@@ -83,6 +262,7 @@ void initjobs(struct job_t *jobs);
 int maxjid(struct job_t *jobs); 
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
 int deletejob(struct job_t *jobs, pid_t pid); 
+int jobs_full(struct job_t *jobs);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid); 
@@ -95,8 +275,113 @@ void app_error(char *msg);
 typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
 
+void prof_now(struct timespec *ts);
+unsigned long long prof_elapsed(struct timespec *start);
+void prof_add(int phase, unsigned long long ns);
+void prof_add_hist(struct prof_hist *h, unsigned long long ns);
+void prof_record(int phase, struct timespec *start);
+unsigned long long prof_percentile(struct prof_hist *h, int pct);
+void prof_report(void);
+
+int trace_record(const char *path);
+int trace_replay(const char *path, const char *speed);
+void trace_begin(void);
+void trace_input(const char *cmdline);
+int trace_next(char *cmdline);
+void trace_start(void);
+void trace_done(const char *cmdline);
+void trace_job(long seq, const char *cmdline, int status);
+void trace_report(void);
+
+void init_paths(const char *root);
+char *proc_entry(char *buf, pid_t pid, int status_file);
+void create_proc_entry(pid_t pid, pid_t ppid, pid_t pgid, char *name, char *state);
+void remove_proc_entry(pid_t pid);
+void uring_init(void);
+int uring_ready(void);
+void uring_create(pid_t pid, pid_t ppid, pid_t pgid, char *name, char *state);
+void uring_remove(pid_t pid);
+void uring_drain(void);
+int builtin_cache(char **argv, int bg, char *cmdline, struct launch_opts *lo);
+void cache_finish(struct job_t *job, int status);
+void cache_proxy(char **argv, char **envp, struct cache_run *run);
+void cache_save(void);
+extern unsigned long env_gen;
+void zygote_init(void);
+void zygote_helper(int sock, pid_t shell);
+void zygote_refill(void);
+pid_t zygote_launch(char **argv, int out_fd, int exec_fd, struct launch_opts *lo);
+
+int cred_add(const char *name, const char *password);
+struct cred_t *cred_lookup(const char *name);
+int cred_refresh(void);
+int add_user_batch(const char *file);
+int passwd_lock(void);
+void server_main(char *path);
+int remote_connect(const char *addr);
+void worker_main(char *addr);
+void remote_proxy(char **argv);
+
+void init_events(void);
+int job_events(int timeout);
+int job_watch(struct job_t *job);
+int job_signal(struct job_t *job, int sig);
+int read_cmdline(char *cmdline);
+size_t parse_size(const char *s);
+int joblog_open(int *wfd);
+void joblog_cancel(int i);
+void joblog_attach(int i, struct job_t *job);
+void joblog_drain(int i);
+void joblog_exit(pid_t pid);
+int builtin_joblog(char **argv);
+int builtin_tail(char **argv);
+int parse_duration(const char *s, long long *ms);
+void init_deadlines(void);
+void deadline_arm(struct deadline *d, long long ms);
+void deadline_cancel(struct deadline *d);
+void wheel_advance(void);
+void job_deadline(struct job_t *job, long long ms, long long grace_ms);
+int builtin_timeout(char **argv, int bg, char *cmdline, struct launch_opts *lo);
+struct job_t *parse_jobspec(char *arg);
+
 void update_tsh_history(char * cmdline);
+int hist_open(struct histfile *h, const char *path);
+void hist_sync(struct histfile *h, const char *path, hist_push_t push, void *ctx);
+void hist_append(struct histfile *h, const char *path, const char *line,
+                 hist_push_t push, void *ctx);
+void hist_close(struct histfile *h);
+void history_push(void *ctx, const char *line);
+void history_load(void);
+void stats_load(void);
+void stats_save(void);
+void stats_observe(const char *name);
+int prefetch_pending(void);
+void prefetch_idle(void);
+long long audit_now(void);
+void audit_init(void);
+void audit_flush(void);
+int audit_due(void);
+void audit_fatal(int sig);
+void audit_record(const char *user, pid_t pid, int status, long long start_ns,
+                  const char *cmdline);
+int builtin_audit(char **argv);
+void env_init(void);
+size_t env_name_len(const char *word);
+char *env_get(const char *name);
+void env_set(const char *name, const char *value, int export);
+char **env_envp(void);
+char **env_layer(char **base, char **assign, int n);
+int env_assign(char **argv);
+int builtin_export(char **argv);
+int builtin_unset(char **argv);
+int builtin_submit(char **argv, struct launch_opts *lo);
+void queue_spill(char **argv, struct launch_opts *lo);
+void queue_job_exit(struct quser *u);
+void queue_jobs(void);
+void queue_prio(int prio);
 void add_user(char **argv);
+static int rio_writen(int fd, const void *buf, size_t n);
+static int rio_readn(int fd, void *buf, size_t n);
 static void sio_reverse(char s[]);
 static void sio_ltoa(long v, char s[], int b);
 static size_t sio_strlen(char s[]);
@@ -115,14 +400,39 @@ int main(int argc, char **argv)
     char c;
     char cmdline[MAXLINE];
     int emit_prompt = 1; /* emit prompt (default) */
-    int first_use = 0;
+    int ch;
+    struct timespec t_read;
+    char *root = getenv("TSH_ROOT");
+    char *server_path = NULL;
+    char *worker_addr = NULL;
+    char *record_path = NULL, *replay_path = NULL, *speed = "1";
+    int monitor = 0;
+    static struct option long_options[] = {
+        {"root", required_argument, NULL, 'r'},
+        {"help", no_argument,       NULL, 'h'},
+        {"server", required_argument, NULL, 'S'},
+        {"worker", required_argument, NULL, 'W'},
+        {"capture", required_argument, NULL, 'C'},
+        {"capture-max", required_argument, NULL, 'M'},
+        {"record", required_argument, NULL, 'R'},
+        {"replay", required_argument, NULL, 'Y'},
+        {"speed", required_argument, NULL, 'X'},
+        {"zygote", required_argument, NULL, 'Z'},
+        {"lean", no_argument,       NULL, 'L'},
+        {"monitor", no_argument,    NULL, 'm'},
+        {NULL,   0,                 NULL, 0}
+    };
+
+    /* A -Z helper the shell started: wait for a command to exec */
+    if (argc == 4 && strcmp(argv[1], "--zygote-helper") == 0)
+        zygote_helper(atoi(argv[2]), atoi(argv[3]));
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt_long(argc, argv, "hvpPLmr:S:W:C:Z:", long_options, NULL)) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -133,17 +443,86 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'P':             /* record per-phase latency histograms */
+            profile = 1;
+	    break;
+        case 'L':             /* lean start for short-lived runs */
+            lean = 1;
+	    break;
+        case 'm':             /* keep proc entries under -L */
+            monitor = 1;
+	    break;
+        case 'r':             /* state directory holding etc/ home/ proc/ */
+            root = optarg;
+	    break;
+        case 'S':             /* serve many sessions on a Unix socket */
+            server_path = optarg;
+	    break;
+        case 'W':             /* run jobs for remote shells */
+            worker_addr = optarg;
+	    break;
+        case 'C':             /* capture background output, per-job ring size */
+            if ((capture_size = parse_size(optarg)) == 0)
+                usage();
+	    break;
+        case 'M':             /* cap on all capture rings together */
+            if ((capture_max = parse_size(optarg)) == 0)
+                usage();
+	    break;
+        case 'R':             /* write input lines and outcomes to a trace */
+            record_path = optarg;
+	    break;
+        case 'Y':             /* read input lines from a trace */
+            replay_path = optarg;
+	    break;
+        case 'X':             /* think time divisor for --replay */
+            speed = optarg;
+	    break;
+        case 'Z':             /* launch through pre-forked helpers */
+            if ((zygote_size = atoi(optarg)) <= 0)
+                usage();
+	    break;
 	default:
             usage();
 	}
     }
 
+    init_paths(root);
+    env_init();
+    if (lean && !monitor)
+        proc_on = 0;            /* and so no ring for them either */
+    if (proc_on)
+        uring_init();
+
+    if (record_path != NULL && replay_path != NULL)
+        usage();
+    if (record_path != NULL && trace_record(record_path) < 0)
+        unix_error("--record");
+    if (replay_path != NULL && trace_replay(replay_path, speed) < 0)
+        unix_error("--replay");
+
+    /* Hangup and SIGTERM end the shell, after the audit buffer is written */
+    Signal(SIGHUP,  sighup_handler);
+    Signal(SIGTERM, sighup_handler);
+
+    if (server_path != NULL)
+        server_main(server_path);
+    if (worker_addr != NULL)
+        worker_main(worker_addr);
+
+    if (profile) {
+        profile_owner = getpid();
+        atexit(prof_report);
+    }
+
     /* Install the signal handlers */
 
     /* These are the ones you will need to implement */
     Signal(SIGINT,  sigint_handler);   /* ctrl-c */
     Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+
+    /* Children are reaped through pidfds; SIGCHLD goes to a signalfd */
+    init_events();
 
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
@@ -151,6 +530,12 @@ int main(int argc, char **argv)
     /* Initialize the job list */
     initjobs(jobs);
 
+    /* 
+     * Login reads through stdio, the command loop reads the descriptor.
+     * Leave stdin unbuffered so no command lines are stranded in stdio.
+     */
+    setvbuf(stdin, NULL, _IONBF, 0);
+
     /* Have a user log into the shell */
     username = login();
     
@@ -158,33 +543,33 @@ int main(int argc, char **argv)
         username = login();
     }
 
+    /* Drop the rest of the password line */
+    while ((ch = getchar()) != '\n' && ch != EOF)
+        ;
+    fflush(stdout);
+
     /* Reload history is user logging in again */
     for (int i = 0; i < 10; i++){
         strcpy(history[i], "");
     }
 
-    char file_choice[20 + strlen(username)];
-    strcpy(file_choice, file_start);
-    strcat(file_choice, username);
-    strcat(file_choice, file_end);
-
-    FILE * fp;
-    fp = fopen(file_choice, "r");
-
-    char line[MAXLINE];
+    snprintf(history_path, sizeof(history_path), "%s%s%s",
+             home_path, username, file_end);
 
-    if (fp != NULL){
-        while (fgets(line, MAXLINE, fp)) {
-            strcpy(history[history_index], line);
-            history_index = (history_index + 1) % 10;
-        }
+    if (lean) {
+        history_lazy = 1;       /* see update_tsh_history and history_load */
     }
     else {
-        perror("fopen");
-        exit(EXIT_FAILURE);
+        if (hist_open(&hist, history_path) < 0) {
+            perror("open");
+            exit(EXIT_FAILURE);
+        }
+        hist_sync(&hist, history_path, history_push, NULL);
+        stats_load();           /* -L runs neither learn nor prefetch */
     }
-
-    fclose(fp);
+    audit_init();
+    if (trace_mode)
+        trace_begin();
 
     /* Create a proc entry for the shell */
     pid_t pid = getpid();
@@ -192,54 +577,33 @@ int main(int argc, char **argv)
     pid_t parent_pid = getppid();
     pid_t process_group_id = getpgid(pid);
 
-    char pid_string[MAXLINE];
-    sprintf(pid_string, "%d", pid);
-    char proc_choice[7 + strlen(pid_string)];
-    strcpy(proc_choice, proc_start);
-    strcat(proc_choice, pid_string);
-    mkdir(proc_choice, 0700);
-
-    char status_file[14 + strlen(pid_string)];
-    strcpy(status_file, proc_start);
-    strcat(status_file, pid_string);
-    strcat(status_file, proc_end);
-
-    FILE * fp7;
-    fp7 = fopen(status_file, "w");
-
-    fprintf(fp7, "Name: %s\nPid: %d\nPPid: %d\nPGid: %d\nSid: %d\nSTAT: %s\nUsername: %s", "Shell", pid, parent_pid, process_group_id, session_leader_pid, "Ss", username);
-
-    fclose(fp7);
+    create_proc_entry(pid, parent_pid, process_group_id, "Shell", "Ss");
+    zygote_init();
 
     /* Execute the shell's read/eval loop */
     while (1) {
 
 	/* Read command line */
 	if (emit_prompt) {
-        if (first_use == 0){
-            first_use = 1;
-        }
-        else{
-            printf("%s", prompt);
-	        fflush(stdout);
-        }
+	    printf("%s", prompt);
+	    fflush(stdout);
 	}
-	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-	    app_error("fgets error");
-	if (feof(stdin)) { /* End of file (ctrl-d) */
+	PROF_START(t_read);
+	if (read_cmdline(cmdline) == 0) { /* End of file (ctrl-d) */
 	    fflush(stdout);
 	    exit(0);
 	}
+	PROF_STOP(PROF_READ, t_read);
 
 	/* Evaluate the command line */
-    if (first_use == 1){
-        first_use = 2;
-    }
-    else{
-        eval(cmdline);
-	    fflush(stdout);
-	    fflush(stdout);
-    }
+	if (trace_mode)
+	    trace_start();
+	PROF_START(t_read);
+	eval(cmdline);
+	PROF_STOP(PROF_EVAL, t_read);
+	if (trace_mode)
+	    trace_done(cmdline);
+	fflush(stdout);
     } 
 
     exit(0); /* control never reaches here */
@@ -271,7 +635,7 @@ char * login() {
     }
 
     FILE * fp1;
-    fp1 = fopen("./etc/passwd.txt", "r");
+    fp1 = fopen(passwd_path, "r");
 
     int username_check = 0;
     int password_check = 0;
@@ -316,169 +680,369 @@ char * login() {
 /* 
  * eval - Evaluate the command line that the user has just typed in
  * 
- * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
- * background children don't receive SIGINT (SIGTSTP) from the kernel
- * when we type ctrl-c (ctrl-z) at the keyboard.  
+ * The line is parsed and recorded in the history, then handed to
+ * run_command. !N lines are recorded after they run, so the history
+ * entry they replay is the one they were given.
 */
 void eval(char *cmdline) 
 {
-    int bg;
-    pid_t pid;
-    sigset_t mask_all, mask_one, prev_one;
+    int bg, replay;
+    char *arguments[MAXARGS];
+    struct timespec t_phase;
 
-    sigfillset(&mask_all);
-    sigemptyset(&mask_one);
-    sigaddset(&mask_one, SIGCHLD);
+    PROF_START(t_phase);
+    bg = parseline(cmdline, arguments);
+    PROF_STOP(PROF_PARSE, t_phase);
 
-    char **arguments = malloc(MAXARGS * sizeof(*arguments));
-    for (int i =0; i < MAXARGS; i++){
-        arguments[i] = malloc(MAXLINE * sizeof(**arguments));
+    if (arguments[0] == NULL){
+        return;
     }
-    
-    bg = parseline(cmdline, arguments);
+    heredoc_read(arguments, read_cmdline);     /* CMD << WORD: the body */
 
-    // printf("%d\n", bg);
+    replay = arguments[0][0] == '!' && is_builtin(arguments[0]);
+    if (!replay) {
+        PROF_START(t_phase);
+        update_tsh_history(cmdline);
+        PROF_STOP(PROF_HISTORY, t_phase);
+    }
+    run_command(arguments, bg, cmdline);
+    if (replay) {
+        PROF_START(t_phase);
+        update_tsh_history(cmdline);
+        PROF_STOP(PROF_HISTORY, t_phase);
+    }
+}
 
-    // for (int i = 0; i < MAXARGS; i++){
-    //     printf("%s\n", arguments[i]);
-    // }
+/*
+ * run_command - Execute one parsed command line
+ * 
+ * If the user has requested a built-in command then execute it
+ * immediately. Otherwise, fork a child process and run the job in
+ * the context of the child. If the job is running in the foreground,
+ * wait for it to terminate and then return.  Note: each child process
+ * must have a unique process group ID so that our background children
+ * don't receive SIGINT (SIGTSTP) from the kernel when we type ctrl-c
+ * (ctrl-z) at the keyboard. cmdline is the text kept in the job list.
+ * Wildcards in unquoted words (parse_quoted) are expanded first.
+ */
+void run_command(char **arguments, int bg, char *cmdline)
+{
+    struct gstate *g;
+    struct redir_t *r;
+    struct launch_opts lo = LAUNCH_OPTS_NONE;
+    char **argv;
+    char name[MAXLINE];
+    int n;
+    unsigned long launched = launched_jobs;
+    long long start_ns = audit_now();
+
+    if (redir_parse(arguments, parse_quoted, &r) < 0) {
+        last_status = 2;
+        return;
+    }
+    if (r != NULL && redir_open(r) < 0) {
+        printf("tsh: %s\n", strerror(errno));
+        redir_free(r);
+        last_status = 1;
+        return;
+    }
+    argv = r != NULL ? redir_glob(r, &g) : glob_expand(arguments, parse_quoted, &g);
+
+    for (n = 0; argv[n] != NULL && env_name_len(argv[n]) > 0; n++)
+        ;
+    if (argv[n] == NULL) {                          /* NAME=value only */
+        last_status = env_assign(argv);
+        redir_free(r);
+        glob_free(argv, g);
+    }
+    else {
+        snprintf(name, sizeof(name), "%s", argv[n]);   /* !N reuses argv */
+        lo.redir = r;
+        lo.env = argv;
+        lo.nenv = n;
+        dispatch_command(argv + n, bg, cmdline, &lo);
+        redir_free(r);
+        glob_free(argv, g);
+        stats_observe(name);
+    }
+    if (launched_jobs == launched)      /* jobs are logged when reaped */
+        audit_record(username, getpid(), last_status, start_ns, cmdline);
+}
 
-    if (arguments[0] == NULL){
+/*
+ * dispatch_command - Run an expanded command line: a builtin in the
+ *    shell, anything else as a job with the settings in lo
+ */
+void dispatch_command(char **arguments, int bg, char *cmdline, struct launch_opts *lo)
+{
+    struct timespec t_phase;
+
+    /* timeout needs the & that parseline took off, so it comes first */
+    if (strcmp(arguments[0], "timeout") == 0) {
+        last_status = builtin_timeout(arguments, bg, cmdline, lo);
+        return;
+    }
+    if (strcmp(arguments[0], "cache") == 0) {
+        last_status = builtin_cache(arguments, bg, cmdline, lo);
         return;
     }
 
-    if (strcmp(arguments[0], "!1") == 0 || strcmp(arguments[0], "!2") == 0 || strcmp(arguments[0], "!3") == 0
-        || strcmp(arguments[0], "!4") == 0 || strcmp(arguments[0], "!5") == 0 || strcmp(arguments[0], "!6") == 0
-        || strcmp(arguments[0], "!7") == 0 || strcmp(arguments[0], "!8") == 0 || strcmp(arguments[0], "!9") == 0
-        || strcmp(arguments[0], "!10") == 0 || strcmp(arguments[0],"bg") == 0 || strcmp(arguments[0], "fg") == 0 || strcmp(arguments[0], "adduser") == 0
-        || strcmp(arguments[0],"quit") == 0 || strcmp(arguments[0],"logout") == 0 || strcmp(arguments[0],"history") == 0 || strcmp(arguments[0],"jobs") == 0){
-        
-        if (strcmp(arguments[0], "!1") == 0 || strcmp(arguments[0], "!2") == 0 || strcmp(arguments[0], "!3") == 0
-        || strcmp(arguments[0], "!4") == 0 || strcmp(arguments[0], "!5") == 0 || strcmp(arguments[0], "!6") == 0
-        || strcmp(arguments[0], "!7") == 0 || strcmp(arguments[0], "!8") == 0 || strcmp(arguments[0], "!9") == 0
-        || strcmp(arguments[0], "!10") == 0){
-            builtin_cmd(arguments);
-            update_tsh_history(cmdline);
+    /* Builtins run in the shell; fork-free ones go to a child only with & */
+    if (is_builtin(arguments[0]) && lo->redir != NULL
+        && !fast_builtin_name(arguments[0])) {
+        printf("%s: cannot be used with <(...), >(...), << or <<<\n", arguments[0]);
+        last_status = 2;
+        return;
+    }
+    if (is_builtin(arguments[0]) && (!bg || fast_builtin_name(arguments[0]) == 0)
+        && lo->redir == NULL){
+        PROF_START(t_phase);
+        builtin_cmd(arguments, lo);
+        PROF_STOP(PROF_BUILTIN, t_phase);
+        return;
+    }
+
+    run_job(arguments, bg, cmdline, 0, 0, lo);
+}
+
+/*
+ * run_job - Launch a job and wait for it if it is in the foreground.
+ *    A timeout_ms above 0 replaces the session's default deadline.
+ */
+void run_job(char **arguments, int bg, char *cmdline, long long timeout_ms, long long grace_ms,
+             struct launch_opts *lo)
+{
+    pid_t pid;
+    struct timespec t_phase;
+
+    sigint_seen = 0;
+    while ((pid = launch_job(arguments, bg, cmdline, lo)) < 0) {
+        if (!jobs_full(jobs)) {             /* the fork failed */
+            last_status = 1;
             return;
         }
-        else {
-            update_tsh_history(cmdline);
-            builtin_cmd(arguments);
+        if (bg && timeout_ms == 0 && lo->redir == NULL) {
+            queue_spill(arguments, lo);         /* starts when a slot frees */
+            last_status = 0;
+            return;
+        }
+        if (bg || sigint_seen) {
+            printf("Tried to create too many jobs\n");
+            last_status = 1;
             return;
         }
+        job_events(-1);                     /* wait for a free slot */
+    }
+    if (timeout_ms > 0)
+        job_deadline(getjobpid(jobs, pid), timeout_ms, grace_ms);
+
+    if (bg == 0) { // Foreground Job
+        PROF_START(t_phase);
+        waitfg(pid);
+        PROF_STOP(PROF_WAITFG, t_phase);
+    }
+    else {
+        printf("%d %s", pid, cmdline);
+        last_status = 0;
     }
+}
+
+/*
+ * launch_job - Fork a child that runs argv as a new job in its own
+ *    process group and add it to the job list as FG or BG. lo holds
+ *    the command's redirections, NAME=value words, cache run and submit
+ *    class; the job takes lo->cache and clears it. Returns the child's pid, or -1
+ *    when the job list is full or the fork failed (reported here).
+ */
+pid_t launch_job(char **arguments, int bg, char *cmdline, struct launch_opts *lo)
+{
+    pid_t pid;
+    sigset_t mask_all, prev_all, empty;
+    struct timespec t_phase;
+    int exec_pipe[2] = {-1, -1};
+    int log_slot = -1, log_fd = -1;
+    long long start_ns = audit_now();
+    char **envp = env_envp();
+    int parent_proc = uring_ready();    /* proc entry written after the fork */
 
-    update_tsh_history(cmdline);
+    sigfillset(&mask_all);
+    sigemptyset(&empty);
+
+    /* A child that cannot be tracked is never started */
+    if (jobs_full(jobs))
+        return -1;
+
+    if (bg && capture_size > 0)
+        log_slot = joblog_open(&log_fd);
+
+    /* 
+     * When profiling, the child reports its proc file cost over a
+     * close-on-exec pipe; EOF on the pipe marks a completed execve.
+     */
+    if (profile && pipe(exec_pipe) == 0) {
+        fcntl(exec_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(exec_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
 
-    sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
-    if ((pid = fork()) == 0) {   /* Child runs user job */
+    PROF_START(t_phase);
+    if ((pid = zygote_launch(arguments, log_fd, exec_pipe[1], lo)) > 0)
+        parent_proc = 1;            /* the helper is already at its exec */
+    else if ((pid = fork()) == 0) {   /* Child runs user job */
+        struct timespec t_proc;
+        PROF_START(t_proc);
         setpgid(0, 0);
+        if (lo->prio >= 0)
+            queue_prio(lo->prio);
+        if (lo->redir != NULL)
+            redir_child(lo->redir);
+        if (log_fd >= 0) {                  /* -C: output goes to the ring */
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
         pid = getpid();
         pid_t parent_pid = getppid();
         pid_t process_group_id = getpgid(pid);
 
-        if (bg ==0){
-            fg_pid = 0;
-
-            char pid_string[MAXLINE];
-            sprintf(pid_string, "%d", pid);
-            char proc_choice[7 + strlen(pid_string)];
-            strcpy(proc_choice, proc_start);
-            strcat(proc_choice, pid_string);
-            mkdir(proc_choice, 0700);
-
-            char status_file[14 + strlen(pid_string)];
-            strcpy(status_file, proc_start);
-            strcat(status_file, pid_string);
-            strcat(status_file, proc_end);
-
-            FILE * fp6;
-            fp6 = fopen(status_file, "w");
-
-            fprintf(fp6, "Name: %s\nPid: %d\nPPid: %d\nPGid: %d\nSid: %d\nSTAT: %s\nUsername: %s", arguments[0], pid, parent_pid, process_group_id, session_leader_pid, "R+", username);
-
-            fclose(fp6);
+        if (!parent_proc)       /* else the shell queues it on its ring */
+            create_proc_entry(pid, parent_pid, process_group_id, arguments[0],
+                              bg ? "R" : "R+");
+        if (exec_pipe[1] >= 0 && !parent_proc) {
+            unsigned long long proc_ns = prof_elapsed(&t_proc);
+            write(exec_pipe[1], &proc_ns, sizeof(proc_ns));
         }
-        else {
-            char pid_string[MAXLINE];
-            sprintf(pid_string, "%d", pid);
-            char proc_choice[7 + strlen(pid_string)];
-            strcpy(proc_choice, proc_start);
-            strcat(proc_choice, pid_string);
-            mkdir(proc_choice, 0700);
-
-            char status_file[14 + strlen(pid_string)];
-            strcpy(status_file, proc_start);
-            strcat(status_file, pid_string);
-            strcat(status_file, proc_end);
-
-            FILE * fp6;
-            fp6 = fopen(status_file, "w");
-
-            fprintf(fp6, "Name: %s\nPid: %d\nPPid: %d\nPGid: %d\nSid: %d\nSTAT: %s\nUsername: %s", arguments[0], pid, parent_pid, process_group_id, session_leader_pid, "R", username);
+        sigprocmask(SIG_SETMASK, &empty, NULL);   /* SIGCHLD was blocked */
+
+        if (strcmp(arguments[0], "remote") == 0)
+            remote_proxy(arguments + 1);
+        if (fast_builtin_name(arguments[0])) {     /* e.g. sleep 5 & */
+            int status;
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            close(jobs_epfd);                    /* the shell's, not ours */
+            jobs_epfd = -1;
+            status = fast_builtin(arguments);
+            fflush(stdout);
+            exit(status);
+        }
+        if (lo->nenv > 0)
+            envp = env_layer(envp, lo->env, lo->nenv);
+        if (lo->cache != NULL)              /* a cache miss */
+            cache_proxy(arguments, envp, lo->cache);
+        if (execve(arguments[0], arguments, envp) < 0) {
+            printf("%s: Command not found.\n", arguments[0]);
+            exit(127);
+        }
+    }
 
-            fclose(fp6);
+    if (pid < 0) {                      /* nothing was started */
+        printf("fork: %s\n", strerror(errno));
+        if (log_fd >= 0) {
+            close(log_fd);
+            joblog_cancel(log_slot);
         }
-        sigprocmask(SIG_SETMASK, &prev_one, NULL);
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[0]);
+            close(exec_pipe[1]);
+        }
+        return -1;
+    }
+    PROF_STOP(PROF_FORK, t_phase);
+    if (parent_proc && pid > 0) {
+        PROF_START(t_phase);
+        create_proc_entry(pid, getpid(), pid, arguments[0], bg ? "R" : "R+");
+        PROF_STOP(PROF_PROCFILE, t_phase);
+    }
+    if (log_fd >= 0)
+        close(log_fd);
+    if (lo->redir != NULL && pid > 0) {
+        setpgid(pid, pid);                  /* the subs join this group */
+        redir_spawn(lo->redir, pid, bg, lo->env, lo->nenv);
+    }
 
-        if (execve(arguments[0], arguments, environ) < 0) {
-            printf("%s: Command not found.\n", arguments[0]);
-            exit(0);
+    if (exec_pipe[0] >= 0) {
+        unsigned long long proc_ns;
+        char drain;
+
+        close(exec_pipe[1]);
+        PROF_START(t_phase);
+        if (read(exec_pipe[0], &proc_ns, sizeof(proc_ns)) == sizeof(proc_ns)) {
+            prof_add(PROF_PROCFILE, proc_ns);
         }
+        while (read(exec_pipe[0], &drain, 1) > 0)
+            ;
+        PROF_STOP(PROF_EXEC, t_phase);
+        close(exec_pipe[0]);
     }
 
-    sigprocmask(SIG_BLOCK, &mask_all, NULL);
+    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    PROF_START(t_phase);
     if (bg == 0){
         addjob(jobs, pid, FG, cmdline);
     }
     else {
         addjob(jobs, pid, BG, cmdline);   
      }
-    sigprocmask(SIG_SETMASK, &prev_one, NULL);
-
-    if (bg == 0) { // Foreground Job
-        int status;
-        waitfg(pid);
+    PROF_STOP(PROF_ADDJOB, t_phase);
+    sigprocmask(SIG_SETMASK, &prev_all, NULL);
+    launched_jobs++;
+    if (getjobpid(jobs, pid) != NULL) {
+        getjobpid(jobs, pid)->start_ns = start_ns;
+        getjobpid(jobs, pid)->trace_seq = bg && trace_mode ? trace_seq : 0;
     }
-    else {
-        printf("%d %s", pid, cmdline);
+    if (log_slot >= 0)
+        joblog_attach(log_slot, getjobpid(jobs, pid));
+    if (lo->cache != NULL && getjobpid(jobs, pid) != NULL) {
+        getjobpid(jobs, pid)->cache = lo->cache;
+        lo->cache = NULL;
     }
-    
+    if (lo->redir != NULL)
+        redir_attach(lo->redir, getjobpid(jobs, pid));
+    if (default_timeout_ms > 0)
+        job_deadline(getjobpid(jobs, pid), default_timeout_ms, default_grace_ms);
+    zygote_refill();                    /* the job's pipes are closed by now */
 
-    return;
+    return pid;
 }
 
-void update_tsh_history(char * cmdline){
-    
-    strcpy(history[history_index], cmdline);
-    history_index = (history_index + 1) % 10;
-    
-    char file_choice[20 + strlen(username)];
-    strcpy(file_choice, file_start);
-    strcat(file_choice, username);
-    strcat(file_choice, file_end);
+/*
+ * update_tsh_history - Append cmdline to the shared history file. The
+ *    ring is refilled from the file, so it also picks up the commands
+ *    other sessions of the same user ran in the meantime.
+ */
+void update_tsh_history(char * cmdline)
+{
+    /* -L: start at the end, the older lines wait for history_load */
+    if (history_lazy && hist.fd < 0 && hist_open(&hist, history_path) == 0)
+        hist.off = lseek(hist.fd, 0, SEEK_END);
+    hist_append(&hist, history_path, cmdline, history_push, NULL);
+}
 
-    FILE * fp2;
-    fp2 = fopen(file_choice, "w");
+/*
+ * history_load - Under -L, fill the ring from the file the first time
+ *    history or !N needs it. The lines pushed since the start are part
+ *    of the file's tail, so the ring is simply read again.
+ */
+void history_load(void)
+{
+    int i;
 
-    if (fp2 != NULL){
-        for (int i = 0; i < 10; i++){
-            if (strcmp(history[i], "") == 0) {
-                break;
-            }
-            fprintf(fp2, "%s", history[i]);
-        }
-    }
-    else {
-        perror("fopen");
-        exit(EXIT_FAILURE);
-    }
+    if (!history_lazy)
+        return;
+    history_lazy = 0;
+    for (i = 0; i < 10; i++)
+        history[i][0] = '\0';
+    history_index = 0;
+    hist_close(&hist);
+    hist_sync(&hist, history_path, history_push, NULL);
+}
 
-    fclose(fp2);
+/* history_push - Add one history line to the shell's ring */
+void history_push(void *ctx, const char *line)
+{
+    strncpy(history[history_index], line, MAXLINE - 1);
+    history[history_index][MAXLINE - 1] = '\0';
+    history_index = (history_index + 1) % 10;
 }
 
 /* 
@@ -512,6 +1076,7 @@ int parseline(const char *cmdline, char **argv)
     }
 
     while (delim) {
+	parse_quoted[argc] = buf > array && buf[-1] == '\'';  /* no globbing */
 	argv[argc++] = buf;
 	*delim = '\0';
 	buf = delim + 1;
@@ -542,27 +1107,65 @@ int parseline(const char *cmdline, char **argv)
  * builtin_cmd - If the user has typed a built-in command then execute
  *    it immediately.  
  */
-int builtin_cmd(char **argv) 
+int builtin_cmd(char **argv, struct launch_opts *lo) 
 {  
+    int status;
 
-    if (strcmp(argv[0],"quit") == 0) {
-        
-        char pid_string[MAXLINE];
-        sprintf(pid_string, "%d", session_leader_pid);
+    if ((status = fast_builtin(argv)) >= 0) {
+        last_status = status;
+        return 1;
+    }
+    last_status = 0;
 
-        char status_file[14 + strlen(pid_string)];
-        strcpy(status_file, proc_start);
-        strcat(status_file, pid_string);
-        strcat(status_file, proc_end);
+    if (strcmp(argv[0], "source") == 0 || strcmp(argv[0], ".") == 0) {
+        if (argv[1] == NULL) {
+            printf("%s: filename argument required\n", argv[0]);
+            last_status = 2;
+        }
+        else {
+            last_status = source_file(argv[1]);
+        }
+        return 1;
+    }
 
-        remove(status_file);
+    if (strcmp(argv[0], "dag") == 0) {
+        last_status = builtin_dag(argv);
+        return 1;
+    }
 
-        char proc_choice[7 + strlen(pid_string)];
-        strcpy(proc_choice, proc_start);
-        strcat(proc_choice, pid_string);
-        
-        rmdir(proc_choice);
+    if (strcmp(argv[0], "joblog") == 0) {
+        last_status = builtin_joblog(argv);
+        return 1;
+    }
 
+    if (strcmp(argv[0], "tail") == 0) {
+        last_status = builtin_tail(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "audit") == 0) {
+        last_status = builtin_audit(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "export") == 0) {
+        last_status = builtin_export(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "unset") == 0) {
+        last_status = builtin_unset(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "submit") == 0) {
+        last_status = builtin_submit(argv, lo);
+        return 1;
+    }
+
+
+    if (strcmp(argv[0],"quit") == 0) {
+        remove_proc_entry(session_leader_pid);
         exit(0);
     }
 
@@ -577,28 +1180,14 @@ int builtin_cmd(char **argv)
             printf("There are suspended jobs.\n");
         }
         else {
-            char pid_string[MAXLINE];
-            sprintf(pid_string, "%d", session_leader_pid);
-
-            char status_file[14 + strlen(pid_string)];
-            strcpy(status_file, proc_start);
-            strcat(status_file, pid_string);
-            strcat(status_file, proc_end);
-
-            remove(status_file);
-
-            char proc_choice[7 + strlen(pid_string)];
-            strcpy(proc_choice, proc_start);
-            strcat(proc_choice, pid_string);
-            
-            rmdir(proc_choice);
-
+            remove_proc_entry(session_leader_pid);
             exit(0);
         }
         
     }
 
     if (strcmp(argv[0],"history") == 0) {
+        history_load();
         int position = history_index;
         int number_label = 1;
         for (int i = 0; i < 10; i++){
@@ -620,12 +1209,16 @@ int builtin_cmd(char **argv)
 
     if (strcmp(argv[0],"jobs") == 0) {
         listjobs(jobs);
+        queue_jobs();
     }
 
     if (strcmp(argv[0], "!1") == 0 || strcmp(argv[0], "!2") == 0 || strcmp(argv[0], "!3") == 0
     || strcmp(argv[0], "!4") == 0 || strcmp(argv[0], "!5") == 0 || strcmp(argv[0], "!6") == 0
     || strcmp(argv[0], "!7") == 0 || strcmp(argv[0], "!8") == 0 || strcmp(argv[0], "!9") == 0
     || strcmp(argv[0], "!10") == 0) {
+        /* other sessions may have added lines since our last command */
+        history_load();
+        hist_sync(&hist, history_path, history_push, NULL);
         if (strlen(argv[0]) == 2){
             char numb = argv[0][1];
             int option = atoi(&numb);
@@ -664,50 +1257,69 @@ int builtin_cmd(char **argv)
     return 0;     /* not a builtin command */
 }
 
+/* is_builtin - Is name a command that builtin_cmd runs in the shell? */
+int is_builtin(char *name)
+{
+    static char *names[] = {
+        "!1", "!2", "!3", "!4", "!5", "!6", "!7", "!8", "!9", "!10",
+        "bg", "fg", "adduser", "quit", "logout", "history", "jobs",
+        "source", ".", "dag", "joblog", "tail", "timeout", "audit", "export", "unset", "submit",
+        "cache", NULL
+    };
+    int i;
+
+    for (i = 0; names[i] != NULL; i++)
+        if (strcmp(name, names[i]) == 0)
+            return 1;
+    return fast_builtin_name(name);
+}
+
 /* 
  * do_bgfg - Execute the builtin bg and fg commands
  */
 void do_bgfg(char **argv) 
 {
-    if (strcmp(argv[0], "bg") == 0){
-        int value = atoi(argv[1]);
-        struct job_t * job1 = getjobjid(jobs, value);
-        struct job_t * job2 = getjobpid(jobs, value);
+    struct job_t * job = parse_jobspec(argv[1]);
 
-        if (job1 != NULL){
-            job1->state = BG;
-            kill(job1->pid, SIGCONT);
-            // update proc status file to running 
-        }
-        else if (job2 != NULL){
-            job2->state = BG;
-            kill(job2->pid, SIGCONT);
-        }
-        else {
-            printf("Invalid JID/PID Entered.\n");
-        }
+    if (job == NULL){
+        printf("Invalid JID/PID Entered.\n");
+        return;
     }
-    else {
-        int value = atoi(argv[1]);
-        struct job_t * job1 = getjobjid(jobs, value);
-        struct job_t * job2 = getjobpid(jobs, value);
 
-        if (job1 != NULL){
-            job1->state = FG;
-            kill(job1->pid, SIGCONT);
-            //update proc status file to running 
-        }
-        else if (job2 != NULL){
-            job2->state = FG;
-            kill(job2->pid, SIGCONT);
-        }
-        else {
-            printf("Invalid JID/PID Entered.\n");
-        }
+    if (job_signal(job, SIGCONT) < 0) {
+        printf("%s: (%d): %s\n", argv[0], job->pid, strerror(errno));
+        return;
+    }
+    if (strcmp(argv[0], "bg") == 0){
+        job->state = BG;
+    }
+    else {
+        job->state = FG;
+        waitfg(job->pid);
     }
     return;
 }
 
+/*
+ * parse_jobspec - Find the job named by %jid, or by a bare number that
+ *    is tried as a JID first and then as a PID. NULL if there is none.
+ */
+struct job_t *parse_jobspec(char *arg)
+{
+    struct job_t * job;
+    int value;
+
+    if (arg == NULL)
+        return NULL;
+    if (arg[0] == '%')
+        return getjobjid(jobs, atoi(arg + 1));
+
+    value = atoi(arg);
+    if ((job = getjobjid(jobs, value)) != NULL)
+        return job;
+    return getjobpid(jobs, value);
+}
+
 /*
 * 
 */
@@ -717,10 +1329,23 @@ void add_user(char **argv)
         printf("root privileges required to run adduser.\n");
         return;
     }
+    else if (argv[1] != NULL && strcmp(argv[1], "--batch") == 0) {
+        if (argv[2] == NULL)
+            printf("adduser: usage: adduser --batch FILE\n");
+        else
+            add_user_batch(argv[2]);
+        return;
+    }
     else {
 
+        int lock_fd = passwd_lock();    /* held until the user is added */
+        if (lock_fd < 0) {
+            perror(passwd_path);
+            return;
+        }
+
         FILE * fp3;
-        fp3 = fopen("./etc/passwd.txt", "r");
+        fp3 = fopen(passwd_path, "r");
 
         int username_check = 0;
 
@@ -749,31 +1374,31 @@ void add_user(char **argv)
 
         if (username_check == 1){
             printf("User already exists.\n");
+            close(lock_fd);
             return;
         }
 
         FILE * fp4;
-        fp4 = fopen("./etc/passwd.txt", "a");
+        fp4 = fopen(passwd_path, "a");
 
         fprintf(fp4, "\n%s:%s:/home/%s", argv[1], argv[2], argv[1]);
 
         fclose(fp4);
+        close(lock_fd);
 
-        char file_choice[7 + strlen(argv[1])];
-        strcpy(file_choice, file_start);
-        strcat(file_choice, argv[1]);
+        char file_choice[MAXLINE];
+        snprintf(file_choice, sizeof(file_choice), "%s%s", home_path, argv[1]);
 
         mkdir(file_choice, 0700);
 
-        char create_file[20 + strlen(argv[1])];
-        strcpy(create_file, file_start);
-        strcat(create_file, argv[1]);
-        strcat(create_file, file_end);
+        char create_file[MAXLINE];
+        snprintf(create_file, sizeof(create_file), "%s%s%s",
+                 home_path, argv[1], file_end);
 
-        FILE * fp5;
-        fp5 = fopen(create_file, "w");
-
-        fclose(fp5);
+        /* Keep the history of a home left behind by an earlier user */
+        int fd5 = open(create_file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd5 >= 0)
+            close(fd5);
     }
 
     return;
@@ -784,12 +1409,10 @@ void add_user(char **argv)
  */
 void waitfg(pid_t pid)
 {
-    while (1) {
-        if (pid == fg_pid) {
-            break;
-        }
-        sleep(1);
-    }
+    struct job_t *job;
+
+    while ((job = getjobpid(jobs, pid)) != NULL && job->state == FG)
+        job_events(-1);
     return;
 }
 
@@ -797,55 +1420,6 @@ void waitfg(pid_t pid)
  * Signal handlers
  *****************/
 
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
- */
-void sigchld_handler(int sig) 
-{
-    int olderrno = errno;
-    pid_t pid;
-    
-    while((pid = wait(NULL)) > 0){ 
-        fg_pid = pid;
-
-        if(verbose){
-            Sio_puts("Handler reaped child ");
-            Sio_putl((long)pid);
-            Sio_puts(" \n");
-        }
-
-        char pid_string[MAXLINE];
-        sprintf(pid_string, "%d", pid);
-
-        char status_file[14 + strlen(pid_string)];
-        strcpy(status_file, proc_start);
-        strcat(status_file, pid_string);
-        strcat(status_file, proc_end);
-
-        remove(status_file);
-
-        char proc_choice[7 + strlen(pid_string)];
-        strcpy(proc_choice, proc_start);
-        strcat(proc_choice, pid_string);
-        
-    
-        rmdir(proc_choice);
-
-        deletejob(jobs, pid);
-
-    }
-    if (errno != ECHILD){
-        Sio_error("wait error");
-    }
-    errno = olderrno;
-
-    return;
-}
-
 /* 
  * sigint_handler - The kernel sends a SIGINT to the shell whenver the
  *    user types ctrl-c at the keyboard.  Catch it and send it along
@@ -854,29 +1428,14 @@ void sigchld_handler(int sig)
 void sigint_handler(int sig) 
 {
     pid_t foreground_pid = fgpid(jobs);
+
+    sigint_seen = 1;
     
     if (foreground_pid == 0){
         return;
     }
     else {
-        killpg(foreground_pid, SIGINT);
-        deletejob(jobs, foreground_pid);
-
-        char pid_string[MAXLINE];
-        sprintf(pid_string, "%d", foreground_pid);
-
-        char status_file[14 + strlen(pid_string)];
-        strcpy(status_file, proc_start);
-        strcat(status_file, pid_string);
-        strcat(status_file, proc_end);
-
-        remove(status_file);
-
-        char proc_choice[7 + strlen(pid_string)];
-        strcpy(proc_choice, proc_start);
-        strcat(proc_choice, pid_string);
-
-        rmdir(proc_choice);
+        killpg(foreground_pid, SIGINT);   /* the job is reaped on exit */
     }
     return;
 }
@@ -894,237 +1453,8699 @@ void sigtstp_handler(int sig)
         return;
     }
     else {
-        killpg(foreground_pid, SIGTSTP);
-        // change job state to stopped in job list 
-        // struct job_t * job1 = getjobpid(jobs, foreground_pid);
-        // job1->state = ST;
-        // Now edit the proc status file to indicate the process has stopped 
+        killpg(foreground_pid, SIGTSTP);  /* the stop arrives on chld_fd */
     }
     return;
 }
 
+/*
+ * sighup_handler - A hangup or SIGTERM ends the shell as it would
+ *    have without a handler, but buffered audit records are written
+ *    out first.
+ */
+void sighup_handler(int sig)
+{
+    audit_fatal(sig);
+}
+
 /*********************
  * End signal handlers
  *********************/
 
 /***********************************************
- * Helper routines that manipulate the job list
+ * Event loop: stdin and job pidfds under epoll
+ *
+ * Every job holds a pidfd registered in jobs_epfd, so an exit is
+ * seen, reaped and cleaned up for exactly that process. SIGCHLD
+ * stays blocked; it is read from a signalfd and used to pick up
+ * stopped or continued children, and the exits of any job that got
+ * no pidfd (pidfd_open failed, e.g. ENOSYS or EMFILE). The main loop waits on stdin
+ * and on jobs_epfd (an epoll set nested in input_epfd), while waitfg
+ * waits on jobs_epfd alone.
  **********************************************/
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+/* pidfd_open - Wrapper for the pidfd_open system call */
+static int pidfd_open(pid_t pid, unsigned int flags)
+{
+    return syscall(SYS_pidfd_open, pid, flags);
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
-    int i;
-
-    for (i = 0; i < MAXJOBS; i++)
-	clearjob(&jobs[i]);
+/* pidfd_send_signal - Wrapper for the pidfd_send_signal system call */
+static int pidfd_send_signal(int pidfd, int sig, siginfo_t *info, unsigned int flags)
+{
+    return syscall(SYS_pidfd_send_signal, pidfd, sig, info, flags);
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs) 
+/*
+ * init_events - Block SIGCHLD, open its signalfd and build the epoll
+ *    sets. Children restore an empty mask before they exec.
+ */
+void init_events(void)
 {
-    int i, max=0;
+    struct epoll_event ev;
+    sigset_t mask;
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    if ((chld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+
+    if ((jobs_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+        || (input_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;                    /* pid 0 tags the signalfd */
+    if (epoll_ctl(jobs_epfd, EPOLL_CTL_ADD, chld_fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    ev.data.fd = jobs_epfd;
+    if (epoll_ctl(input_epfd, EPOLL_CTL_ADD, jobs_epfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    init_deadlines();
+
+    /* Regular files cannot be polled; they are always readable */
+    ev.data.fd = STDIN_FILENO;
+    stdin_pollable = epoll_ctl(input_epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
+/* job_finish - Drop a job whose processes have all exited */
+static void job_finish(struct job_t *job, int status)
 {
-    int i;
-    
-    if (pid < 1)
-	return 0;
+    pid_t pid = job->pid;
+    struct quser *qu = job->quser;
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = nextjid++;
-            if (nextjid > MAXJOBS)
-            nextjid = 1;
-            strcpy(jobs[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-                return 1;
-        }
+    if (job->timed_out) {
+        printf("Job [%d] (%d) timed out after %gs\n", job->jid, pid, job->limit_ms / 1000.0);
+        status = 124;
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
+    if (job->state == FG)
+        last_status = status;
+    audit_record(username, pid, status, job->start_ns, job->cmdline);
+    if (job->trace_seq > 0)
+        trace_job(job->trace_seq, job->cmdline, status);
+    if (job->cache != NULL)
+        cache_finish(job, status);
+    joblog_exit(pid);
+    deletejob(jobs, pid);
+    if (job_exit_hook != NULL)
+        job_exit_hook(pid, status);
+    queue_job_exit(qu);                 /* a slot is free */
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) 
+/*
+ * reap_job - Collect job's exit, if it has exited, and drop the job.
+ *    A job with substituted processes still running lives on until
+ *    reap_sub has collected the last of them.
+ */
+static void reap_job(struct job_t *job)
 {
-    int i;
+    siginfo_t si;
+    pid_t pid = job->pid;
+    int status, i;
+
+    si.si_pid = 0;
+    if ((job->pidfd >= 0 ? waitid(P_PIDFD, job->pidfd, &si, WEXITED | WNOHANG)
+                         : waitid(P_PID, pid, &si, WEXITED | WNOHANG)) < 0
+        || si.si_pid == 0)
+        return;
 
-    if (pid < 1)
-	return 0;
+    if (verbose)
+        printf("Handler reaped child %d \n", pid);
+    status = si.si_code == CLD_EXITED ? si.si_status : 128 + si.si_status;
+    remove_proc_entry(pid);
+    if (job->nsubs == 0) {
+        job_finish(job, status);
+        return;
+    }
+    close(job->pidfd);                  /* reaped: it would stay readable */
+    job->pidfd = -1;
+    job->main_done = 1;
+    job->main_status = status;
+    for (i = 0; i < job->nsubs; i++)    /* nobody reads <(...) any more */
+        if (job->subdir[i] == '<')
+            kill(job->subs[i], SIGTERM);
+}
+
+/* reap_sub - Collect a substituted process of some job */
+static void reap_sub(pid_t pid)
+{
+    siginfo_t si;
+    int i, k;
 
     for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == pid) {
-	    clearjob(&jobs[i]);
-	    nextjid = maxjid(jobs)+1;
-	    return 1;
-	}
+        struct job_t *job = &jobs[i];
+
+        for (k = 0; k < job->nsubs; k++) {
+            if (job->subs[k] != pid)
+                continue;
+            si.si_pid = 0;
+            if (waitid(P_PIDFD, job->subfd[k], &si, WEXITED | WNOHANG) < 0
+                || si.si_pid == 0)
+                return;
+            close(job->subfd[k]);
+            remove_proc_entry(pid);
+            job->nsubs--;
+            job->subs[k] = job->subs[job->nsubs];
+            job->subfd[k] = job->subfd[job->nsubs];
+            job->subdir[k] = job->subdir[job->nsubs];
+            if (job->main_done && job->nsubs == 0)
+                job_finish(job, job->main_status);
+            return;
+        }
     }
-    return 0;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
+/*
+ * reap_stops - Drain the SIGCHLD signalfd and apply any stop or
+ *    continue reports. Without WEXITED this never consumes an exit,
+ *    and returns at once when nothing stopped. Jobs without a pidfd
+ *    are reaped here instead.
+ */
+static void reap_stops(void)
+{
+    struct signalfd_siginfo ssi;
+    siginfo_t si;
+    struct job_t *job;
     int i;
 
+    while (read(chld_fd, &ssi, sizeof(ssi)) == sizeof(ssi))
+        ;
+
+    while (1) {
+        si.si_pid = 0;
+        if (waitid(P_ALL, 0, &si, WSTOPPED | WCONTINUED | WNOHANG) < 0 || si.si_pid == 0)
+            break;
+        if ((job = getjobpid(jobs, si.si_pid)) == NULL)
+            continue;
+        if (si.si_code == CLD_STOPPED)
+            job->state = ST;
+        else if (si.si_code == CLD_CONTINUED && job->state == ST)
+            job->state = BG;
+    }
     for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
-    return 0;
+        if (jobs[i].pid != 0 && jobs[i].pidfd < 0 && !jobs[i].main_done)
+            reap_job(&jobs[i]);
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
-
-    if (pid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+/*
+ * job_events - Wait up to timeout ms (-1 forever, 0 poll) for job
+ *    events and handle them. Returns the number of events handled.
+ */
+int job_events(int timeout)
+{
+    struct epoll_event evs[MAXJOBS + 1];
+    int i, n;
+
+    n = epoll_wait(jobs_epfd, evs, MAXJOBS + 1, timeout);
+    for (i = 0; i < n; i++) {
+        pid_t pid = (pid_t)evs[i].data.u64;
+        struct job_t *job;
+
+        if (evs[i].data.u64 == TIMER_TAG)
+            wheel_advance();
+        else if (evs[i].data.u64 & SUBST_TAG)
+            reap_sub((pid_t)(evs[i].data.u64 & 0xffffffff));
+        else if (evs[i].data.u64 & JOBLOG_TAG)
+            joblog_drain((int)(evs[i].data.u64 & 0xffffffff));
+        else if (pid == 0)
+            reap_stops();
+        else if ((job = getjobpid(jobs, pid)) != NULL)
+            reap_job(job);
+    }
+    return n < 0 ? 0 : n;
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
+/* job_watch - Open a pidfd for a new job and add it to the job epoll set */
+int job_watch(struct job_t *job)
 {
-    int i;
+    struct epoll_event ev;
+
+    if ((job->pidfd = pidfd_open(job->pid, 0)) < 0)
+        return -1;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)job->pid;
+    if (epoll_ctl(jobs_epfd, EPOLL_CTL_ADD, job->pidfd, &ev) < 0) {
+        close(job->pidfd);
+        job->pidfd = -1;
+        return -1;
+    }
+    return 0;
+}
 
-    if (jid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-	    return &jobs[i];
-    return NULL;
+/*
+ * job_signal - Send sig to a job through its pidfd. A job without one
+ *    is treated as already reaped: its raw pid is never signalled.
+ */
+int job_signal(struct job_t *job, int sig)
+{
+    if (job->pidfd < 0) {
+        errno = ESRCH;
+        return -1;
+    }
+    return pidfd_send_signal(job->pidfd, sig, NULL, 0);
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) 
+/*
+ * read_cmdline - Run the event loop until a full line is available on
+ *    stdin and copy it (with its newline) into cmdline. Returns 0 at
+ *    end of file.
+ */
+int read_cmdline(char *cmdline)
 {
-    int i;
+    struct epoll_event evs[2];
+    char *nl;
+    size_t len;
+    ssize_t n;
+    int i, k, due;
 
-    if (pid < 1)
-	return 0;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-            return jobs[i].jid;
+    if (trace_mode == TRACE_REPLAY)
+        return trace_next(cmdline);
+    while (1) {
+        nl = memchr(inbuf, '\n', inlen);
+        if (nl != NULL || inlen >= MAXLINE - 1 || (in_eof && inlen > 0)) {
+            len = nl ? (size_t)(nl - inbuf + 1) : inlen;
+            if (len > MAXLINE - 2)
+                len = MAXLINE - 2;
+            memcpy(cmdline, inbuf, len);
+            if (cmdline[len - 1] != '\n')
+                cmdline[len++] = '\n';
+            cmdline[len] = '\0';
+            inlen -= nl ? (size_t)(nl - inbuf + 1) : len - 1;
+            memmove(inbuf, inbuf + (nl ? nl - inbuf + 1 : (long)len - 1), inlen);
+            if (trace_mode == TRACE_RECORD)
+                trace_input(cmdline);
+            return 1;
         }
-    return 0;
+        if (in_eof)
+            return 0;
+
+        if (!stdin_pollable) {
+            job_events(0);
+        }
+        else {
+            due = audit_due();      /* idle at the prompt: write the log */
+            k = epoll_wait(input_epfd, evs, 2, prefetch_pending() ? 0 : due);
+            if (k == 0 && prefetch_pending()) {     /* nothing typed ahead */
+                prefetch_idle();
+                continue;
+            }
+            if (k == 0 && due >= 0)
+                audit_flush();
+            for (i = 0; i < k; i++)
+                if (evs[i].data.fd == jobs_epfd)
+                    job_events(0);
+            if (k <= 0 || (k == 1 && evs[0].data.fd == jobs_epfd))
+                continue;
+        }
+
+        n = read(STDIN_FILENO, inbuf + inlen, sizeof(inbuf) - inlen);
+        if (n > 0)
+            inlen += n;
+        else if (n == 0)
+            in_eof = 1;
+        else if (errno != EINTR && errno != EAGAIN)
+            app_error("read error");
+    }
 }
+/**********************************************
+ * end event loop
+ **********************************************/
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) 
+/***********************************************
+ * Background output capture (-C)
+ *
+ * With -C SIZE every background job's stdout and stderr go to a pipe
+ * instead of the terminal. The event loop drains the pipe with large
+ * vectored reads into a per-job ring buffer of SIZE bytes, mapped
+ * with mmap so untouched pages cost nothing. Once full, a ring keeps
+ * the newest output. Logs outlive their jobs for joblog and tail;
+ * --capture-max caps the total mapped size by dropping the oldest
+ * logs of finished jobs first, then by shrinking new rings.
+ **********************************************/
+
+struct joblog_t {
+    pid_t pid;              /* 0 if the slot is free */
+    int jid;
+    int fd;                 /* read end of the job's pipe, -1 at EOF */
+    int live;               /* job still in the job list */
+    char *buf;              /* mmap'd ring */
+    size_t size;
+    unsigned long long total;       /* bytes ever written */
+    unsigned long seq;              /* start order, for eviction */
+    char cmdline[MAXLINE];
+};
+struct joblog_t joblogs[MAXLOGS];
+size_t capture_used = 0;
+unsigned long joblog_seq = 0;
+
+/* parse_size - Parse a byte count with an optional k, m or g suffix */
+size_t parse_size(const char *s)
 {
-    // for (int i =0; i < MAXJOBS; i++) {
-    //     printf("%d\n", jobs[i].pid);
-    // }
-    int i;
-    
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid != 0) {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-            switch (jobs[i].state) {
-            case BG: 
-                printf("Running ");
-                break;
-            case FG: 
-                printf("Foreground ");
-                break;
-            case ST: 
-                printf("Stopped ");
-                break;
-            default:
-                printf("listjobs: Internal error: job[%d].state=%d ", 
-                i, jobs[i].state);
-            }
-            printf("%s", jobs[i].cmdline);
-	    }
+    char *end;
+    double v = strtod(s, &end);
+
+    if (end == s || v < 0)
+        return 0;
+    switch (tolower((unsigned char)*end)) {
+    case 'k': v *= 1024; break;
+    case 'm': v *= 1024 * 1024; break;
+    case 'g': v *= 1024.0 * 1024 * 1024; break;
     }
+    return (size_t)v;
 }
-/******************************
- * end job list helper routines
- ******************************/
 
+/* joblog_free - Unmap a log and close its pipe */
+static void joblog_free(struct joblog_t *log)
+{
+    if (log->fd >= 0) {
+        epoll_ctl(jobs_epfd, EPOLL_CTL_DEL, log->fd, NULL);
+        close(log->fd);
+    }
+    munmap(log->buf, log->size);
+    capture_used -= log->size;
+    memset(log, 0, sizeof(*log));
+    log->fd = -1;
+}
 
-/***********************
- * Other helper routines
- ***********************/
+/* joblog_evict - Free the oldest log of a finished job; 0 if none */
+static int joblog_evict(void)
+{
+    struct joblog_t *old = NULL;
+    int i;
+
+    for (i = 0; i < MAXLOGS; i++)
+        if (joblogs[i].pid != 0 && !joblogs[i].live
+            && (old == NULL || joblogs[i].seq < old->seq))
+            old = &joblogs[i];
+    if (old == NULL)
+        return 0;
+    joblog_free(old);
+    return 1;
+}
 
 /*
- * usage - print a help message
+ * joblog_open - Make a pipe and a ring for a background job about to
+ *    be forked. Returns the slot with the write end in *wfd, or -1 if
+ *    the job should run uncaptured.
  */
-void usage(void) 
+int joblog_open(int *wfd)
 {
-    printf("Usage: shell [-hvp]\n");
-    printf("   -h   print this message\n");
-    printf("   -v   print additional diagnostic information\n");
-    printf("   -p   do not emit a command prompt\n");
-    exit(1);
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (capture_size + page - 1) / page * page;
+    struct epoll_event ev;
+    struct joblog_t *log = NULL;
+    int p[2], i;
+
+    while (capture_used + size > capture_max && joblog_evict())
+        ;
+    if (capture_used + size > capture_max)      /* only live logs left */
+        size = capture_max > capture_used + page
+            ? (capture_max - capture_used) / page * page : (size_t)page;
+
+    for (i = 0; i < MAXLOGS && joblogs[i].pid != 0; i++)
+        ;
+    if (i == MAXLOGS) {
+        if (!joblog_evict())
+            return -1;
+        for (i = 0; joblogs[i].pid != 0; i++)
+            ;
+    }
+    log = &joblogs[i];
+
+    if (pipe2(p, O_CLOEXEC) < 0)
+        return -1;
+    log->buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (log->buf == MAP_FAILED) {
+        close(p[0]);
+        close(p[1]);
+        log->buf = NULL;
+        return -1;
+    }
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u64 = JOBLOG_TAG | (uint64_t)i;
+    epoll_ctl(jobs_epfd, EPOLL_CTL_ADD, p[0], &ev);
+
+    log->pid = -1;              /* reserved until joblog_attach */
+    log->fd = p[0];
+    log->size = size;
+    log->total = 0;
+    log->seq = joblog_seq++;
+    capture_used += size;
+    *wfd = p[1];
+    return i;
 }
 
-/*
- * unix_error - unix-style error routine
- */
-void unix_error(char *msg)
+/* joblog_cancel - Give back slot i when its job could not be started */
+void joblog_cancel(int i)
 {
-    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
-    exit(1);
+    joblog_free(&joblogs[i]);
 }
 
-/*
- * app_error - application-style error routine
- */
-void app_error(char *msg)
+/* joblog_attach - Bind slot i to the job that was just added */
+void joblog_attach(int i, struct job_t *job)
 {
-    fprintf(stdout, "%s\n", msg);
-    exit(1);
+    int k;
+
+    /* A reused jid now names the new job only */
+    for (k = 0; k < MAXLOGS; k++)
+        if (k != i && joblogs[k].pid != 0 && joblogs[k].jid == job->jid && !joblogs[k].live)
+            joblog_free(&joblogs[k]);
+    joblogs[i].pid = job->pid;
+    joblogs[i].jid = job->jid;
+    joblogs[i].live = 1;
+    strcpy(joblogs[i].cmdline, job->cmdline);
 }
 
 /*
- * Signal - wrapper for the sigaction function
+ * joblog_drain - Read everything available from log i's pipe into its
+ *    ring. Output of a job that has been brought to the foreground is
+ *    also passed through to the terminal.
  */
-handler_t *Signal(int signum, handler_t *handler) 
+void joblog_drain(int i)
 {
-    struct sigaction action, old_action;
+    struct joblog_t *log = &joblogs[i];
+    struct job_t *job;
+    struct iovec iov[2];
+    ssize_t n;
 
-    action.sa_handler = handler;  
-    sigemptyset(&action.sa_mask); /* block sigs of type being handled */
-    action.sa_flags = SA_RESTART; /* restart syscalls if possible */
+    while (log->fd >= 0) {
+        size_t pos = log->total % log->size;
+        size_t want = log->size < JOBLOG_CHUNK ? log->size : JOBLOG_CHUNK;
+
+        iov[0].iov_base = log->buf + pos;
+        iov[0].iov_len = log->size - pos < want ? log->size - pos : want;
+        iov[1].iov_base = log->buf;
+        iov[1].iov_len = want - iov[0].iov_len;
+        n = readv(log->fd, iov, 2);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0) {
+            epoll_ctl(jobs_epfd, EPOLL_CTL_DEL, log->fd, NULL);
+            close(log->fd);
+            log->fd = -1;
+            return;
+        }
+        log->total += n;
 
-    if (sigaction(signum, &action, &old_action) < 0)
-	unix_error("Signal error");
-    return (old_action.sa_handler);
+        if (log->live && (job = getjobpid(jobs, log->pid)) != NULL && job->state == FG) {
+            size_t first = (size_t)n < iov[0].iov_len ? (size_t)n : iov[0].iov_len;
+            fflush(stdout);
+            rio_writen(STDOUT_FILENO, iov[0].iov_base, first);
+            rio_writen(STDOUT_FILENO, iov[1].iov_base, n - first);
+        }
+    }
+}
+
+/* joblog_exit - The job pid has been reaped; keep its log for later */
+void joblog_exit(pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < MAXLOGS; i++) {
+        if (joblogs[i].pid == pid && joblogs[i].live) {
+            joblog_drain(i);
+            joblogs[i].live = 0;
+            return;
+        }
+    }
+}
+
+/* joblog_find - Log for "%jid", jid or pid; newest first */
+static struct joblog_t *joblog_find(char *arg)
+{
+    struct joblog_t *best = NULL;
+    int value, i, pass;
+
+    if (arg == NULL)
+        return NULL;
+    value = atoi(arg[0] == '%' ? arg + 1 : arg);
+    for (pass = 0; pass < 2 && best == NULL; pass++) {
+        if (pass == 1 && arg[0] == '%')
+            break;
+        for (i = 0; i < MAXLOGS; i++) {
+            struct joblog_t *log = &joblogs[i];
+            if (log->pid <= 0 || (pass == 0 ? log->jid : log->pid) != value)
+                continue;
+            if (best == NULL || log->seq > best->seq)
+                best = log;
+        }
+    }
+    return best;
+}
+
+/* joblog_write - Print the bytes of log from offset start on */
+static void joblog_write(struct joblog_t *log, unsigned long long start)
+{
+    unsigned long long first = log->total > log->size ? log->total - log->size : 0;
+    size_t pos, len;
+
+    if (start < first)
+        start = first;
+    fflush(stdout);
+    while (start < log->total) {
+        pos = start % log->size;
+        len = log->size - pos;
+        if (len > log->total - start)
+            len = log->total - start;
+        rio_writen(STDOUT_FILENO, log->buf + pos, len);
+        start += len;
+    }
 }
 
 /*
- * sigquit_handler - The driver program can gracefully terminate the
- *    child shell by sending it a SIGQUIT signal.
+ * builtin_joblog - joblog [%jid | pid]. With no argument, list the
+ *    captured logs; otherwise print one job's captured output.
  */
-void sigquit_handler(int sig) 
+int builtin_joblog(char **argv)
 {
-    printf("Terminating after receipt of SIGQUIT signal\n");
-    exit(1);
-}
+    struct joblog_t *log;
+    int i;
 
+    if (argv[1] == NULL) {
+        for (i = 0; i < MAXLOGS; i++) {
+            log = &joblogs[i];
+            if (log->pid <= 0)
+                continue;
+            printf("[%d] (%d) %s %llu bytes%s %s", log->jid, log->pid,
+                   log->live ? "Running" : "Done", log->total,
+                   log->total > log->size ? " (wrapped)" : "", log->cmdline);
+        }
+        return 0;
+    }
+    if ((log = joblog_find(argv[1])) == NULL) {
+        printf("%s: no captured output for %s\n", argv[0], argv[1]);
+        return 1;
+    }
+    if (log->fd >= 0)
+        joblog_drain(log - joblogs);
+    if (log->total > log->size)
+        printf("[... %llu bytes dropped ...]\n", log->total - log->size);
+    joblog_write(log, 0);
+    return 0;
+}
+
+/* builtin_tail - tail [-n N] %jid | pid: the last N lines (default 10) */
+int builtin_tail(char **argv)
+{
+    struct joblog_t *log;
+    unsigned long long first, off;
+    long lines = 10;
+    int i = 1;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0 && argv[2] != NULL) {
+        lines = atol(argv[2]);
+        i = 3;
+    }
+    else if (argv[1] != NULL && argv[1][0] == '-' && isdigit((unsigned char)argv[1][1])) {
+        lines = atol(argv[1] + 1);
+        i = 2;
+    }
+    if (argv[i] == NULL || (log = joblog_find(argv[i])) == NULL) {
+        printf("tail: no captured output for %s\n", argv[i] ? argv[i] : "(none)");
+        return 1;
+    }
+    if (log->fd >= 0)
+        joblog_drain(log - joblogs);
+
+    /* Scan back from the end for lines + 1 newlines, ignoring a final one */
+    first = log->total > log->size ? log->total - log->size : 0;
+    off = log->total;
+    if (off > first && log->buf[(off - 1) % log->size] == '\n')
+        off--;
+    while (off > first && lines > 0) {
+        if (log->buf[(off - 1) % log->size] == '\n' && --lines == 0)
+            break;
+        off--;
+    }
+    if (lines > 0)
+        off = first;
+    joblog_write(log, off);
+    return 0;
+}
+/**********************************************
+ * end background output capture
+ **********************************************/
+
+/***********************************************
+ * Job deadlines: a timer wheel on one timerfd
+ *
+ * Deadlines hang off a hashed timing wheel of WHEEL_SLOTS lists, one
+ * WHEEL_TICK_MS apart; a deadline further out than one turn carries
+ * the number of turns left. Arming and cancelling are O(1) list
+ * operations however many deadlines exist, and the single timerfd in
+ * jobs_epfd only ticks while at least one deadline is armed. An
+ * expired job gets SIGTERM, then SIGKILL once its grace period runs
+ * out, and is reported as timed out when it is reaped.
+ **********************************************/
+
+struct deadline *wheel[WHEEL_SLOTS];
+unsigned long wheel_pos = 0;        /* slot of the current tick */
+int wheel_count = 0;                /* armed deadlines */
+int timer_fd = -1;
+
+/* parse_duration - Parse NUMBER[smhd] into *ms; -1 if malformed */
+int parse_duration(const char *s, long long *ms)
+{
+    char *end;
+    double v = strtod(s, &end);
+
+    if (end == s || v < 0 || (end[0] && (end[1] || !strchr("smhd", end[0]))))
+        return -1;
+    if (*end == 'm') v *= 60;
+    if (*end == 'h') v *= 3600;
+    if (*end == 'd') v *= 86400;
+    *ms = (long long)(v * 1000 + 0.5);
+    return 0;
+}
+
+/* wheel_tick - Start or stop the timerfd's periodic tick */
+static void wheel_tick(int on)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_value.tv_nsec = WHEEL_TICK_MS * 1000000L;
+        its.it_interval = its.it_value;
+    }
+    timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+/* init_deadlines - Create the timerfd and add it to jobs_epfd */
+void init_deadlines(void)
+{
+    struct epoll_event ev;
+
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        unix_error("timerfd_create error");
+    ev.events = EPOLLIN;
+    ev.data.u64 = TIMER_TAG;
+    if (epoll_ctl(jobs_epfd, EPOLL_CTL_ADD, timer_fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+}
+
+/* deadline_cancel - Disarm d if it is armed */
+void deadline_cancel(struct deadline *d)
+{
+    if (d->slot < 0)
+        return;
+    if (d->prev != NULL)
+        d->prev->next = d->next;
+    else
+        wheel[d->slot] = d->next;
+    if (d->next != NULL)
+        d->next->prev = d->prev;
+    d->slot = -1;
+    if (--wheel_count == 0)
+        wheel_tick(0);
+}
+
+/* deadline_arm - (Re)arm d to fire ms from now */
+void deadline_arm(struct deadline *d, long long ms)
+{
+    unsigned long ticks = ms <= 0 ? 1 : (unsigned long)((ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS);
+
+    deadline_cancel(d);
+    d->slot = (wheel_pos + ticks) % WHEEL_SLOTS;
+    d->rounds = (ticks - 1) / WHEEL_SLOTS;
+    d->prev = NULL;
+    d->next = wheel[d->slot];
+    if (d->next != NULL)
+        d->next->prev = d;
+    wheel[d->slot] = d;
+    if (wheel_count++ == 0)
+        wheel_tick(1);
+}
+
+/* deadline_fire - Escalate the job that owns an expired deadline */
+static void deadline_fire(struct deadline *d)
+{
+    struct job_t *job = (struct job_t *)((char *)d - offsetof(struct job_t, dl));
+
+    if (job->pid == 0)
+        return;
+    if (!job->timed_out) {
+        job->timed_out = 1;
+        kill(-job->pid, SIGTERM);
+        if (job->state == ST)
+            kill(-job->pid, SIGCONT);   /* a stopped job cannot act on TERM */
+        deadline_arm(d, job->grace_ms);
+    }
+    else {
+        kill(-job->pid, SIGKILL);
+    }
+}
+
+/* wheel_advance - Handle the ticks that passed since the last call */
+void wheel_advance(void)
+{
+    uint64_t n;
+
+    if (read(timer_fd, &n, sizeof(n)) != sizeof(n))
+        return;
+    while (n-- > 0 && wheel_count > 0) {
+        struct deadline *d, *next;
+
+        wheel_pos = (wheel_pos + 1) % WHEEL_SLOTS;
+        for (d = wheel[wheel_pos]; d != NULL; d = next) {
+            next = d->next;
+            if (d->rounds > 0) {
+                d->rounds--;
+                continue;
+            }
+            deadline_cancel(d);
+            deadline_fire(d);
+        }
+    }
+}
+
+/* job_deadline - Give job a deadline of ms (0 for none) and a grace period */
+void job_deadline(struct job_t *job, long long ms, long long grace_ms)
+{
+    job->limit_ms = ms;
+    job->grace_ms = grace_ms;
+    job->timed_out = 0;
+    if (ms > 0)
+        deadline_arm(&job->dl, ms);
+    else
+        deadline_cancel(&job->dl);
+}
+
+/*
+ * builtin_timeout - timeout [-k GRACE] DURATION command [args] [&]
+ *    runs a job with a deadline. timeout -d [DURATION] [-k GRACE]
+ *    shows or sets the deadline every job of this session gets.
+ */
+int builtin_timeout(char **argv, int bg, char *cmdline, struct launch_opts *lo)
+{
+    long long ms, grace = default_grace_ms;
+    int i = 1, set_default = 0;
+
+    while (argv[i] != NULL && argv[i][0] == '-') {
+        if (strcmp(argv[i], "-d") == 0) {
+            set_default = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-k") == 0 && argv[i + 1] != NULL) {
+            if (parse_duration(argv[i + 1], &grace) < 0) {
+                printf("timeout: invalid time interval '%s'\n", argv[i + 1]);
+                return 125;
+            }
+            i += 2;
+        }
+        else {
+            break;
+        }
+    }
+
+    if (set_default) {
+        if (argv[i] == NULL) {
+            if (default_timeout_ms > 0)
+                printf("timeout: %gs, then %gs to exit after SIGTERM\n",
+                       default_timeout_ms / 1000.0, default_grace_ms / 1000.0);
+            else
+                printf("timeout: no default\n");
+            return 0;
+        }
+        if (parse_duration(argv[i], &ms) < 0) {
+            printf("timeout: invalid time interval '%s'\n", argv[i]);
+            return 125;
+        }
+        default_timeout_ms = ms;
+        default_grace_ms = grace;
+        return 0;
+    }
+
+    if (argv[i] == NULL || argv[i + 1] == NULL) {
+        printf("usage: timeout [-k GRACE] DURATION command [args] [&]\n");
+        printf("       timeout -d [DURATION] [-k GRACE]\n");
+        return 125;
+    }
+    if (parse_duration(argv[i], &ms) < 0) {
+        printf("timeout: invalid time interval '%s'\n", argv[i]);
+        return 125;
+    }
+    if (is_builtin(argv[i + 1]) && !fast_builtin_name(argv[i + 1])) {
+        printf("timeout: cannot time out the builtin %s\n", argv[i + 1]);
+        return 125;
+    }
+
+    run_job(argv + i + 1, bg, cmdline, ms, grace, lo);
+    return last_status;
+}
+/**********************************************
+ * end job deadlines
+ **********************************************/
+
+/***********************************************
+ * Fork-free builtins
+ *
+ * echo, true, false, test/[, printf, sleep and cd run inside the
+ * shell. Their output and exit status follow the coreutils tools
+ * they replace; the status is left in last_status.
+ **********************************************/
+
+/* put_escape - Print the backslash escape at *s; returns chars consumed,
+ *    or -1 for \c (stop all output) */
+static int put_escape(const char *s, int octal_needs_zero)
+{
+    int n = 0, v = 0, max;
+
+    switch (s[0]) {
+    case 'a': putchar('\a'); return 1;
+    case 'b': putchar('\b'); return 1;
+    case 'c': return -1;
+    case 'e': putchar(27); return 1;
+    case 'f': putchar('\f'); return 1;
+    case 'n': putchar('\n'); return 1;
+    case 'r': putchar('\r'); return 1;
+    case 't': putchar('\t'); return 1;
+    case 'v': putchar('\v'); return 1;
+    case '\\': putchar('\\'); return 1;
+    case 'x':
+        while (n < 2 && isxdigit((unsigned char)s[1 + n])) {
+            char c = s[1 + n];
+            v = v * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+            n++;
+        }
+        if (n == 0) {
+            putchar('\\');
+            return 0;
+        }
+        putchar(v);
+        return 1 + n;
+    case '0': case '1': case '2': case '3':
+    case '4': case '5': case '6': case '7':
+        /* echo wants \0NNN; printf takes \NNN */
+        if (octal_needs_zero && s[0] != '0') {
+            putchar('\\');
+            return 0;
+        }
+        if (octal_needs_zero)
+            s++;
+        max = 3;
+        while (n < max && s[n] >= '0' && s[n] <= '7') {
+            v = v * 8 + (s[n] - '0');
+            n++;
+        }
+        putchar(v & 0xff);
+        return n + (octal_needs_zero ? 1 : 0);
+    default:
+        putchar('\\');
+        return 0;
+    }
+}
+
+/* builtin_echo - echo [-neE] [string ...] */
+static int builtin_echo(char **argv)
+{
+    int newline = 1, escapes = 0, i = 1, j;
+
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        for (j = 1; argv[i][j] != '\0'; j++)
+            if (strchr("neE", argv[i][j]) == NULL)
+                break;
+        if (argv[i][j] != '\0')
+            break;              /* not an option: print it */
+        for (j = 1; argv[i][j] != '\0'; j++) {
+            if (argv[i][j] == 'n')
+                newline = 0;
+            else
+                escapes = (argv[i][j] == 'e');
+        }
+    }
+
+    for (; argv[i] != NULL; i++) {
+        const char *p = argv[i];
+        while (*p) {
+            if (escapes && *p == '\\' && p[1] != '\0') {
+                int used = put_escape(p + 1, 1);
+                if (used < 0)
+                    return 0;
+                p += 1 + used;
+            }
+            else {
+                putchar(*p++);
+            }
+        }
+        if (argv[i + 1] != NULL)
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+
+/* printf_number - Parse a printf numeric argument; sets *bad on junk */
+static long long printf_number(const char *s, int *bad)
+{
+    char *end;
+    long long v;
+
+    if (s == NULL)
+        return 0;
+    if (s[0] == '\'' || s[0] == '"')
+        return (unsigned char)s[1];
+    errno = 0;
+    v = strtoll(s, &end, 0);
+    if (*s == '\0' || *end != '\0' || errno != 0) {
+        printf("printf: '%s': expected a numeric value\n", s);
+        *bad = 1;
+    }
+    return v;
+}
+
+/* printf_double - Parse a printf floating point argument */
+static double printf_double(const char *s, int *bad)
+{
+    char *end;
+    double v;
+
+    if (s == NULL)
+        return 0;
+    if (s[0] == '\'' || s[0] == '"')
+        return (unsigned char)s[1];
+    v = strtod(s, &end);
+    if (*s == '\0' || *end != '\0') {
+        printf("printf: '%s': expected a numeric value\n", s);
+        *bad = 1;
+    }
+    return v;
+}
+
+/*
+ * builtin_printf - printf FORMAT [argument ...]. The format is reused
+ *    until every argument has been consumed.
+ */
+static int builtin_printf(char **argv)
+{
+    char **args;
+    int bad = 0;
+
+    if (argv[1] == NULL) {
+        printf("printf: missing operand\n");
+        return 1;
+    }
+    args = argv + 2;
+
+    do {
+        char **start = args;
+        const char *f = argv[1];
+
+        while (*f) {
+            char spec[64], conv;
+            int n = 0, used, room = sizeof(spec) - 4;   /* "ll", conv, NUL */
+
+            if (*f == '\\') {
+                if (f[1] == '\0') {
+                    putchar(*f++);
+                    continue;
+                }
+                used = put_escape(f + 1, 0);
+                if (used < 0)
+                    return bad;
+                f += 1 + used;
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f++);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar('%');
+                f += 2;
+                continue;
+            }
+
+            /* copy %[flags][width][.precision] into spec; n == room: too long */
+            spec[n++] = *f++;
+            while (*f && strchr("-+ #0", *f) && n < room)
+                spec[n++] = *f++;
+            if (*f == '*' && n < room) {
+                n += snprintf(spec + n, room - n, "%d", (int)printf_number(*args, &bad));
+                if (n > room)
+                    n = room;
+                if (*args) args++;
+                f++;
+            }
+            while (isdigit((unsigned char)*f) && n < room)
+                spec[n++] = *f++;
+            if (*f == '.' && n < room) {
+                spec[n++] = *f++;
+                if (*f == '*' && n < room) {
+                    n += snprintf(spec + n, room - n, "%d", (int)printf_number(*args, &bad));
+                    if (n > room)
+                        n = room;
+                    if (*args) args++;
+                    f++;
+                }
+                while (isdigit((unsigned char)*f) && n < room)
+                    spec[n++] = *f++;
+            }
+            if (n >= room) {
+                printf("printf: format specification too long\n");
+                return 1;
+            }
+            conv = *f ? *f++ : '\0';
+
+            switch (conv) {
+            case 'd': case 'i':
+                spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+                printf(spec, printf_number(*args, &bad));
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+                printf(spec, (unsigned long long)printf_number(*args, &bad));
+                break;
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                spec[n++] = conv; spec[n] = '\0';
+                printf(spec, printf_double(*args, &bad));
+                break;
+            case 'c':
+                spec[n++] = 'c'; spec[n] = '\0';
+                printf(spec, *args ? (*args)[0] : '\0');
+                break;
+            case 's':
+                spec[n++] = 's'; spec[n] = '\0';
+                printf(spec, *args ? *args : "");
+                break;
+            case 'b': {
+                const char *p = *args ? *args : "";
+                while (*p) {
+                    if (*p == '\\' && p[1] != '\0') {
+                        used = put_escape(p + 1, 1);
+                        if (used < 0)
+                            return bad;
+                        p += 1 + used;
+                    }
+                    else {
+                        putchar(*p++);
+                    }
+                }
+                break;
+            }
+            default:
+                printf("printf: %%%c: invalid conversion specification\n", conv);
+                return 1;
+            }
+            if (*args)
+                args++;
+        }
+        if (args == start)      /* format consumed no arguments */
+            break;
+    } while (*args);
+
+    return bad;
+}
+
+/* test_unary - Evaluate a unary test primary */
+static int test_unary(const char *op, const char *arg)
+{
+    struct stat sb;
+
+    switch (op[1]) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 't': return isatty(atoi(arg));
+    case 'L': case 'h': return lstat(arg, &sb) == 0 && S_ISLNK(sb.st_mode);
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    }
+    if (stat(arg, &sb) < 0)
+        return 0;
+    switch (op[1]) {
+    case 'e': return 1;
+    case 'f': return S_ISREG(sb.st_mode);
+    case 'd': return S_ISDIR(sb.st_mode);
+    case 'b': return S_ISBLK(sb.st_mode);
+    case 'c': return S_ISCHR(sb.st_mode);
+    case 'p': return S_ISFIFO(sb.st_mode);
+    case 'S': return S_ISSOCK(sb.st_mode);
+    case 's': return sb.st_size > 0;
+    case 'g': return (sb.st_mode & S_ISGID) != 0;
+    case 'u': return (sb.st_mode & S_ISUID) != 0;
+    case 'k': return (sb.st_mode & S_ISVTX) != 0;
+    }
+    return 0;
+}
+
+/* test_is_unary - Is s one of the unary primaries? */
+static int test_is_unary(const char *s)
+{
+    return s[0] == '-' && s[1] != '\0' && s[2] == '\0'
+        && strchr("nztLhrwxefdbcpSsguk", s[1]) != NULL;
+}
+
+/* test_is_binary - Is s one of the binary primaries? */
+static int test_is_binary(const char *s)
+{
+    static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt",
+        "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+    int i;
+
+    for (i = 0; ops[i] != NULL; i++)
+        if (strcmp(s, ops[i]) == 0)
+            return 1;
+    return 0;
+}
+
+/* test_integer - Parse an integer operand, flagging errors */
+static long long test_integer(const char *s, int *err)
+{
+    char *end;
+    long long v;
+
+    while (isspace((unsigned char)*s))
+        s++;
+    errno = 0;
+    v = strtoll(s, &end, 10);
+    while (isspace((unsigned char)*end))
+        end++;
+    if (*s == '\0' || *end != '\0' || errno != 0) {
+        printf("test: invalid integer '%s'\n", s);
+        *err = 1;
+    }
+    return v;
+}
+
+/* test_binary - Evaluate a binary test primary */
+static int test_binary(const char *a, const char *op, const char *b, int *err)
+{
+    struct stat sa, sb;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        int ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e')
+            return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if (op[1] == 'n')
+            return ha && (!hb || sa.st_mtime > sb.st_mtime);
+        return hb && (!ha || sa.st_mtime < sb.st_mtime);
+    }
+    {
+        long long x = test_integer(a, err), y = test_integer(b, err);
+        if (strcmp(op, "-eq") == 0) return x == y;
+        if (strcmp(op, "-ne") == 0) return x != y;
+        if (strcmp(op, "-lt") == 0) return x < y;
+        if (strcmp(op, "-le") == 0) return x <= y;
+        if (strcmp(op, "-gt") == 0) return x > y;
+        return x >= y;
+    }
+}
+
+static int test_or(char **av, int *pos, int argc, int *err);
+
+/* test_primary - primary: ! primary | ( expr ) | unary | binary | string */
+static int test_primary(char **av, int *pos, int argc, int *err)
+{
+    int left = argc - *pos;
+    int r;
+
+    if (left <= 0) {
+        printf("test: argument expected\n");
+        *err = 1;
+        return 0;
+    }
+    if (strcmp(av[*pos], "!") == 0 && left > 1) {
+        (*pos)++;
+        return !test_primary(av, pos, argc, err);
+    }
+    if (strcmp(av[*pos], "(") == 0 && left > 1) {
+        (*pos)++;
+        r = test_or(av, pos, argc, err);
+        if (*pos >= argc || strcmp(av[*pos], ")") != 0) {
+            printf("test: ')' expected\n");
+            *err = 1;
+            return 0;
+        }
+        (*pos)++;
+        return r;
+    }
+    if (left >= 3 && test_is_binary(av[*pos + 1])) {
+        r = test_binary(av[*pos], av[*pos + 1], av[*pos + 2], err);
+        *pos += 3;
+        return r;
+    }
+    if (left >= 2 && test_is_unary(av[*pos])) {
+        r = test_unary(av[*pos], av[*pos + 1]);
+        *pos += 2;
+        return r;
+    }
+    return av[(*pos)++][0] != '\0';
+}
+
+/* test_and - and_expr: primary [-a and_expr] */
+static int test_and(char **av, int *pos, int argc, int *err)
+{
+    int r = test_primary(av, pos, argc, err);
+
+    while (*pos < argc && strcmp(av[*pos], "-a") == 0) {
+        (*pos)++;
+        r = test_primary(av, pos, argc, err) && r;
+    }
+    return r;
+}
+
+/* test_or - expr: and_expr [-o expr] */
+static int test_or(char **av, int *pos, int argc, int *err)
+{
+    int r = test_and(av, pos, argc, err);
+
+    while (*pos < argc && strcmp(av[*pos], "-o") == 0) {
+        (*pos)++;
+        r = test_and(av, pos, argc, err) || r;
+    }
+    return r;
+}
+
+/*
+ * builtin_test - test EXPRESSION, or [ EXPRESSION ]. Returns 0 for
+ *    true, 1 for false and 2 for a malformed expression.
+ */
+static int builtin_test(char **argv)
+{
+    int argc = 0, pos = 1, err = 0, r;
+
+    while (argv[argc] != NULL)
+        argc++;
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            printf("[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    if (argc == 1)
+        return 1;
+
+    /* POSIX fixes the meaning of the short forms */
+    if (argc == 2)
+        return argv[1][0] == '\0';
+    if (argc == 3 && strcmp(argv[1], "!") == 0)
+        return argv[2][0] != '\0';
+    if (argc == 3 && test_is_unary(argv[1]))
+        return !test_unary(argv[1], argv[2]);
+    if (argc == 4 && test_is_binary(argv[2])) {
+        r = test_binary(argv[1], argv[2], argv[3], &err);
+        return err ? 2 : !r;
+    }
+
+    r = test_or(argv, &pos, argc, &err);
+    if (!err && pos != argc) {
+        printf("test: extra argument '%s'\n", argv[pos]);
+        err = 1;
+    }
+    return err ? 2 : !r;
+}
+
+/*
+ * builtin_sleep - sleep NUMBER[smhd]... Job exits are still handled
+ *    while sleeping, and ctrl-c cuts the sleep short.
+ */
+static int builtin_sleep(char **argv)
+{
+    struct timespec start;
+    long long ms = 0, v;
+    int i;
+
+    if (argv[1] == NULL) {
+        printf("sleep: missing operand\n");
+        return 1;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        if (parse_duration(argv[i], &v) < 0) {
+            printf("sleep: invalid time interval '%s'\n", argv[i]);
+            return 1;
+        }
+        ms += v;
+    }
+
+    sigint_seen = 0;
+    prof_now(&start);
+    while (1) {
+        long long left = ms - (long long)(prof_elapsed(&start) / 1000000);
+        if (sigint_seen)
+            return 130;
+        if (left <= 0)
+            return 0;
+        if (jobs_epfd < 0) {            /* running as a background job */
+            struct timespec ts = { left / 1000, (left % 1000) * 1000000 };
+            nanosleep(&ts, NULL);
+        }
+        else {
+            job_events(left > INT32_MAX ? INT32_MAX : (int)left);
+        }
+    }
+}
+
+/* builtin_cd - cd [dir | -], defaulting to $HOME */
+static int builtin_cd(char **argv)
+{
+    char *dir = argv[1];
+    char old[MAXLINE], cwd[MAXLINE];
+
+    if (dir == NULL && (dir = env_get("HOME")) == NULL) {
+        printf("cd: HOME not set\n");
+        return 1;
+    }
+    if (strcmp(dir, "-") == 0) {
+        if ((dir = env_get("OLDPWD")) == NULL) {
+            printf("cd: OLDPWD not set\n");
+            return 1;
+        }
+        printf("%s\n", dir);
+    }
+
+    if (getcwd(old, sizeof(old)) == NULL)
+        old[0] = '\0';
+    if (chdir(dir) < 0) {
+        printf("cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    if (old[0] != '\0')
+        env_set("OLDPWD", old, 0);
+    if (getcwd(cwd, sizeof(cwd)) != NULL)
+        env_set("PWD", cwd, 0);
+    return 0;
+}
+
+/* fast_builtin_name - Is name one of the fork-free builtins? */
+int fast_builtin_name(char *name)
+{
+    static char *names[] = {
+        "echo", "true", "false", "test", "[", "printf", "sleep", "cd", NULL
+    };
+    int i;
+
+    for (i = 0; names[i] != NULL; i++)
+        if (strcmp(name, names[i]) == 0)
+            return 1;
+    return 0;
+}
+
+/* fast_builtin - Run one of the fork-free builtins; -1 if name is not one */
+int fast_builtin(char **argv)
+{
+    char *name = argv[0];
+
+    if (!fast_builtin_name(name))
+        return -1;
+    if (strcmp(name, "echo") == 0)
+        return builtin_echo(argv);
+    if (strcmp(name, "true") == 0)
+        return 0;
+    if (strcmp(name, "false") == 0)
+        return 1;
+    if (strcmp(name, "printf") == 0)
+        return builtin_printf(argv);
+    if (strcmp(name, "sleep") == 0)
+        return builtin_sleep(argv);
+    if (strcmp(name, "cd") == 0)
+        return builtin_cd(argv);
+    return builtin_test(argv);      /* test or [ */
+}
+/**********************************************
+ * end fork-free builtins
+ **********************************************/
+
+/***********************************************
+ * Environment variables
+ *
+ * The shell keeps its variables in a hash table loaded from environ
+ * at startup. export, unset and NAME=value lines change the table;
+ * the envp handed to execve is an array of pointers to the exported
+ * entries, rebuilt only after an exported variable has changed, so
+ * spawns in between all share it. NAME=value words in front of a
+ * command apply to that command alone: the child puts them ahead of
+ * the cached array's other entries, skipping the names they replace,
+ * which copies pointers but no strings. export NAME on an unset name
+ * keeps a valueless entry that only remembers the flag, so a later
+ * NAME=value is exported.
+ **********************************************/
+
+#define ENV_BUCKETS 256
+
+struct envvar {
+    char *entry;                /* "NAME=value", or "NAME" if not set yet */
+    size_t name_len;
+    int exported;
+    struct envvar *next;        /* hash chain */
+};
+
+static struct envvar *env_table[ENV_BUCKETS];
+static char **env_vec;          /* exported entries, NULL terminated */
+static size_t env_exported;
+static int env_dirty = 1;       /* env_vec is out of date */
+unsigned long env_gen;          /* bumped whenever env_vec is rebuilt */
+
+/* env_hash - FNV-1a of the len byte name */
+static unsigned env_hash(const char *name, size_t len)
+{
+    unsigned h = 2166136261u;
+
+    while (len-- > 0)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h % ENV_BUCKETS;
+}
+
+/* env_valid - Are the len bytes at s a variable name? */
+static int env_valid(const char *s, size_t len)
+{
+    size_t i;
+
+    if (len == 0 || isdigit((unsigned char)s[0]))
+        return 0;
+    for (i = 0; i < len; i++)
+        if (!isalnum((unsigned char)s[i]) && s[i] != '_')
+            return 0;
+    return 1;
+}
+
+/* env_name_len - Length of the NAME in a NAME=value word, 0 if it is not one */
+size_t env_name_len(const char *word)
+{
+    size_t n = strcspn(word, "=");
+
+    return word[n] == '=' && env_valid(word, n) ? n : 0;
+}
+
+/* env_isset - Does v have a value (and not only an export flag)? */
+static int env_isset(const struct envvar *v)
+{
+    return v->entry[v->name_len] == '=';
+}
+
+/* env_find - The variable named by the first len bytes of name */
+static struct envvar *env_find(const char *name, size_t len)
+{
+    struct envvar *v;
+
+    for (v = env_table[env_hash(name, len)]; v != NULL; v = v->next)
+        if (v->name_len == len && memcmp(v->entry, name, len) == 0)
+            return v;
+    return NULL;
+}
+
+/*
+ * env_put - Set a variable from a NAME=value word. export above 0
+ *    exports it; otherwise it keeps its old export flag, or export's
+ *    if it is new. A bare NAME only records the flag.
+ */
+static void env_put(const char *word, int export)
+{
+    size_t len = strcspn(word, "=");
+    struct envvar *v = env_find(word, len);
+    char *entry;
+    int was = v != NULL && v->exported && env_isset(v), now;
+
+    if ((entry = strdup(word)) == NULL)
+        unix_error("strdup error");
+    if (v == NULL) {
+        unsigned b = env_hash(word, len);
+
+        if ((v = calloc(1, sizeof(*v))) == NULL)
+            unix_error("calloc error");
+        v->name_len = len;
+        v->next = env_table[b];
+        env_table[b] = v;
+    }
+    else {
+        free(v->entry);
+    }
+    v->entry = entry;
+    if (export > 0)
+        v->exported = 1;
+    now = v->exported && env_isset(v);
+    env_exported += now - was;
+    if (was || now)
+        env_dirty = 1;
+}
+
+/* env_init - Load the table from environ, every entry exported */
+void env_init(void)
+{
+    char **e;
+
+    for (e = environ; *e != NULL; e++)
+        if (strchr(*e, '=') != NULL)
+            env_put(*e, 1);
+}
+
+/* env_get - The value of name, NULL if it is not set */
+char *env_get(const char *name)
+{
+    struct envvar *v = env_find(name, strlen(name));
+
+    return v != NULL && env_isset(v) ? v->entry + v->name_len + 1 : NULL;
+}
+
+/* env_set - Set name to value, exported if it was or export is set */
+void env_set(const char *name, const char *value, int export)
+{
+    size_t len = strlen(name);
+    char *word = malloc(len + strlen(value) + 2);
+
+    if (word == NULL)
+        unix_error("malloc error");
+    memcpy(word, name, len);
+    word[len] = '=';
+    strcpy(word + len + 1, value);
+    env_put(word, export);
+    free(word);
+}
+
+/* env_unset - Remove name from the table */
+static void env_unset(const char *name)
+{
+    size_t len = strlen(name);
+    struct envvar **p, *v;
+
+    for (p = &env_table[env_hash(name, len)]; (v = *p) != NULL; p = &v->next) {
+        if (v->name_len == len && memcmp(v->entry, name, len) == 0) {
+            *p = v->next;
+            if (v->exported && env_isset(v)) {
+                env_exported--;
+                env_dirty = 1;
+            }
+            free(v->entry);
+            free(v);
+            return;
+        }
+    }
+}
+
+/* env_envp - The exported variables as an envp, rebuilt if they changed */
+char **env_envp(void)
+{
+    struct envvar *v;
+    size_t n = 0;
+    int b;
+
+    if (!env_dirty)
+        return env_vec;
+    if ((env_vec = realloc(env_vec, (env_exported + 1) * sizeof(char *))) == NULL)
+        unix_error("realloc error");
+    for (b = 0; b < ENV_BUCKETS; b++)
+        for (v = env_table[b]; v != NULL; v = v->next)
+            if (v->exported && env_isset(v))
+                env_vec[n++] = v->entry;
+    env_vec[n] = NULL;
+    env_dirty = 0;
+    env_gen++;
+    return env_vec;
+}
+
+/*
+ * env_layer - envp with the n NAME=value words in assign put in front
+ *    of base's entries for other names. Called in the child, where
+ *    the array is never freed.
+ */
+char **env_layer(char **base, char **assign, int n)
+{
+    char **envp;
+    size_t k = 0, i, len;
+    int j, m;
+
+    for (i = 0; base[i] != NULL; i++)
+        ;
+    if ((envp = malloc((i + n + 1) * sizeof(char *))) == NULL)
+        return base;
+    for (j = 0; j < n; j++) {
+        len = env_name_len(assign[j]);
+        for (m = j + 1; m < n; m++)         /* the last one wins */
+            if (strncmp(assign[m], assign[j], len + 1) == 0)
+                break;
+        if (m == n)
+            envp[k++] = assign[j];
+    }
+    for (i = 0; base[i] != NULL; i++) {
+        len = strcspn(base[i], "=");
+        for (j = 0; j < n; j++)
+            if (env_name_len(assign[j]) == len && memcmp(assign[j], base[i], len) == 0)
+                break;
+        if (j == n)
+            envp[k++] = base[i];
+    }
+    envp[k] = NULL;
+    return envp;
+}
+
+/* env_cmp - qsort order for export's listing */
+static int env_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * builtin_export - export [NAME[=value]...]: set and export each
+ *    NAME=value, export each NAME (once it is set, if it is not yet),
+ *    or list the exported variables when there are no arguments
+ */
+int builtin_export(char **argv)
+{
+    int i, status = 0;
+
+    if (argv[1] == NULL) {
+        char **envp = env_envp();
+        char **sorted;
+        size_t n;
+
+        for (n = 0; envp[n] != NULL; n++)
+            ;
+        if ((sorted = malloc((n + 1) * sizeof(char *))) == NULL)
+            unix_error("malloc error");
+        memcpy(sorted, envp, (n + 1) * sizeof(char *));
+        qsort(sorted, n, sizeof(char *), env_cmp);
+        for (i = 0; sorted[i] != NULL; i++)
+            printf("export %s\n", sorted[i]);
+        free(sorted);
+        return 0;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        size_t len = strcspn(argv[i], "=");
+        struct envvar *v;
+
+        if (!env_valid(argv[i], len)) {
+            printf("export: %s: not a valid name\n", argv[i]);
+            status = 1;
+        }
+        else if (argv[i][len] == '=' || (v = env_find(argv[i], len)) == NULL) {
+            env_put(argv[i], 1);
+        }
+        else if (!v->exported) {
+            v->exported = 1;
+            env_exported++;             /* only set variables are unexported */
+            env_dirty = 1;
+        }
+    }
+    return status;
+}
+
+/* builtin_unset - unset NAME...: remove each variable */
+int builtin_unset(char **argv)
+{
+    int i;
+
+    for (i = 1; argv[i] != NULL; i++)
+        env_unset(argv[i]);
+    return 0;
+}
+
+/* env_assign - A line of NAME=value words only: set shell variables */
+int env_assign(char **argv)
+{
+    int i;
+
+    for (i = 0; argv[i] != NULL; i++)
+        env_put(argv[i], 0);
+    return 0;
+}
+/**********************************************
+ * end environment variables
+ **********************************************/
+
+/***********************************************
+ * Helper routines for the state directory
+ **********************************************/
+
+/*
+ * init_paths - Build the etc/, home/ and proc/ paths under root once,
+ *    so the hot paths only append a user name or a pid.
+ */
+void init_paths(const char *root)
+{
+    char *abs;
+
+    if (root != NULL && *root != '\0') {
+        if (strlen(root) >= sizeof(root_dir) - 32)
+            app_error("root directory name too long");
+        strcpy(root_dir, root);
+    }
+    /* Anchor the root so cd does not move the shell's own state */
+    if ((abs = realpath(root_dir, NULL)) != NULL) {
+        if (strlen(abs) < sizeof(root_dir) - 32)
+            strcpy(root_dir, abs);
+        free(abs);
+    }
+    snprintf(passwd_path, sizeof(passwd_path), "%s/etc/passwd.txt", root_dir);
+    snprintf(home_path, sizeof(home_path), "%s/home/", root_dir);
+    snprintf(proc_path, sizeof(proc_path), "%s/proc/", root_dir);
+    proc_path_len = strlen(proc_path);
+}
+
+/*
+ * proc_entry - Write <root>/proc/<pid> into buf (MAXLINE bytes), with
+ *    /status appended if status_file is set. Async-signal-safe.
+ */
+char *proc_entry(char *buf, pid_t pid, int status_file)
+{
+    memcpy(buf, proc_path, proc_path_len);
+    sio_ltoa((long)pid, buf + proc_path_len, 10);
+    if (status_file)
+        strcat(buf, proc_end);
+    return buf;
+}
+
+/* create_proc_entry - Create the proc directory and status file for pid */
+void create_proc_entry(pid_t pid, pid_t ppid, pid_t pgid, char *name, char *state)
+{
+    char path[MAXLINE];
+    FILE * fp;
+
+    if (!proc_on)
+        return;
+    if (uring_ready()) {
+        uring_create(pid, ppid, pgid, name, state);
+        return;
+    }
+    mkdir(proc_entry(path, pid, 0), 0700);
+
+    fp = fopen(proc_entry(path, pid, 1), "w");
+    if (fp == NULL)
+        return;
+
+    fprintf(fp, "Name: %s\nPid: %d\nPPid: %d\nPGid: %d\nSid: %d\nSTAT: %s\nUsername: %s", name, pid, ppid, pgid, session_leader_pid, state, username);
+
+    fclose(fp);
+}
+
+/* remove_proc_entry - Remove the proc status file and directory for pid */
+void remove_proc_entry(pid_t pid)
+{
+    char path[MAXLINE];
+
+    if (!proc_on)
+        return;
+    if (uring_ready()) {
+        uring_remove(pid);
+        return;
+    }
+    remove(proc_entry(path, pid, 1));
+    rmdir(proc_entry(path, pid, 0));
+}
+/**********************************************
+ * end state directory helper routines
+ **********************************************/
+
+
+/***********************************************
+ * io_uring file I/O
+ *
+ * The proc entries are the shell's most frequent file operations: a
+ * mkdir, an open, a write and a close for every job started, and an
+ * unlink and an rmdir for every job reaped. When the kernel has
+ * io_uring (5.19 or later), the shell queues each of these sets as one
+ * linked chain and a single io_uring_enter, and the kernel's workers
+ * carry them out while the shell moves on. A new job's entry is then
+ * written by the shell after the fork instead of by the child before
+ * its exec. The open goes into a registered file slot, so the write and
+ * the close can follow it in the same chain. Each chain keeps its paths
+ * and text in one of URING_CHAINS slots until its last completion has
+ * been collected. Completions are collected whenever a chain is queued,
+ * and the shell only waits for them when every slot is busy and at
+ * exit. A pid reaped before its entry is complete gets its removal
+ * queued as soon as the entry is. Without io_uring, in children of
+ * the shell and with TSH_URING=0 the entries are written with plain
+ * system calls as before.
+ **********************************************/
+
+#define URING_CHAINS   32                   /* chains in flight */
+#define URING_ENTRIES  (4 * URING_CHAINS)   /* a chain is at most 4 requests */
+
+struct uring_chain {
+    pid_t pid;                  /* 0 if the slot is free */
+    int left;                   /* completions still to collect */
+    int create;                 /* creating the entry, not removing it */
+    int doomed;                 /* pid reaped: remove the entry once created */
+    char dir[MAXLINE];
+    char file[MAXLINE];
+    char text[MAXLINE + 256];
+};
+
+static struct {
+    int fd;                     /* the ring, or -1 for plain system calls */
+    pid_t owner;                /* children never touch the ring */
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned tail;              /* next SQE to fill */
+    struct uring_chain chain[URING_CHAINS];
+} uring = { .fd = -1 };
+
+/*
+ * uring_init - Set up the ring and its file slots, unless TSH_URING=0
+ *    or the kernel lacks them; the proc entries then stay synchronous
+ */
+void uring_init(void)
+{
+    struct io_uring_params p;
+    struct io_uring_rsrc_register files;
+    const char *env = getenv("TSH_URING");
+    size_t ring_len, sqes_len;
+    char *ring;
+    void *sqes;
+    int fd;
+
+    if (env != NULL && strcmp(env, "0") == 0)
+        return;
+    memset(&p, 0, sizeof(p));
+    if ((fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p)) < 0)
+        return;
+    ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring_len < p.sq_off.array + p.sq_entries * sizeof(unsigned))
+        ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        return;
+    }
+    ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_SQES);
+    memset(&files, 0, sizeof(files));
+    files.nr = URING_CHAINS;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (sqes == MAP_FAILED
+        || syscall(SYS_io_uring_register, fd, IORING_REGISTER_FILES2,
+                   &files, sizeof(files)) < 0) {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_len);
+        munmap(ring, ring_len);
+        close(fd);
+        return;
+    }
+
+    uring.sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(ring + p.sq_off.array);
+    uring.cq_head = (unsigned *)(ring + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    uring.sqes = sqes;
+    uring.tail = *uring.sq_tail;
+    uring.fd = fd;
+    uring.owner = getpid();
+    atexit(uring_drain);
+}
+
+/* uring_ready - True if this process writes its proc entries through the ring */
+int uring_ready(void)
+{
+    return uring.fd >= 0 && getpid() == uring.owner;
+}
+
+static void uring_unlink(struct uring_chain *c);
+
+/*
+ * uring_collect - Count the completions the kernel has posted so far.
+ *    A created entry whose pid has been reaped meanwhile gets its
+ *    removal queued in the same slot.
+ */
+static void uring_collect(void)
+{
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    int i, doomed = 0;
+
+    for (; head != tail; head++) {
+        struct uring_chain *c = &uring.chain[uring.cqes[head & *uring.cq_mask].user_data];
+
+        if (--c->left == 0 && c->doomed)
+            doomed++;
+        else if (c->left == 0)
+            c->pid = 0;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+    for (i = 0; i < URING_CHAINS && doomed > 0; i++)
+        if (uring.chain[i].doomed && uring.chain[i].left == 0) {
+            uring_unlink(&uring.chain[i]);
+            doomed--;
+        }
+}
+
+/* uring_wait - Block until at least one more completion, then collect */
+static void uring_wait(void)
+{
+    if (syscall(SYS_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+        && errno != EINTR)
+        unix_error("io_uring_enter error");
+    uring_collect();
+}
+
+/* uring_chain_get - A free chain slot for pid, waiting for one if need be */
+static struct uring_chain *uring_chain_get(pid_t pid, int create)
+{
+    int i;
+
+    for (;;) {
+        uring_collect();
+        for (i = 0; i < URING_CHAINS; i++)
+            if (uring.chain[i].pid == 0) {
+                uring.chain[i].pid = pid;
+                uring.chain[i].create = create;
+                uring.chain[i].doomed = 0;
+                uring.chain[i].left = 0;
+                return &uring.chain[i];
+            }
+        uring_wait();
+    }
+}
+
+/*
+ * uring_sqe - Fill in the next request of chain c. Every request but
+ *    the chain's last is hard linked to the next, which then runs after
+ *    it even if it failed (the mkdir of a stale entry, say).
+ */
+static struct io_uring_sqe *uring_sqe(struct uring_chain *c, int op, int last)
+{
+    unsigned i = uring.tail++ & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = AT_FDCWD;
+    sqe->flags = last ? 0 : IOSQE_IO_HARDLINK;
+    sqe->user_data = c - uring.chain;
+    uring.sq_array[i] = i;
+    c->left++;
+    return sqe;
+}
+
+/* uring_submit - Hand the requests filled in so far to the kernel */
+static void uring_submit(unsigned n)
+{
+    __atomic_store_n(uring.sq_tail, uring.tail, __ATOMIC_RELEASE);
+    while (syscall(SYS_io_uring_enter, uring.fd, n, 0, 0, NULL, 0) < 0)
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            unix_error("io_uring_enter error");
+}
+
+/* uring_unlink - Queue the chain removing the entry named in c */
+static void uring_unlink(struct uring_chain *c)
+{
+    struct io_uring_sqe *sqe;
+
+    c->create = 0;
+    c->doomed = 0;
+    sqe = uring_sqe(c, IORING_OP_UNLINKAT, 0);
+    sqe->addr = (uintptr_t)c->file;
+    sqe = uring_sqe(c, IORING_OP_UNLINKAT, 1);
+    sqe->addr = (uintptr_t)c->dir;
+    sqe->unlink_flags = AT_REMOVEDIR;
+    uring_submit(2);
+}
+
+/* uring_create - Queue the chain that writes pid's proc entry */
+void uring_create(pid_t pid, pid_t ppid, pid_t pgid, char *name, char *state)
+{
+    struct uring_chain *c = uring_chain_get(pid, 1);
+    int slot = c - uring.chain;
+    struct io_uring_sqe *sqe;
+    int len;
+
+    proc_entry(c->dir, pid, 0);
+    proc_entry(c->file, pid, 1);
+    len = snprintf(c->text, sizeof(c->text),
+                   "Name: %s\nPid: %d\nPPid: %d\nPGid: %d\nSid: %d\nSTAT: %s\nUsername: %s",
+                   name, pid, ppid, pgid, session_leader_pid, state, username);
+    if (len >= (int)sizeof(c->text))
+        len = sizeof(c->text) - 1;
+
+    sqe = uring_sqe(c, IORING_OP_MKDIRAT, 0);
+    sqe->addr = (uintptr_t)c->dir;
+    sqe->len = 0700;
+    sqe = uring_sqe(c, IORING_OP_OPENAT, 0);
+    sqe->addr = (uintptr_t)c->file;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = 0666;
+    sqe->file_index = slot + 1;
+    sqe = uring_sqe(c, IORING_OP_WRITE, 0);
+    sqe->fd = slot;
+    sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)c->text;
+    sqe->len = len;
+    sqe = uring_sqe(c, IORING_OP_CLOSE, 1);
+    sqe->fd = 0;
+    sqe->file_index = slot + 1;
+    uring_submit(4);
+}
+
+/*
+ * uring_remove - Queue the chain that removes pid's proc entry. If the
+ *    entry is still being created, the removal is left for
+ *    uring_collect to queue once that chain has finished.
+ */
+void uring_remove(pid_t pid)
+{
+    struct uring_chain *c;
+    int i;
+
+    for (i = 0; i < URING_CHAINS; i++)
+        if (uring.chain[i].pid == pid && uring.chain[i].create) {
+            uring.chain[i].doomed = 1;
+            return;
+        }
+
+    c = uring_chain_get(pid, 0);
+    proc_entry(c->file, pid, 1);
+    proc_entry(c->dir, pid, 0);
+    uring_unlink(c);
+}
+
+/*
+ * uring_drain - Wait for every queued chain (atexit), since exiting
+ *    would cancel the requests still in flight
+ */
+void uring_drain(void)
+{
+    int i;
+
+    if (!uring_ready())
+        return;
+    for (i = 0; i < URING_CHAINS; i++)
+        while (uring.chain[i].pid != 0)
+            uring_wait();
+}
+/**********************************************
+ * end io_uring file I/O
+ **********************************************/
+
+
+/***********************************************
+ * Shared history
+ *
+ * .tsh_history is an append-only log of command lines shared by every
+ * session of a user. A line is added with one O_APPEND write under an
+ * exclusive flock, and each session remembers how far into the file
+ * it has read, so keeping its ring of the last 10 lines current costs
+ * an fstat and a read of only the new tail. Once the file passes
+ * HIST_COMPACT bytes the writer holding the lock replaces it with its
+ * last 10 lines (temporary file plus rename); the other sessions see
+ * the new inode on their next sync and read the short file again.
+ **********************************************/
+
+#define HIST_KEEP     10                    /* lines kept by compaction */
+#define HIST_TAIL     (HIST_KEEP * MAXLINE) /* most bytes a sync reads */
+#define HIST_COMPACT  (64 * 1024)           /* compact past this size */
+
+/* hist_open - Open path for shared appends; 0 or -1 with errno set */
+int hist_open(struct histfile *h, const char *path)
+{
+    struct stat sb;
+
+    hist_close(h);
+    if ((h->fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(h->fd, &sb) < 0) {
+        hist_close(h);
+        return -1;
+    }
+    h->ino = sb.st_ino;
+    h->off = 0;
+    return 0;
+}
+
+/* hist_close - Close a history file opened with hist_open */
+void hist_close(struct histfile *h)
+{
+    if (h->fd >= 0)
+        close(h->fd);
+    h->fd = -1;
+    h->off = 0;
+}
+
+/*
+ * hist_read - Push the complete lines added since h->off. A tail longer
+ *    than HIST_TAIL is cut to its last whole lines, which are the only
+ *    ones a ring of 10 keeps anyway.
+ */
+static void hist_read(struct histfile *h, hist_push_t push, void *ctx)
+{
+    static char buf[HIST_TAIL + 1];
+    char line[MAXLINE];
+    struct stat sb;
+    off_t start;
+    ssize_t n;
+    char *p, *nl, *end;
+    int cut = 0;
+
+    if (fstat(h->fd, &sb) < 0)
+        return;
+    if (sb.st_size < h->off)            /* truncated under us */
+        h->off = 0;
+    if (sb.st_size == h->off)
+        return;
+
+    start = h->off;
+    if (sb.st_size - start > HIST_TAIL) {
+        start = sb.st_size - HIST_TAIL - 1;     /* one byte before the cut */
+        cut = 1;
+    }
+    if ((n = pread(h->fd, buf, sb.st_size - start, start)) <= 0)
+        return;
+    p = buf;
+    end = buf + n;
+    if (cut && (nl = memchr(p, '\n', n)) != NULL)
+        p = nl + 1;                     /* drop the partial line */
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        size_t len = nl - p + 1;
+
+        if (len > MAXLINE - 1)
+            len = MAXLINE - 1;
+        memcpy(line, p, len);
+        line[len] = '\0';
+        push(ctx, line);
+        p = nl + 1;
+    }
+    h->off = start + (p - buf);         /* a torn last line waits */
+}
+
+/* hist_current - Reopen h if path was replaced by a compaction */
+static void hist_current(struct histfile *h, const char *path)
+{
+    struct stat sb;
+
+    if (stat(path, &sb) == 0 && (h->fd < 0 || sb.st_ino != h->ino))
+        hist_open(h, path);
+}
+
+/* hist_sync - Bring the ring up to date with the shared file */
+void hist_sync(struct histfile *h, const char *path, hist_push_t push, void *ctx)
+{
+    hist_current(h, path);
+    if (h->fd >= 0)
+        hist_read(h, push, ctx);
+}
+
+/*
+ * hist_compact - Replace path with its last HIST_KEEP lines. Called
+ *    with the flock held on the old file, so no append is lost.
+ */
+static void hist_compact(struct histfile *h, const char *path)
+{
+    static char buf[HIST_TAIL];
+    char tmp[MAXLINE + 16];
+    struct stat sb;
+    off_t start;
+    ssize_t n;
+    int fd, k = 0;
+    char *p;
+
+    if (fstat(h->fd, &sb) < 0)
+        return;
+    start = sb.st_size > HIST_TAIL ? sb.st_size - HIST_TAIL : 0;
+    if ((n = pread(h->fd, buf, sb.st_size - start, start)) <= 0)
+        return;
+    for (p = buf + n - 1; p > buf; p--)     /* back over HIST_KEEP lines */
+        if (p[-1] == '\n' && ++k == HIST_KEEP)
+            break;
+    if (p == buf && start > 0 && (p = memchr(buf, '\n', n)) != NULL)
+        p++;                                /* never keep a cut line */
+    if (p == NULL)
+        return;
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0)
+        return;
+    fchmod(fd, sb.st_mode & 07777);
+    if (rio_writen(fd, p, buf + n - p) < 0 || close(fd) < 0
+        || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return;
+    }
+    /* our lock stays on the old inode until the caller drops it */
+}
+
+/*
+ * hist_append - Add line to the shared file, then sync the ring (which
+ *    also pushes line itself, in the order the appends landed).
+ */
+void hist_append(struct histfile *h, const char *path, const char *line,
+                 hist_push_t push, void *ctx)
+{
+    char rec[MAXLINE + 1];
+    size_t len = strlen(line);
+    struct stat sb;
+    int fd, tries;
+
+    if (len > MAXLINE - 1)
+        len = MAXLINE - 1;
+    memcpy(rec, line, len);
+    if (len == 0 || rec[len - 1] != '\n')
+        rec[len++] = '\n';
+
+    /* Lock the file that is still at path; a compaction may have won */
+    for (tries = 0; ; tries++) {
+        hist_current(h, path);
+        if (h->fd < 0)
+            return;
+        if (flock(h->fd, LOCK_EX) < 0)
+            return;
+        if (tries == 8 || (stat(path, &sb) == 0 && sb.st_ino == h->ino))
+            break;
+        flock(h->fd, LOCK_UN);
+    }
+
+    rio_writen(h->fd, rec, len);
+    hist_read(h, push, ctx);
+    if (h->off > HIST_COMPACT) {
+        fd = h->fd;
+        hist_compact(h, path);
+        h->fd = -1;                     /* reopen, keeping the old lock */
+        hist_open(h, path);
+        if (h->fd >= 0 && fstat(h->fd, &sb) == 0)
+            h->off = sb.st_size;        /* the ring already has these */
+        flock(fd, LOCK_UN);
+        close(fd);
+        return;
+    }
+    flock(h->fd, LOCK_UN);
+}
+/**********************************************
+ * end shared history
+ **********************************************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->pidfd = -1;
+    job->dl.slot = -1;
+    job->limit_ms = 0;
+    job->timed_out = 0;
+    job->nsubs = 0;
+    job->main_done = 0;
+    job->quser = NULL;
+    job->cache = NULL;
+    job->cmdline[0] = '\0';
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct job_t *jobs) {
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+	clearjob(&jobs[i]);
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(struct job_t *jobs) 
+{
+    int i, max=0;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].jid > max)
+	    max = jobs[i].jid;
+    return max;
+}
+
+/* addjob - Add a job to the job list */
+int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
+{
+    int i;
+    
+    if (pid < 1)
+	return 0;
+
+    for (i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].pid == 0) {
+            jobs[i].pid = pid;
+            jobs[i].state = state;
+            jobs[i].jid = nextjid++;
+            if (nextjid > MAXJOBS)
+            nextjid = 1;
+            strcpy(jobs[i].cmdline, cmdline);
+            if (job_watch(&jobs[i]) < 0 && verbose)   /* reap_stops polls it */
+                printf("pidfd_open: %s; job %d is polled\n", strerror(errno), pid);
+            if(verbose){
+                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+            }
+                return 1;
+        }
+    }
+    printf("Tried to create too many jobs\n");
+    return 0;
+}
+
+/* deletejob - Delete a job whose PID=pid from the job list */
+int deletejob(struct job_t *jobs, pid_t pid) 
+{
+    int i;
+
+    if (pid < 1)
+	return 0;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid == pid) {
+	    if (jobs[i].pidfd >= 0)
+		close(jobs[i].pidfd);   /* also leaves jobs_epfd */
+	    while (jobs[i].nsubs > 0)
+		close(jobs[i].subfd[--jobs[i].nsubs]);
+	    deadline_cancel(&jobs[i].dl);
+	    clearjob(&jobs[i]);
+	    nextjid = maxjid(jobs)+1;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/* jobs_full - Return true if every job slot is in use */
+int jobs_full(struct job_t *jobs)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid == 0)
+	    return 0;
+    return 1;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct job_t *jobs) {
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].state == FG)
+	    return jobs[i].pid;
+    return 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
+    int i;
+
+    if (pid < 1)
+	return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid == pid)
+	    return &jobs[i];
+    return NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct job_t *jobs, int jid) 
+{
+    int i;
+
+    if (jid < 1)
+	return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].jid == jid)
+	    return &jobs[i];
+    return NULL;
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) 
+{
+    int i;
+
+    if (pid < 1)
+	return 0;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid == pid) {
+            return jobs[i].jid;
+        }
+    return 0;
+}
+
+/* listjobs - Print the job list */
+void listjobs(struct job_t *jobs) 
+{
+    // for (int i =0; i < MAXJOBS; i++) {
+    //     printf("%d\n", jobs[i].pid);
+    // }
+    int i;
+    
+    for (i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].pid != 0) {
+            int k;
+
+            printf("[%d] (%d", jobs[i].jid, jobs[i].pid);
+            for (k = 0; k < jobs[i].nsubs; k++)     /* <(...), >(...) */
+                printf(" %d", jobs[i].subs[k]);
+            printf(") ");
+            switch (jobs[i].state) {
+            case BG: 
+                printf("Running ");
+                break;
+            case FG: 
+                printf("Foreground ");
+                break;
+            case ST: 
+                printf("Stopped ");
+                break;
+            default:
+                printf("listjobs: Internal error: job[%d].state=%d ", 
+                i, jobs[i].state);
+            }
+            printf("%s", jobs[i].cmdline);
+	    }
+    }
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+
+/***********************************************
+ * Credential index
+ *
+ * passwd.txt parsed once into a chained hash table keyed by user
+ * name. cred_refresh reloads it only when the file's mtime or size
+ * changes, so adduser from another shell is picked up.
+ **********************************************/
+
+/* cred_hash - FNV-1a hash of a user name */
+static unsigned long cred_hash(const char *s)
+{
+    unsigned long h = 1469598103934665603UL;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* cred_free - Release every entry in the credential index */
+static void cred_free(void)
+{
+    size_t i;
+    struct cred_t *c, *next;
+
+    for (i = 0; i < cred_nbuckets; i++) {
+        for (c = cred_table[i]; c != NULL; c = next) {
+            next = c->next;
+            free(c);
+        }
+    }
+    free(cred_table);
+    cred_table = NULL;
+    cred_nbuckets = 0;
+    cred_count = 0;
+}
+
+/* cred_add - Insert name/password; returns 0 if name is already present */
+int cred_add(const char *name, const char *password)
+{
+    size_t nlen = strlen(name), plen = strlen(password);
+    unsigned long b;
+    struct cred_t *c;
+
+    if (cred_lookup(name) != NULL)
+        return 0;
+
+    if (cred_count >= cred_nbuckets) {    /* keep the load factor <= 1 */
+        size_t nb = cred_nbuckets ? cred_nbuckets * 2 : 64, i;
+        struct cred_t **nt = calloc(nb, sizeof(*nt));
+
+        if (nt == NULL)
+            unix_error("calloc error");
+        for (i = 0; i < cred_nbuckets; i++) {
+            struct cred_t *next;
+            for (c = cred_table[i]; c != NULL; c = next) {
+                next = c->next;
+                b = cred_hash(c->name) & (nb - 1);
+                c->next = nt[b];
+                nt[b] = c;
+            }
+        }
+        free(cred_table);
+        cred_table = nt;
+        cred_nbuckets = nb;
+    }
+
+    /* name and password share one allocation with the entry */
+    if ((c = malloc(sizeof(*c) + nlen + plen + 2)) == NULL)
+        unix_error("malloc error");
+    c->name = (char *)(c + 1);
+    c->password = c->name + nlen + 1;
+    memcpy(c->name, name, nlen + 1);
+    memcpy(c->password, password, plen + 1);
+
+    b = cred_hash(name) & (cred_nbuckets - 1);
+    c->next = cred_table[b];
+    cred_table[b] = c;
+    cred_count++;
+    return 1;
+}
+
+/* cred_lookup - Find the entry for name, NULL if there is none */
+struct cred_t *cred_lookup(const char *name)
+{
+    struct cred_t *c;
+
+    if (cred_nbuckets == 0)
+        return NULL;
+    for (c = cred_table[cred_hash(name) & (cred_nbuckets - 1)]; c != NULL; c = c->next)
+        if (strcmp(c->name, name) == 0)
+            return c;
+    return NULL;
+}
+
+/* cred_refresh - (Re)load passwd.txt if it changed since the last load */
+int cred_refresh(void)
+{
+    struct stat sb;
+    FILE * fp;
+    char *line = NULL;
+    size_t size = 0;
+
+    if (stat(passwd_path, &sb) < 0)
+        return -1;
+    if (cred_table != NULL && sb.st_mtime == cred_mtime && sb.st_size == cred_size)
+        return 0;
+
+    if ((fp = fopen(passwd_path, "r")) == NULL)
+        return -1;
+    cred_free();
+    while (getline(&line, &size, fp) != -1) {
+        char * name = strtok(line, ":\n");
+        char * password = strtok(NULL, ":\n");
+        if (name != NULL && password != NULL)
+            cred_add(name, password);
+    }
+    free(line);
+    fclose(fp);
+
+    cred_mtime = sb.st_mtime;
+    cred_size = sb.st_size;
+    return 0;
+}
+
+/* user_name_ok - Can name be a user (and a directory under home/)? */
+static int user_name_ok(const char *name)
+{
+    const char *p;
+
+    if (*name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return 0;
+    for (p = name; *p; p++)
+        if (*p == ':' || *p == '/' || isspace((unsigned char)*p))
+            return 0;
+    return 1;
+}
+
+/*
+ * passwd_lock - Open passwd.txt and take an exclusive flock on it for
+ *    adduser. add_user_batch replaces the file by rename, so a lock
+ *    won on a file that has since been replaced is given up and taken
+ *    again. Returns the descriptor holding the lock, or -1.
+ */
+int passwd_lock(void)
+{
+    struct stat held, now;
+    int fd;
+
+    while (1) {
+        if ((fd = open(passwd_path, O_RDONLY | O_CLOEXEC)) < 0)
+            return -1;
+        if (flock(fd, LOCK_EX) < 0) {
+            close(fd);
+            return -1;
+        }
+        if (fstat(fd, &held) == 0 && stat(passwd_path, &now) == 0
+            && held.st_ino == now.st_ino && held.st_dev == now.st_dev)
+            return fd;
+        close(fd);
+    }
+}
+
+/*
+ * add_user_batch - adduser --batch FILE: add every name:password line
+ *    of FILE at once. All names are checked against the credential
+ *    index (and each other) first; one bad line rejects the whole
+ *    batch. Home directories are made next, relative to one home/
+ *    descriptor, and then passwd.txt is replaced in a single rename of
+ *    a fully written temporary file, so a crash leaves either the old
+ *    or the new file. passwd_lock is held throughout. Returns the
+ *    number of users added, or -1.
+ */
+int add_user_batch(const char *file)
+{
+    char tmp[MAXLINE + 16], *line = NULL, *out = NULL, *old = NULL;
+    size_t size = 0, len = 0, cap = 0, oldlen = 0;
+    int lineno = 0, nadd = 0, bad = 0, fd = -1, hfd = -1, lfd, dfd, i;
+    struct stat sb;
+    FILE *fp;
+    char **users = NULL;                /* names, owned by the index */
+    size_t ucap = 0;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        printf("adduser: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    if ((lfd = passwd_lock()) < 0) {
+        printf("adduser: %s: %s\n", passwd_path, strerror(errno));
+        fclose(fp);
+        return -1;
+    }
+    cred_free();                        /* force a reload from disk */
+    if (cred_refresh() < 0) {
+        printf("adduser: %s: %s\n", passwd_path, strerror(errno));
+        fclose(fp);
+        close(lfd);
+        return -1;
+    }
+
+    /* Validate everything and build the lines to append */
+    while (getline(&line, &size, fp) != -1) {
+        char *name, *password, *nl;
+        size_t need;
+
+        lineno++;
+        if ((nl = strchr(line, '\n')) != NULL)
+            *nl = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        name = line;
+        if ((password = strchr(line, ':')) == NULL || password[1] == '\0'
+            || strchr(password + 1, ':') != NULL) {
+            printf("adduser: %s:%d: expected name:password\n", file, lineno);
+            bad++;
+            continue;
+        }
+        *password++ = '\0';
+        if (!user_name_ok(name)) {
+            printf("adduser: %s:%d: invalid user name '%s'\n", file, lineno, name);
+            bad++;
+            continue;
+        }
+        if (!cred_add(name, password)) {
+            printf("adduser: %s:%d: user %s already exists\n", file, lineno, name);
+            bad++;
+            continue;
+        }
+
+        need = len + 2 * strlen(name) + strlen(password) + 16;
+        while (need > cap) {
+            cap = cap ? cap * 2 : 65536;
+            if ((out = realloc(out, cap)) == NULL)
+                unix_error("realloc error");
+        }
+        len += sprintf(out + len, "\n%s:%s:/home/%s", name, password, name);
+        if ((size_t)nadd == ucap) {
+            ucap = ucap ? ucap * 2 : 1024;
+            if ((users = realloc(users, ucap * sizeof(*users))) == NULL)
+                unix_error("realloc error");
+        }
+        users[nadd++] = cred_lookup(name)->name;
+    }
+    free(line);
+    fclose(fp);
+
+    if (bad > 0 || nadd == 0) {
+        if (bad > 0)
+            printf("No users added.\n");
+        cred_free();                    /* drop the rejected names */
+        close(lfd);
+        free(out);
+        free(users);
+        return bad > 0 ? -1 : 0;
+    }
+
+    /* Home directories first: a user is only visible once it has one */
+    if ((hfd = open(home_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        printf("adduser: %s: %s\n", home_path, strerror(errno));
+        goto fail;
+    }
+    for (i = 0; i < nadd; i++) {
+        char hist[MAXLINE];
+        int h;
+
+        if (mkdirat(hfd, users[i], 0700) < 0 && errno != EEXIST) {
+            printf("adduser: %s%s: %s\n", home_path, users[i], strerror(errno));
+            goto fail;
+        }
+        snprintf(hist, sizeof(hist), "%s%s", users[i], file_end);
+        h = openat(hfd, hist, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (h < 0 && errno != EEXIST) {     /* an old home keeps its history */
+            printf("adduser: %s%s: %s\n", home_path, hist, strerror(errno));
+            goto fail;
+        }
+        if (h >= 0)
+            close(h);
+    }
+
+    /* Old contents plus the new lines into a temporary file, then rename */
+    if (fstat(lfd, &sb) < 0) {
+        printf("adduser: %s: %s\n", passwd_path, strerror(errno));
+        goto fail;
+    }
+    if ((old = malloc(sb.st_size + 1)) == NULL)
+        unix_error("malloc error");
+    if (rio_readn(lfd, old, sb.st_size) < 0) {
+        printf("adduser: %s: %s\n", passwd_path, strerror(errno));
+        goto fail;
+    }
+    oldlen = sb.st_size;
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", passwd_path);
+    if ((fd = mkstemp(tmp)) < 0) {
+        printf("adduser: %s: %s\n", tmp, strerror(errno));
+        goto fail;
+    }
+    fchmod(fd, sb.st_mode & 07777);
+    if (rio_writen(fd, old, oldlen) < 0
+        || rio_writen(fd, out + (oldlen == 0), len - (oldlen == 0)) < 0
+        || fsync(fd) < 0 || close(fd) < 0) {
+        printf("adduser: %s: %s\n", tmp, strerror(errno));
+        fd = -1;
+        unlink(tmp);
+        goto fail;
+    }
+    fd = -1;
+    if (rename(tmp, passwd_path) < 0) {
+        printf("adduser: %s: %s\n", passwd_path, strerror(errno));
+        unlink(tmp);
+        goto fail;
+    }
+    snprintf(tmp, sizeof(tmp), "%s/etc", root_dir);
+    if ((dfd = open(tmp, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        fsync(dfd);                     /* make the rename itself durable */
+        close(dfd);
+    }
+
+    close(lfd);                         /* waiters retry on the new file */
+    close(hfd);
+    free(old);
+    free(out);
+    free(users);
+    cred_refresh();
+    printf("Added %d users.\n", nadd);
+    return nadd;
+
+ fail:
+    if (fd >= 0)
+        close(fd);
+    if (hfd >= 0)
+        close(hfd);
+    close(lfd);
+    free(old);
+    free(out);
+    free(users);
+    cred_free();
+    printf("No users added.\n");
+    return -1;
+}
+/**********************************************
+ * end credential index
+ **********************************************/
+
+
+/***********************************************
+ * Command statistics and prefetch
+ *
+ * Each user has a table of the commands they run, how often, and
+ * which commands tend to follow which (the STAT_SUCC most common
+ * successors of each). It is loaded from <home>/.tsh_stats at login
+ * and saved back at exit. After each command, if one successor has
+ * followed it at least PREFETCH_MIN times and at least half the time,
+ * its binary and the shared libraries it needs (DT_NEEDED, read from
+ * the ELF dynamic section once and cached) get posix_fadvise
+ * WILLNEED. This runs from read_cmdline once the prompt is up and no
+ * input is waiting; typed-ahead input skips it, so the next command
+ * is never held up. The kernel then reads the files in while the user
+ * types, so the exec that follows finds them in the page cache. Each
+ * binary is prefetched at most once per PREFETCH_INTERVAL_MS, and
+ * files past PREFETCH_MAX_BYTES in total are left alone.
+ * TSH_PREFETCH=0 keeps the statistics but turns the prefetch off.
+ **********************************************/
+
+#define STAT_BUCKETS          256
+#define STAT_MAX              4096      /* commands tracked per user */
+#define STAT_SUCC             4         /* successors kept per command */
+#define PREFETCH_MIN          2
+#define PREFETCH_INTERVAL_MS  1000
+#define PREFETCH_MAX_LIBS     64
+#define PREFETCH_MAX_BYTES    (256LL << 20)
+#define PREFETCH_CHUNK        (2 << 20)
+
+struct cmdstat {
+    char *name;
+    unsigned long count;
+    struct {
+        struct cmdstat *to;
+        unsigned long n;
+    } succ[STAT_SUCC];
+    char *path;                 /* binary the libs below belong to */
+    char **libs;                /* its shared libraries, resolved */
+    int nlibs;
+    long long last_ms;          /* last prefetch */
+    struct cmdstat *next;       /* hash chain */
+};
+
+static struct cmdstat *stat_table[STAT_BUCKETS];
+static struct cmdstat *stat_prev;       /* the command run before */
+static int stat_count;
+static pid_t stat_owner;
+static char stats_path[2 * MAXLINE];
+static int prefetch_on = 1;
+static struct cmdstat *prefetch_next;   /* for prefetch_idle */
+
+/* stat_get - The entry for name, created if create is set */
+static struct cmdstat *stat_get(const char *name, int create)
+{
+    unsigned long b = cred_hash(name) & (STAT_BUCKETS - 1);
+    struct cmdstat *c;
+
+    for (c = stat_table[b]; c != NULL; c = c->next)
+        if (strcmp(c->name, name) == 0)
+            return c;
+    if (!create || stat_count >= STAT_MAX)
+        return NULL;
+    if ((c = calloc(1, sizeof(*c))) == NULL || (c->name = strdup(name)) == NULL)
+        unix_error("malloc error");
+    c->next = stat_table[b];
+    stat_table[b] = c;
+    stat_count++;
+    return c;
+}
+
+/* stat_follow - Count n more runs of to right after from */
+static void stat_follow(struct cmdstat *from, struct cmdstat *to, unsigned long n)
+{
+    int i, min = 0;
+
+    for (i = 0; i < STAT_SUCC; i++) {
+        if (from->succ[i].to == to) {
+            from->succ[i].n += n;
+            return;
+        }
+        if (from->succ[i].n < from->succ[min].n)
+            min = i;
+    }
+    from->succ[min].to = to;            /* evict the rarest successor */
+    from->succ[min].n = n;
+}
+
+/* mono_ms - Monotonic clock in milliseconds */
+static long long mono_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * elf_needed - Append the DT_NEEDED names of the ELF file at path to
+ *    names (at most max in all), and its RPATH/RUNPATH to rpath.
+ *    Returns the new count; files that are not native ELF add nothing.
+ */
+static int elf_needed(const char *path, char **names, int n, int max,
+                      char *rpath, size_t rlen)
+{
+    Elf64_Ehdr eh;
+    Elf64_Phdr ph[64];
+    Elf64_Dyn dyn[512];
+    Elf64_Off dyn_off = 0;
+    Elf64_Xword dyn_size = 0;
+    Elf64_Addr strtab = 0;
+    Elf64_Xword strsz = 0;
+    char *str = NULL;
+    ssize_t r;
+    int fd, i, nph, ndyn;
+    off_t str_off = -1;
+
+    rpath[0] = '\0';
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return n;
+    if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh)
+        || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0
+        || eh.e_ident[EI_CLASS] != ELFCLASS64
+        || eh.e_phentsize != sizeof(Elf64_Phdr))
+        goto done;
+    nph = eh.e_phnum < 64 ? eh.e_phnum : 64;
+    if (pread(fd, ph, nph * sizeof(Elf64_Phdr), eh.e_phoff) != (ssize_t)(nph * sizeof(Elf64_Phdr)))
+        goto done;
+    for (i = 0; i < nph; i++)
+        if (ph[i].p_type == PT_DYNAMIC) {
+            dyn_off = ph[i].p_offset;
+            dyn_size = ph[i].p_filesz;
+        }
+    if (dyn_size == 0)
+        goto done;                      /* static */
+    if (dyn_size > sizeof(dyn))
+        dyn_size = sizeof(dyn);
+    if ((r = pread(fd, dyn, dyn_size, dyn_off)) <= 0)
+        goto done;
+    ndyn = r / sizeof(Elf64_Dyn);
+
+    for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+        if (dyn[i].d_tag == DT_STRTAB)
+            strtab = dyn[i].d_un.d_ptr;
+        else if (dyn[i].d_tag == DT_STRSZ)
+            strsz = dyn[i].d_un.d_val;
+    }
+    for (i = 0; i < nph; i++)           /* string table address to offset */
+        if (ph[i].p_type == PT_LOAD && strtab >= ph[i].p_vaddr
+            && strtab < ph[i].p_vaddr + ph[i].p_filesz)
+            str_off = strtab - ph[i].p_vaddr + ph[i].p_offset;
+    if (str_off < 0 || strsz == 0 || strsz > (1 << 20))
+        goto done;
+    if ((str = malloc(strsz + 1)) == NULL)
+        unix_error("malloc error");
+    if (pread(fd, str, strsz, str_off) != (ssize_t)strsz)
+        goto done;
+    str[strsz] = '\0';
+
+    for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+        Elf64_Xword v = dyn[i].d_un.d_val;
+
+        if (v >= strsz)
+            continue;
+        if (dyn[i].d_tag == DT_NEEDED && n < max) {
+            if ((names[n++] = strdup(str + v)) == NULL)
+                unix_error("strdup error");
+        }
+        else if (dyn[i].d_tag == DT_RUNPATH || dyn[i].d_tag == DT_RPATH)
+            snprintf(rpath, rlen, "%s", str + v);
+    }
+ done:
+    free(str);
+    close(fd);
+    return n;
+}
+
+/* lib_find - Resolve a DT_NEEDED name the way ld.so would, roughly */
+static char *lib_find(const char *lib, const char *rpath, const char *origin)
+{
+    static const char *sys[] = {
+        "/lib64", "/usr/lib64", "/lib/x86_64-linux-gnu",
+        "/usr/lib/x86_64-linux-gnu", "/lib/aarch64-linux-gnu",
+        "/usr/lib/aarch64-linux-gnu", "/lib", "/usr/lib", NULL
+    };
+    const char *lists[2] = { rpath, getenv("LD_LIBRARY_PATH") };
+    char buf[3 * MAXLINE], dir[2 * MAXLINE];
+    int i;
+
+    if (strchr(lib, '/') != NULL)
+        return access(lib, R_OK) == 0 ? strdup(lib) : NULL;
+    for (i = 0; i < 2; i++) {
+        const char *p = lists[i];
+
+        while (p != NULL && *p) {
+            size_t len = strcspn(p, ":");
+
+            if (len >= 7 && strncmp(p, "$ORIGIN", 7) == 0)
+                snprintf(dir, sizeof(dir), "%s%.*s", origin, (int)len - 7, p + 7);
+            else
+                snprintf(dir, sizeof(dir), "%.*s", (int)len, p);
+            snprintf(buf, sizeof(buf), "%s/%s", dir, lib);
+            if (access(buf, R_OK) == 0)
+                return strdup(buf);
+            p += len + (p[len] == ':');
+        }
+    }
+    for (i = 0; sys[i] != NULL; i++) {
+        snprintf(buf, sizeof(buf), "%s/%s", sys[i], lib);
+        if (access(buf, R_OK) == 0)
+            return strdup(buf);
+    }
+    return NULL;
+}
+
+/*
+ * stat_libs - Work out c->libs for the binary at path: its DT_NEEDED
+ *    libraries and theirs, each resolved to a file once.
+ */
+static void stat_libs(struct cmdstat *c, const char *path)
+{
+    char *names[PREFETCH_MAX_LIBS], rpath[MAXLINE], origin[MAXLINE];
+    int n, i, j, k;
+
+    for (i = 0; i < c->nlibs; i++)
+        free(c->libs[i]);
+    free(c->libs);
+    free(c->path);
+    c->libs = calloc(PREFETCH_MAX_LIBS, sizeof(char *));
+    c->path = strdup(path);
+    if (c->libs == NULL || c->path == NULL)
+        unix_error("malloc error");
+    c->nlibs = 0;
+
+    /* breadth first from the binary; c->libs doubles as the queue */
+    for (k = -1; k < c->nlibs; k++) {
+        const char *file = k < 0 ? path : c->libs[k];
+        char *slash;
+
+        snprintf(origin, sizeof(origin), "%s", file);
+        if ((slash = strrchr(origin, '/')) != NULL)
+            *slash = '\0';
+        n = elf_needed(file, names, 0, PREFETCH_MAX_LIBS, rpath, sizeof(rpath));
+        for (i = 0; i < n; i++) {
+            char *lib = c->nlibs < PREFETCH_MAX_LIBS
+                ? lib_find(names[i], rpath, origin) : NULL;
+
+            for (j = 0; lib != NULL && j < c->nlibs; j++)
+                if (strcmp(c->libs[j], lib) == 0) {
+                    free(lib);
+                    lib = NULL;
+                }
+            if (lib != NULL)
+                c->libs[c->nlibs++] = lib;
+            free(names[i]);
+        }
+    }
+}
+
+/*
+ * prefetch_file - Ask the kernel to read path into the page cache. One
+ *    WILLNEED covers at most the device's readahead window, so large
+ *    files are advised PREFETCH_CHUNK bytes at a time.
+ */
+static long long prefetch_file(const char *path, long long budget)
+{
+    struct stat sb;
+    off_t off;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size <= budget) {
+        for (off = 0; off < sb.st_size; off += PREFETCH_CHUNK)
+            posix_fadvise(fd, off, PREFETCH_CHUNK, POSIX_FADV_WILLNEED);
+    }
+    else {
+        sb.st_size = 0;
+    }
+    close(fd);
+    return sb.st_size;
+}
+
+/*
+ * prefetch_cmd - Prefetch the binary c->name runs, and its libraries.
+ *    Like execve in launch_job, a relative name is taken from the cwd.
+ */
+static void prefetch_cmd(struct cmdstat *c)
+{
+    long long now = mono_ms(), budget = PREFETCH_MAX_BYTES;
+    char *path;
+    int i;
+
+    if (now - c->last_ms < PREFETCH_INTERVAL_MS || is_builtin(c->name)
+        || strcmp(c->name, "timeout") == 0)
+        return;
+    c->last_ms = now;
+    if ((path = realpath(c->name, NULL)) == NULL)
+        return;
+
+    if (c->path == NULL || strcmp(c->path, path) != 0)
+        stat_libs(c, path);
+    budget -= prefetch_file(path, budget);
+    for (i = 0; i < c->nlibs && budget > 0; i++)
+        budget -= prefetch_file(c->libs[i], budget);
+    free(path);
+}
+
+/* prefetch_pending - Is there a prefetch waiting for the shell to be idle? */
+int prefetch_pending(void)
+{
+    return prefetch_next != NULL;
+}
+
+/* prefetch_idle - Run the waiting prefetch; read_cmdline calls it when idle */
+void prefetch_idle(void)
+{
+    struct cmdstat *c = prefetch_next;
+
+    prefetch_next = NULL;
+    if (c != NULL)
+        prefetch_cmd(c);
+}
+
+/*
+ * stats_observe - Count a run of name after the previous command and
+ *    note the command most likely to come next for prefetch_idle.
+ */
+void stats_observe(const char *name)
+{
+    struct cmdstat *c, *best = NULL;
+    unsigned long total = 0, most = 0;
+    int i;
+
+    if (stats_path[0] == '\0' || name[0] == '!' || strchr(name, '\t') != NULL)
+        return;
+    if ((c = stat_get(name, 1)) == NULL)
+        return;
+    c->count++;
+    if (stat_prev != NULL)
+        stat_follow(stat_prev, c, 1);
+    stat_prev = c;
+
+    prefetch_next = NULL;
+    if (!prefetch_on)
+        return;
+    for (i = 0; i < STAT_SUCC; i++) {
+        total += c->succ[i].n;
+        if (c->succ[i].n > most) {
+            most = c->succ[i].n;
+            best = c->succ[i].to;
+        }
+    }
+    if (best != NULL && most >= PREFETCH_MIN && most * 2 >= total)
+        prefetch_next = best;
+}
+
+/*
+ * stats_load - Read the user's .tsh_stats. Each line is a count and a
+ *    command name, then pairs of successor count and name, all split
+ *    by tabs.
+ */
+void stats_load(void)
+{
+    char *line = NULL, *tok, *save;
+    size_t size = 0;
+    FILE *fp;
+    const char *env = getenv("TSH_PREFETCH");
+
+    prefetch_on = env == NULL || strcmp(env, "0") != 0;
+    snprintf(stats_path, sizeof(stats_path), "%s%s/.tsh_stats", home_path, username);
+    if (stat_owner == 0) {
+        stat_owner = getpid();
+        atexit(stats_save);
+    }
+    stat_prev = NULL;
+    if ((fp = fopen(stats_path, "r")) == NULL)
+        return;
+    while (getline(&line, &size, fp) != -1) {
+        struct cmdstat *c;
+        unsigned long n;
+
+        if ((tok = strtok_r(line, "\t\n", &save)) == NULL)
+            continue;
+        n = strtoul(tok, NULL, 10);
+        if ((tok = strtok_r(NULL, "\t\n", &save)) == NULL
+            || (c = stat_get(tok, 1)) == NULL)
+            continue;
+        c->count = n;
+        while ((tok = strtok_r(NULL, "\t\n", &save)) != NULL) {
+            struct cmdstat *to;
+
+            n = strtoul(tok, NULL, 10);
+            if ((tok = strtok_r(NULL, "\t\n", &save)) == NULL)
+                break;
+            if ((to = stat_get(tok, 1)) != NULL)
+                stat_follow(c, to, n);
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+/* stats_save - Write .tsh_stats back (temporary file plus rename) */
+void stats_save(void)
+{
+    char tmp[2 * MAXLINE + 16];
+    struct cmdstat *c;
+    FILE *fp;
+    int fd, b, i;
+
+    if (getpid() != stat_owner || stats_path[0] == '\0' || stat_count == 0)
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", stats_path);
+    if ((fd = mkstemp(tmp)) < 0)
+        return;
+    if ((fp = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    for (b = 0; b < STAT_BUCKETS; b++) {
+        for (c = stat_table[b]; c != NULL; c = c->next) {
+            fprintf(fp, "%lu\t%s", c->count, c->name);
+            for (i = 0; i < STAT_SUCC; i++)
+                if (c->succ[i].to != NULL)
+                    fprintf(fp, "\t%lu\t%s", c->succ[i].n, c->succ[i].to->name);
+            fputc('\n', fp);
+        }
+    }
+    if (fclose(fp) != 0 || rename(tmp, stats_path) < 0)
+        unlink(tmp);
+}
+/**********************************************
+ * end command statistics and prefetch
+ **********************************************/
+
+/***********************************************
+ * Audit log
+ *
+ * Every command the shell runs is recorded with the user, the pid,
+ * start and end times (CLOCK_REALTIME, ns) and the exit status.
+ * Builtins are recorded when they return and jobs when they are
+ * reaped, so a background job shows up at the time it finishes.
+ * Records collect in a buffer of AUDIT_BLOCK bytes; a full buffer,
+ * one older than AUDIT_FLUSH_MS (checked per record and by the event
+ * loops while idle), exit, SIGHUP, SIGTERM and the audit builtin
+ * write it to <root>/etc/audit.log as one block compressed with a small LZ77
+ * coder (LZ4's sequence layout, stored raw if that does not help).
+ * The block is appended under flock together with an entry in
+ * <root>/etc/audit.idx holding its offset, its time range and a
+ * 64-bit bloom filter of its users, so a query reads the index and
+ * then only the blocks that can match. TSH_AUDIT=0 turns logging off.
+ **********************************************/
+
+#define AUDIT_BLOCK      65536          /* raw bytes per block */
+#define AUDIT_FLUSH_MS   1000           /* at most this much lost to SIGKILL */
+#define AUDIT_MAGIC      0x31445541     /* "AUD1" */
+#define LZ_HASH_BITS     12
+#define LZ_MINMATCH      4
+#define LZ_BOUND(n)      ((n) + (n) / 255 + 16)
+
+struct audit_rec {              /* followed by the user and the command */
+    int64_t start_ns;
+    int64_t end_ns;
+    int32_t pid;
+    int32_t status;
+    uint16_t user_len;
+    uint16_t cmd_len;
+};
+
+struct audit_block {            /* block header in audit.log */
+    uint32_t magic;
+    uint32_t raw_len;
+    uint32_t comp_len;          /* == raw_len: stored uncompressed */
+    uint32_t nrec;
+    int64_t min_ns, max_ns;     /* range of the start times */
+    uint64_t bloom;             /* users in the block */
+};
+
+struct audit_ent {              /* one line of audit.idx */
+    uint64_t off;               /* of the block header */
+    uint32_t comp_len;
+    uint32_t nrec;
+    int64_t min_ns, max_ns;
+    uint64_t bloom;
+};
+
+static char audit_log_path[MAXLINE + 16];
+static char audit_idx_path[MAXLINE + 16];
+static unsigned char audit_buf[AUDIT_BLOCK];
+static size_t audit_len;
+static struct audit_block audit_cur;    /* header of the buffered block */
+static long long audit_first_ms;        /* when the buffer was started */
+static pid_t audit_owner;
+static int audit_on;
+static volatile sig_atomic_t audit_busy;    /* buffer being changed */
+static volatile sig_atomic_t audit_killed;  /* fatal signal held off meanwhile */
+
+/* audit_leave - End a change to the buffer; die of a signal held off during it */
+static void audit_leave(void)
+{
+    int sig;
+
+    if (--audit_busy == 0 && (sig = audit_killed) != 0) {
+        audit_killed = 0;
+        audit_fatal(sig);
+    }
+}
+
+/*
+ * audit_fatal - Write the buffer and die of sig with its default
+ *    action. Called from a handler; if the buffer is being changed,
+ *    the signal is held until that is done.
+ */
+void audit_fatal(int sig)
+{
+    if (audit_busy) {
+        audit_killed = sig;
+        return;
+    }
+    audit_flush();
+    Signal(sig, SIG_DFL);
+    raise(sig);                 /* delivered once the handler returns */
+}
+
+/* audit_now - CLOCK_REALTIME in nanoseconds */
+long long audit_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* audit_bloom - The two bloom bits of user */
+static uint64_t audit_bloom(const char *user)
+{
+    unsigned long h = cred_hash(user);
+
+    return (1ULL << (h & 63)) | (1ULL << ((h >> 6) & 63));
+}
+
+/* lz_compress - Compress n bytes of src into dst (LZ_BOUND(n) bytes) */
+static size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst)
+{
+    uint32_t table[1 << LZ_HASH_BITS];  /* position + 1, 0 if none */
+    size_t ip = 0, anchor = 0, op = 0, lit, len;
+
+    memset(table, 0, sizeof(table));
+    while (ip + LZ_MINMATCH <= n) {
+        uint32_t seq, h;
+        size_t ref;
+
+        memcpy(&seq, src + ip, 4);
+        h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        ref = table[h];
+        table[h] = ip + 1;
+        if (ref-- == 0 || ip - ref > 65535 || memcmp(src + ref, src + ip, 4) != 0) {
+            ip++;
+            continue;
+        }
+        for (len = LZ_MINMATCH; ip + len < n && src[ref + len] == src[ip + len]; len++)
+            ;
+        lit = ip - anchor;
+        dst[op++] = (lit < 15 ? lit : 15) << 4 | (len - 4 < 15 ? len - 4 : 15);
+        if (lit >= 15) {
+            size_t l;
+            for (l = lit - 15; l >= 255; l -= 255)
+                dst[op++] = 255;
+            dst[op++] = l;
+        }
+        memcpy(dst + op, src + anchor, lit);
+        op += lit;
+        dst[op++] = (ip - ref) & 0xff;
+        dst[op++] = (ip - ref) >> 8;
+        if (len - 4 >= 15) {
+            size_t l;
+            for (l = len - 4 - 15; l >= 255; l -= 255)
+                dst[op++] = 255;
+            dst[op++] = l;
+        }
+        ip += len;
+        anchor = ip;
+    }
+    lit = n - anchor;                   /* the last sequence has no match */
+    dst[op++] = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15) {
+        size_t l;
+        for (l = lit - 15; l >= 255; l -= 255)
+            dst[op++] = 255;
+        dst[op++] = l;
+    }
+    memcpy(dst + op, src + anchor, lit);
+    return op + lit;
+}
+
+/* lz_decompress - Inverse of lz_compress; -1 unless it yields exactly n bytes */
+static int lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t n)
+{
+    const unsigned char *end = src + len;
+    size_t op = 0;
+
+    while (src < end) {
+        size_t lit = *src >> 4, mlen = (*src & 15) + 4, off;
+        unsigned char b;
+
+        src++;
+        if (lit == 15)
+            do {
+                if (src >= end)
+                    return -1;
+                lit += (b = *src++);
+            } while (b == 255);
+        if ((size_t)(end - src) < lit || n - op < lit)
+            return -1;
+        memcpy(dst + op, src, lit);
+        src += lit;
+        op += lit;
+        if (src == end)
+            break;
+        if (end - src < 2)
+            return -1;
+        off = src[0] | src[1] << 8;
+        src += 2;
+        if (mlen == 19)
+            do {
+                if (src >= end)
+                    return -1;
+                mlen += (b = *src++);
+            } while (b == 255);
+        if (off == 0 || off > op || n - op < mlen)
+            return -1;
+        for (; mlen > 0; mlen--, op++)      /* may overlap itself */
+            dst[op] = dst[op - off];
+    }
+    return op == n ? 0 : -1;
+}
+
+/*
+ * audit_repair - Index blocks that made it into audit.log without an
+ *    entry in audit.idx (a writer died between the two). The caller
+ *    holds the lock; end is the size of audit.log.
+ */
+static void audit_repair(int fd, int ifd, off_t end)
+{
+    struct audit_ent e;
+    struct audit_block b;
+    struct stat st;
+    off_t off = 0;
+
+    if (fstat(ifd, &st) < 0)
+        return;
+    if (st.st_size % sizeof(e) != 0)    /* torn entry */
+        ftruncate(ifd, st.st_size - st.st_size % sizeof(e));
+    if (st.st_size >= (off_t)sizeof(e)
+        && pread(ifd, &e, sizeof(e), st.st_size - st.st_size % sizeof(e) - sizeof(e)) == sizeof(e))
+        off = e.off + sizeof(b) + e.comp_len;
+    while (off + (off_t)sizeof(b) <= end
+           && pread(fd, &b, sizeof(b), off) == sizeof(b) && b.magic == AUDIT_MAGIC
+           && off + (off_t)sizeof(b) + b.comp_len <= end) {
+        e.off = off;
+        e.comp_len = b.comp_len;
+        e.nrec = b.nrec;
+        e.min_ns = b.min_ns;
+        e.max_ns = b.max_ns;
+        e.bloom = b.bloom;
+        if (rio_writen(ifd, &e, sizeof(e)) < 0)
+            return;
+        off += sizeof(b) + b.comp_len;
+    }
+}
+
+/* audit_flush - Write the buffered records as one block */
+void audit_flush(void)
+{
+    static unsigned char comp[LZ_BOUND(AUDIT_BLOCK)];
+    struct audit_ent e;
+    struct stat st;
+    struct iovec iov[2];
+    size_t clen;
+    int fd, ifd;
+
+    if (audit_len == 0 || getpid() != audit_owner)
+        return;
+    audit_busy++;
+    clen = lz_compress(audit_buf, audit_len, comp);
+    audit_cur.magic = AUDIT_MAGIC;
+    audit_cur.raw_len = audit_len;
+    audit_cur.comp_len = clen < audit_len ? clen : audit_len;
+    iov[0].iov_base = &audit_cur;
+    iov[0].iov_len = sizeof(audit_cur);
+    iov[1].iov_base = clen < audit_len ? comp : audit_buf;
+    iov[1].iov_len = audit_cur.comp_len;
+    audit_len = 0;
+
+    if ((fd = open(audit_log_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0) {
+        audit_leave();
+        return;
+    }
+    if ((ifd = open(audit_idx_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0) {
+        close(fd);
+        audit_leave();
+        return;
+    }
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) == 0) {
+        audit_repair(fd, ifd, st.st_size);
+        if (writev(fd, iov, 2) == (ssize_t)(iov[0].iov_len + iov[1].iov_len)) {
+            e.off = st.st_size;
+            e.comp_len = audit_cur.comp_len;
+            e.nrec = audit_cur.nrec;
+            e.min_ns = audit_cur.min_ns;
+            e.max_ns = audit_cur.max_ns;
+            e.bloom = audit_cur.bloom;
+            rio_writen(ifd, &e, sizeof(e));
+        }
+        else {
+            ftruncate(fd, st.st_size);      /* no half blocks */
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(ifd);
+    close(fd);
+    audit_leave();
+}
+
+/* audit_init - Start logging into <root>/etc, unless TSH_AUDIT=0 */
+void audit_init(void)
+{
+    const char *env = getenv("TSH_AUDIT");
+
+    audit_on = env == NULL || strcmp(env, "0") != 0;
+    snprintf(audit_log_path, sizeof(audit_log_path), "%s/etc/audit.log", root_dir);
+    snprintf(audit_idx_path, sizeof(audit_idx_path), "%s/etc/audit.idx", root_dir);
+    if (audit_owner == 0) {
+        audit_owner = getpid();
+        atexit(audit_flush);
+    }
+}
+
+/*
+ * audit_record - Log one finished command of user. start_ns is from
+ *    audit_now; cmdline may end in a newline.
+ */
+void audit_record(const char *user, pid_t pid, int status, long long start_ns,
+                  const char *cmdline)
+{
+    struct audit_rec r;
+    size_t ulen, clen;
+    long long now_ms;
+
+    if (!audit_on || user == NULL)
+        return;
+    ulen = strnlen(user, 255);
+    clen = strnlen(cmdline, MAXLINE);
+    while (clen > 0 && cmdline[clen - 1] == '\n')
+        clen--;
+    r.start_ns = start_ns;
+    r.end_ns = audit_now();
+    r.pid = pid;
+    r.status = status;
+    r.user_len = ulen;
+    r.cmd_len = clen;
+    now_ms = r.end_ns / 1000000;
+
+    audit_busy++;
+    if (audit_len + sizeof(r) + ulen + clen > AUDIT_BLOCK)
+        audit_flush();
+    if (audit_len == 0) {
+        memset(&audit_cur, 0, sizeof(audit_cur));
+        audit_cur.min_ns = INT64_MAX;
+        audit_cur.max_ns = INT64_MIN;
+        audit_first_ms = now_ms;
+    }
+    memcpy(audit_buf + audit_len, &r, sizeof(r));
+    memcpy(audit_buf + audit_len + sizeof(r), user, ulen);
+    memcpy(audit_buf + audit_len + sizeof(r) + ulen, cmdline, clen);
+    audit_len += sizeof(r) + ulen + clen;
+    audit_cur.nrec++;
+    if (start_ns < audit_cur.min_ns)
+        audit_cur.min_ns = start_ns;
+    if (start_ns > audit_cur.max_ns)
+        audit_cur.max_ns = start_ns;
+    audit_cur.bloom |= audit_bloom(user);
+    if (now_ms - audit_first_ms >= AUDIT_FLUSH_MS)
+        audit_flush();
+    audit_leave();
+}
+
+/* audit_due - Milliseconds until the buffer is due to be written, -1 if empty */
+int audit_due(void)
+{
+    long long left;
+
+    if (audit_len == 0)
+        return -1;
+    left = audit_first_ms + AUDIT_FLUSH_MS - audit_now() / 1000000;
+    return left > 0 ? left : 0;
+}
+
+/*
+ * audit_time - Parse YYYY-MM-DD[THH:MM:SS] (local time) or a duration
+ *    ago (NUMBER[smhd]) into ns; -1 if malformed
+ */
+static int audit_time(const char *s, long long *ns)
+{
+    static const char *formats[] = { "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d", NULL };
+    struct tm tm;
+    long long ms;
+    char *end;
+    int i;
+
+    for (i = 0; formats[i] != NULL; i++) {
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_isdst = -1;
+        if ((end = strptime(s, formats[i], &tm)) != NULL && *end == '\0') {
+            *ns = (long long)mktime(&tm) * 1000000000LL;
+            return 0;
+        }
+    }
+    if (parse_duration(s, &ms) < 0)
+        return -1;
+    *ns = audit_now() - ms * 1000000;
+    return 0;
+}
+
+/* audit_print - Print the records of one raw block that match */
+static void audit_print(const unsigned char *p, size_t n, const char *user,
+                        long long since, long long until)
+{
+    size_t ulen = user != NULL ? strlen(user) : 0;
+    struct audit_rec r;
+    size_t off = 0;
+
+    while (off + sizeof(r) <= n) {
+        char when[32];
+        const char *u, *cmd;
+        struct tm tm;
+        time_t t;
+
+        memcpy(&r, p + off, sizeof(r));
+        u = (const char *)p + off + sizeof(r);
+        cmd = u + r.user_len;
+        off += sizeof(r) + r.user_len + r.cmd_len;
+        if (off > n)
+            break;
+        if (r.start_ns < since || r.start_ns >= until
+            || (user != NULL && (r.user_len != ulen || memcmp(u, user, ulen) != 0)))
+            continue;
+        t = r.start_ns / 1000000000LL;
+        localtime_r(&t, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+        printf("%s %-8.*s %7d %3d %9.3fs %.*s\n", when, (int)r.user_len, u, r.pid,
+               r.status, (r.end_ns - r.start_ns) / 1e9, (int)r.cmd_len, cmd);
+    }
+}
+
+/*
+ * builtin_audit - audit [-u USER] [-s SINCE] [-e UNTIL]: print the
+ *    logged commands that started in [SINCE, UNTIL) and were run by
+ *    USER. Root only.
+ */
+int builtin_audit(char **argv)
+{
+    static unsigned char comp[LZ_BOUND(AUDIT_BLOCK)], raw[AUDIT_BLOCK];
+    long long since = INT64_MIN, until = INT64_MAX;
+    const char *user = NULL;
+    struct audit_ent *idx;
+    struct audit_block b;
+    struct stat st;
+    uint64_t mask;
+    size_t n, i;
+    int fd, ifd;
+
+    if (strcmp(username, "root") != 0) {
+        printf("root privileges required to run audit.\n");
+        return 1;
+    }
+    for (i = 1; argv[i] != NULL; i += 2) {
+        if (argv[i + 1] == NULL)
+            goto usage;
+        if (strcmp(argv[i], "-u") == 0)
+            user = argv[i + 1];
+        else if (strcmp(argv[i], "-s") == 0 && audit_time(argv[i + 1], &since) == 0)
+            ;
+        else if (strcmp(argv[i], "-e") == 0 && audit_time(argv[i + 1], &until) == 0)
+            ;
+        else
+            goto usage;
+    }
+    mask = user != NULL ? audit_bloom(user) : 0;
+    audit_flush();
+
+    if ((ifd = open(audit_idx_path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;                       /* nothing logged yet */
+    if ((fd = open(audit_log_path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(ifd, &st) < 0) {
+        printf("audit: %s\n", strerror(errno));
+        close(ifd);
+        return 1;
+    }
+    n = st.st_size / sizeof(*idx);
+    idx = n > 0 ? mmap(NULL, n * sizeof(*idx), PROT_READ, MAP_PRIVATE, ifd, 0) : NULL;
+    if (idx == MAP_FAILED)
+        n = 0;
+    for (i = 0; i < n; i++) {
+        struct audit_ent *e = &idx[i];
+
+        if (e->max_ns < since || e->min_ns >= until || (e->bloom & mask) != mask)
+            continue;
+        if (e->comp_len > sizeof(comp)
+            || pread(fd, &b, sizeof(b), e->off) != sizeof(b) || b.magic != AUDIT_MAGIC
+            || b.raw_len > sizeof(raw) || b.comp_len != e->comp_len
+            || pread(fd, comp, b.comp_len, e->off + sizeof(b)) != b.comp_len
+            || (b.comp_len == b.raw_len ? (memcpy(raw, comp, b.raw_len), 0)
+                : lz_decompress(comp, b.comp_len, raw, b.raw_len)) < 0) {
+            printf("audit: block at %llu is damaged\n", (unsigned long long)e->off);
+            continue;
+        }
+        audit_print(raw, b.raw_len, user, since, until);
+    }
+    if (n > 0)
+        munmap(idx, n * sizeof(*idx));
+    close(fd);
+    close(ifd);
+    return 0;
+
+usage:
+    printf("audit: usage: audit [-u USER] [-s SINCE] [-e UNTIL]\n");
+    return 2;
+}
+/**********************************************
+ * end audit log
+ **********************************************/
+
+/***********************************************
+ * Glob expansion
+ *
+ * Unquoted words holding *, ? or [...] are replaced by the sorted
+ * paths they match, or kept as they are if nothing matches. A path
+ * component of just ** matches zero or more directories (hidden ones
+ * and symlinks excepted). Each pattern is compiled once into a list
+ * of per-component matchers; literal components are checked with a
+ * stat instead of a scan. Directories are read with getdents64 in
+ * GLOB_DENTS byte batches into a cache that lives for one command,
+ * so words sharing a prefix never scan a directory twice.
+ **********************************************/
+
+#define GLOB_DENTS    (256 * 1024)  /* getdents64 buffer */
+#define GLOB_BUCKETS  1024          /* directory cache hash buckets */
+
+#define GT_LIT   0      /* one literal character */
+#define GT_ANY   1      /* ? */
+#define GT_STAR  2      /* * */
+#define GT_SET   3      /* [...] */
+
+#define GC_LIT   0      /* literal component */
+#define GC_PAT   1      /* component with wildcards */
+#define GC_DEEP  2      /* ** */
+
+struct gtok {               /* one compiled pattern element */
+    unsigned char kind;
+    unsigned char c;        /* GT_LIT */
+    uint32_t set[8];        /* GT_SET, negation already applied */
+};
+
+struct gcomp {              /* one compiled path component */
+    int kind;
+    char *lit;              /* GC_LIT, unescaped */
+    struct gtok *tok;       /* GC_PAT */
+    int ntok;
+    int dot;                /* may match names starting with . */
+};
+
+struct gdir {               /* a scanned directory in the cache */
+    char *path;
+    char *names;            /* NUL separated */
+    uint32_t *off;          /* start of each name in names */
+    unsigned char *type;    /* d_type of each name */
+    int n;
+    struct gdir *next;      /* hash chain */
+};
+
+struct gout {               /* paths produced for one command */
+    char **v;
+    size_t n, cap;
+};
+
+struct gstate {            /* state for expanding one command line */
+    struct gdir *cache[GLOB_BUCKETS];
+    struct gout out;
+};
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* glob_magic - Does s hold an unescaped wildcard? */
+int glob_magic(const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '\\' && s[1] != '\0')
+            s++;
+        else if (*s == '*' || *s == '?' || *s == '[')
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * gcomp_compile - Compile the component s[0..n). Returns 0, or -1 if
+ *    a [ is never closed (the component is then taken literally).
+ */
+static int gcomp_compile(const char *s, size_t n, struct gcomp *gc)
+{
+    size_t i = 0, k = 0;
+
+    gc->dot = s[0] == '.' || (s[0] == '\\' && n > 1 && s[1] == '.');
+    gc->tok = malloc((n + 1) * sizeof(struct gtok));
+    gc->lit = malloc(n + 1);
+    if (gc->tok == NULL || gc->lit == NULL)
+        unix_error("malloc error");
+    gc->kind = GC_LIT;
+
+    if (n == 2 && s[0] == '*' && s[1] == '*') {
+        gc->kind = GC_DEEP;
+        return 0;
+    }
+
+    while (i < n) {
+        struct gtok *t = &gc->tok[k];
+        char c = s[i];
+
+        memset(t, 0, sizeof(*t));
+        if (c == '\\' && i + 1 < n) {
+            t->kind = GT_LIT;
+            t->c = s[i + 1];
+            i += 2;
+        }
+        else if (c == '?' || c == '*') {
+            t->kind = c == '?' ? GT_ANY : GT_STAR;
+            gc->kind = GC_PAT;
+            i++;
+            if (c == '*' && k > 0 && gc->tok[k - 1].kind == GT_STAR)
+                continue;               /* ** inside a name is * */
+        }
+        else if (c == '[') {
+            size_t j = i + 1;
+            int neg = 0, w;
+
+            if (j < n && (s[j] == '!' || s[j] == '^')) {
+                neg = 1;
+                j++;
+            }
+            if (j < n && s[j] == ']') {     /* leading ] is literal */
+                t->set[']' / 32] |= 1u << (']' % 32);
+                j++;
+            }
+            while (j < n && s[j] != ']') {
+                unsigned char lo = s[j], hi;
+                if (lo == '\\' && j + 1 < n)
+                    lo = s[++j];
+                hi = lo;
+                if (j + 2 < n && s[j + 1] == '-' && s[j + 2] != ']') {
+                    hi = s[j + 2];
+                    j += 2;
+                }
+                for (w = lo; w <= hi; w++)
+                    t->set[w / 32] |= 1u << (w % 32);
+                j++;
+            }
+            if (j >= n) {               /* unterminated: literal [ */
+                t->kind = GT_LIT;
+                t->c = '[';
+                i++;
+            }
+            else {
+                if (neg)
+                    for (w = 0; w < 8; w++)
+                        t->set[w] = ~t->set[w];
+                t->kind = GT_SET;
+                gc->kind = GC_PAT;
+                i = j + 1;
+            }
+        }
+        else {
+            t->kind = GT_LIT;
+            t->c = c;
+            i++;
+        }
+        k++;
+    }
+    gc->ntok = k;
+
+    if (gc->kind == GC_LIT) {           /* keep the unescaped text */
+        for (i = 0; i < k; i++)
+            gc->lit[i] = gc->tok[i].c;
+        gc->lit[k] = '\0';
+    }
+    return 0;
+}
+
+/* gmatch - Match name against a compiled component */
+static int gmatch(const struct gcomp *gc, const char *s)
+{
+    const struct gtok *t = gc->tok;
+    int nt = gc->ntok, ti = 0, star = -1;
+    const char *mark = NULL;
+
+    if (*s == '.' && !gc->dot)
+        return 0;
+    while (*s) {
+        if (ti < nt) {
+            unsigned char c = *s;
+            const struct gtok *k = &t[ti];
+
+            if (k->kind == GT_STAR) {
+                star = ti++;
+                mark = s;
+                continue;
+            }
+            if ((k->kind == GT_LIT && k->c == c) || k->kind == GT_ANY
+                || (k->kind == GT_SET && (k->set[c / 32] >> (c % 32) & 1))) {
+                ti++;
+                s++;
+                continue;
+            }
+        }
+        if (star < 0)
+            return 0;
+        ti = star + 1;                  /* let the last * eat one more */
+        s = ++mark;
+    }
+    while (ti < nt && t[ti].kind == GT_STAR)
+        ti++;
+    return ti == nt;
+}
+
+/* gpath - Join a directory and a name; dir "" is the cwd */
+static char *gpath(const char *dir, const char *name)
+{
+    size_t dl = strlen(dir), nl = strlen(name);
+    char *p = malloc(dl + nl + 2);
+
+    if (p == NULL)
+        unix_error("malloc error");
+    memcpy(p, dir, dl);
+    if (dl > 0 && dir[dl - 1] != '/')
+        p[dl++] = '/';
+    memcpy(p + dl, name, nl + 1);
+    return p;
+}
+
+/* gout_add - Append a path (taking ownership) */
+static void gout_add(struct gout *o, char *path)
+{
+    if (o->n == o->cap) {
+        o->cap = o->cap ? o->cap * 2 : 64;
+        if ((o->v = realloc(o->v, o->cap * sizeof(char *))) == NULL)
+            unix_error("realloc error");
+    }
+    o->v[o->n++] = path;
+}
+
+/* gscan - Entries of dir, read once per command with getdents64 */
+static struct gdir *gscan(struct gstate *g, const char *dir)
+{
+    unsigned long h = cred_hash(dir) & (GLOB_BUCKETS - 1);
+    static char *buf;
+    struct gdir *d;
+    size_t ncap = 0, cap = 0, len = 0;
+    long nread;
+    int fd;
+
+    for (d = g->cache[h]; d != NULL; d = d->next)
+        if (strcmp(d->path, dir) == 0)
+            return d;
+
+    if ((d = calloc(1, sizeof(*d))) == NULL || (d->path = strdup(dir)) == NULL)
+        unix_error("malloc error");
+    d->next = g->cache[h];
+    g->cache[h] = d;
+
+    if ((fd = open(*dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return d;
+    if (buf == NULL && (buf = malloc(GLOB_DENTS)) == NULL)
+        unix_error("malloc error");
+
+    while ((nread = syscall(SYS_getdents64, fd, buf, GLOB_DENTS)) > 0) {
+        long pos;
+        for (pos = 0; pos < nread; ) {
+            struct linux_dirent64 *e = (struct linux_dirent64 *)(buf + pos);
+            const char *nm = e->d_name;
+            size_t nl;
+
+            pos += e->d_reclen;
+            if (nm[0] == '.' && (nm[1] == '\0' || (nm[1] == '.' && nm[2] == '\0')))
+                continue;
+            nl = strlen(nm) + 1;
+            if (d->n == (int)ncap) {
+                ncap = ncap ? ncap * 2 : 64;
+                if ((d->off = realloc(d->off, ncap * sizeof(uint32_t))) == NULL
+                    || (d->type = realloc(d->type, ncap)) == NULL)
+                    unix_error("realloc error");
+            }
+            while (len + nl > cap) {
+                cap = cap ? cap * 2 : 4096;
+                if ((d->names = realloc(d->names, cap)) == NULL)
+                    unix_error("realloc error");
+            }
+            memcpy(d->names + len, nm, nl);
+            d->off[d->n] = len;
+            d->type[d->n++] = e->d_type;
+            len += nl;
+        }
+    }
+    close(fd);
+    return d;
+}
+
+/* gisdir - Is entry i of d a directory? Symlinks are followed if follow */
+static int gisdir(struct gdir *d, int i, int follow)
+{
+    struct stat sb;
+    char *p;
+    int r;
+
+    if (d->type[i] == DT_DIR)
+        return 1;
+    if (d->type[i] != DT_UNKNOWN && (d->type[i] != DT_LNK || !follow))
+        return 0;
+    p = gpath(*d->path ? d->path : ".", d->names + d->off[i]);
+    r = (follow ? stat(p, &sb) : lstat(p, &sb)) == 0 && S_ISDIR(sb.st_mode);
+    free(p);
+    return r;
+}
+
+/* gwalk - Expand components c[ci..nc) below dir into g->out */
+static void gwalk(struct gstate *g, const char *dir, struct gcomp *c, int ci, int nc)
+{
+    struct gdir *d;
+    struct stat sb;
+    char *p;
+    int i, last = ci == nc - 1;
+
+    if (ci == nc) {
+        gout_add(&g->out, strdup(dir));
+        return;
+    }
+
+    if (c[ci].kind == GC_LIT) {         /* no scan: just look it up */
+        p = gpath(dir, c[ci].lit);
+        if (last ? lstat(p, &sb) == 0 : (stat(p, &sb) == 0 && S_ISDIR(sb.st_mode))) {
+            if (last) {
+                gout_add(&g->out, p);
+                return;
+            }
+            gwalk(g, p, c, ci + 1, nc);
+        }
+        free(p);
+        return;
+    }
+
+    if (c[ci].kind == GC_DEEP) {
+        /* zero directories here, then one more level for each subdir */
+        if (!last)
+            gwalk(g, dir, c, ci + 1, nc);
+        d = gscan(g, dir);
+        for (i = 0; i < d->n; i++) {
+            const char *nm = d->names + d->off[i];
+            int isdir;
+
+            if (nm[0] == '.')
+                continue;
+            isdir = gisdir(d, i, 0);
+            p = gpath(dir, nm);
+            if (last)
+                gout_add(&g->out, strdup(p));
+            if (isdir)
+                gwalk(g, p, c, ci, nc);
+            free(p);
+        }
+        return;
+    }
+
+    d = gscan(g, dir);
+    for (i = 0; i < d->n; i++) {
+        const char *nm = d->names + d->off[i];
+
+        if (!gmatch(&c[ci], nm))
+            continue;
+        if (last) {
+            gout_add(&g->out, gpath(dir, nm));
+        }
+        else if (gisdir(d, i, 1)) {
+            p = gpath(dir, nm);
+            gwalk(g, p, c, ci + 1, nc);
+            free(p);
+        }
+    }
+}
+
+/* gcmp - qsort comparison for paths */
+static int gcmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* glob_word - Expand one word into g->out; 0 if nothing matched */
+static size_t glob_word(struct gstate *g, const char *word)
+{
+    struct gcomp comp[MAXLINE / 2];
+    size_t before = g->out.n;
+    const char *s = word, *e;
+    int nc = 0, i;
+    char *root = "";
+
+    if (*s == '/') {
+        root = "/";
+        while (*s == '/')
+            s++;
+    }
+    while (*s) {
+        e = strchr(s, '/');
+        if (e == NULL)
+            e = s + strlen(s);
+        gcomp_compile(s, e - s, &comp[nc]);
+        /* a ** after a ** adds nothing */
+        if (comp[nc].kind == GC_DEEP && nc > 0 && comp[nc - 1].kind == GC_DEEP) {
+            free(comp[nc].tok);
+            free(comp[nc].lit);
+        }
+        else {
+            nc++;
+        }
+        while (*e == '/')
+            e++;
+        s = e;
+    }
+    if (nc > 0 && s[-1] == '/') {       /* dir/ : directories only */
+        gcomp_compile("", 0, &comp[nc]);
+        nc++;
+    }
+
+    if (nc > 0)
+        gwalk(g, root, comp, 0, nc);
+    for (i = 0; i < nc; i++) {
+        free(comp[i].tok);
+        free(comp[i].lit);
+    }
+    qsort(g->out.v + before, g->out.n - before, sizeof(char *), gcmp);
+    return g->out.n - before;
+}
+
+/*
+ * glob_expand - Expand the unquoted wildcard words of argv, whose
+ *    quote flags are in quoted. Returns argv itself when no word has
+ *    a wildcard; otherwise a new vector, freed with glob_free.
+ */
+char **glob_expand(char **argv, const char *quoted, struct gstate **gp)
+{
+    struct gstate *g;
+    char **v;
+    size_t n = 0, i, k;
+    int any = 0;
+
+    *gp = NULL;
+    for (i = 0; argv[i] != NULL; i++)
+        if (!quoted[i] && glob_magic(argv[i]))
+            any = 1;
+    if (!any)
+        return argv;
+
+    if ((g = calloc(1, sizeof(*g))) == NULL)
+        unix_error("malloc error");
+    for (i = 0; argv[i] != NULL; i++) {
+        if (!quoted[i] && glob_magic(argv[i]) && glob_word(g, argv[i]) > 0)
+            continue;
+        gout_add(&g->out, strdup(argv[i]));     /* literal, or no match */
+    }
+    n = g->out.n;
+    if ((v = malloc((n + 1) * sizeof(char *))) == NULL)
+        unix_error("malloc error");
+    for (k = 0; k < n; k++)
+        v[k] = g->out.v[k];
+    v[n] = NULL;
+    *gp = g;
+    return v;
+}
+
+/* glob_free - Release an expansion made by glob_expand */
+void glob_free(char **v, struct gstate *g)
+{
+    size_t i;
+    struct gdir *d, *next;
+
+    if (g == NULL)
+        return;
+    for (i = 0; i < g->out.n; i++)
+        free(g->out.v[i]);
+    free(g->out.v);
+    for (i = 0; i < GLOB_BUCKETS; i++) {
+        for (d = g->cache[i]; d != NULL; d = next) {
+            next = d->next;
+            free(d->path);
+            free(d->names);
+            free(d->off);
+            free(d->type);
+            free(d);
+        }
+    }
+    free(g);
+    free(v);
+}
+/**********************************************
+ * end glob expansion
+ **********************************************/
+
+
+/***********************************************
+ * Process substitution and here-documents
+ *
+ * <(cmd args) and >(cmd args) run cmd next to the command, in the
+ * job's process group, joined to it by a pipe that the command sees
+ * as /dev/fd/N. CMD << WORD feeds the lines up to WORD to stdin, and
+ * CMD <<< WORD feeds WORD and a newline; both bodies are written to
+ * a memfd, so nothing touches the disk. run_command turns the words
+ * into a struct redir_t (redir_parse), opens the pipes and the memfd
+ * (redir_open) and hands it to launch_job in its launch_opts, which
+ * forks the substituted processes (redir_spawn) and records them in
+ * the job. The job ends when the command and all of them have
+ * exited; <(...) processes still running when the command exits are
+ * sent SIGTERM, as nothing can read them any more.
+ **********************************************/
+
+#define HEREDOC_BODY 2      /* parse_quoted value: word is a heredoc body */
+
+struct subst_t {
+    char dir;               /* '<': cmd writes, '>': cmd reads */
+    char *argv[MAXARGS];    /* owned copies */
+    char quoted[MAXARGS];
+    int fd[2];              /* [0] the command's end, [1] cmd's end */
+    char path[32];          /* /dev/fd/N */
+    pid_t pid;
+};
+
+struct redir_t {
+    char *argv[MAXARGS];    /* the command with the redirections removed */
+    char quoted[MAXARGS];
+    struct subst_t sub[MAXSUBST];
+    int nsub;
+    const char *in;         /* heredoc or here-string body, or NULL */
+    int in_nl;              /* add a newline after in (<<<) */
+    int in_fd;              /* its memfd */
+};
+
+/*
+ * heredoc_read - Replace the word after an unquoted << with the lines
+ *    that follow on input, up to one that holds just that word. The
+ *    body is kept until the next call. Returns 0, or -1 on error.
+ */
+int heredoc_read(char **argv, int (*next)(char *line))
+{
+    static char *body;
+    static size_t cap;
+    char line[MAXLINE];
+    size_t len = 0, n;
+    int i;
+
+    for (i = 0; argv[i] != NULL; i++)
+        if (!parse_quoted[i] && strcmp(argv[i], "<<") == 0
+            && argv[i + 1] != NULL && parse_quoted[i + 1] != HEREDOC_BODY)
+            break;
+    if (argv[i] == NULL)
+        return 0;
+
+    while (1) {
+        if (next(line) == 0) {
+            printf("tsh: here-document ended by end of file (wanted '%s')\n", argv[i + 1]);
+            break;
+        }
+        n = strlen(line);
+        if (n > 0 && line[n - 1] == '\n' && n - 1 == strlen(argv[i + 1])
+            && strncmp(line, argv[i + 1], n - 1) == 0)
+            break;
+        while (len + n + 1 > cap) {
+            cap = cap ? cap * 2 : 4096;
+            if ((body = realloc(body, cap)) == NULL)
+                unix_error("realloc error");
+        }
+        memcpy(body + len, line, n);
+        len += n;
+    }
+    if (body == NULL && (body = malloc(cap = 4096)) == NULL)
+        unix_error("malloc error");
+    body[len] = '\0';
+    argv[i + 1] = body;
+    parse_quoted[i + 1] = HEREDOC_BODY;
+    return 0;
+}
+
+/* redir_free - Close whatever redir_open left open and free r */
+void redir_free(struct redir_t *r)
+{
+    int i, k;
+
+    if (r == NULL)
+        return;
+    for (i = 0; i < r->nsub; i++) {
+        for (k = 0; k < 2; k++)
+            if (r->sub[i].fd[k] >= 0)
+                close(r->sub[i].fd[k]);
+        for (k = 0; r->sub[i].argv[k] != NULL; k++)
+            free(r->sub[i].argv[k]);
+    }
+    if (r->in_fd >= 0)
+        close(r->in_fd);
+    free(r);
+}
+
+/*
+ * redir_parse - Take the redirection words out of argv (whose quote
+ *    flags are in quoted). Sets *rp to NULL when there are none, else
+ *    to a new struct redir_t. Returns 0, or -1 after a syntax error.
+ */
+int redir_parse(char **argv, const char *quoted, struct redir_t **rp)
+{
+    struct redir_t *r;
+    int i, n = 0, any = 0;
+
+    *rp = NULL;
+    for (i = 0; argv[i] != NULL; i++)
+        if (!quoted[i] && (argv[i][0] == '<' || argv[i][0] == '>'))
+            any = 1;
+    if (!any)
+        return 0;
+
+    if ((r = calloc(1, sizeof(*r))) == NULL)
+        unix_error("calloc error");
+    r->in_fd = -1;
+    for (i = 0; argv[i] != NULL; i++) {
+        char *w = argv[i];
+
+        if (quoted[i]) {
+            r->quoted[n] = quoted[i];
+            r->argv[n++] = w;
+        }
+        else if ((w[0] == '<' || w[0] == '>') && w[1] == '(') {
+            struct subst_t *sb = &r->sub[r->nsub];
+            int k = 0, closed = 0;
+
+            if (r->nsub == MAXSUBST) {
+                printf("tsh: too many process substitutions\n");
+                goto fail;
+            }
+            sb->dir = w[0];
+            sb->fd[0] = sb->fd[1] = -1;
+            r->nsub++;
+            w += 2;
+            for (;;) {                  /* words up to the one ending in ) */
+                size_t len = strlen(w);
+
+                if (!quoted[i] && len > 0 && w[len - 1] == ')') {
+                    closed = 1;
+                    len--;
+                }
+                if (len > 0 || quoted[i]) {
+                    if (k == MAXARGS - 1)
+                        break;
+                    if ((sb->argv[k] = strndup(w, len)) == NULL)
+                        unix_error("strdup error");
+                    sb->quoted[k++] = quoted[i];
+                }
+                if (closed || argv[i + 1] == NULL)
+                    break;
+                w = argv[++i];
+            }
+            if (!closed || k == 0) {
+                printf("tsh: %s in %c(...)\n", closed ? "no command" : "missing )", sb->dir);
+                goto fail;
+            }
+            r->quoted[n] = 1;           /* a path; never a glob */
+            r->argv[n++] = sb->path;
+        }
+        else if (strncmp(w, "<<<", 3) == 0 || strcmp(w, "<<") == 0) {
+            int here = w[2] == '<';
+
+            if (r->in != NULL) {
+                printf("tsh: only one here-document or here-string per command\n");
+                goto fail;
+            }
+            if (here && w[3] != '\0') {
+                r->in = w + 3;
+            }
+            else if (argv[i + 1] == NULL
+                     || (!here && quoted[i + 1] != HEREDOC_BODY)) {
+                printf("tsh: %s needs %s\n", w, here ? "a word" : "input lines");
+                goto fail;
+            }
+            else {
+                r->in = argv[++i];
+            }
+            r->in_nl = here;
+        }
+        else {
+            r->quoted[n] = 0;
+            r->argv[n++] = w;
+        }
+    }
+    r->argv[n] = NULL;
+    if (n == 0) {
+        printf("tsh: redirection without a command\n");
+        goto fail;
+    }
+    *rp = r;
+    return 0;
+
+ fail:
+    redir_free(r);
+    return -1;
+}
+
+/* redir_glob - glob_expand the command that is left in r */
+char **redir_glob(struct redir_t *r, struct gstate **gp)
+{
+    return glob_expand(r->argv, r->quoted, gp);
+}
+
+/*
+ * redir_open - Create the pipes and the memfd that r needs. All of
+ *    them are close-on-exec; redir_child opens up the command's ends.
+ */
+int redir_open(struct redir_t *r)
+{
+    int i;
+
+    for (i = 0; i < r->nsub; i++) {
+        struct subst_t *sb = &r->sub[i];
+        int p[2];
+
+        if (pipe2(p, O_CLOEXEC) < 0)
+            return -1;
+        sb->fd[0] = sb->dir == '<' ? p[0] : p[1];
+        sb->fd[1] = sb->dir == '<' ? p[1] : p[0];
+        snprintf(sb->path, sizeof(sb->path), "/dev/fd/%d", sb->fd[0]);
+    }
+    if (r->in != NULL) {
+        if ((r->in_fd = memfd_create("tsh-heredoc", MFD_CLOEXEC)) < 0
+            || rio_writen(r->in_fd, r->in, strlen(r->in)) < 0
+            || (r->in_nl && rio_writen(r->in_fd, "\n", 1) < 0)
+            || lseek(r->in_fd, 0, SEEK_SET) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* redir_child - In the command's child: keep its pipe ends, set stdin */
+void redir_child(struct redir_t *r)
+{
+    int i;
+
+    for (i = 0; i < r->nsub; i++)
+        fcntl(r->sub[i].fd[0], F_SETFD, 0);
+    if (r->in_fd >= 0)
+        dup2(r->in_fd, STDIN_FILENO);
+}
+
+/*
+ * redir_spawn - Fork the substituted processes of r into the process
+ *    group of the job whose leader is pgid, with the command's nenv
+ *    NAME=value words, then close the shell's copies of every pipe
+ *    end and of the memfd.
+ */
+void redir_spawn(struct redir_t *r, pid_t pgid, int bg, char **env, int nenv)
+{
+    int i, k;
+
+    for (i = 0; i < r->nsub; i++) {
+        struct subst_t *sb = &r->sub[i];
+
+        if ((sb->pid = fork()) == 0) {
+            struct gstate *g;
+            char **argv, **envp;
+            sigset_t empty;
+
+            setpgid(0, pgid);
+            dup2(sb->fd[1], sb->dir == '<' ? STDOUT_FILENO : STDIN_FILENO);
+            create_proc_entry(getpid(), getppid(), pgid, sb->argv[0], bg ? "R" : "R+");
+            sigemptyset(&empty);
+            sigprocmask(SIG_SETMASK, &empty, NULL);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            argv = glob_expand(sb->argv, sb->quoted, &g);
+            if (fast_builtin_name(argv[0])) {
+                close(jobs_epfd);
+                jobs_epfd = -1;
+                k = fast_builtin(argv);
+                fflush(stdout);
+                exit(k);
+            }
+            envp = env_envp();
+            if (nenv > 0)                   /* FOO=1 cmd <(...) */
+                envp = env_layer(envp, env, nenv);
+            execve(argv[0], argv, envp);
+            printf("%s: Command not found.\n", argv[0]);
+            fflush(stdout);
+            exit(127);
+        }
+        if (sb->pid > 0)
+            setpgid(sb->pid, pgid);     /* whichever of us runs first */
+    }
+    for (i = 0; i < r->nsub; i++)
+        for (k = 0; k < 2; k++) {
+            if (r->sub[i].fd[k] >= 0)
+                close(r->sub[i].fd[k]);
+            r->sub[i].fd[k] = -1;
+        }
+    if (r->in_fd >= 0)
+        close(r->in_fd);
+    r->in_fd = -1;
+}
+
+/* redir_attach - Record r's substituted processes in job and watch them */
+void redir_attach(struct redir_t *r, struct job_t *job)
+{
+    struct epoll_event ev;
+    int i, fd;
+
+    for (i = 0; i < r->nsub; i++) {
+        if (r->sub[i].pid <= 0)
+            continue;
+        if ((fd = pidfd_open(r->sub[i].pid, 0)) < 0)
+            continue;
+        ev.events = EPOLLIN;
+        ev.data.u64 = SUBST_TAG | (uint32_t)r->sub[i].pid;
+        if (epoll_ctl(jobs_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            continue;
+        }
+        job->subs[job->nsubs] = r->sub[i].pid;
+        job->subfd[job->nsubs] = fd;
+        job->subdir[job->nsubs++] = r->sub[i].dir;
+    }
+}
+/**********************************************
+ * end process substitution and here-documents
+ **********************************************/
+
+/***********************************************
+ * Job queue (submit)
+ *
+ * submit CMD puts a background command in a queue. At most max
+ * submitted jobs run at once (submit -j N, the CPU count by default).
+ * The rest start one by one as running ones exit: the highest class
+ * first, and within a class the oldest. With submit -o fair a class
+ * instead takes the command of the user with the fewest submitted jobs
+ * running, and of those the one served longest ago. The classes set
+ * nice and the I/O priority of the child:
+ *     high    nice -5, best effort 0
+ *     normal  nice 0,  best effort 4
+ *     low     nice 10, best effort 7
+ *     idle    nice 19, idle class
+ * Raising the priority needs privilege and is skipped without it. The
+ * shell also queues cmd & when its job list is full, instead of
+ * refusing it. The server keeps one queue for all of its sessions, so
+ * fair share works across the users logged in to it.
+ **********************************************/
+
+#define QPRIO_HIGH    0
+#define QPRIO_NORMAL  1
+#define QPRIO_LOW     2
+#define QPRIO_IDLE    3
+#define QPRIO_N       4
+
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_WHO_PROCESS  1
+
+struct quser {                  /* a user with submitted jobs */
+    char name[32];
+    int running;
+    unsigned long last_start;   /* q->starts when it last had a job started */
+    struct quser *next;
+};
+
+struct qjob {                   /* a queued command */
+    struct qjob *next;
+    unsigned long id;
+    int prio;
+    struct quser *user;
+    void *owner;                /* submitting session, NULL in the shell */
+    int nprefix;                /* NAME=value words that start argv */
+    char **argv;
+    char cmdline[];
+};
+
+struct jobqueue {
+    struct qjob *head[QPRIO_N];
+    struct quser *users;
+    int max_running;
+    int running;                /* submitted jobs started and not done */
+    int fair;                   /* fair share instead of FIFO */
+    unsigned long next_id;
+    unsigned long starts;
+    int (*start)(struct qjob *j);   /* 0 if started, -1 if not now */
+};
+
+static const char *qprio_names[QPRIO_N] = { "high", "normal", "low", "idle" };
+static struct jobqueue shell_queue;     /* submit in the shell */
+
+/* queue_init - An empty FIFO queue that starts jobs with start */
+void queue_init(struct jobqueue *q, int (*start)(struct qjob *j))
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memset(q, 0, sizeof(*q));
+    q->max_running = cpus > 0 ? cpus : 1;
+    q->next_id = 1;
+    q->start = start;
+}
+
+/* queue_user - The entry for user name, created on first use */
+static struct quser *queue_user(struct jobqueue *q, const char *name)
+{
+    struct quser *u;
+
+    for (u = q->users; u != NULL; u = u->next)
+        if (strcmp(u->name, name) == 0)
+            return u;
+    if ((u = calloc(1, sizeof(*u))) == NULL)
+        unix_error("calloc error");
+    snprintf(u->name, sizeof(u->name), "%s", name);
+    u->next = q->users;
+    q->users = u;
+    return u;
+}
+
+/*
+ * queue_add - Queue the command made of the n words in prefix and
+ *    then argv; returns its id
+ */
+unsigned long queue_add(struct jobqueue *q, const char *user, void *owner, int prio,
+                        char **prefix, int n, char **argv)
+{
+    size_t words = n, len = 0;
+    struct qjob *j, **p;
+    char *s;
+    int i;
+
+    for (i = 0; i < n; i++)
+        len += strlen(prefix[i]) + 1;
+    for (i = 0; argv[i] != NULL; i++, words++)
+        len += strlen(argv[i]) + 1;
+    /* the words, then the cmdline shown by jobs: them again, a newline */
+    if ((j = malloc(sizeof(*j) + 2 * len + 1 + (words + 1) * sizeof(char *))) == NULL)
+        unix_error("malloc error");
+    j->argv = (char **)(j->cmdline + len + 1);
+    s = (char *)(j->argv + words + 1);
+    j->cmdline[0] = '\0';
+    for (i = 0; (size_t)i < words; i++) {
+        const char *w = i < n ? prefix[i] : argv[i - n];
+
+        j->argv[i] = strcpy(s, w);
+        s += strlen(w) + 1;
+        strcat(j->cmdline, w);
+        strcat(j->cmdline, (size_t)i + 1 < words ? " " : "\n");
+    }
+    j->argv[words] = NULL;
+    j->id = q->next_id++;
+    j->prio = prio;
+    j->user = queue_user(q, user);
+    j->owner = owner;
+    j->nprefix = n;
+    j->next = NULL;
+    for (p = &q->head[prio]; *p != NULL; p = &(*p)->next)
+        ;
+    *p = j;
+    return j->id;
+}
+
+/* queue_pick - Unlink the job that should start next, NULL if none */
+static struct qjob *queue_pick(struct jobqueue *q)
+{
+    struct qjob **p, **best, *j;
+    int c;
+
+    for (c = 0; c < QPRIO_N; c++) {
+        if (q->head[c] == NULL)
+            continue;
+        best = &q->head[c];
+        if (q->fair)        /* fewest running, then longest since served */
+            for (p = &q->head[c]; *p != NULL; p = &(*p)->next)
+                if ((*p)->user->running < (*best)->user->running
+                    || ((*p)->user->running == (*best)->user->running
+                        && (*p)->user->last_start < (*best)->user->last_start))
+                    best = p;
+        j = *best;
+        *best = j->next;
+        return j;
+    }
+    return NULL;
+}
+
+/* queue_run - Start queued jobs while there is room */
+void queue_run(struct jobqueue *q)
+{
+    struct qjob *j;
+
+    while (q->running < q->max_running && (j = queue_pick(q)) != NULL) {
+        if (q->start(j) < 0) {          /* no slot: back to the front */
+            j->next = q->head[j->prio];
+            q->head[j->prio] = j;
+            return;
+        }
+        q->running++;
+        j->user->running++;
+        j->user->last_start = ++q->starts;
+        free(j);
+    }
+}
+
+/* queue_done - A job that q started has ended */
+void queue_done(struct jobqueue *q, struct quser *u)
+{
+    q->running--;
+    u->running--;
+}
+
+/* queue_drop - Forget the queued jobs of owner */
+void queue_drop(struct jobqueue *q, void *owner)
+{
+    struct qjob **p, *j;
+    int c;
+
+    for (c = 0; c < QPRIO_N; c++)
+        for (p = &q->head[c]; (j = *p) != NULL; )
+            if (j->owner == owner) {
+                *p = j->next;
+                free(j);
+            }
+            else {
+                p = &j->next;
+            }
+}
+
+/* queue_find - Is job id still queued? */
+static struct qjob *queue_find(struct jobqueue *q, unsigned long id)
+{
+    struct qjob *j;
+    int c;
+
+    for (c = 0; c < QPRIO_N; c++)
+        for (j = q->head[c]; j != NULL; j = j->next)
+            if (j->id == id)
+                return j;
+    return NULL;
+}
+
+/* queue_list - Show owner's queued jobs through put, in start order per class */
+void queue_list(struct jobqueue *q, void *owner, void (*put)(void *ctx, const char *line),
+                void *ctx)
+{
+    char line[MAXLINE + 64];
+    struct qjob *j;
+    int c;
+
+    for (c = 0; c < QPRIO_N; c++)
+        for (j = q->head[c]; j != NULL; j = j->next)
+            if (j->owner == owner) {
+                snprintf(line, sizeof(line), "[Q%lu] Queued (%s) %.*s", j->id,
+                         qprio_names[c], MAXLINE, j->cmdline);
+                put(ctx, line);
+            }
+}
+
+/* queue_prio - Give the calling process the nice and I/O priority of class prio */
+void queue_prio(int prio)
+{
+    static const int nices[QPRIO_N] = { -5, 0, 10, 19 };
+    static const int ioprios[QPRIO_N] = {
+        IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | 0,
+        IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | 4,
+        IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | 7,
+        IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT,
+    };
+
+    setpriority(PRIO_PROCESS, 0, nices[prio]);  /* EPERM for high if unprivileged */
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprios[prio]);
+}
+
+/*
+ * queue_submit - The submit builtin for q:
+ *        submit [-p high|normal|low|idle] CMD [ARGS...]
+ *        submit -j N | -o fifo|fair     (if may_config)
+ *        submit                         (print the queue's state)
+ *    The n prefix words are NAME=value assignments for CMD. Output
+ *    goes through put.
+ */
+int queue_submit(struct jobqueue *q, char **argv, const char *user, void *owner,
+                 int may_config, char **prefix, int n,
+                 void (*put)(void *ctx, const char *line), void *ctx)
+{
+    char line[MAXLINE + 64];
+    int i, c, prio = QPRIO_NORMAL, config = 0, queued = 0;
+    unsigned long id;
+    struct qjob *j;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i += 2) {
+        if (argv[i + 1] == NULL)
+            goto usage;
+        if (strcmp(argv[i], "-p") == 0) {
+            for (prio = 0; prio < QPRIO_N; prio++)
+                if (strcmp(argv[i + 1], qprio_names[prio]) == 0)
+                    break;
+            if (prio == QPRIO_N)
+                goto usage;
+            continue;
+        }
+        if (!may_config) {
+            put(ctx, "submit: root privileges required to change the queue\n");
+            return 1;
+        }
+        config = 1;
+        if (strcmp(argv[i], "-j") == 0 && atoi(argv[i + 1]) > 0)
+            q->max_running = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-o") == 0 && strcmp(argv[i + 1], "fifo") == 0)
+            q->fair = 0;
+        else if (strcmp(argv[i], "-o") == 0 && strcmp(argv[i + 1], "fair") == 0)
+            q->fair = 1;
+        else
+            goto usage;
+    }
+
+    if (argv[i] == NULL) {
+        if (prio != QPRIO_NORMAL && !config)
+            goto usage;
+        for (c = 0; c < QPRIO_N; c++)
+            for (j = q->head[c]; j != NULL; j = j->next)
+                queued++;
+        snprintf(line, sizeof(line), "submit: %d running, %d queued, at most %d, %s\n",
+                 q->running, queued, q->max_running, q->fair ? "fair" : "fifo");
+        put(ctx, line);
+        queue_run(q);                   /* -j may have made room */
+        return 0;
+    }
+    id = queue_add(q, user, owner, prio, prefix, n, argv + i);
+    queue_run(q);
+    if ((j = queue_find(q, id)) != NULL) {
+        snprintf(line, sizeof(line), "[Q%lu] Queued (%s) %.*s", id, qprio_names[prio],
+                 MAXLINE, j->cmdline);
+        put(ctx, line);
+    }
+    return 0;
+
+usage:
+    put(ctx, "submit: usage: submit [-p high|normal|low|idle] CMD [ARGS...]\n"
+             "              submit [-j N] [-o fifo|fair]\n");
+    return 2;
+}
+
+/* queue_put - put callback that prints to stdout */
+void queue_put(void *ctx, const char *line)
+{
+    fputs(line, stdout);
+}
+
+/* queue_start_job - The shell's start callback: launch j as a background job */
+static int queue_start_job(struct qjob *j)
+{
+    struct launch_opts lo = LAUNCH_OPTS_NONE;
+    pid_t pid;
+
+    if (jobs_full(jobs))
+        return -1;
+    lo.env = j->argv;
+    lo.nenv = j->nprefix;
+    lo.prio = j->prio;
+    pid = launch_job(j->argv + j->nprefix, 1, j->cmdline, &lo);
+    if (pid < 0)
+        return -1;
+    getjobpid(jobs, pid)->quser = j->user;
+    printf("%d %s", pid, j->cmdline);
+    fflush(stdout);
+    return 0;
+}
+
+/* builtin_submit - submit in the shell (see queue_submit) */
+int builtin_submit(char **argv, struct launch_opts *lo)
+{
+    if (shell_queue.start == NULL)
+        queue_init(&shell_queue, queue_start_job);
+    return queue_submit(&shell_queue, argv, username, NULL, 1, lo->env, lo->nenv,
+                        queue_put, NULL);
+}
+
+/*
+ * queue_spill - Queue argv (and the command's NAME=value words) in
+ *    the shell's queue at normal priority, for cmd & with no free slot
+ */
+void queue_spill(char **argv, struct launch_opts *lo)
+{
+    unsigned long id;
+
+    if (shell_queue.start == NULL)
+        queue_init(&shell_queue, queue_start_job);
+    id = queue_add(&shell_queue, username, NULL, QPRIO_NORMAL, lo->env, lo->nenv, argv);
+    printf("[Q%lu] Queued (normal) %s", id, queue_find(&shell_queue, id)->cmdline);
+}
+
+/* queue_job_exit - A shell job ended: u is its queue user, or NULL */
+void queue_job_exit(struct quser *u)
+{
+    if (shell_queue.start == NULL)
+        return;
+    if (u != NULL)
+        queue_done(&shell_queue, u);
+    queue_run(&shell_queue);
+}
+
+/* queue_jobs - List the shell's queued jobs for jobs */
+void queue_jobs(void)
+{
+    if (shell_queue.start != NULL)
+        queue_list(&shell_queue, NULL, queue_put, NULL);
+}
+/**********************************************
+ * end job queue
+ **********************************************/
+
+/***********************************************
+ * Result cache
+ *
+ * cache CMD ARGS... runs CMD once and answers later runs of the same
+ * command from <user directory>/.tsh_cache without starting it. The
+ * key is a 128-bit FNV-1a hash of the working directory, the command's
+ * NAME=value prefixes and words, the variables named in TSH_CACHE_ENV
+ * (PATH, HOME, LANG, LC_ALL and TZ by default) and the device, inode,
+ * size and mtime of every word that names a regular file, CMD
+ * included. Editing an input or installing a new binary therefore
+ * gives a new key; standard input is not part of it. On a miss the
+ * job's child forks CMD with stdout and stderr on pipes and copies
+ * both to its own and to two memfds as they arrive, so the output is
+ * still seen live. When CMD exits (with any status, but not killed or
+ * timed out) the shell stores the status, both outputs and the run
+ * time in a file named by the key. A hit writes the stored stdout,
+ * then the stored stderr, and returns the status. An entry's mtime is
+ * its last use: once the store passes TSH_CACHE_MAX bytes (64m by
+ * default) the least recently used entries are deleted until it is
+ * down to three quarters of that. Counts of hits, misses, stores and
+ * evictions are added to .tsh_cache/stats at exit.
+ **********************************************/
+
+#define CACHE_MAGIC   0x3143485354ULL   /* "TSHC1" */
+#define CACHE_ENV     "PATH:HOME:LANG:LC_ALL:TZ"
+
+struct cache_hdr {              /* start of an entry, then stdout and stderr */
+    uint64_t magic;
+    int64_t status;
+    uint64_t out_len;
+    uint64_t err_len;
+    uint64_t run_ns;            /* what a hit saves */
+};
+
+struct cache_run {              /* a miss, from launch to job_finish */
+    char name[33];              /* the key in hex */
+    int out_fd, err_fd;         /* memfds the child copies the output to */
+};
+
+struct cache_counts {
+    unsigned long long hits, misses, stores, evictions, saved_ns;
+};
+
+static char cache_dir[2 * MAXLINE];
+static size_t cache_max;
+static long long cache_bytes = -1;  /* size of the store, -1 until scanned */
+static struct cache_counts cache_new;   /* not yet added to the stats file */
+static pid_t cache_owner;
+
+/* cache_fnv - Fold n bytes into a 128-bit FNV-1a hash */
+static unsigned __int128 cache_fnv(unsigned __int128 h, const void *p, size_t n)
+{
+    const unsigned __int128 prime = ((unsigned __int128)1 << 88) | 0x13b;
+    const unsigned char *s = p;
+
+    while (n-- > 0)
+        h = (h ^ *s++) * prime;
+    return h;
+}
+
+/* cache_init - Find the user's store and read TSH_CACHE_MAX, once */
+static void cache_init(void)
+{
+    const char *max;
+
+    if (cache_dir[0] != '\0')
+        return;
+    snprintf(cache_dir, sizeof(cache_dir), "%s%s/.tsh_cache", home_path, username);
+    mkdir(cache_dir, 0700);
+    max = getenv("TSH_CACHE_MAX");
+    if (max == NULL || (cache_max = parse_size(max)) == 0)
+        cache_max = 64 << 20;
+    cache_owner = getpid();
+    atexit(cache_save);
+}
+
+/*
+ * cache_key - Hash what argv's output may depend on, including lo's
+ *    NAME=value words, into name (33 bytes)
+ */
+static void cache_key(char **argv, struct launch_opts *lo, char *name)
+{
+    unsigned __int128 h = ((unsigned __int128)0x6c62272e07bb0142ULL << 64)
+                          | 0x62b821756295c58dULL;
+    char cwd[MAXLINE], vars[MAXLINE], *var, *save;
+    const char *list, *v;
+    struct stat st;
+    uint64_t meta[5];
+    int i;
+
+    h = cache_fnv(h, "tsh-cache-1", 12);
+    if (getcwd(cwd, sizeof(cwd)) != NULL)
+        h = cache_fnv(h, cwd, strlen(cwd) + 1);
+    for (i = 0; i < lo->nenv; i++)
+        h = cache_fnv(h, lo->env[i], strlen(lo->env[i]) + 1);
+    h = cache_fnv(h, "", 1);
+    for (i = 0; argv[i] != NULL; i++) {
+        h = cache_fnv(h, argv[i], strlen(argv[i]) + 1);
+        if (stat(argv[i], &st) == 0 && S_ISREG(st.st_mode)) {
+            meta[0] = st.st_dev;
+            meta[1] = st.st_ino;
+            meta[2] = st.st_size;
+            meta[3] = st.st_mtim.tv_sec;
+            meta[4] = st.st_mtim.tv_nsec;
+            h = cache_fnv(h, meta, sizeof(meta));
+        }
+    }
+    if ((list = env_get("TSH_CACHE_ENV")) == NULL)
+        list = CACHE_ENV;
+    snprintf(vars, sizeof(vars), "%s", list);
+    for (var = strtok_r(vars, ": ", &save); var != NULL; var = strtok_r(NULL, ": ", &save)) {
+        v = env_get(var);
+        h = cache_fnv(h, var, strlen(var) + 1);
+        h = cache_fnv(h, v != NULL ? v : "", v != NULL ? strlen(v) + 1 : 0);
+    }
+    snprintf(name, 33, "%016llx%016llx", (unsigned long long)(h >> 64),
+             (unsigned long long)h);
+}
+
+/* cache_copy - Copy len bytes at *off in in to out */
+static int cache_copy(int out, int in, off_t *off, size_t len)
+{
+    char buf[65536];
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = sendfile(out, in, off, len)) > 0) {
+            len -= n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            return -1;
+        /* sendfile cannot write to out: copy through a buffer */
+        if ((n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), *off)) <= 0
+            || rio_writen(out, buf, n) < 0)
+            return -1;
+        *off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* cache_hit - Replay the entry name and return its status, or -1 */
+static int cache_hit(const char *name)
+{
+    char path[3 * MAXLINE];
+    struct cache_hdr h;
+    struct stat st;
+    off_t off = sizeof(h);
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, name);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != CACHE_MAGIC
+        || fstat(fd, &st) < 0 || (uint64_t)st.st_size != sizeof(h) + h.out_len + h.err_len) {
+        close(fd);
+        return -1;
+    }
+    fflush(stdout);
+    cache_copy(STDOUT_FILENO, fd, &off, h.out_len);
+    cache_copy(STDERR_FILENO, fd, &off, h.err_len);
+    futimens(fd, NULL);                 /* most recently used */
+    close(fd);
+    cache_new.hits++;
+    cache_new.saved_ns += h.run_ns;
+    return (int)h.status;
+}
+
+struct cache_entry {             /* an entry seen by cache_evict */
+    char name[33];
+    struct timespec used;
+    off_t size;
+};
+
+/* cache_entry_cmp - Order entries by last use, oldest first */
+static int cache_entry_cmp(const void *a, const void *b)
+{
+    const struct timespec *x = &((const struct cache_entry *)a)->used;
+    const struct timespec *y = &((const struct cache_entry *)b)->used;
+
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/*
+ * cache_evict - Measure the store and, if it is over the cap, delete
+ *    the least recently used entries down to three quarters of it
+ */
+static void cache_evict(void)
+{
+    struct cache_entry *v = NULL;
+    struct dirent *e;
+    struct stat st;
+    size_t n = 0, cap = 0, i;
+    long long total = 0;
+    DIR *d;
+
+    if ((d = opendir(cache_dir)) == NULL)
+        return;
+    while ((e = readdir(d)) != NULL) {
+        if (strlen(e->d_name) != 32 || fstatat(dirfd(d), e->d_name, &st, 0) < 0)
+            continue;                   /* ., .., stats and unfinished stores */
+        if (n == cap) {
+            cap = cap ? 2 * cap : 256;
+            if ((v = realloc(v, cap * sizeof(*v))) == NULL)
+                unix_error("realloc error");
+        }
+        memcpy(v[n].name, e->d_name, 33);
+        v[n].used = st.st_mtim;
+        v[n].size = st.st_size;
+        total += st.st_size;
+        n++;
+    }
+    if (total > (long long)cache_max) {
+        qsort(v, n, sizeof(*v), cache_entry_cmp);
+        for (i = 0; i < n && total > (long long)(cache_max / 4 * 3); i++)
+            if (unlinkat(dirfd(d), v[i].name, 0) == 0) {
+                total -= v[i].size;
+                cache_new.evictions++;
+            }
+    }
+    cache_bytes = total;
+    closedir(d);
+    free(v);
+}
+
+/* cache_store - Save a finished miss, if it ran to an exit */
+static void cache_store(struct cache_run *run, int status, long long run_ns)
+{
+    char path[3 * MAXLINE], tmp[3 * MAXLINE + 32];
+    struct cache_hdr h;
+    off_t off = 0;
+    int fd;
+
+    h.magic = CACHE_MAGIC;
+    h.status = status;
+    h.out_len = lseek(run->out_fd, 0, SEEK_END);
+    h.err_len = lseek(run->err_fd, 0, SEEK_END);
+    h.run_ns = run_ns > 0 ? run_ns : 0;
+    if (sizeof(h) + h.out_len + h.err_len > cache_max)
+        return;
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, run->name);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return;
+    if (rio_writen(fd, &h, sizeof(h)) < 0
+        || cache_copy(fd, run->out_fd, &off, h.out_len) < 0
+        || (off = 0, cache_copy(fd, run->err_fd, &off, h.err_len)) < 0
+        || rename(tmp, path) < 0) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    close(fd);
+    cache_new.stores++;
+    if (cache_bytes < 0 || (cache_bytes += sizeof(h) + h.out_len + h.err_len)
+                           > (long long)cache_max)
+        cache_evict();
+}
+
+/* cache_drop - Close run's memfds and free it */
+static void cache_drop(struct cache_run *run)
+{
+    if (run->out_fd >= 0)
+        close(run->out_fd);
+    if (run->err_fd >= 0)
+        close(run->err_fd);
+    free(run);
+}
+
+/*
+ * cache_finish - job finished with status: store its output unless it
+ *    was killed or timed out, and drop its memfds
+ */
+void cache_finish(struct job_t *job, int status)
+{
+    struct cache_run *run = job->cache;
+
+    job->cache = NULL;
+    if (status < 128 && !job->timed_out)
+        cache_store(run, status, audit_now() - job->start_ns);
+    cache_drop(run);
+}
+
+/*
+ * cache_proxy - In the child of a miss: run argv with its stdout and
+ *    stderr passed through and copied to run's memfds, then exit the
+ *    way it did. Never returns.
+ */
+void cache_proxy(char **argv, char **envp, struct cache_run *run)
+{
+    int out[2], err[2], copy[2] = { run->out_fd, run->err_fd };
+    int i, open = 2, status;
+    struct pollfd pfd[2];
+    char buf[65536];
+    ssize_t n;
+    pid_t pid;
+
+    signal(SIGINT, SIG_DFL);            /* stop and die with the command */
+    signal(SIGTSTP, SIG_DFL);
+    close(jobs_epfd);
+    if (pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0)
+        unix_error("pipe error");
+    if ((pid = fork()) == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        if (execve(argv[0], argv, envp) < 0) {
+            printf("%s: Command not found.\n", argv[0]);
+            exit(127);
+        }
+    }
+    if (pid < 0)
+        unix_error("fork error");
+    close(out[1]);
+    close(err[1]);
+    pfd[0].fd = out[0];
+    pfd[1].fd = err[0];
+    pfd[0].events = pfd[1].events = POLLIN;
+    while (open > 0) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < 2; i++) {
+            if (pfd[i].fd < 0 || pfd[i].revents == 0)
+                continue;
+            if ((n = read(pfd[i].fd, buf, sizeof(buf))) <= 0) {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                pfd[i].fd = -1;
+                open--;
+                continue;
+            }
+            rio_writen(i == 0 ? STDOUT_FILENO : STDERR_FILENO, buf, n);
+            rio_writen(copy[i], buf, n);
+        }
+    }
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            exit(1);
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
+    }
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+/* cache_save - Add this session's counts to the stats file (atexit) */
+void cache_save(void)
+{
+    struct cache_counts c = { 0, 0, 0, 0, 0 };
+    char path[3 * MAXLINE], buf[512];
+    ssize_t n;
+    int fd;
+
+    if (getpid() != cache_owner
+        || memcmp(&cache_new, &c, sizeof(c)) == 0)
+        return;
+    snprintf(path, sizeof(path), "%s/stats", cache_dir);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+        return;
+    flock(fd, LOCK_EX);
+    if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        sscanf(buf, "hits %llu misses %llu stores %llu evictions %llu saved_ns %llu",
+               &c.hits, &c.misses, &c.stores, &c.evictions, &c.saved_ns);
+    }
+    c.hits += cache_new.hits;
+    c.misses += cache_new.misses;
+    c.stores += cache_new.stores;
+    c.evictions += cache_new.evictions;
+    c.saved_ns += cache_new.saved_ns;
+    n = snprintf(buf, sizeof(buf), "hits %llu\nmisses %llu\nstores %llu\nevictions %llu\n"
+                 "saved_ns %llu\n", c.hits, c.misses, c.stores, c.evictions, c.saved_ns);
+    if (ftruncate(fd, 0) == 0)
+        pwrite(fd, buf, n, 0);
+    close(fd);                          /* drops the lock */
+    memset(&cache_new, 0, sizeof(cache_new));
+}
+
+/* cache_stats - cache --stats: the store's size and the saved counts */
+static void cache_stats(void)
+{
+    struct cache_counts c = { 0, 0, 0, 0, 0 };
+    char path[3 * MAXLINE];
+    unsigned long long looked;
+    FILE *fp;
+
+    cache_save();
+    snprintf(path, sizeof(path), "%s/stats", cache_dir);
+    if ((fp = fopen(path, "r")) != NULL) {
+        if (fscanf(fp, "hits %llu misses %llu stores %llu evictions %llu saved_ns %llu",
+                   &c.hits, &c.misses, &c.stores, &c.evictions, &c.saved_ns) < 0)
+            c.hits = 0;
+        fclose(fp);
+    }
+    cache_bytes = -1;
+    cache_evict();                      /* also measures the store */
+    looked = c.hits + c.misses;
+    printf("cache: %lld bytes of %zu in %s\n", cache_bytes, cache_max, cache_dir);
+    printf("cache: %llu hits, %llu misses, hit rate %.1f%%\n", c.hits, c.misses,
+           looked ? 100.0 * c.hits / looked : 0.0);
+    printf("cache: %llu stored, %llu evicted, %.3fs saved\n", c.stores, c.evictions,
+           c.saved_ns / 1e9);
+}
+
+/*
+ * builtin_cache - cache [--stats | CMD ARGS...]: run CMD through the
+ *    result cache. Builtins and commands with <(...), >(...), << or
+ *    <<< are run as usual, uncached.
+ */
+int builtin_cache(char **argv, int bg, char *cmdline, struct launch_opts *lo)
+{
+    struct cache_run *run;
+    int status;
+
+    cache_init();
+    if (argv[1] != NULL && strcmp(argv[1], "--stats") == 0 && argv[2] == NULL) {
+        cache_stats();
+        return 0;
+    }
+    if (argv[1] == NULL || argv[1][0] == '-') {
+        printf("cache: usage: cache CMD [ARGS...] | cache --stats\n");
+        return 2;
+    }
+    if (is_builtin(argv[1]) || strcmp(argv[1], "remote") == 0 || lo->redir != NULL) {
+        dispatch_command(argv + 1, bg, cmdline, lo);
+        return last_status;
+    }
+
+    if ((run = malloc(sizeof(*run))) == NULL)
+        unix_error("malloc error");
+    cache_key(argv + 1, lo, run->name);
+    if ((status = cache_hit(run->name)) >= 0) {
+        free(run);
+        return status;
+    }
+    cache_new.misses++;
+    run->out_fd = memfd_create("tsh-cache-out", MFD_CLOEXEC);
+    run->err_fd = memfd_create("tsh-cache-err", MFD_CLOEXEC);
+    if (run->out_fd < 0 || run->err_fd < 0) {   /* run it uncached */
+        cache_drop(run);
+        run_job(argv + 1, bg, cmdline, 0, 0, lo);
+        return last_status;
+    }
+    lo->cache = run;
+    run_job(argv + 1, bg, cmdline, 0, 0, lo);
+    if (lo->cache != NULL) {            /* no child took it (job list full) */
+        lo->cache = NULL;
+        cache_drop(run);
+    }
+    return last_status;
+}
+/**********************************************
+ * end result cache
+ **********************************************/
+
+/***********************************************
+ * Zygote pool
+ *
+ * With -Z N (--zygote=N) the shell keeps N helpers forked ahead of
+ * time. They come from a master: the shell's own binary run again
+ * with posix_spawn in helper mode, small, with every signal blocked.
+ * The master forks helpers with CLONE_PARENT, so each one is the
+ * shell's child but shares no memory with the shell (no copy-on-write
+ * faults on the shell's side) and costs no exec or dynamic linking. A
+ * helper moves to its own process group and waits on its end of a
+ * SOCK_SEQPACKET pair, which the master passes to the shell. To launch
+ * a command, the shell sends one message to an idle helper. The
+ * message carries argv, the submit class and, only if the variables
+ * changed since the master started or the command has NAME=value
+ * prefixes, the environment. The shell's working directory goes along
+ * as an fd through
+ * SCM_RIGHTS, with the -C capture pipe and the -P exec pipe when there
+ * are any. The helper applies them and calls execve right away, so a
+ * launch costs one sendmsg instead of a fork. The helper's pid is the
+ * job's pid, and it is the shell's child, so jobs, fg, bg and reaping
+ * work unchanged. The pool refills in the background: each launch asks
+ * the master for another helper and the shell picks the new ones up,
+ * without waiting, at the next launch. Commands with <(...), >(...) or
+ * here-documents, remote and cache misses, and anything launched with
+ * the pool empty, take the usual fork path.
+ **********************************************/
+
+#define ZYG_MAX      32         /* helpers at most */
+#define ZYG_MSG      65536      /* largest launch message */
+
+struct zyg_msg {                /* header of a launch message */
+    int prio;                   /* launch_opts prio */
+    int argc;
+    int envc;                   /* -1: the helper's own environ */
+    int nprefix;                /* NAME=value words, after the env */
+    int has_out;                /* an fd for stdout and stderr follows cwd */
+    int has_exec;               /* the -P exec pipe follows */
+};
+
+struct zygote {
+    pid_t pid;                  /* 0 if the slot is empty */
+    int sock;                   /* the shell's end */
+    unsigned long gen;          /* env_gen of its environment */
+};
+
+static struct zygote zygotes[ZYG_MAX];
+static int zygote_idle;         /* helpers waiting */
+static struct {
+    pid_t pid;
+    int sock;                   /* the shell's end, -1 if none */
+    unsigned long gen;          /* env_gen when it was started */
+    int asked;                  /* helpers asked for, not yet picked up */
+} zmaster = { 0, -1, 0, 0 };
+
+/* zygote_strings - Append the n strings of v to buf at *len */
+static int zygote_strings(char *buf, size_t *len, char **v, int n)
+{
+    int i;
+    size_t k;
+
+    for (i = 0; i < n; i++) {
+        k = strlen(v[i]) + 1;
+        if (*len + k > ZYG_MSG)
+            return -1;
+        memcpy(buf + *len, v[i], k);
+        *len += k;
+    }
+    return 0;
+}
+
+/* zygote_split - Point v[0..n-1] at the next n strings of buf at *p */
+static char *zygote_split(char *p, char **v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        v[i] = p;
+        p += strlen(p) + 1;
+    }
+    v[n] = NULL;
+    return p;
+}
+
+/*
+ * zygote_wait - A helper's life: wait for one launch message on sock
+ *    and exec it. Never returns.
+ */
+static void zygote_wait(int sock)
+{
+    static char buf[ZYG_MSG];
+    char **argv, **envp, **prefix, *p;
+    union {
+        struct cmsghdr h;
+        char space[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    struct zyg_msg m;
+    struct iovec iov[2] = { { &m, sizeof(m) }, { buf, sizeof(buf) } };
+    struct msghdr msg;
+    struct cmsghdr *c;
+    int fds[3], nfds = 0;
+    sigset_t empty;
+    ssize_t n;
+
+    envp = environ;                     /* as the master started with */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n < (ssize_t)sizeof(m))
+        _exit(0);                       /* the shell has gone */
+    for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+        }
+    close(sock);
+
+    if ((argv = malloc((m.argc + m.nprefix + (m.envc > 0 ? m.envc : 0) + 3)
+                       * sizeof(char *))) == NULL)
+        _exit(126);
+    p = zygote_split(buf, argv, m.argc);
+    if (m.envc >= 0) {
+        envp = argv + m.argc + 1;
+        p = zygote_split(p, envp, m.envc);
+    }
+    prefix = argv + m.argc + (m.envc >= 0 ? m.envc + 1 : 0) + 1;
+    zygote_split(p, prefix, m.nprefix);
+    if (nfds > 0 && fchdir(fds[0]) == 0)
+        close(fds[0]);
+    if (m.has_out && nfds > 1) {        /* -C: output goes to the ring */
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+    }
+    if (m.prio >= 0)
+        queue_prio(m.prio);
+    if (m.nprefix > 0)
+        envp = env_layer(envp, prefix, m.nprefix);
+    prctl(PR_SET_PDEATHSIG, 0);         /* the job may outlive the shell */
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    execve(argv[0], argv, envp);
+    printf("%s: Command not found.\n", argv[0]);
+    fflush(stdout);
+    _exit(127);
+}
+
+/*
+ * zygote_helper - main for tsh --zygote-helper FD SHELL: the master
+ *    for the shell whose pid is SHELL. Each byte read on socket FD asks
+ *    for one helper, which is forked as SHELL's child; its pid and the
+ *    shell's end of its socket go back on FD. Never returns.
+ */
+void zygote_helper(int sock, pid_t shell)
+{
+    union {
+        struct cmsghdr h;
+        char space[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *c;
+    pid_t pid;
+    int sv[2];
+    char req;
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != shell)
+        _exit(0);
+    while (recv(sock, &req, 1, 0) == 1) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+            _exit(1);
+        if ((pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0)) == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);   /* the shell, not us */
+            if (getppid() != shell)
+                _exit(0);
+            close(sock);
+            close(sv[0]);
+            setpgid(0, 0);
+            zygote_wait(sv[1]);
+        }
+        close(sv[1]);
+        if (pid < 0)
+            _exit(1);
+        iov.iov_base = &pid;
+        iov.iov_len = sizeof(pid);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.space;
+        msg.msg_controllen = sizeof(ctl.space);
+        c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &sv[0], sizeof(int));
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+            _exit(0);
+        close(sv[0]);
+    }
+    _exit(0);
+}
+
+/* zygote_collect - Pick up the helpers the master has forked so far */
+static void zygote_collect(void)
+{
+    union {
+        struct cmsghdr h;
+        char space[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *c;
+    pid_t pid;
+    ssize_t n;
+    int i;
+
+    while (zmaster.asked > 0) {
+        iov.iov_base = &pid;
+        iov.iov_len = sizeof(pid);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.space;
+        msg.msg_controllen = sizeof(ctl.space);
+        n = recvmsg(zmaster.sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        c = CMSG_FIRSTHDR(&msg);
+        if (n != sizeof(pid) || c == NULL || c->cmsg_type != SCM_RIGHTS) {
+            close(zmaster.sock);        /* the master died: no more helpers */
+            zmaster.sock = -1;
+            zmaster.asked = 0;
+            return;
+        }
+        zmaster.asked--;
+        for (i = 0; i < ZYG_MAX && zygotes[i].pid != 0; i++)
+            ;
+        zygotes[i].pid = pid;
+        memcpy(&zygotes[i].sock, CMSG_DATA(c), sizeof(int));
+        zygotes[i].gen = zmaster.gen;
+        zygote_idle++;
+    }
+}
+
+/* zygote_refill - Ask the master for helpers up to zygote_size */
+void zygote_refill(void)
+{
+    char req = 0;
+
+    while (zmaster.sock >= 0 && zygote_idle + zmaster.asked < zygote_size
+           && send(zmaster.sock, &req, 1, MSG_NOSIGNAL | MSG_DONTWAIT) == 1)
+        zmaster.asked++;
+}
+
+/*
+ * zygote_launch - Hand argv and lo's NAME=value words to an idle helper
+ *    and return its pid, or -1 if the command needs the fork path.
+ *    out_fd replaces stdout and stderr and exec_fd is the -P exec
+ *    pipe, each if not -1.
+ */
+pid_t zygote_launch(char **argv, int out_fd, int exec_fd, struct launch_opts *lo)
+{
+    static char buf[ZYG_MSG];
+    struct zygote *z = NULL;
+    struct zyg_msg m;
+    struct iovec iov[2] = { { &m, sizeof(m) }, { buf, 0 } };
+    union {
+        struct cmsghdr h;
+        char space[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *c;
+    char **envp;
+    int fds[3], nfds = 0, i, ok;
+    size_t len = 0;
+    pid_t pid;
+
+    if (zygote_size == 0)
+        return -1;
+    zygote_collect();
+    if (zygote_idle == 0 || lo->redir != NULL || lo->cache != NULL
+        || strcmp(argv[0], "remote") == 0 || fast_builtin_name(argv[0]))
+        return -1;
+    for (i = 0; i < ZYG_MAX && z == NULL; i++)
+        if (zygotes[i].pid != 0)
+            z = &zygotes[i];
+
+    memset(&m, 0, sizeof(m));
+    m.prio = lo->prio;
+    for (m.argc = 0; argv[m.argc] != NULL; m.argc++)
+        ;
+    m.envc = -1;
+    m.nprefix = lo->nenv;
+    envp = env_envp();
+    if (zygote_strings(buf, &len, argv, m.argc) < 0)
+        return -1;
+    if (env_gen != z->gen) {            /* the helper's copy is stale */
+        for (m.envc = 0; envp[m.envc] != NULL; m.envc++)
+            ;
+        if (zygote_strings(buf, &len, envp, m.envc) < 0)
+            return -1;
+    }
+    if (zygote_strings(buf, &len, lo->env, lo->nenv) < 0)
+        return -1;
+    iov[1].iov_len = len;
+
+    if ((fds[nfds++] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+    if ((m.has_out = out_fd >= 0))
+        fds[nfds++] = out_fd;
+    if ((m.has_exec = exec_fd >= 0))
+        fds[nfds++] = exec_fd;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+
+    while ((ok = sendmsg(z->sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    close(fds[0]);
+    close(z->sock);
+    pid = z->pid;
+    z->pid = 0;
+    zygote_idle--;
+    if (ok < 0) {                       /* the helper died: reap it */
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return pid;
+}
+
+/* zygote_init - Start the master and fill the pool, if -Z asked for one */
+void zygote_init(void)
+{
+    posix_spawnattr_t attr;
+    sigset_t all;
+    char fd[16], shell[16];
+    char *argv[] = { "tsh", "--zygote-helper", fd, shell, NULL };
+    int sv[2], err;
+
+    if (zygote_size > ZYG_MAX)
+        zygote_size = ZYG_MAX;
+    if (zygote_size == 0 || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+        return;
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);  /* only the master's end goes along */
+    snprintf(fd, sizeof(fd), "%d", sv[1]);
+    snprintf(shell, sizeof(shell), "%d", (int)getpid());
+    sigfillset(&all);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, 0);    /* off the terminal's signals */
+    posix_spawnattr_setsigmask(&attr, &all);
+    err = posix_spawn(&zmaster.pid, "/proc/self/exe", NULL, &attr, argv, env_envp());
+    posix_spawnattr_destroy(&attr);
+    close(sv[1]);
+    if (err != 0) {
+        close(sv[0]);
+        return;
+    }
+    zmaster.sock = sv[0];
+    zmaster.gen = env_gen;
+    zygote_refill();
+}
+/**********************************************
+ * end zygote pool
+ **********************************************/
+
+/***********************************************
+ * Multi-session server (--server)
+ *
+ * One process serves every session on a Unix socket. Sessions are
+ * small structs with their own job list and history; all sockets
+ * and SIGCHLD (through a signalfd) are multiplexed with epoll, and
+ * children are found again through a pid hash. A session stops being
+ * read while its buffer is full of lines it cannot run yet (behind a
+ * foreground job) and once its client has hung up; the lines it
+ * already sent are still run before it is closed.
+ **********************************************/
+
+#define SESS_USER   0   /* waiting for the user name */
+#define SESS_PASS   1   /* waiting for the password */
+#define SESS_SHELL  2   /* logged in */
+#define SESS_QUIT   3   /* quit: run nothing more, close */
+
+#define PIDMAP_SIZE 4096
+
+struct sjob_t {                 /* A job owned by one session */
+    pid_t pid;
+    int jid;
+    int state;                  /* BG, FG or ST */
+    long long start_ns;         /* audit_now() at launch */
+    struct quser *quser;        /* submitter, if it came from the queue */
+    struct session_t *sess;
+    struct sjob_t *next;        /* next job of the same session */
+    struct sjob_t *hnext;       /* next job in the pid hash chain */
+    char cmdline[];
+};
+
+struct session_t {              /* One connected client */
+    int fd;
+    int state;                  /* SESS_USER, SESS_PASS, SESS_SHELL or SESS_QUIT */
+    char user[32];              /* name typed at the username prompt, then the
+                                   logged in user: a copy, as cred_refresh
+                                   may free the index entry at any login */
+    pid_t fg;                   /* foreground child, 0 if none */
+    struct sjob_t *jobs;
+    char *history[10];
+    int history_index;
+    struct histfile hist;       /* the user's shared .tsh_history */
+    int eof;                    /* the client has sent all it will */
+    int skip;                   /* dropping an overlong line up to its newline */
+    int watched;                /* fd is in the epoll set */
+    size_t inlen;
+    char inbuf[MAXLINE];
+};
+
+static struct sjob_t *pidmap[PIDMAP_SIZE];
+static struct jobqueue server_queue;    /* submit, shared by all sessions */
+static int server_listen_fd = -1;
+static int server_signal_fd = -1;
+static int server_epfd = -1;
+static long server_sessions = 0;
+
+/* sess_write - Best effort send; a client that stops reading loses output */
+static void sess_write(struct session_t *s, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(s->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* sess_printf - printf to a session's socket */
+static void sess_printf(struct session_t *s, const char *fmt, ...)
+{
+    char buf[MAXLINE + 128];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n > (int)sizeof(buf) - 1)
+        n = sizeof(buf) - 1;
+    if (n > 0)
+        sess_write(s, buf, n);
+}
+
+/* sess_put - queue_submit output callback: write line to the session ctx */
+static void sess_put(void *ctx, const char *line)
+{
+    sess_printf(ctx, "%s", line);
+}
+
+/* sjob_find - Look up a session job by pid in the pid hash */
+static struct sjob_t *sjob_find(pid_t pid)
+{
+    struct sjob_t *j;
+
+    for (j = pidmap[pid % PIDMAP_SIZE]; j != NULL; j = j->hnext)
+        if (j->pid == pid)
+            return j;
+    return NULL;
+}
+
+/* sjob_add - Add a job to session s and the pid hash */
+static struct sjob_t *sjob_add(struct session_t *s, pid_t pid, int state, char *cmdline)
+{
+    struct sjob_t *j, **tail;
+    size_t len = strlen(cmdline);
+    int jid = 1;
+
+    for (j = s->jobs; j != NULL; j = j->next)
+        if (j->jid >= jid)
+            jid = j->jid + 1;
+
+    if ((j = malloc(sizeof(*j) + len + 1)) == NULL)
+        return NULL;
+    j->pid = pid;
+    j->jid = jid;
+    j->state = state;
+    j->start_ns = audit_now();
+    j->quser = NULL;
+    j->sess = s;
+    j->next = NULL;
+    memcpy(j->cmdline, cmdline, len + 1);
+
+    for (tail = &s->jobs; *tail != NULL; tail = &(*tail)->next)
+        ;
+    *tail = j;
+    j->hnext = pidmap[pid % PIDMAP_SIZE];
+    pidmap[pid % PIDMAP_SIZE] = j;
+    return j;
+}
+
+/* sjob_delete - Unlink a job from its session and the pid hash, free it */
+static void sjob_delete(struct sjob_t *job)
+{
+    struct sjob_t **p;
+
+    for (p = &pidmap[job->pid % PIDMAP_SIZE]; *p != NULL; p = &(*p)->hnext)
+        if (*p == job) {
+            *p = job->hnext;
+            break;
+        }
+    for (p = &job->sess->jobs; *p != NULL; p = &(*p)->next)
+        if (*p == job) {
+            *p = job->next;
+            break;
+        }
+    if (job->quser != NULL) {
+        queue_done(&server_queue, job->quser);
+        free(job);
+        queue_run(&server_queue);
+        return;
+    }
+    free(job);
+}
+
+/* sess_prompt - Print the prompt for the session's current state */
+static void sess_prompt(struct session_t *s)
+{
+    if (s->state == SESS_USER)
+        sess_printf(s, "username: ");
+    else if (s->state == SESS_PASS)
+        sess_printf(s, "password: ");
+    else
+        sess_printf(s, "%s", prompt);
+}
+
+/* sess_history_path - Build <root>/home/<user>/.tsh_history */
+static void sess_history_path(struct session_t *s, char *buf)
+{
+    if (snprintf(buf, MAXLINE, "%s%s%s", home_path, s->user, file_end) >= MAXLINE)
+        buf[0] = '\0';                 /* root too long: no history */
+}
+
+/* sess_history_push - hist_push_t for a session's ring */
+static void sess_history_push(void *ctx, const char *line)
+{
+    struct session_t *s = ctx;
+
+    free(s->history[s->history_index]);
+    s->history[s->history_index] = strdup(line);
+    s->history_index = (s->history_index + 1) % 10;
+}
+
+/* sess_load_history - Open the user's shared history for the session */
+static void sess_load_history(struct session_t *s)
+{
+    char path[MAXLINE];
+
+    sess_history_path(s, path);
+    if (hist_open(&s->hist, path) == 0)
+        hist_sync(&s->hist, path, sess_history_push, s);
+}
+
+/* sess_update_history - Session counterpart of update_tsh_history */
+static void sess_update_history(struct session_t *s, char *cmdline)
+{
+    char path[MAXLINE];
+
+    sess_history_path(s, path);
+    hist_append(&s->hist, path, cmdline, sess_history_push, s);
+}
+
+/* sess_history_nth - The Nth (1-based, oldest first) history entry */
+static char *sess_history_nth(struct session_t *s, int n)
+{
+    if (s->history[s->history_index] == NULL)
+        return s->history[n - 1];
+    return s->history[(n + s->history_index - 1) % 10];
+}
+
+static void sess_eval(struct session_t *s, char *cmdline);
+
+/*
+ * sess_fast_builtin - Run a fork-free builtin with stdout captured and
+ *    sent to session s; -1 if argv is not one. sleep and cd stay out:
+ *    they would block or move the whole server.
+ */
+static int sess_fast_builtin(struct session_t *s, char **argv)
+{
+    FILE *out, *saved = stdout;
+    char *buf = NULL;
+    size_t len = 0;
+    int status;
+
+    if (!fast_builtin_name(argv[0]) || strcmp(argv[0], "sleep") == 0
+        || strcmp(argv[0], "cd") == 0)
+        return -1;
+    fflush(stdout);
+    if ((out = open_memstream(&buf, &len)) == NULL)
+        return -1;
+    stdout = out;
+    status = fast_builtin(argv);
+    stdout = saved;
+    fclose(out);
+    sess_write(s, buf, len);
+    free(buf);
+    return status;
+}
+
+/* sess_builtin - Run a builtin for session s; its status, or -1 if not one */
+static int sess_builtin(struct session_t *s, char **argv)
+{
+    struct sjob_t *j;
+    int i;
+
+    if (strcmp(argv[0], "quit") == 0 || strcmp(argv[0], "logout") == 0) {
+        for (j = s->jobs; j != NULL; j = j->next)
+            if (j->state == ST) {
+                sess_printf(s, "There are suspended jobs.\n");
+                return 1;
+            }
+        s->state = SESS_QUIT;
+        return 0;
+    }
+    if (strcmp(argv[0], "jobs") == 0) {
+        for (j = s->jobs; j != NULL; j = j->next)
+            sess_printf(s, "[%d] (%d) %s%s", j->jid, j->pid,
+                        j->state == ST ? "Stopped " : "Running ", j->cmdline);
+        queue_list(&server_queue, s, sess_put, s);
+        return 0;
+    }
+    if (strcmp(argv[0], "submit") == 0) {
+        queue_submit(&server_queue, argv, s->user, s,
+                     strcmp(s->user, "root") == 0, NULL, 0, sess_put, s);
+        return 0;
+    }
+    if (strcmp(argv[0], "history") == 0) {
+        for (i = 1; i <= 10; i++) {
+            char *h = sess_history_nth(s, i);
+            if (h == NULL)
+                break;
+            sess_printf(s, "%d %s\n", i, h);
+        }
+        return 0;
+    }
+    if (argv[0][0] == '!' && isdigit((unsigned char)argv[0][1])) {
+        int n = atoi(argv[0] + 1);
+        char *h, path[MAXLINE];
+
+        sess_history_path(s, path);
+        hist_sync(&s->hist, path, sess_history_push, s);
+        h = (n >= 1 && n <= 10) ? sess_history_nth(s, n) : NULL;
+        if (h != NULL && h[0] != '!') {
+            char line[MAXLINE];
+            strcpy(line, h);
+            sess_eval(s, line);
+        }
+        return 0;
+    }
+    if (strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0) {
+        int value = argv[1] ? atoi(argv[1]) : 0;
+        for (j = s->jobs; j != NULL; j = j->next)
+            if (j->jid == value || j->pid == value)
+                break;
+        if (j == NULL) {
+            sess_printf(s, "Invalid JID/PID Entered.\n");
+            return 1;
+        }
+        kill(j->pid, SIGCONT);
+        if (argv[0][0] == 'f') {
+            j->state = FG;
+            s->fg = j->pid;
+        }
+        else {
+            j->state = BG;
+        }
+        return 0;
+    }
+    if (strcmp(argv[0], "adduser") == 0) {
+        sess_printf(s, "adduser is not available in server mode.\n");
+        return 1;
+    }
+    return sess_fast_builtin(s, argv);
+}
+
+/*
+ * sess_spawn - Fork argv for session s, with the nice and I/O
+ *    priority of submit class prio unless it is -1, and add the job
+ */
+static struct sjob_t *sess_spawn(struct session_t *s, char **argv, int bg, char *cmdline,
+                                 int prio)
+{
+    struct sjob_t *job;
+    sigset_t empty;
+    pid_t pid;
+
+    if ((pid = fork()) == 0) {
+        int devnull = open("/dev/null", O_RDONLY);
+
+        setpgid(0, 0);
+        if (prio >= 0)
+            queue_prio(prio);
+        username = s->user;
+        create_proc_entry(getpid(), getppid(), getpid(), argv[0], bg ? "R" : "R+");
+
+        dup2(devnull, STDIN_FILENO);
+        dup2(s->fd, STDOUT_FILENO);
+        dup2(s->fd, STDERR_FILENO);
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        signal(SIGPIPE, SIG_DFL);
+
+        execve(argv[0], argv, environ);
+        printf("%s: Command not found.\n", argv[0]);
+        exit(0);
+    }
+    if (pid < 0) {
+        sess_printf(s, "fork: %s\n", strerror(errno));
+        return NULL;
+    }
+    if ((job = sjob_add(s, pid, bg ? BG : FG, cmdline)) == NULL)
+        kill(pid, SIGKILL);             /* reaped as an unknown child */
+    return job;
+}
+
+/* sess_queue_start - The server queue's start callback */
+static int sess_queue_start(struct qjob *j)
+{
+    struct sjob_t *job = sess_spawn(j->owner, j->argv, 1, j->cmdline, j->prio);
+
+    if (job == NULL)
+        return -1;
+    job->quser = j->user;
+    sess_printf(j->owner, "%d %s", job->pid, j->cmdline);
+    return 0;
+}
+
+/* sess_eval - Evaluate one command line for session s */
+static void sess_eval(struct session_t *s, char *cmdline)
+{
+    char *argv[MAXARGS];
+    struct sjob_t *job;
+    int bg, status;
+    long long start_ns = audit_now();
+
+    bg = parseline(cmdline, argv);
+    if (argv[0] == NULL)
+        return;
+
+    if (argv[0][0] != '!')
+        sess_update_history(s, cmdline);
+    if ((status = sess_builtin(s, argv)) >= 0) {
+        audit_record(s->user, getpid(), status, start_ns, cmdline);
+        return;
+    }
+
+    if ((job = sess_spawn(s, argv, bg, cmdline, -1)) == NULL)
+        return;
+    if (bg)
+        sess_printf(s, "%d %s", job->pid, cmdline);
+    else
+        s->fg = job->pid;
+}
+
+/* sess_login_line - Handle one line typed at the login prompts */
+static void sess_login_line(struct session_t *s, char *line)
+{
+    char *word = strtok(line, " \t\r\n");
+    struct cred_t *cred;
+
+    if (word == NULL)
+        word = "";
+    if (strcmp(word, "quit") == 0) {
+        s->state = SESS_QUIT;
+        return;
+    }
+
+    if (s->state == SESS_USER) {
+        snprintf(s->user, sizeof(s->user), "%s", word);
+        s->state = SESS_PASS;
+        return;
+    }
+
+    cred_refresh();
+    cred = cred_lookup(s->user);
+    if (cred == NULL || strcmp(cred->password, word) != 0) {
+        s->state = SESS_USER;
+        sess_printf(s, "User Authentication failed. Please try again.\n");
+        return;
+    }
+    s->state = SESS_SHELL;
+    sess_load_history(s);
+}
+
+/* sess_run_input - Consume complete lines until the session blocks on a job */
+static void sess_run_input(struct session_t *s)
+{
+    char line[MAXLINE];
+    char *nl;
+
+    while (s->fg == 0 && s->state != SESS_QUIT
+           && (nl = memchr(s->inbuf, '\n', s->inlen)) != NULL) {
+        size_t len = nl - s->inbuf + 1;
+
+        memcpy(line, s->inbuf, len);
+        line[len] = '\0';
+        s->inlen -= len;
+        memmove(s->inbuf, s->inbuf + len, s->inlen);
+
+        if (s->state == SESS_SHELL)
+            sess_eval(s, line);
+        else
+            sess_login_line(s, line);
+        if (s->fg == 0 && s->state != SESS_QUIT)
+            sess_prompt(s);
+    }
+}
+
+/* sess_close - Hang up a session's jobs and free it */
+static void sess_close(struct session_t *s)
+{
+    int i;
+
+    queue_drop(&server_queue, s);
+    while (s->jobs != NULL) {
+        killpg(s->jobs->pid, SIGHUP);
+        killpg(s->jobs->pid, SIGCONT);
+        sjob_delete(s->jobs);
+    }
+    for (i = 0; i < 10; i++)
+        free(s->history[i]);
+    hist_close(&s->hist);
+    close(s->fd);           /* also drops it from the epoll set */
+    free(s);
+    server_sessions--;
+}
+
+/*
+ * sess_input - Run the lines s has sent, then watch its socket only
+ *    while there is room to read into. Once s has quit, or hung up
+ *    with nothing left to run, it is closed and -1 returned; from
+ *    server_reap, whose epoll batch may still hold an event for s, the
+ *    socket is shut for reading instead so that event closes it.
+ */
+static int sess_input(struct session_t *s, int reaping)
+{
+    struct epoll_event ev;
+    int want;
+
+    sess_run_input(s);
+    if (s->state == SESS_QUIT
+        || (s->eof && s->fg == 0 && memchr(s->inbuf, '\n', s->inlen) == NULL)) {
+        if (!reaping) {
+            sess_close(s);
+            return -1;
+        }
+        shutdown(s->fd, SHUT_RD);       /* reads as EOF from now on */
+        s->eof = 1;
+        s->inlen = 0;
+        want = 1;
+    }
+    else {
+        want = !s->eof && s->inlen < sizeof(s->inbuf);
+    }
+    if (want != s->watched) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        epoll_ctl(server_epfd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, s->fd, &ev);
+        s->watched = want;
+    }
+    return 0;
+}
+
+/* server_reap - Collect every child that changed state */
+static void server_reap(void)
+{
+    struct signalfd_siginfo si;
+    int status;
+    pid_t pid;
+
+    while (read(server_signal_fd, &si, sizeof(si)) == sizeof(si))
+        ;
+
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        struct sjob_t *j = sjob_find(pid);
+        struct session_t *s = j ? j->sess : NULL;
+
+        if (WIFCONTINUED(status))
+            continue;
+        if (WIFSTOPPED(status)) {
+            if (j != NULL)
+                j->state = ST;
+        }
+        else {
+            remove_proc_entry(pid);
+            if (j != NULL) {
+                audit_record(s->user, pid, WIFEXITED(status) ? WEXITSTATUS(status)
+                             : 128 + WTERMSIG(status), j->start_ns, j->cmdline);
+                sjob_delete(j);
+            }
+        }
+        if (s != NULL && s->fg == pid) {    /* release the session */
+            s->fg = 0;
+            sess_prompt(s);
+            sess_input(s, 1);
+        }
+    }
+}
+
+/* server_accept - Accept every pending connection */
+static void server_accept(int epfd)
+{
+    struct epoll_event ev;
+    struct session_t *s;
+    int fd;
+
+    while ((fd = accept4(server_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if ((s = calloc(1, sizeof(*s))) == NULL) {
+            close(fd);
+            continue;
+        }
+        s->fd = fd;
+        s->state = SESS_USER;
+        s->hist.fd = -1;
+        s->watched = 1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(s);
+            continue;
+        }
+        server_sessions++;
+        sess_prompt(s);
+    }
+}
+
+/*
+ * server_read - Read what a session sent, until its buffer is full of
+ *    lines or the client hangs up (s->eof). A line too long for the
+ *    buffer is dropped. Returns -1 on a socket error.
+ */
+static int server_read(struct session_t *s)
+{
+    ssize_t n;
+    char *nl;
+
+    while (!s->eof) {
+        if (s->inlen == sizeof(s->inbuf)) {
+            if (memchr(s->inbuf, '\n', s->inlen) != NULL)
+                return 0;               /* sess_input stops watching */
+            s->inlen = 0;               /* one overlong line: drop it */
+            s->skip = 1;
+        }
+        n = read(s->fd, s->inbuf + s->inlen, sizeof(s->inbuf) - s->inlen);
+        if (n > 0 && s->skip) {         /* keep what follows its newline */
+            if ((nl = memchr(s->inbuf + s->inlen, '\n', n)) == NULL)
+                continue;
+            n -= nl + 1 - (s->inbuf + s->inlen);
+            memmove(s->inbuf + s->inlen, nl + 1, n);
+            s->skip = 0;
+        }
+        if (n > 0) {
+            s->inlen += n;
+            continue;
+        }
+        if (n == 0) {                   /* a last line may lack its newline */
+            s->eof = 1;
+            if (s->inlen > 0 && s->inbuf[s->inlen - 1] != '\n' && !s->skip
+                && s->inlen < sizeof(s->inbuf))
+                s->inbuf[s->inlen++] = '\n';
+            return 0;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * server_main - Serve sessions on the Unix socket at path. Never returns.
+ */
+void server_main(char *path)
+{
+    struct sockaddr_un addr;
+    struct epoll_event ev, events[64];
+    struct rlimit rl;
+    sigset_t mask;
+    int epfd, i, n;
+    static char listen_tag, signal_tag;
+
+    if (cred_refresh() < 0) {
+        perror(passwd_path);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Every session costs a descriptor; take all we are allowed */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        app_error("server socket path too long");
+    strcpy(addr.sun_path, path);
+
+    server_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_listen_fd < 0)
+        unix_error("socket error");
+    unlink(path);
+    if (bind(server_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        unix_error("bind error");
+    if (listen(server_listen_fd, SOMAXCONN) < 0)
+        unix_error("listen error");
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    if ((server_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    server_epfd = epfd;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_tag;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, server_listen_fd, &ev);
+    ev.data.ptr = &signal_tag;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, server_signal_fd, &ev);
+
+    session_leader_pid = getpid();
+    username = "root";
+    audit_init();
+    queue_init(&server_queue, sess_queue_start);
+    create_proc_entry(getpid(), getppid(), getpgid(0), "Server", "Ss");
+    if (verbose)
+        printf("tsh: serving sessions on %s\n", path);
+    fflush(stdout);
+
+    while (1) {
+        n = epoll_wait(epfd, events, 64, audit_due());
+        if (n == 0)
+            audit_flush();
+        for (i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+
+            if (tag == &listen_tag) {
+                server_accept(epfd);
+            }
+            else if (tag == &signal_tag) {
+                server_reap();
+            }
+            else {
+                struct session_t *s = tag;
+                if (server_read(s) < 0) {
+                    sess_close(s);
+                    continue;
+                }
+                sess_input(s, 0);
+            }
+        }
+    }
+}
+/**********************************************
+ * end multi-session server
+ **********************************************/
+
+/***********************************************
+ * Remote job execution (--worker, remote)
+ *
+ * A worker agent runs commands on behalf of other shells. The wire
+ * format is a stream of frames: a one byte type, a four byte
+ * big-endian length and the payload.
+ *
+ *   client -> worker   'L' load query          'R' run (argv, NUL separated)
+ *                      'S' signal (4 byte signo)
+ *   worker -> client   'L' running jobs (4 byte count)
+ *                      'O' stdout data   'E' stderr data
+ *                      'X' wait status (4 bytes)
+ *
+ * Every connection opens with an 'A' frame carrying the shared secret
+ * from the file named by TSH_WORKER_TOKEN; the worker drops any
+ * connection whose first frame is not that. Workers listen on Unix
+ * sockets or loopback addresses only, unless TSH_WORKER_PUBLIC=1.
+ *
+ * On the client, "remote cmd args" is an ordinary job: the forked
+ * child becomes a proxy that relays output and forwards the signals
+ * it receives, so jobs, fg, bg, ctrl-c and ctrl-z work unchanged.
+ **********************************************/
+
+#define RFRAME_MAX 65536    /* largest payload we send or accept */
+#define TOKEN_MAX  256      /* longest shared secret */
+#define AUTH_WAIT  5        /* seconds a peer has to authenticate */
+
+static int remote_conn = -1;            /* proxy's connection to its worker */
+static volatile sig_atomic_t worker_reaped = 0;
+
+/* rio_writen - Write all n bytes, restarting after signals */
+static int rio_writen(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* rio_readn - Read exactly n bytes; -1 on error or early EOF */
+static int rio_readn(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+/* rframe_write - Send one frame. Async-signal-safe. */
+static int rframe_write(int fd, char type, const void *buf, uint32_t len)
+{
+    unsigned char hdr[5];
+
+    hdr[0] = type;
+    hdr[1] = len >> 24;
+    hdr[2] = len >> 16;
+    hdr[3] = len >> 8;
+    hdr[4] = len;
+    if (rio_writen(fd, hdr, 5) < 0)
+        return -1;
+    return len ? rio_writen(fd, buf, len) : 0;
+}
+
+/* rframe_write32 - Send a frame carrying one 32-bit value */
+static int rframe_write32(int fd, char type, uint32_t v)
+{
+    unsigned char b[4] = { v >> 24, v >> 16, v >> 8, v };
+    return rframe_write(fd, type, b, 4);
+}
+
+/* rframe_read - Receive one frame into buf; returns payload length or -1 */
+static long rframe_read(int fd, char *type, void *buf, uint32_t cap)
+{
+    unsigned char hdr[5];
+    uint32_t len;
+
+    if (rio_readn(fd, hdr, 5) < 0)
+        return -1;
+    len = ((uint32_t)hdr[1] << 24) | (hdr[2] << 16) | (hdr[3] << 8) | hdr[4];
+    if (len > cap)
+        return -1;
+    if (len && rio_readn(fd, buf, len) < 0)
+        return -1;
+    *type = hdr[0];
+    return len;
+}
+
+/* rframe_get32 - Decode the 32-bit value carried by a frame */
+static uint32_t rframe_get32(const unsigned char *b)
+{
+    return ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+/*
+ * worker_token - Read the shared secret from the file named by
+ *    TSH_WORKER_TOKEN into buf (TOKEN_MAX bytes). Returns its length
+ *    without a trailing newline, or -1 if there is none.
+ */
+static int worker_token(char *buf)
+{
+    char *path = getenv("TSH_WORKER_TOKEN");
+    ssize_t n;
+    int fd;
+
+    if (path == NULL || *path == '\0' || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, buf, TOKEN_MAX);
+    close(fd);
+    while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r'))
+        n--;
+    return n > 0 ? n : -1;
+}
+
+/* token_equal - Compare two secrets in time independent of their contents */
+static int token_equal(const char *a, long alen, const char *b, long blen)
+{
+    unsigned char diff = alen != blen;
+    long i;
+
+    for (i = 0; i < alen && i < blen; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+/* addr_loopback - True if sa is a 127.0.0.0/8 or ::1 address */
+static int addr_loopback(const struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET)
+        return ntohl(((const struct sockaddr_in *)sa)->sin_addr.s_addr) >> 24 == 127;
+    if (sa->sa_family == AF_INET6) {
+        const struct in6_addr *a = &((const struct sockaddr_in6 *)sa)->sin6_addr;
+
+        return IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return 0;
+}
+
+/*
+ * remote_connect - Connect to a worker address: a path containing '/'
+ *    is a Unix socket, anything else is host:port over TCP.
+ */
+int remote_connect(const char *addr)
+{
+    int fd = -1;
+
+    if (strchr(addr, '/') != NULL) {
+        struct sockaddr_un un;
+
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(un.sun_path))
+            return -1;
+        strcpy(un.sun_path, addr);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    else {
+        char host[MAXLINE];
+        char *port;
+        struct addrinfo hints, *res, *ai;
+
+        snprintf(host, sizeof(host), "%s", addr);
+        if ((port = strrchr(host, ':')) == NULL)
+            return -1;
+        *port++ = '\0';
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, port, &hints, &res) != 0)
+            return -1;
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+            if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+                continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd >= 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return fd;
+    }
+}
+
+/*
+ * remote_listen - Listen on a worker address (see remote_connect). A
+ *    TCP address must be loopback unless TSH_WORKER_PUBLIC=1. An empty
+ *    host means 127.0.0.1, or every interface with TSH_WORKER_PUBLIC=1.
+ */
+static int remote_listen(const char *addr)
+{
+    int fd, one = 1;
+
+    if (strchr(addr, '/') != NULL) {
+        struct sockaddr_un un;
+
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(un.sun_path))
+            app_error("worker socket path too long");
+        strcpy(un.sun_path, addr);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            unix_error("socket error");
+        unlink(addr);
+        if (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0)
+            unix_error("bind error");
+    }
+    else {
+        char host[MAXLINE];
+        char *port;
+        struct addrinfo hints, *res;
+
+        snprintf(host, sizeof(host), "%s", addr);
+        if ((port = strrchr(host, ':')) == NULL)
+            app_error("worker address must be a socket path or host:port");
+        *port++ = '\0';
+        char *public = getenv("TSH_WORKER_PUBLIC");
+        int open_to_all = public != NULL && strcmp(public, "1") == 0;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(*host ? host : open_to_all ? NULL : "127.0.0.1",
+                        port, &hints, &res) != 0)
+            app_error("worker address lookup failed");
+        if (!open_to_all && !addr_loopback(res->ai_addr))
+            app_error("worker address is not loopback (set TSH_WORKER_PUBLIC=1 to allow)");
+        if ((fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol)) < 0)
+            unix_error("socket error");
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, res->ai_addr, res->ai_addrlen) < 0)
+            unix_error("bind error");
+        freeaddrinfo(res);
+    }
+    if (listen(fd, SOMAXCONN) < 0)
+        unix_error("listen error");
+    return fd;
+}
+
+/*
+ * worker_serve_job - Run one command for a client on conn: stream its
+ *    output back, apply the signals the client forwards and finish
+ *    with its wait status. Runs in a child of the worker.
+ */
+static void worker_serve_job(int conn, char *payload, long len)
+{
+    char *argv[MAXARGS];
+    int out[2], err[2], argc = 0, status = 0, open_pipes = 2;
+    long off = 0;
+    pid_t pid;
+    sigset_t empty;
+    struct timeval forever = { 0, 0 };
+
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever));
+    payload[len] = '\0';
+    while (off < len && argc < MAXARGS - 1) {
+        argv[argc++] = payload + off;
+        off += strlen(payload + off) + 1;
+    }
+    argv[argc] = NULL;
+    if (argc == 0)
+        exit(0);
+
+    if (pipe(out) < 0 || pipe(err) < 0)
+        exit(1);
+    if ((pid = fork()) == 0) {
+        int devnull = open("/dev/null", O_RDONLY);
+
+        setpgid(0, 0);
+        dup2(devnull, STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(out[0]);
+        close(err[0]);
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        signal(SIGINT, SIG_DFL);    /* the worker may run with these ignored */
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        execve(argv[0], argv, environ);
+        printf("%s: Command not found.\n", argv[0]);
+        exit(127);
+    }
+    setpgid(pid, pid);
+    close(out[1]);
+    close(err[1]);
+
+    while (open_pipes > 0) {
+        struct pollfd fds[3] = {
+            { out[0], POLLIN, 0 }, { err[0], POLLIN, 0 }, { conn, POLLIN, 0 }
+        };
+        char buf[RFRAME_MAX];
+        int i;
+
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < 2; i++) {
+            ssize_t n;
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP)))
+                continue;
+            n = read(fds[i].fd, buf, sizeof(buf));
+            if (n > 0) {
+                rframe_write(conn, i == 0 ? 'O' : 'E', buf, n);
+            }
+            else if (n == 0 || errno != EINTR) {
+                close(fds[i].fd);
+                if (i == 0)
+                    out[0] = -1;
+                else
+                    err[0] = -1;
+                open_pipes--;
+            }
+        }
+        if (fds[2].revents & (POLLIN | POLLHUP)) {
+            char type;
+            if (rframe_read(conn, &type, buf, sizeof(buf)) < 0) {
+                killpg(pid, SIGHUP);        /* client went away */
+                killpg(pid, SIGCONT);
+                break;
+            }
+            if (type == 'S')
+                killpg(pid, (int)rframe_get32((unsigned char *)buf));
+        }
+    }
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    rframe_write32(conn, 'X', (uint32_t)status);
+    exit(0);
+}
+
+/* worker_sigchld - Note that a job handler exited */
+static void worker_sigchld(int sig)
+{
+    worker_reaped = 1;
+}
+
+/*
+ * worker_serve - Check the shared secret on conn and answer its one
+ *    request: a load query ('L', answered with load) or a job ('R').
+ *    Runs in a child forked right after accept, so a peer that sends
+ *    nothing only holds up its own child until AUTH_WAIT runs out.
+ */
+static void worker_serve(int conn, const char *token, int tlen, int load)
+{
+    char payload[RFRAME_MAX + 1];
+    char type;
+    long len;
+    struct timeval wait = { AUTH_WAIT, 0 };
+
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    len = rframe_read(conn, &type, payload, RFRAME_MAX);
+    if (len < 0 || type != 'A' || !token_equal(payload, len, token, tlen))
+        exit(1);                        /* no secret, no service */
+    len = rframe_read(conn, &type, payload, RFRAME_MAX);
+    if (len >= 0 && type == 'L')
+        rframe_write32(conn, 'L', (uint32_t)load);
+    else if (len >= 0 && type == 'R')
+        worker_serve_job(conn, payload, len);
+    exit(0);
+}
+
+/*
+ * worker_main - Accept jobs from other shells on addr. Every
+ *    connection gets its own child. Never returns.
+ */
+void worker_main(char *addr)
+{
+    char token[TOKEN_MAX];
+    int tlen = worker_token(token);
+    int lfd, running = 0;               /* connections being served */
+
+    if (tlen < 0)
+        app_error("--worker needs TSH_WORKER_TOKEN, a file holding the shared secret");
+    lfd = remote_listen(addr);
+
+    Signal(SIGCHLD, worker_sigchld);
+    signal(SIGPIPE, SIG_IGN);
+    if (verbose)
+        printf("tsh: worker listening on %s\n", addr);
+    fflush(stdout);
+
+    while (1) {
+        int conn;
+        pid_t pid;
+
+        if ((conn = accept(lfd, NULL, NULL)) < 0)
+            continue;
+        fcntl(conn, F_SETFD, FD_CLOEXEC);
+
+        if (worker_reaped) {    /* keep the load figure current */
+            worker_reaped = 0;
+            while (waitpid(-1, NULL, WNOHANG) > 0)
+                running--;
+        }
+
+        /* Load probes are over in a moment; jobs make up the count */
+        if ((pid = fork()) == 0) {
+            close(lfd);
+            Signal(SIGCHLD, SIG_DFL);
+            worker_serve(conn, token, tlen, running);
+        }
+        if (pid > 0)
+            running++;
+        close(conn);
+    }
+}
+
+/* remote_dial - Connect to a worker and present the shared secret */
+static int remote_dial(const char *addr, const char *token, int tlen)
+{
+    int fd = remote_connect(addr);
+
+    if (fd >= 0 && rframe_write(fd, 'A', token, tlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* remote_pick - Connect to the least loaded worker in TSH_WORKERS */
+static int remote_pick(void)
+{
+    char *list = getenv("TSH_WORKERS");
+    char copy[MAXLINE], token[TOKEN_MAX];
+    char *addr, *save = NULL, best[MAXLINE] = "";
+    uint32_t best_load = UINT32_MAX;
+    int ties = 0, tlen;
+
+    if (list == NULL || *list == '\0') {
+        printf("remote: TSH_WORKERS is not set.\n");
+        return -1;
+    }
+    if ((tlen = worker_token(token)) < 0) {
+        printf("remote: TSH_WORKER_TOKEN does not name a readable secret file.\n");
+        return -1;
+    }
+    srand((unsigned)getpid() ^ (unsigned)time(NULL));
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (addr = strtok_r(copy, ",", &save); addr != NULL; addr = strtok_r(NULL, ",", &save)) {
+        unsigned char b[4];
+        char type;
+        int fd = remote_dial(addr, token, tlen);
+
+        if (fd < 0)
+            continue;
+        /* ties are broken at random so idle workers share new jobs */
+        if (rframe_write(fd, 'L', NULL, 0) == 0
+            && rframe_read(fd, &type, b, sizeof(b)) == 4 && type == 'L') {
+            uint32_t load = rframe_get32(b);
+            if (load < best_load)
+                ties = 0;
+            if (load <= best_load && rand() % ++ties == 0) {
+                best_load = load;
+                strcpy(best, addr);
+            }
+        }
+        close(fd);
+    }
+    if (best[0] == '\0') {
+        printf("remote: no worker is reachable.\n");
+        return -1;
+    }
+    return remote_dial(best, token, tlen);
+}
+
+/* remote_forward - Proxy signal handler: pass the signal to the worker */
+static void remote_forward(int sig)
+{
+    int olderrno = errno;
+    sigset_t tstp;
+
+    rframe_write32(remote_conn, 'S', (uint32_t)sig);
+    if (sig == SIGTSTP) {          /* stop the proxy too, so the job stops */
+        sigemptyset(&tstp);
+        sigaddset(&tstp, SIGTSTP);
+        signal(SIGTSTP, SIG_DFL);
+        sigprocmask(SIG_UNBLOCK, &tstp, NULL);
+        raise(SIGTSTP);
+        sigprocmask(SIG_BLOCK, &tstp, NULL);
+        signal(SIGTSTP, remote_forward);
+    }
+    errno = olderrno;
+}
+
+/*
+ * remote_proxy - Run argv on a worker from inside a job's child process.
+ *    Exits the way the remote command did.
+ */
+void remote_proxy(char **argv)
+{
+    char buf[RFRAME_MAX];
+    long len = 0;
+    int i;
+    char type;
+    struct sigaction sa;
+
+    if (argv[0] == NULL) {
+        printf("remote: usage: remote command [args...]\n");
+        exit(1);
+    }
+    for (i = 0; argv[i] != NULL; i++) {
+        size_t n = strlen(argv[i]) + 1;
+        if (len + n > sizeof(buf)) {
+            printf("remote: command line too long\n");
+            exit(1);
+        }
+        memcpy(buf + len, argv[i], n);
+        len += n;
+    }
+
+    if ((remote_conn = remote_pick()) < 0)
+        exit(1);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = remote_forward;
+    sigfillset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGTSTP, &sa, NULL);
+    sigaction(SIGCONT, &sa, NULL);
+    signal(SIGQUIT, SIG_DFL);
+
+    if (rframe_write(remote_conn, 'R', buf, len) < 0)
+        exit(1);
+    while ((len = rframe_read(remote_conn, &type, buf, sizeof(buf))) >= 0) {
+        if (type == 'O')
+            rio_writen(STDOUT_FILENO, buf, len);
+        else if (type == 'E')
+            rio_writen(STDERR_FILENO, buf, len);
+        else if (type == 'X' && len == 4) {
+            int status = (int)rframe_get32((unsigned char *)buf);
+            if (WIFSIGNALED(status)) {
+                signal(WTERMSIG(status), SIG_DFL);
+                raise(WTERMSIG(status));
+            }
+            exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+        }
+    }
+    printf("remote: lost connection to worker\n");
+    exit(1);
+}
+/**********************************************
+ * end remote job execution
+ **********************************************/
+
+/***********************************************
+ * Scripts: compiled once, cached on disk
+ *
+ * source FILE compiles the script into a flat array of instructions
+ * plus a string pool, and runs it with a small interpreter loop.
+ * The compiled form is cached in home/<user>/.tsh_cache/, keyed by
+ * the script's absolute path, mtime and size, so running an unchanged
+ * script again skips parsing entirely.
+ *
+ * Scripts hold one command per line; # starts a comment. Lines of
+ * their own form the control flow, driven by each command's status:
+ *     if CMD ... [else ...] fi
+ *     while CMD ... done
+ * (then and do lines are accepted and ignored)
+ **********************************************/
+
+#define SCRIPT_MAGIC   0x42485354u   /* "TSHB" */
+#define SCRIPT_VERSION 3
+#define SCRIPT_DEPTH   16            /* max nested source */
+#define SCRIPT_NEST    64            /* max nested if/while */
+#define SCRIPT_PATHPAD(n) (((n) + 8) & ~(size_t)7)  /* NUL padded, keeps insns aligned */
+
+#define OP_CMD   0   /* argc quote flags at arg, then argc strings; line is the cmdline */
+#define OP_JMP   1   /* jump to arg */
+#define OP_JMPF  2   /* jump to arg if last_status != 0 */
+
+struct insn_t {             /* one bytecode instruction */
+    uint8_t op;
+    uint8_t bg;
+    uint16_t argc;
+    uint32_t arg;           /* pool offset (OP_CMD) or target */
+    uint32_t line;          /* pool offset of the command line */
+};
+
+struct script_hdr {         /* cache file header */
+    uint32_t magic;
+    uint32_t version;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint32_t ninsn;
+    uint32_t pool_len;
+    uint32_t path_len;      /* followed by the padded path, insns, pool */
+};
+
+struct script_t {           /* a loaded script */
+    struct insn_t *insn;
+    uint32_t ninsn;
+    char *pool;
+    uint32_t pool_len;
+    char *buf;              /* backing allocation */
+};
+
+int script_depth = 0;
+
+/* pool_add - Append len bytes and a NUL to the pool; returns the offset */
+static uint32_t pool_add(char **pool, uint32_t *len, size_t *cap, const char *s, size_t n)
+{
+    uint32_t off = *len;
+
+    while (*len + n + 1 > *cap) {
+        *cap = *cap ? *cap * 2 : 4096;
+        if ((*pool = realloc(*pool, *cap)) == NULL)
+            unix_error("realloc error");
+    }
+    memcpy(*pool + off, s, n);
+    (*pool)[off + n] = '\0';
+    *len += n + 1;
+    return off;
+}
+
+/*
+ * script_compile - Parse the text of a script into sc. Returns 0, or
+ *    -1 after printing a syntax error.
+ */
+static int script_compile(const char *path, char *text, size_t size, struct script_t *sc)
+{
+    struct insn_t *insn = NULL;
+    size_t ninsn = 0, icap = 0, pcap = 0;
+    uint32_t stack[SCRIPT_NEST];    /* index of the open if/else/while */
+    int kind[SCRIPT_NEST];          /* 'i', 'e' or 'w' */
+    int depth = 0, lineno = 0;
+    char *p = text, *end = text + size;
+    char line[MAXLINE];
+    char *argv[MAXARGS];
+    char *body = NULL;              /* the current here-document */
+
+    sc->pool = NULL;
+    sc->pool_len = 0;
+
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        size_t n = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        int bg, argc, i, cond;
+        char *s;
+
+        lineno++;
+        s = p;
+        p += n + (nl != NULL);
+        while (n > 0 && (*s == ' ' || *s == '\t')) {
+            s++;
+            n--;
+        }
+        while (n > 0 && (s[n - 1] == ' ' || s[n - 1] == '\t' || s[n - 1] == '\r'))
+            n--;
+        if (n == 0 || *s == '#')
+            continue;
+        if (n > MAXLINE - 2) {
+            printf("source: %s:%d: line too long\n", path, lineno);
+            goto fail;
+        }
+        memcpy(line, s, n);
+        line[n] = '\n';
+        line[n + 1] = '\0';
+        bg = parseline(line, argv);
+        for (argc = 0; argv[argc] != NULL; argc++)
+            ;
+        if (argc == 0)
+            continue;
+
+        if (ninsn + 2 > icap) {
+            icap = icap ? icap * 2 : 256;
+            if ((insn = realloc(insn, icap * sizeof(*insn))) == NULL)
+                unix_error("realloc error");
+        }
+
+        if (argc == 1 && (strcmp(argv[0], "then") == 0 || strcmp(argv[0], "do") == 0))
+            continue;
+
+        /* CMD << WORD: the following lines up to WORD are the body */
+        for (i = 0; i + 1 < argc; i++) {
+            char *from = p, *dnl;
+            size_t dlen = strlen(argv[i + 1]);
+
+            if (parse_quoted[i] || strcmp(argv[i], "<<") != 0)
+                continue;
+            while (p < end) {
+                dnl = memchr(p, '\n', end - p);
+                n = dnl ? (size_t)(dnl - p) : (size_t)(end - p);
+                lineno++;
+                if (n == dlen && memcmp(p, argv[i + 1], n) == 0)
+                    break;
+                p += n + (dnl != NULL);
+            }
+            if (p >= end) {
+                printf("source: %s:%d: here-document never ends (wanted '%s')\n",
+                       path, lineno, argv[i + 1]);
+                goto fail;
+            }
+            free(body);
+            if ((body = strndup(from, p - from)) == NULL)
+                unix_error("strdup error");
+            argv[i + 1] = body;
+            parse_quoted[i + 1] = HEREDOC_BODY;
+            p += n + (dnl != NULL);
+            break;
+        }
+
+        if (argc == 1 && strcmp(argv[0], "else") == 0) {
+            if (depth == 0 || kind[depth - 1] != 'i')
+                goto unexpected;
+            insn[ninsn].op = OP_JMP;        /* end of the then branch */
+            insn[ninsn].bg = insn[ninsn].argc = insn[ninsn].line = 0;
+            insn[stack[depth - 1]].arg = ninsn + 1;
+            stack[depth - 1] = ninsn++;
+            kind[depth - 1] = 'e';
+            continue;
+        }
+        if (argc == 1 && strcmp(argv[0], "fi") == 0) {
+            if (depth == 0 || kind[depth - 1] == 'w')
+                goto unexpected;
+            insn[stack[--depth]].arg = ninsn;
+            continue;
+        }
+        if (argc == 1 && strcmp(argv[0], "done") == 0) {
+            if (depth == 0 || kind[depth - 1] != 'w')
+                goto unexpected;
+            depth--;
+            insn[ninsn].op = OP_JMP;        /* back to the condition */
+            insn[ninsn].arg = stack[depth] - 1;
+            insn[ninsn].bg = insn[ninsn].argc = insn[ninsn].line = 0;
+            ninsn++;
+            insn[stack[depth]].arg = ninsn;
+            continue;
+        }
+
+        cond = 0;
+        if (strcmp(argv[0], "if") == 0 || strcmp(argv[0], "while") == 0) {
+            if (argc == 1) {
+                printf("source: %s:%d: %s needs a command\n", path, lineno, argv[0]);
+                goto fail;
+            }
+            if (depth == SCRIPT_NEST) {
+                printf("source: %s:%d: nested too deeply\n", path, lineno);
+                goto fail;
+            }
+            kind[depth] = argv[0][0];
+            cond = 1;
+        }
+
+        insn[ninsn].op = OP_CMD;
+        insn[ninsn].bg = bg;
+        insn[ninsn].argc = argc - cond;
+        insn[ninsn].arg = pool_add(&sc->pool, &sc->pool_len, &pcap,
+                                   parse_quoted + cond, argc - cond);
+        for (i = cond; i < argc; i++)
+            pool_add(&sc->pool, &sc->pool_len, &pcap, argv[i], strlen(argv[i]));
+        insn[ninsn].line = pool_add(&sc->pool, &sc->pool_len, &pcap, line, n + 1);
+        ninsn++;
+
+        if (cond) {
+            insn[ninsn].op = OP_JMPF;       /* patched by else/fi/done */
+            insn[ninsn].bg = insn[ninsn].argc = insn[ninsn].line = 0;
+            stack[depth++] = ninsn++;
+        }
+        continue;
+
+    unexpected:
+        printf("source: %s:%d: unexpected '%s'\n", path, lineno, argv[0]);
+        goto fail;
+    }
+
+    if (depth > 0) {
+        printf("source: %s: missing '%s'\n", path, kind[depth - 1] == 'w' ? "done" : "fi");
+        goto fail;
+    }
+    sc->insn = insn;
+    sc->ninsn = ninsn;
+    sc->buf = NULL;
+    free(body);
+    return 0;
+
+fail:
+    free(insn);
+    free(sc->pool);
+    free(body);
+    return -1;
+}
+
+/* script_cache_path - Cache file for the script at abs, by path hash */
+static void script_cache_path(char *buf, size_t len, const char *abs)
+{
+    snprintf(buf, len, "%s%s/.tsh_cache/%016lx", home_path, username, cred_hash(abs));
+}
+
+/* pool_string - True if a NUL ends the pool string at *off; moves past it */
+static int pool_string(const struct script_t *sc, uint32_t *off)
+{
+    char *nul;
+
+    if (*off >= sc->pool_len
+        || (nul = memchr(sc->pool + *off, '\0', sc->pool_len - *off)) == NULL)
+        return 0;
+    *off = nul - sc->pool + 1;
+    return 1;
+}
+
+/*
+ * script_valid - Check a loaded compile before trusting it: known
+ *    opcodes, commands with 1 to MAXARGS - 1 words whose flags and
+ *    strings all end inside the pool, and jumps that stay in the
+ *    program (a jump to ninsn ends it)
+ */
+static int script_valid(const struct script_t *sc)
+{
+    uint32_t pc, off;
+    int i;
+
+    for (pc = 0; pc < sc->ninsn; pc++) {
+        const struct insn_t *in = &sc->insn[pc];
+
+        switch (in->op) {
+        case OP_CMD:
+            if (in->argc == 0 || in->argc >= MAXARGS
+                || in->arg > sc->pool_len || sc->pool_len - in->arg <= in->argc
+                || sc->pool[in->arg + in->argc] != '\0')
+                return 0;
+            off = in->arg + in->argc + 1;
+            for (i = 0; i < in->argc; i++)
+                if (!pool_string(sc, &off))
+                    return 0;
+            off = in->line;
+            if (!pool_string(sc, &off))
+                return 0;
+            break;
+        case OP_JMP:
+        case OP_JMPF:
+            if (in->arg > sc->ninsn)
+                return 0;
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * script_cache_load - Load a cached compile of abs if it is still fresh
+ *    and well formed; anything else is compiled again
+ */
+static int script_cache_load(const char *abs, struct stat *sb, struct script_t *sc)
+{
+    char cpath[2 * MAXLINE];
+    struct script_hdr h;
+    struct stat cb;
+    size_t plen = strlen(abs), body;
+    char *buf;
+    int fd;
+
+    script_cache_path(cpath, sizeof(cpath), abs);
+    if ((fd = open(cpath, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, &cb) < 0 || rio_readn(fd, &h, sizeof(h)) < 0
+        || h.magic != SCRIPT_MAGIC || h.version != SCRIPT_VERSION
+        || h.mtime_sec != sb->st_mtim.tv_sec || h.mtime_nsec != sb->st_mtim.tv_nsec
+        || h.size != sb->st_size || h.path_len != SCRIPT_PATHPAD(plen)) {
+        close(fd);
+        return -1;
+    }
+    body = h.path_len + (size_t)h.ninsn * sizeof(struct insn_t) + h.pool_len;
+    if ((off_t)(sizeof(h) + body) != cb.st_size || (buf = malloc(body)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    if (rio_readn(fd, buf, body) < 0 || memcmp(buf, abs, plen + 1) != 0) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    sc->buf = buf;
+    sc->insn = (struct insn_t *)(buf + h.path_len);
+    sc->ninsn = h.ninsn;
+    sc->pool = buf + h.path_len + (size_t)h.ninsn * sizeof(struct insn_t);
+    sc->pool_len = h.pool_len;
+    if (!script_valid(sc)) {
+        free(buf);
+        return -1;
+    }
+    return 0;
+}
+
+/* script_cache_store - Write sc to the cache; failures are not fatal */
+static void script_cache_store(const char *abs, struct stat *sb, struct script_t *sc)
+{
+    char cpath[2 * MAXLINE], tmp[2 * MAXLINE + 32], *slash;
+    struct script_hdr h;
+    char pad[8] = { 0 };
+    size_t plen = strlen(abs);
+    int fd, ok;
+
+    script_cache_path(cpath, sizeof(cpath), abs);
+    slash = strrchr(cpath, '/');
+    *slash = '\0';
+    mkdir(cpath, 0700);
+    *slash = '/';
+    snprintf(tmp, sizeof(tmp), "%s.%d", cpath, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = SCRIPT_MAGIC;
+    h.version = SCRIPT_VERSION;
+    h.mtime_sec = sb->st_mtim.tv_sec;
+    h.mtime_nsec = sb->st_mtim.tv_nsec;
+    h.size = sb->st_size;
+    h.ninsn = sc->ninsn;
+    h.pool_len = sc->pool_len;
+    h.path_len = SCRIPT_PATHPAD(plen);
+
+    ok = rio_writen(fd, &h, sizeof(h)) == 0
+        && rio_writen(fd, abs, plen) == 0
+        && rio_writen(fd, pad, h.path_len - plen) == 0
+        && rio_writen(fd, sc->insn, sc->ninsn * sizeof(struct insn_t)) == 0
+        && rio_writen(fd, sc->pool, sc->pool_len) == 0;
+    if (close(fd) < 0 || !ok || rename(tmp, cpath) < 0)
+        unlink(tmp);
+}
+
+/* script_free - Release a loaded script */
+static void script_free(struct script_t *sc)
+{
+    if (sc->buf != NULL) {
+        free(sc->buf);
+    }
+    else {
+        free(sc->insn);
+        free(sc->pool);
+    }
+}
+
+/*
+ * script_run - Interpret a compiled script. Stops early when ctrl-c
+ *    reaches the shell. Returns the status of the last command.
+ */
+static int script_run(struct script_t *sc)
+{
+    char *argv[MAXARGS];
+    uint32_t pc = 0;
+    int i;
+
+    last_status = 0;
+    while (pc < sc->ninsn && !sigint_seen) {
+        struct insn_t *in = &sc->insn[pc++];
+        char *s;
+
+        switch (in->op) {
+        case OP_CMD:
+            memcpy(parse_quoted, sc->pool + in->arg, in->argc);
+            s = sc->pool + in->arg + in->argc + 1;
+            for (i = 0; i < in->argc; i++) {
+                argv[i] = s;
+                s += strlen(s) + 1;
+            }
+            argv[i] = NULL;
+            run_command(argv, in->bg, sc->pool + in->line);
+            fflush(stdout);
+            break;
+        case OP_JMP:
+            pc = in->arg;
+            break;
+        case OP_JMPF:
+            if (last_status != 0)
+                pc = in->arg;
+            break;
+        }
+    }
+    return last_status;
+}
+
+/*
+ * source_file - Run the script at path, compiling it only when the
+ *    cache has no fresh copy. Returns the script's exit status.
+ */
+int source_file(char *arg)
+{
+    struct script_t sc;
+    struct stat sb;
+    char *abs, *text;
+    char path[MAXLINE];
+    int fd, status;
+
+    /* arg lives in parseline's buffer, which compiling reuses */
+    snprintf(path, sizeof(path), "%s", arg);
+
+    if (script_depth >= SCRIPT_DEPTH) {
+        printf("source: %s: nested too deeply\n", path);
+        return 1;
+    }
+    if ((abs = realpath(path, NULL)) == NULL || stat(abs, &sb) < 0) {
+        printf("source: %s: %s\n", path, strerror(errno));
+        free(abs);
+        return 1;
+    }
+
+    if (script_cache_load(abs, &sb, &sc) < 0) {
+        if ((fd = open(abs, O_RDONLY | O_CLOEXEC)) < 0) {
+            printf("source: %s: %s\n", path, strerror(errno));
+            free(abs);
+            return 1;
+        }
+        if ((text = malloc(sb.st_size + 1)) == NULL)
+            unix_error("malloc error");
+        if (rio_readn(fd, text, sb.st_size) < 0) {
+            printf("source: %s: short read\n", path);
+            close(fd);
+            free(text);
+            free(abs);
+            return 1;
+        }
+        close(fd);
+        status = script_compile(path, text, sb.st_size, &sc);
+        free(text);
+        if (status < 0) {
+            free(abs);
+            return 2;
+        }
+        script_cache_store(abs, &sb, &sc);
+    }
+    free(abs);
+
+    if (script_depth++ == 0)
+        sigint_seen = 0;
+    status = script_run(&sc);
+    script_depth--;
+    script_free(&sc);
+    return status;
+}
+/**********************************************
+ * end scripts
+ **********************************************/
+
+/***********************************************
+ * dag: run a dependency graph of commands
+ *
+ *     dag [-k] [-j N] -f FILE [target ...]
+ *     dag [-k] [-j N] RULE ...
+ *
+ * Rules use make's syntax: "target: deps" followed by indented
+ * command lines, or "target: deps ; command" on one line. Every
+ * command runs as a background job in the shell's own job table,
+ * and a node starts as soon as all of its deps have exited with
+ * status 0. At most N nodes run at once (default: online CPUs,
+ * bounded by the free job slots). A failure stops new nodes from
+ * starting unless -k is given, in which case only its dependents
+ * are skipped. The run ends with a summary and the critical path.
+ **********************************************/
+
+#define DAG_WAIT    0   /* deps still pending */
+#define DAG_READY   1   /* queued to start */
+#define DAG_RUN     2   /* one of its commands is a live job */
+#define DAG_DONE    3
+#define DAG_FAILED  4
+#define DAG_SKIPPED 5
+
+struct dag_node {
+    char *name;
+    int *deps;              /* indices of the nodes this one needs */
+    int ndeps;
+    int *outs;              /* indices of the nodes that need this one */
+    int nouts, outcap;
+    char **cmds;            /* command lines, run in order */
+    int ncmds;
+    int cmd;                /* index of the running command */
+    int state;
+    int needed;             /* part of the requested targets */
+    int pending;            /* deps not yet done */
+    pid_t pid;              /* running job, 0 if none */
+    int status;             /* status of the last command */
+    int exited;             /* the running job has exited */
+    int gate;               /* dep that finished last, -1 if none */
+    unsigned long long start, end;   /* ns since the run began */
+};
+
+struct dag_t {
+    struct dag_node *node;
+    int n, cap;
+    int *ready;             /* FIFO of DAG_READY nodes */
+    int rhead, rtail;
+};
+
+static struct dag_t *dag_active;    /* graph whose jobs job_exit_hook tracks */
+
+/* dag_find - Index of the node named name, or -1 */
+static int dag_find(struct dag_t *g, const char *name)
+{
+    int i;
+
+    for (i = 0; i < g->n; i++)
+        if (strcmp(g->node[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+/* dag_strndup - Copy n bytes of s, trimming surrounding blanks */
+static char *dag_strndup(const char *s, size_t n)
+{
+    char *d;
+
+    while (n > 0 && isspace((unsigned char)*s)) {
+        s++;
+        n--;
+    }
+    while (n > 0 && isspace((unsigned char)s[n - 1]))
+        n--;
+    if ((d = malloc(n + 1)) == NULL)
+        unix_error("malloc error");
+    memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
+/* dag_add_cmd - Append a command line to node */
+static void dag_add_cmd(struct dag_node *node, const char *s, size_t n)
+{
+    char *cmd = dag_strndup(s, n);
+
+    if (*cmd == '\0') {
+        free(cmd);
+        return;
+    }
+    if ((node->cmds = realloc(node->cmds, (node->ncmds + 1) * sizeof(char *))) == NULL)
+        unix_error("realloc error");
+    node->cmds[node->ncmds++] = cmd;
+}
+
+/*
+ * dag_rule - Add the rule "target: deps [; command]". Dep names are
+ *    kept as strings in the deps of the new node until dag_link.
+ *    Returns the node index, or -1 on a malformed rule.
+ */
+static int dag_rule(struct dag_t *g, const char *line, char ***depnames, int **ndepnames)
+{
+    const char *colon = strchr(line, ':');
+    const char *semi, *p;
+    struct dag_node *node;
+    char *name;
+    int nd = 0;
+
+    if (colon == NULL)
+        return -1;
+    name = dag_strndup(line, colon - line);
+    if (*name == '\0' || strpbrk(name, " \t") != NULL) {
+        free(name);
+        return -1;
+    }
+    if (dag_find(g, name) >= 0) {
+        printf("dag: duplicate target '%s'\n", name);
+        free(name);
+        return -2;
+    }
+
+    if (g->n == g->cap) {
+        g->cap = g->cap ? g->cap * 2 : 32;
+        if ((g->node = realloc(g->node, g->cap * sizeof(*g->node))) == NULL
+            || (*depnames = realloc(*depnames, g->cap * sizeof(**depnames))) == NULL
+            || (*ndepnames = realloc(*ndepnames, g->cap * sizeof(**ndepnames))) == NULL)
+            unix_error("realloc error");
+    }
+    node = &g->node[g->n];
+    memset(node, 0, sizeof(*node));
+    node->name = name;
+    node->gate = -1;
+
+    /* deps are stored NUL separated in one string */
+    semi = strchr(colon + 1, ';');
+    p = dag_strndup(colon + 1, semi ? (size_t)(semi - colon - 1) : strlen(colon + 1));
+    (*depnames)[g->n] = (char *)p;
+    for (; *p; p++)
+        if (!isspace((unsigned char)*p) && (p == (*depnames)[g->n] || isspace((unsigned char)p[-1])))
+            nd++;
+    (*ndepnames)[g->n] = nd;
+    if (semi != NULL)
+        dag_add_cmd(node, semi + 1, strlen(semi + 1));
+    return g->n++;
+}
+
+/*
+ * dag_link - Resolve dep names into indices. A dep with no rule is
+ *    fine if it names an existing file, as with make.
+ */
+static int dag_link(struct dag_t *g, char **depnames, int *ndepnames)
+{
+    int i, d;
+
+    for (i = 0; i < g->n; i++) {
+        struct dag_node *node = &g->node[i];
+        char *p = depnames[i];
+
+        if ((node->deps = malloc((ndepnames[i] + 1) * sizeof(int))) == NULL)
+            unix_error("malloc error");
+        while (*p) {
+            char *q;
+            struct stat sb;
+
+            while (isspace((unsigned char)*p))
+                p++;
+            if (*p == '\0')
+                break;
+            for (q = p; *q && !isspace((unsigned char)*q); q++)
+                ;
+            if (*q)
+                *q++ = '\0';
+            if ((d = dag_find(g, p)) >= 0) {
+                struct dag_node *dep = &g->node[d];
+                node->deps[node->ndeps++] = d;
+                if (dep->nouts == dep->outcap) {
+                    dep->outcap = dep->outcap ? dep->outcap * 2 : 4;
+                    if ((dep->outs = realloc(dep->outs, dep->outcap * sizeof(int))) == NULL)
+                        unix_error("realloc error");
+                }
+                dep->outs[dep->nouts++] = i;
+            }
+            else if (stat(p, &sb) < 0) {
+                printf("dag: no rule for '%s' (needed by '%s')\n", p, node->name);
+                return -1;
+            }
+            p = q;
+        }
+    }
+    return 0;
+}
+
+/* dag_need - Mark node i and everything it depends on as needed */
+static void dag_need(struct dag_t *g, int i)
+{
+    int k;
+
+    if (g->node[i].needed)
+        return;
+    g->node[i].needed = 1;
+    for (k = 0; k < g->node[i].ndeps; k++)
+        dag_need(g, g->node[i].deps[k]);
+}
+
+/* dag_acyclic - Check for cycles with Kahn's algorithm over needed nodes */
+static int dag_acyclic(struct dag_t *g)
+{
+    int *indeg, *queue, head = 0, tail = 0, seen = 0, total = 0, i, k;
+
+    if ((indeg = calloc(g->n, sizeof(int))) == NULL
+        || (queue = malloc(g->n * sizeof(int))) == NULL)
+        unix_error("malloc error");
+    for (i = 0; i < g->n; i++) {
+        if (!g->node[i].needed)
+            continue;
+        total++;
+        indeg[i] = g->node[i].ndeps;
+        if (indeg[i] == 0)
+            queue[tail++] = i;
+    }
+    while (head < tail) {
+        struct dag_node *node = &g->node[queue[head++]];
+        seen++;
+        for (k = 0; k < node->nouts; k++)
+            if (g->node[node->outs[k]].needed && --indeg[node->outs[k]] == 0)
+                queue[tail++] = node->outs[k];
+    }
+    for (i = 0; seen < total && i < g->n; i++) {
+        if (g->node[i].needed && indeg[i] > 0) {
+            printf("dag: dependency cycle through '%s'\n", g->node[i].name);
+            break;
+        }
+    }
+    free(indeg);
+    free(queue);
+    return seen == total ? 0 : -1;
+}
+
+/* dag_load - Read rules from a make-style file */
+static int dag_load(struct dag_t *g, const char *path, char ***depnames, int **ndepnames)
+{
+    FILE *fp;
+    char line[MAXLINE];
+    int cur = -1, lineno = 0, r;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        printf("dag: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *p = line;
+
+        lineno++;
+        line[strcspn(line, "\n")] = '\0';
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            continue;
+        if (p != line) {            /* indented: a command line */
+            if (cur < 0) {
+                printf("dag: %s:%d: command before first target\n", path, lineno);
+                fclose(fp);
+                return -1;
+            }
+            dag_add_cmd(&g->node[cur], p, strlen(p));
+            continue;
+        }
+        if ((r = dag_rule(g, line, depnames, ndepnames)) < 0) {
+            if (r == -1)
+                printf("dag: %s:%d: expected 'target: deps'\n", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+        cur = r;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* dag_job_exit - job_exit_hook: note which node's command finished */
+static void dag_job_exit(pid_t pid, int status)
+{
+    int i;
+
+    for (i = 0; i < dag_active->n; i++) {
+        struct dag_node *node = &dag_active->node[i];
+        if (node->state == DAG_RUN && node->pid == pid) {
+            node->status = status;
+            node->exited = 1;
+            node->pid = 0;
+            return;
+        }
+    }
+}
+
+/* dag_spawn - Start the current command of node as a background job */
+static int dag_spawn(struct dag_node *node)
+{
+    char cmdline[MAXLINE];
+    char *argv[MAXARGS], **v;
+    struct gstate *g;
+    struct launch_opts lo = LAUNCH_OPTS_NONE;
+
+    snprintf(cmdline, sizeof(cmdline) - 1, "%s", node->cmds[node->cmd]);
+    strcat(cmdline, "\n");
+    if (parseline(cmdline, argv) || argv[0] == NULL) {
+        printf("dag: %s: commands cannot end in &\n", node->name);
+        return -1;
+    }
+    v = glob_expand(argv, parse_quoted, &g);
+    node->pid = launch_job(v, 1, cmdline, &lo);
+    glob_free(v, g);
+    if (node->pid < 0) {
+        node->pid = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* dag_finish - Settle a node that has no more commands to run */
+static void dag_finish(struct dag_t *g, int i, int ok, unsigned long long now, int *failed)
+{
+    struct dag_node *node = &g->node[i];
+    int k;
+
+    node->end = now;
+    node->state = ok ? DAG_DONE : DAG_FAILED;
+    if (!ok) {
+        (*failed)++;
+        printf("dag: %s failed with status %d\n", node->name, node->status);
+    }
+    for (k = 0; k < node->nouts; k++) {
+        struct dag_node *out = &g->node[node->outs[k]];
+        if (!out->needed || out->state != DAG_WAIT)
+            continue;
+        if (!ok) {
+            out->state = DAG_SKIPPED;   /* transitively, once it is looked at */
+            continue;
+        }
+        if (--out->pending == 0) {
+            out->gate = i;              /* the dep it was waiting on last */
+            out->state = DAG_READY;
+            g->ready[g->rtail++] = node->outs[k];
+        }
+    }
+}
+
+/* dag_skip - Propagate DAG_SKIPPED to everything downstream */
+static void dag_skip(struct dag_t *g)
+{
+    int i, k, changed = 1;
+
+    while (changed) {
+        changed = 0;
+        for (i = 0; i < g->n; i++) {
+            if (g->node[i].state != DAG_SKIPPED)
+                continue;
+            for (k = 0; k < g->node[i].nouts; k++) {
+                struct dag_node *out = &g->node[g->node[i].outs[k]];
+                if (out->needed && out->state == DAG_WAIT) {
+                    out->state = DAG_SKIPPED;
+                    changed = 1;
+                }
+            }
+        }
+    }
+}
+
+/* dag_report - Print the summary and the critical path of a finished run */
+static void dag_report(struct dag_t *g, unsigned long long wall)
+{
+    int i, last = -1, ndone = 0, nfail = 0, nskip = 0, nleft = 0;
+    int *path, len = 0;
+
+    for (i = 0; i < g->n; i++) {
+        struct dag_node *node = &g->node[i];
+        if (!node->needed)
+            continue;
+        if (node->state == DAG_DONE)
+            ndone++;
+        else if (node->state == DAG_FAILED)
+            nfail++;
+        else if (node->state == DAG_SKIPPED)
+            nskip++;
+        else
+            nleft++;
+        if ((node->state == DAG_DONE || node->state == DAG_FAILED)
+            && (last < 0 || node->end > g->node[last].end))
+            last = i;
+    }
+    printf("dag: %d done, %d failed, %d skipped, %d not run, wall %.3fs\n",
+           ndone, nfail, nskip, nleft, wall / 1e9);
+    if (last < 0)
+        return;
+
+    /* Walk back from the last finisher through the dep that gated each start */
+    if ((path = malloc(g->n * sizeof(int))) == NULL)
+        unix_error("malloc error");
+    for (i = last; i >= 0 && len < g->n; i = g->node[i].gate)
+        path[len++] = i;
+    printf("dag: critical path %.3fs:", g->node[last].end / 1e9);
+    while (len-- > 0) {
+        struct dag_node *node = &g->node[path[len]];
+        printf(" %s (%.3fs)%s", node->name, (node->end - node->start) / 1e9, len ? " ->" : "");
+    }
+    printf("\n");
+    free(path);
+}
+
+/* dag_free - Release a graph */
+static void dag_free(struct dag_t *g, char **depnames)
+{
+    int i, k;
+
+    for (i = 0; i < g->n; i++) {
+        for (k = 0; k < g->node[i].ncmds; k++)
+            free(g->node[i].cmds[k]);
+        free(g->node[i].cmds);
+        free(g->node[i].deps);
+        free(g->node[i].outs);
+        free(g->node[i].name);
+        if (depnames != NULL)
+            free(depnames[i]);
+    }
+    free(g->node);
+    free(g->ready);
+}
+
+/*
+ * dag_run - Schedule the needed nodes of g with up to maxjobs running
+ *    at once. Returns 0 if every node succeeded.
+ */
+static int dag_run(struct dag_t *g, int maxjobs, int keep_going)
+{
+    struct timespec t0;
+    int i, running = 0, failed = 0, stop = 0, interrupted = 0;
+
+    if ((g->ready = malloc(g->n * sizeof(int))) == NULL)
+        unix_error("malloc error");
+    g->rhead = g->rtail = 0;
+    for (i = 0; i < g->n; i++) {
+        struct dag_node *node = &g->node[i];
+        node->pending = node->ndeps;
+        if (node->needed && node->pending == 0) {
+            node->state = DAG_READY;
+            g->ready[g->rtail++] = i;
+        }
+    }
+
+    prof_now(&t0);
+    dag_active = g;
+    job_exit_hook = dag_job_exit;
+    sigint_seen = 0;
+
+    while (1) {
+        /* Start ready nodes while there is room */
+        while (!stop && g->rhead < g->rtail && running < maxjobs && !jobs_full(jobs)) {
+            i = g->ready[g->rhead++];
+            g->node[i].start = prof_elapsed(&t0);
+            g->node[i].cmd = 0;
+            if (g->node[i].ncmds == 0) {
+                dag_finish(g, i, 1, g->node[i].start, &failed);
+                continue;
+            }
+            g->node[i].state = DAG_RUN;
+            if (dag_spawn(&g->node[i]) < 0) {
+                g->node[i].status = 127;
+                dag_finish(g, i, 0, g->node[i].start, &failed);
+                stop = !keep_going;
+                continue;
+            }
+            running++;
+        }
+        if (running == 0)
+            break;
+
+        job_events(-1);
+        if (sigint_seen && !interrupted) {
+            interrupted = stop = 1;
+            for (i = 0; i < g->n; i++)
+                if (g->node[i].state == DAG_RUN && g->node[i].pid > 0)
+                    kill(-g->node[i].pid, SIGINT);
+        }
+
+        /* Advance nodes whose command exited */
+        for (i = 0; i < g->n; i++) {
+            struct dag_node *node = &g->node[i];
+            if (node->state != DAG_RUN || !node->exited)
+                continue;
+            node->exited = 0;
+            if (node->status == 0 && ++node->cmd < node->ncmds && !interrupted) {
+                if (dag_spawn(node) == 0)
+                    continue;
+                node->status = 127;
+            }
+            running--;
+            dag_finish(g, i, node->status == 0 && node->cmd >= node->ncmds,
+                       prof_elapsed(&t0), &failed);
+            if (node->state == DAG_FAILED && !keep_going)
+                stop = 1;
+        }
+    }
+
+    job_exit_hook = NULL;
+    dag_active = NULL;
+    dag_skip(g);
+    dag_report(g, prof_elapsed(&t0));
+    if (interrupted)
+        return 130;
+    return failed ? 1 : 0;
+}
+
+/* builtin_dag - Parse the dag command line, load the graph and run it */
+int builtin_dag(char **argv)
+{
+    struct dag_t g;
+    char **depnames = NULL;
+    int *ndepnames = NULL;
+    char *file = NULL;
+    int maxjobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_going = 0, i = 1, status = 2, ntargets = 0, k;
+    char rules[MAXARGS][MAXLINE];
+    int nrules = 0;
+
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "-k") == 0) {
+            keep_going = 1;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && argv[i + 1] != NULL) {
+            maxjobs = atoi(argv[++i]);
+        }
+        else if (strncmp(argv[i], "-j", 2) == 0 && isdigit((unsigned char)argv[i][2])) {
+            maxjobs = atoi(argv[i] + 2);
+        }
+        else if (strcmp(argv[i], "-f") == 0 && argv[i + 1] != NULL) {
+            file = argv[++i];
+        }
+        else {
+            break;
+        }
+    }
+    if (maxjobs < 1)
+        maxjobs = 1;
+    if (file == NULL && argv[i] == NULL) {
+        printf("usage: dag [-k] [-j N] -f FILE [target ...]\n");
+        printf("       dag [-k] [-j N] 'target: deps ; command' ...\n");
+        return 2;
+    }
+
+    /* argv points into parseline's buffer, which spawning reuses */
+    for (; argv[i] != NULL; i++)
+        snprintf(rules[nrules++], MAXLINE, "%s", argv[i]);
+
+    memset(&g, 0, sizeof(g));
+    if (file != NULL) {
+        if (dag_load(&g, file, &depnames, &ndepnames) < 0)
+            goto out;
+        ntargets = nrules;
+    }
+    else {
+        for (k = 0; k < nrules; k++) {
+            int r = dag_rule(&g, rules[k], &depnames, &ndepnames);
+            if (r == -1)
+                printf("dag: expected 'target: deps ; command', got '%s'\n", rules[k]);
+            if (r < 0)
+                goto out;
+        }
+    }
+    if (dag_link(&g, depnames, ndepnames) < 0)
+        goto out;
+
+    for (k = 0; k < ntargets; k++) {
+        int t = dag_find(&g, rules[k]);
+        if (t < 0) {
+            printf("dag: no rule for target '%s'\n", rules[k]);
+            goto out;
+        }
+        dag_need(&g, t);
+    }
+    if (ntargets == 0)
+        for (k = 0; k < g.n; k++)
+            g.node[k].needed = 1;
+    if (dag_acyclic(&g) < 0)
+        goto out;
+
+    status = dag_run(&g, maxjobs, keep_going);
+out:
+    dag_free(&g, depnames);
+    free(depnames);
+    free(ndepnames);
+    return status;
+}
+/**********************************************
+ * end dag
+ **********************************************/
+
+/***********************
+ * Other helper routines
+ ***********************/
+
+/*
+ * usage - print a help message
+ */
+void usage(void) 
+{
+    printf("Usage: shell [-hvpPLm] [-r dir] [-S path] [-W addr] [-C size] [-Z N]\n");
+    printf("             [--record file | --replay file [--speed N]]\n");
+    printf("   -h   print this message\n");
+    printf("   -v   print additional diagnostic information\n");
+    printf("   -p   do not emit a command prompt\n");
+    printf("   -P   print per-phase latency percentiles at exit\n");
+    printf("   -L, --lean\n");
+    printf("        start fast for short runs: no proc entries, no prefetch\n");
+    printf("        statistics, history read only when history or !N asks\n");
+    printf("   -m, --monitor\n");
+    printf("        with -L, still write proc entries\n");
+    printf("   -r dir, --root=dir\n");
+    printf("        keep etc/, home/ and proc/ under dir (default: $TSH_ROOT or .)\n");
+    printf("   -S path, --server=path\n");
+    printf("        serve login sessions on the Unix socket at path\n");
+    printf("   -W addr, --worker=addr\n");
+    printf("        run remote jobs on addr (socket path or host:port). Peers\n");
+    printf("        must send the secret in the file named by $TSH_WORKER_TOKEN;\n");
+    printf("        TCP binds loopback only unless $TSH_WORKER_PUBLIC is 1\n");
+    printf("   -C size, --capture=size\n");
+    printf("        keep up to size bytes of each background job's output\n");
+    printf("        for joblog and tail instead of printing it\n");
+    printf("   --capture-max=size\n");
+    printf("        cap on all captured output together (default 64m)\n");
+    printf("   -Z N, --zygote=N\n");
+    printf("        launch commands through N pre-forked helper processes\n");
+    printf("   --record=file\n");
+    printf("        write input lines, think times and outcomes to file\n");
+    printf("   --replay=file [--speed=Nx]\n");
+    printf("        run the lines recorded in file, think times divided by N\n");
+    printf("        (0 or max: none), and report latencies and divergences\n");
+    exit(1);
+}
+
+/*
+ * unix_error - unix-style error routine
+ */
+void unix_error(char *msg)
+{
+    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+/*
+ * app_error - application-style error routine
+ */
+void app_error(char *msg)
+{
+    fprintf(stdout, "%s\n", msg);
+    exit(1);
+}
+
+/*
+ * Signal - wrapper for the sigaction function
+ */
+handler_t *Signal(int signum, handler_t *handler) 
+{
+    struct sigaction action, old_action;
+
+    action.sa_handler = handler;  
+    sigemptyset(&action.sa_mask); /* block sigs of type being handled */
+    action.sa_flags = SA_RESTART; /* restart syscalls if possible */
+
+    if (sigaction(signum, &action, &old_action) < 0)
+	unix_error("Signal error");
+    return (old_action.sa_handler);
+}
+
+/*
+ * sigquit_handler - The driver program can gracefully terminate the
+ *    child shell by sending it a SIGQUIT signal.
+ */
+void sigquit_handler(int sig) 
+{
+    printf("Terminating after receipt of SIGQUIT signal\n");
+    exit(1);
+}
+
+
+/*************************************************************
+ * Latency profiler (-P)
+ *
+ * Each phase keeps a log-linear histogram (8 buckets per power
+ * of two, so percentiles are within 12.5%) in a fixed array, so
+ * recording is a clock read and an increment.
+ *************************************************************/
+
+/* prof_now - Read the monotonic clock */
+void prof_now(struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+/* prof_elapsed - Nanoseconds since start */
+unsigned long long prof_elapsed(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)(now.tv_sec - start->tv_sec) * 1000000000ULL
+        + (now.tv_nsec - start->tv_nsec);
+}
+
+/* prof_bucket - Map a latency in ns to its histogram bucket */
+static int prof_bucket(unsigned long long ns)
+{
+    int msb;
+
+    if (ns < 16)
+        return (int)ns;
+    msb = 63 - __builtin_clzll(ns);
+    return 16 + (msb - 4) * 8 + (int)((ns >> (msb - 3)) & 7);
+}
+
+/* prof_bucket_max - Largest latency that falls in bucket b */
+static unsigned long long prof_bucket_max(int b)
+{
+    int msb, sub;
+
+    if (b < 16)
+        return b;
+    msb = (b - 16) / 8 + 4;
+    sub = (b - 16) % 8;
+    return ((unsigned long long)(9 + sub) << (msb - 3)) - 1;
+}
+
+/* prof_add - Record one sample of ns nanoseconds for phase */
+void prof_add(int phase, unsigned long long ns)
+{
+    prof_add_hist(&prof[phase], ns);
+}
+
+/* prof_add_hist - Record one sample in histogram h */
+void prof_add_hist(struct prof_hist *h, unsigned long long ns)
+{
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->buckets[prof_bucket(ns)]++;
+}
+
+/* prof_record - Record the time elapsed since start for phase */
+void prof_record(int phase, struct timespec *start)
+{
+    prof_add(phase, prof_elapsed(start));
+}
+
+/* prof_percentile - Upper bound of the bucket holding the pct'th sample */
+unsigned long long prof_percentile(struct prof_hist *h, int pct)
+{
+    unsigned long rank = (h->count * pct + 99) / 100;
+    unsigned long seen = 0;
+    int b;
+
+    for (b = 0; b < PROF_NBUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank && seen > 0)
+            return prof_bucket_max(b) < h->max ? prof_bucket_max(b) : h->max;
+    }
+    return h->max;
+}
+
+/*
+ * prof_report - Print p50/p99 per phase at exit. When TSH_PROFILE_OUT
+ *    names a file, the summary and the raw buckets are written there
+ *    instead, one whitespace separated record per line.
+ */
+void prof_report(void)
+{
+    char *out_name = getenv("TSH_PROFILE_OUT");
+    FILE *out = stderr;
+    int i, b;
+
+    if (getpid() != profile_owner)
+        return;
+    fflush(stdout);
+    if (out_name != NULL && (out = fopen(out_name, "w")) == NULL) {
+        perror("fopen");
+        out = stderr;
+    }
+
+    fprintf(out, "%-10s %8s %12s %12s %12s %12s\n",
+            "phase", "count", "p50_ns", "p99_ns", "max_ns", "mean_ns");
+    for (i = 0; i < PROF_NPHASES; i++) {
+        struct prof_hist *h = &prof[i];
+        if (h->count == 0)
+            continue;
+        fprintf(out, "%-10s %8lu %12llu %12llu %12llu %12llu\n",
+                prof_names[i], h->count, prof_percentile(h, 50),
+                prof_percentile(h, 99), h->max, h->sum / h->count);
+    }
+
+    if (out != stderr) {
+        for (i = 0; i < PROF_NPHASES; i++)
+            for (b = 0; b < PROF_NBUCKETS; b++)
+                if (prof[i].buckets[b] != 0)
+                    fprintf(out, "bucket %s %llu %lu\n", prof_names[i],
+                            prof_bucket_max(b), prof[i].buckets[b]);
+        fclose(out);
+    }
+}
+
+/***********************************************
+ * Session record and replay (--record, --replay)
+ *
+ * --record FILE writes each input line read after login to FILE with
+ * the think time before it (since the shell last asked for input).
+ * After each command it adds the exit status and the latency from
+ * reading the line to the next prompt, and a background job adds its
+ * exit status when it is reaped. The login is not recorded.
+ * --replay FILE feeds the lines back in place of stdin. Before each
+ * line it waits for the recorded think time divided by --speed; a
+ * speed of 0 (or max) means no waiting. At exit it reports the
+ * latency per command name next to the recorded latency, and lists
+ * every command or background job whose exit status differs from
+ * the recording. The report goes to stderr, or to the file named by
+ * TSH_REPLAY_OUT.
+ *
+ * A trace is text, one entry per line, with tab separated fields:
+ *     L  think_us  line              an input line
+ *     =  seq  status  latency_us     command number seq returned
+ *     J  seq  status                 a background job of seq exited
+ **********************************************/
+
+#define TRACE_NAMES  256            /* command names in the report */
+#define TRACE_SHOW   10             /* divergences listed by name */
+
+struct trace_cmd {                  /* recorded outcome of one command */
+    int status;
+    int job_status;                 /* -1 if no background job exited */
+    long long latency_us;
+};
+
+struct trace_name {                 /* latencies of one command name */
+    char name[64];
+    struct prof_hist rec, now;      /* recorded and replayed, in us */
+};
+
+static int trace_fd = -1;                   /* --record */
+static char **trace_lines;                  /* --replay */
+static long long *trace_think;
+static size_t trace_nlines, trace_pos;
+static struct trace_cmd *trace_cmds;
+static size_t trace_ncmds;
+static double trace_speed = 1;
+static long long trace_recorded_us;         /* think time plus latency */
+static struct trace_name trace_names[TRACE_NAMES];
+static unsigned long trace_diverged;
+static char trace_show[TRACE_SHOW][128];
+static long long trace_ready_ns, trace_cmd_ns, trace_start_ns;
+static pid_t trace_owner;
+
+/* trace_now - CLOCK_MONOTONIC in nanoseconds */
+static long long trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* trace_record - Start --record into path; -1 if it cannot be created */
+int trace_record(const char *path)
+{
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return -1;
+    dprintf(trace_fd, "# tsh trace 1\n");
+    trace_mode = TRACE_RECORD;
+    return 0;
+}
+
+/*
+ * trace_replay - Load path for --replay at speed ("10x", "10", "0" or
+ *    "max"); -1 with errno set or EINVAL if either is malformed
+ */
+int trace_replay(const char *path, const char *speed)
+{
+    char *line = NULL, *f[3], *end;
+    size_t size = 0, cap_lines = 0, cap_cmds = 0;
+    ssize_t n;
+    FILE *fp;
+    int i;
+
+    if (strcmp(speed, "max") == 0) {
+        trace_speed = 0;
+    }
+    else {
+        trace_speed = strtod(speed, &end);
+        if (end == speed || trace_speed < 0 || (*end && strcmp(end, "x") != 0)) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    while ((n = getline(&line, &size, fp)) != -1) {
+        if (n > 0 && line[n - 1] == '\n')
+            line[--n] = '\0';
+        f[0] = strchr(line, '\t');
+        for (i = 1; i < 3; i++)
+            f[i] = f[i - 1] != NULL ? strchr(f[i - 1] + 1, '\t') : NULL;
+        for (i = 0; i < 3; i++)
+            if (f[i] != NULL)
+                *f[i]++ = '\0';
+
+        if (line[0] == 'L' && f[1] != NULL) {
+            if (trace_nlines == cap_lines) {
+                cap_lines = cap_lines ? 2 * cap_lines : 1024;
+                if ((trace_lines = realloc(trace_lines, cap_lines * sizeof(char *))) == NULL
+                    || (trace_think = realloc(trace_think, cap_lines * sizeof(long long))) == NULL)
+                    unix_error("realloc error");
+            }
+            if (f[2] != NULL)           /* the line itself held a tab */
+                f[2][-1] = '\t';
+            trace_think[trace_nlines] = atoll(f[0]);
+            trace_recorded_us += trace_think[trace_nlines];
+            if ((trace_lines[trace_nlines++] = strdup(f[1])) == NULL)
+                unix_error("strdup error");
+        }
+        else if ((line[0] == '=' && f[2] != NULL) || (line[0] == 'J' && f[1] != NULL)) {
+            size_t seq = strtoul(f[0], NULL, 10);
+
+            if (seq == 0 || seq > (1 << 24))
+                continue;
+            while (seq > trace_ncmds) {
+                if (trace_ncmds == cap_cmds) {
+                    cap_cmds = cap_cmds ? 2 * cap_cmds : 1024;
+                    if ((trace_cmds = realloc(trace_cmds, cap_cmds * sizeof(*trace_cmds))) == NULL)
+                        unix_error("realloc error");
+                }
+                trace_cmds[trace_ncmds].status = -1;
+                trace_cmds[trace_ncmds].job_status = -1;
+                trace_cmds[trace_ncmds++].latency_us = -1;
+            }
+            if (line[0] == 'J') {
+                trace_cmds[seq - 1].job_status = atoi(f[1]);
+            }
+            else {
+                trace_cmds[seq - 1].status = atoi(f[1]);
+                trace_cmds[seq - 1].latency_us = atoll(f[2]);
+                trace_recorded_us += trace_cmds[seq - 1].latency_us;
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+    trace_mode = TRACE_REPLAY;
+    atexit(trace_report);
+    return 0;
+}
+
+/* trace_begin - Start the clocks once the user has logged in */
+void trace_begin(void)
+{
+    trace_owner = getpid();
+    trace_start_ns = trace_ready_ns = trace_now();
+}
+
+/* trace_input - --record: log a line read_cmdline is returning */
+void trace_input(const char *cmdline)
+{
+    long long now = trace_now();
+    int len = strcspn(cmdline, "\n");
+
+    dprintf(trace_fd, "L\t%lld\t%.*s\n", (now - trace_ready_ns) / 1000, len, cmdline);
+    trace_ready_ns = now;
+}
+
+/* trace_next - --replay: the next line, after its scaled think time; 0 at the end */
+int trace_next(char *cmdline)
+{
+    long long until, left;
+
+    job_events(0);
+    if (trace_pos >= trace_nlines)
+        return 0;
+    if (trace_speed > 0) {
+        until = trace_now() + (long long)(trace_think[trace_pos] * 1000 / trace_speed);
+        while ((left = until - trace_now()) > 0) {
+            if (left >= 1000000) {
+                job_events(left / 1000000);
+            }
+            else {
+                struct timespec ts = { 0, left };
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    snprintf(cmdline, MAXLINE, "%.*s\n", MAXLINE - 2, trace_lines[trace_pos++]);
+    return 1;
+}
+
+/* trace_start - A command line is about to run */
+void trace_start(void)
+{
+    trace_seq++;
+    trace_cmd_ns = trace_now();
+}
+
+/* trace_name_get - The report entry for the first word of cmdline */
+static struct trace_name *trace_name_get(const char *cmdline)
+{
+    char name[64];
+    unsigned long h;
+    int i, len;
+
+    cmdline += strspn(cmdline, " \t");
+    len = strcspn(cmdline, " \t\n");
+    snprintf(name, sizeof(name), "%.*s", len, cmdline);
+    h = cred_hash(name);
+    for (i = 0; i < TRACE_NAMES; i++) {
+        struct trace_name *t = &trace_names[(h + i) % TRACE_NAMES];
+
+        if (t->name[0] == '\0')
+            strcpy(t->name, name);
+        if (strcmp(t->name, name) == 0)
+            return t;
+    }
+    return NULL;
+}
+
+/* trace_diverge - Count a status that differs from the recording */
+static void trace_diverge(const char *what, int status, int recorded)
+{
+    if (trace_diverged < TRACE_SHOW)
+        snprintf(trace_show[trace_diverged], sizeof(trace_show[0]),
+                 "#%ld %s: status %d, recorded %d", trace_seq, what, status, recorded);
+    trace_diverged++;
+}
+
+/* trace_done - The command started by trace_start has returned */
+void trace_done(const char *cmdline)
+{
+    long long now = trace_now(), us = (now - trace_cmd_ns) / 1000;
+    struct trace_cmd *c;
+    struct trace_name *t;
+
+    trace_ready_ns = now;
+    if (trace_mode == TRACE_RECORD) {
+        dprintf(trace_fd, "=\t%ld\t%d\t%lld\n", trace_seq, last_status, us);
+        return;
+    }
+    if ((t = trace_name_get(cmdline)) != NULL)
+        prof_add_hist(&t->now, us);
+    if ((size_t)trace_seq > trace_ncmds || (c = &trace_cmds[trace_seq - 1])->status < 0)
+        return;
+    if (t != NULL)
+        prof_add_hist(&t->rec, c->latency_us);
+    if (c->status != last_status) {
+        char what[64];
+
+        snprintf(what, sizeof(what), "%.*s", (int)strcspn(cmdline, "\n"), cmdline);
+        trace_diverge(what, last_status, c->status);
+    }
+}
+
+/* trace_job - A background job launched by command seq exited */
+void trace_job(long seq, const char *cmdline, int status)
+{
+    if (trace_mode == TRACE_RECORD) {
+        dprintf(trace_fd, "J\t%ld\t%d\n", seq, status);
+        return;
+    }
+    if ((size_t)seq <= trace_ncmds && trace_cmds[seq - 1].job_status >= 0
+        && trace_cmds[seq - 1].job_status != status) {
+        char what[64];
+        long cur = trace_seq;
+
+        snprintf(what, sizeof(what), "job %.*s", (int)strcspn(cmdline, "\n"), cmdline);
+        trace_seq = seq;
+        trace_diverge(what, status, trace_cmds[seq - 1].job_status);
+        trace_seq = cur;
+    }
+}
+
+/* trace_report - Print the --replay summary at exit */
+void trace_report(void)
+{
+    char *out_name = getenv("TSH_REPLAY_OUT");
+    FILE *out = stderr;
+    unsigned long i;
+
+    if (getpid() != trace_owner)
+        return;
+    fflush(stdout);
+    if (out_name != NULL && (out = fopen(out_name, "w")) == NULL) {
+        perror("fopen");
+        out = stderr;
+    }
+    fprintf(out, "replay: %ld commands, %zu lines in %.3fs (recorded %.3fs, speed ",
+            trace_seq, trace_pos, (trace_now() - trace_start_ns) / 1e9,
+            trace_recorded_us / 1e6);
+    if (trace_speed > 0)
+        fprintf(out, "%gx)\n", trace_speed);
+    else
+        fprintf(out, "max)\n");
+    fprintf(out, "replay: %lu diverged\n", trace_diverged);
+    for (i = 0; i < trace_diverged && i < TRACE_SHOW; i++)
+        fprintf(out, "  %s\n", trace_show[i]);
+    fprintf(out, "%-24s %8s %12s %12s %12s %12s\n",
+            "command", "count", "rec_p50_us", "p50_us", "p99_us", "max_us");
+    for (i = 0; i < TRACE_NAMES; i++) {
+        struct trace_name *t = &trace_names[i];
+
+        if (t->now.count == 0)
+            continue;
+        fprintf(out, "%-24s %8lu %12llu %12llu %12llu %12llu\n", t->name, t->now.count,
+                t->rec.count ? prof_percentile(&t->rec, 50) : 0,
+                prof_percentile(&t->now, 50), prof_percentile(&t->now, 99), t->now.max);
+    }
+    if (out != stderr)
+        fclose(out);
+}
+/**********************************************
+ * end session record and replay
+ **********************************************/
 
 /*************************************************************
  * The Sio (Signal-safe I/O) package - simple reentrant output